@@ -9,7 +9,82 @@
  */
 
 #include "BMI323.h"
+#include "BMI323Core.h"
+#include "Perf.h"
 #include <cinttypes>
+#include <cmath>
+
+namespace
+{
+    /**
+     * @brief Runs of contiguous writable registers kept in the shadow, each loaded with one burst read
+     * 
+     * FEATURE_IO1-3 are left out as the feature engine writes them, as are the command and pointer registers.
+     */
+    struct shadow_range {
+        uint8_t first;
+        uint8_t count;
+    };
+
+    constexpr shadow_range SHADOW_RANGES[] = {
+        {0x10, 1},      // FEATURE_IO0
+        {0x20, 2},      // ACC_CONF, GYR_CONF
+        {0x28, 3},      // ALT_ACC_CONF, ALT_GYR_CONF, ALT_CONF
+        {0x35, 2},      // FIF_WATERMARK, FIFO_CONF
+        {0x38, 4},      // IO_INT_CTRL, INT_CONF, INT_MAP_1, INT_MAP_2
+        {0x40, 1},      // FEATURE_CTRL
+        {0x4F, 4},      // IO_PDN_CTRL to IO_I2C_IF, IO_ODR_DEVIATION (0x53) is read only
+        {0x60, 12},     // data path offset/gain
+        {0x70, 3}       // I3C_TC_SYNC_*
+    };
+
+    constexpr uint8_t SHADOW_MAX_RUN = 12;
+
+    bool isShadowed(uint8_t address)
+    {
+        for(const shadow_range &range : SHADOW_RANGES)
+        {
+            if(address >= range.first && address < range.first + range.count)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Soft reset command word for CMD (Section 6.1)
+    constexpr uint16_t CMD_SOFT_RESET = 0xDEAF;
+
+    // Longest burst write or verification read applyScript() issues, in registers
+    constexpr uint16_t SCRIPT_MAX_BURST = BMI323SPIBus::MAX_WRITE_WORDS;
+
+    // Sample reads, scaling and FIFO decoding, inlined from the header only core
+    using SPICore = BMI323Core<BMI323SPIBus>;
+
+    // Registers that change state when read, a verification burst must not cross them
+    bool clearsOnRead(uint8_t address)
+    {
+        return (address >= 0x0D && address <= 0x0F) ||     // INT_STATUS_*
+            address == 0x16 ||                              // FIFO_DATA
+            address == 0x42 ||                              // FEATURE_DATA_TX
+            address == 0x47;                                // FEATURE_EVENT_EXT
+    }
+
+    // Clock ladder for trainClock(), the first step is the rate the bus starts at
+    constexpr int CLOCK_STEPS[] = {100'000, 1'000'000, 2'000'000, 4'000'000, 5'000'000, 8'000'000, 10'000'000};
+    constexpr uint8_t CLOCK_STEP_COUNT = sizeof(CLOCK_STEPS) / sizeof(CLOCK_STEPS[0]);
+
+    constexpr uint16_t CHIP_ID_VALUE = 0x0043;
+
+    // The FIFO is 2048 bytes
+    constexpr uint16_t FIFO_WORDS = 1024;
+
+    // Registers that must not be part of a burst write
+    bool writtenAlone(uint8_t address)
+    {
+        return address == 0x42 || address == 0x7E;          // FEATURE_DATA_TX, CMD
+    }
+}
 
 /**
  * @brief Construct a new BMI323Base::BMI323Base object
@@ -39,7 +114,8 @@ BMI323I2C::BMI323I2C(PinName sda, PinName scl, uint8_t address) :
 }
 
 BMI323SPI::BMI323SPI(PinName mosi, PinName miso, PinName sclk, PinName ssel) : 
-    spi(mosi, miso, sclk, ssel, use_gpio_ssel)
+    spi(mosi, miso, sclk, ssel, use_gpio_ssel), shadow{}, shadowValid(false), clockStep(0), spiHz(CLOCK_STEPS[0]),
+    linkErrorCount(0)
 {
     /**
      * Section 7.2.3 SPI Protocol:
@@ -64,8 +140,8 @@ BMI323SPI::BMI323SPI(PinName mosi, PinName miso, PinName sclk, PinName ssel) :
      */
     spi.format(8, 3);
     spi.set_default_write_value(0);     // Making the value of the dummy write value 0
-    spi.frequency(100'000);          // Section 7.2.2 Clock Frequency of SPI is 10 MHz
-                                        // Drops to 8 MHz when VDDIO < 1.62V
+    spi.frequency(CLOCK_STEPS[0]);      // Section 7.2.2 Clock Frequency of SPI is 10 MHz
+                                        // Drops to 8 MHz when VDDIO < 1.62V, trainClock() finds the rate
 
     // BMI323 requires a rising edge after power up to enable SPI.
     spi.select();
@@ -137,6 +213,7 @@ bool BMI323SPI::init()
     // If the init is successful
     if(testChipID == 0x0043)
     {
+        loadShadow();
         return true;
     }
 
@@ -149,12 +226,9 @@ bool BMI323SPI::init()
  * 
  * The returned char array is in little endian
  */
-void BMI323SPI::readAddressSPI(Register address, char* data, uint8_t length)
+void BMI323SPI::readAddressSPI(Register address, char* data, uint16_t length)
 {
-    spi.select();
-    spi.write(0x80 | static_cast<uint8_t>(address));
-    spi.write(nullptr, 0, data, length);
-    spi.deselect();
+    BMI323SPIBus(spi).read(static_cast<uint8_t>(address), data, length);
 }
 
 /**
@@ -171,103 +245,623 @@ bool BMI323SPI::writeAddressSPI(Register address, uint16_t data)
      * to avoid overwriting the reserved part with undefined content."
      */
 
-    uint8_t toSend[3] = {static_cast<uint8_t>(address), static_cast<uint8_t>(data & 0xFF), static_cast<uint8_t>((data >> 8) & 0xFF)};
+    BMI323SPIBus(spi).write(static_cast<uint8_t>(address), &data, 1);
 
-    spi.write(toSend, 3, nullptr, 0);
+    updateShadow(address, data);
 
     return false;
 }
 
-void BMI323SPI::readAccel(accel_data* accel)
+void BMI323SPI::writeBurstSPI(Register first, const uint16_t* data, uint16_t count)
 {
-    char data[7];
+    BMI323SPIBus bus(spi);
+
+    // Split anything longer than the bus takes, the address auto-increments either way
+    while(count > 0)
+    {
+        uint16_t run = count < SCRIPT_MAX_BURST ? count : SCRIPT_MAX_BURST;
 
-    readAddressSPI(Register::ACC_DATA_X, data, 7);
+        bus.write(static_cast<uint8_t>(first), data, run);
 
-    accel->x = static_cast<float>(static_cast<int16_t>((static_cast<int16_t>(data[2]) << 8) | static_cast<int16_t>(data[1])));
-    accel->y = static_cast<float>(static_cast<int16_t>((static_cast<int16_t>(data[4]) << 8) | static_cast<int16_t>(data[3])));
-    accel->z = static_cast<float>(static_cast<int16_t>((static_cast<int16_t>(data[6]) << 8) | static_cast<int16_t>(data[5])));
+        for(uint16_t i = 0; i < run; i++)
+        {
+            updateShadow(static_cast<Register>(static_cast<uint8_t>(first) + i), data[i]);
+        }
 
-    accel->x = (accel->x / 16.38f) / 1000.0f;
-    accel->y = (accel->y / 16.38f) / 1000.0f;
-    accel->z = (accel->z / 16.38f) / 1000.0f;
+        first = static_cast<Register>(static_cast<uint8_t>(first) + run);
+        data += run;
+        count -= run;
+    }
 }
 
-void BMI323SPI::readGyro(gyro_data* gyro)
+void BMI323SPI::updateShadow(Register address, uint16_t data)
 {
-    char data[7];
+    // Keep the shadow coherent, a soft reset puts every register back to its default
+    uint8_t index = static_cast<uint8_t>(address) & 0x7F;
+    if(isShadowed(index))
+    {
+        shadow[index] = data;
+    }
+    else if(address == Register::CMD && data == CMD_SOFT_RESET)
+    {
+        shadowValid = false;
+    }
+}
+
+bool BMI323SPI::applyScript(const register_write* script, size_t count)
+{
+    // Which shadowed registers the script wrote, checked once everything is out
+    uint32_t written[4] = {0, 0, 0, 0};
 
-    readAddressSPI(Register::GYR_DATA_X, data, 7);
+    size_t i = 0;
+    while(i < count)
+    {
+        uint16_t words[SCRIPT_MAX_BURST];
+        uint8_t first = static_cast<uint8_t>(script[i].address) & 0x7F;
+        uint16_t run = 0;
+
+        // Extend the burst while the next entry is the next address
+        do
+        {
+            uint8_t address = first + run;
+            if(isShadowed(address))
+            {
+                written[address / 32] |= 1u << (address % 32);
+            }
+            words[run++] = script[i++].value;
+        }
+        while(i < count && run < SCRIPT_MAX_BURST && !writtenAlone(first) &&
+            !writtenAlone(static_cast<uint8_t>(script[i].address)) &&
+            static_cast<uint8_t>(script[i].address) == first + run);
+
+        if(run == 1)
+        {
+            writeAddressSPI(static_cast<Register>(first), words[0]);
+        }
+        else
+        {
+            writeBurstSPI(static_cast<Register>(first), words, run);
+        }
+    }
 
-    gyro->x = static_cast<float>(static_cast<int16_t>((static_cast<int16_t>(data[2]) << 8) | static_cast<int16_t>(data[1])));
-    gyro->y = static_cast<float>(static_cast<int16_t>((static_cast<int16_t>(data[4]) << 8) | static_cast<int16_t>(data[3])));
-    gyro->z = static_cast<float>(static_cast<int16_t>((static_cast<int16_t>(data[6]) << 8) | static_cast<int16_t>(data[5])));
+    // Read back in as few bursts as possible: extend over unwritten registers as long as none of them clears on read
+    char data[1 + 2 * SCRIPT_MAX_BURST];
+    bool match = true;
+    uint8_t address = 0;
+    while(address < 128)
+    {
+        if(!(written[address / 32] & (1u << (address % 32))))
+        {
+            address++;
+            continue;
+        }
+
+        uint8_t first = address;
+        uint8_t last = address;
+        for(uint8_t next = address + 1; next < 128 && next - first < SCRIPT_MAX_BURST && !clearsOnRead(next); next++)
+        {
+            if(written[next / 32] & (1u << (next % 32)))
+            {
+                last = next;
+            }
+        }
+
+        uint16_t length = last - first + 1;
+        readAddressSPI(static_cast<Register>(first), data, 1 + 2 * length);
+        for(uint8_t reg = first; reg <= last; reg++)
+        {
+            if(!(written[reg / 32] & (1u << (reg % 32))))
+            {
+                continue;
+            }
+            uint16_t actual = (static_cast<uint16_t>(static_cast<uint8_t>(data[2 + 2 * (reg - first)])) << 8) |
+                static_cast<uint8_t>(data[1 + 2 * (reg - first)]);
+            if(actual != shadow[reg])
+            {
+                printf("Script: register 0x%02x is 0x%04x, wrote 0x%04x\n", reg, actual, shadow[reg]);
+                match = false;
+            }
+        }
+        address = last + 1;
+    }
 
-    gyro->x = (gyro->x / 262.144f);
-    gyro->y = (gyro->y / 262.144f);
-    gyro->z = (gyro->z / 262.144f);
+    return match;
 }
 
-void BMI323SPI::bulkRead(accel_gyro_data* data)
+void BMI323SPI::loadShadow()
 {
-    char toRecieve[13];
+    char data[1 + 2 * SHADOW_MAX_RUN];
 
-    readAddressSPI(Register::ACC_DATA_X, toRecieve, 15);
+    for(const shadow_range &range : SHADOW_RANGES)
+    {
+        readAddressSPI(static_cast<Register>(range.first), data, 1 + 2 * range.count);
+        for(uint8_t i = 0; i < range.count; i++)
+        {
+            shadow[range.first + i] = (static_cast<uint16_t>(static_cast<uint8_t>(data[2 + 2 * i])) << 8) |
+                static_cast<uint8_t>(data[1 + 2 * i]);
+        }
+    }
+    shadowValid = true;
+}
 
-    data->accel.x = static_cast<float>(static_cast<int16_t>((static_cast<int16_t>(toRecieve[2]) << 8) | static_cast<int16_t>(toRecieve[1])));
-    data->accel.y = static_cast<float>(static_cast<int16_t>((static_cast<int16_t>(toRecieve[4]) << 8) | static_cast<int16_t>(toRecieve[3])));
-    data->accel.z = static_cast<float>(static_cast<int16_t>((static_cast<int16_t>(toRecieve[6]) << 8) | static_cast<int16_t>(toRecieve[5])));
-    data->gyro.x = static_cast<float>(static_cast<int16_t>((static_cast<int16_t>(toRecieve[8]) << 8) | static_cast<int16_t>(toRecieve[7])));
-    data->gyro.y = static_cast<float>(static_cast<int16_t>((static_cast<int16_t>(toRecieve[10]) << 8) | static_cast<int16_t>(toRecieve[9])));
-    data->gyro.z = static_cast<float>(static_cast<int16_t>((static_cast<int16_t>(toRecieve[12]) << 8) | static_cast<int16_t>(toRecieve[11])));
+uint16_t BMI323SPI::readShadow(Register address)
+{
+    uint8_t index = static_cast<uint8_t>(address) & 0x7F;
+    if(!isShadowed(index))
+    {
+        return readWordSPI(address);
+    }
+    if(!shadowValid)
+    {
+        loadShadow();
+    }
+    return shadow[index];
+}
 
+void BMI323SPI::writeField(const RegisterField &field, uint16_t value)
+{
+    writeAddressSPI(field.address, field.set(readShadow(field.address), value));
+}
+
+uint16_t BMI323SPI::checkShadow()
+{
+    char data[1 + 2 * SHADOW_MAX_RUN];
+    uint16_t mismatches = 0;
 
-    data->accel.x = (data->accel.x / 16.38f) / 1000.0f;
-    data->accel.y = (data->accel.y / 16.38f) / 1000.0f;
-    data->accel.z = (data->accel.z / 16.38f) / 1000.0f;
+    if(!shadowValid)
+    {
+        loadShadow();
+    }
 
-    data->gyro.x = (data->gyro.x / 262.144f);
-    data->gyro.y = (data->gyro.y / 262.144f);
-    data->gyro.z = (data->gyro.z / 262.144f);
+    for(const shadow_range &range : SHADOW_RANGES)
+    {
+        readAddressSPI(static_cast<Register>(range.first), data, 1 + 2 * range.count);
+        for(uint8_t i = 0; i < range.count; i++)
+        {
+            uint16_t actual = (static_cast<uint16_t>(static_cast<uint8_t>(data[2 + 2 * i])) << 8) |
+                static_cast<uint8_t>(data[1 + 2 * i]);
+            if(actual != shadow[range.first + i])
+            {
+                printf("Register 0x%02x is 0x%04x, shadow has 0x%04x\n", range.first + i, actual,
+                    shadow[range.first + i]);
+                mismatches++;
+            }
+        }
+    }
+    return mismatches;
 }
 
+int BMI323SPI::trainClock(int maxHz, uint16_t checks)
+{
+    uint16_t watermark = readShadow(Register::FIF_WATERMARK);
+
+    // Fastest step that passed, training starts from the power on rate
+    uint8_t good = 0;
+    bool failed = false;
+    for(uint8_t step = 1; step < CLOCK_STEP_COUNT && CLOCK_STEPS[step] <= maxHz; step++)
+    {
+        setClockStep(step);
+        if(!checkLink(checks))
+        {
+            failed = true;
+            break;
+        }
+        good = step;
+    }
+
+    // Keep a step of margin below a clock that failed
+    uint8_t settled = failed && good > 0 ? good - 1 : good;
+    setClockStep(settled);
 
-void BMI323SPI::accelSetup()
+    writeAddressSPI(Register::FIF_WATERMARK, watermark);
+
+    printf("SPI clock trained to %d Hz (fastest good %d Hz%s)\n", spiHz, CLOCK_STEPS[good],
+        failed ? ", next step failed" : "");
+    return spiHz;
+}
+
+bool BMI323SPI::verifyLink()
 {
-    uint16_t accelConfig = 0x7000;  // Enables the accelerometer in high performance mode
-    uint16_t accAvgNum = 0x0000;    // no averaging, pass sample without filtering
-    uint16_t LSBperMg = 0x0000;     // +/-2g, 16.38 LSB/mg
-    uint16_t ODR_6_4_KHz = 0x000B;  // ODR = 800Hz
+    if(readWordSPI(Register::CHIP_ID) == CHIP_ID_VALUE)
+    {
+        return true;
+    }
+    linkError();
+    return false;
+}
 
-    uint16_t toSend = accelConfig | accAvgNum | LSBperMg | ODR_6_4_KHz;
-    
-    char responseData[3] = {0x0, 0x0, 0x0};
+bool BMI323SPI::checkLink(uint16_t rounds)
+{
+    if(!shadowValid)
+    {
+        loadShadow();
+    }
 
-    readAddressSPI(Register::ACC_CONF, responseData, 3);
-    printf("Content of ACC_CONF is: 0x%04x\n", (static_cast<int16_t>(responseData[2]) << 8) | static_cast<int16_t>(responseData[1]));
+    for(uint16_t round = 0; round < rounds; round++)
+    {
+        if(readWordSPI(Register::CHIP_ID) != CHIP_ID_VALUE)
+        {
+            return false;
+        }
+
+        // Alternating bits on both lines, FIF_WATERMARK is 10 bits wide
+        uint16_t pattern = (round & 1) ? 0x02AA : 0x0155;
+        writeAddressSPI(Register::FIF_WATERMARK, pattern);
+        if(readWordSPI(Register::FIF_WATERMARK) != pattern)
+        {
+            return false;
+        }
+
+        char data[5];
+        readAddressSPI(Register::ACC_CONF, data, 5);
+        uint16_t accelConf = (static_cast<uint16_t>(static_cast<uint8_t>(data[2])) << 8) | static_cast<uint8_t>(data[1]);
+        uint16_t gyroConf = (static_cast<uint16_t>(static_cast<uint8_t>(data[4])) << 8) | static_cast<uint8_t>(data[3]);
+        if(accelConf != shadow[static_cast<uint8_t>(Register::ACC_CONF)] ||
+            gyroConf != shadow[static_cast<uint8_t>(Register::GYR_CONF)])
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
-    writeAddressSPI(Register::ACC_CONF, toSend);
-    readAddressSPI(Register::ACC_CONF, responseData, 3);
+void BMI323SPI::setClockStep(uint8_t step)
+{
+    clockStep = step;
+    spiHz = CLOCK_STEPS[step];
+    spi.frequency(spiHz);
+}
 
-    printf("Content of ACC_CONF is: 0x%04x\n", (static_cast<int16_t>(responseData[2]) << 8) | static_cast<int16_t>(responseData[1]));
+void BMI323SPI::linkError()
+{
+    PERF_COUNT(PERF_IMU_LINK_ERRORS, 1);
+    linkErrorCount++;
+    if(clockStep > 0)
+    {
+        setClockStep(clockStep - 1);
+        printf("SPI link error, clock down to %d Hz\n", spiHz);
+    }
+}
+
+void BMI323SPI::readAccel(accel_data* accel)
+{
+    SPICore(BMI323SPIBus(spi)).readAccel(accel);
+}
+
+void BMI323SPI::readGyro(gyro_data* gyro)
+{
+    SPICore(BMI323SPIBus(spi)).readGyro(gyro);
+}
+
+void BMI323SPI::bulkRead(accel_gyro_data* data)
+{
+    SPICore(BMI323SPIBus(spi)).read(data);
 }
 
-void BMI323SPI::gyroSetup()
+
+void BMI323SPI::accelSetup(uint16_t odr)
 {
-    uint16_t gyroMode = 0x7000; // Enables the gyroscope in high performance mode
-    uint16_t gyroAvgNum = 0x0000; // no averaging, pass sample without filtering
-    uint16_t gyroRange = 0x0000; // +/-125◦/s, 262.144 LSB/◦/s
-    uint16_t ODR = 0x000B; // ODR = 800Hz
+    // Built on the shadow, so reserved bits are kept without reading the register back
+    uint16_t toSend = readShadow(Register::ACC_CONF);
+    toSend = ACC_CONF.mode.set(toSend, SENSOR_MODE_HIGH_PERF);    // high performance mode
+    toSend = ACC_CONF.avgNum.set(toSend, 0);                      // no averaging, pass sample without filtering
+    toSend = ACC_CONF.bw.set(toSend, 0);                          // ODR/2
+    toSend = ACC_CONF.range.set(toSend, 0);                       // +/-2g, 16.38 LSB/mg
+    toSend = ACC_CONF.odr.set(toSend, odr);
 
-    uint16_t toSend = gyroMode | gyroAvgNum | gyroRange | ODR;
+    writeAddressSPI(Register::ACC_CONF, toSend);
 
-    char responseData[3] = {0x0, 0x0, 0x0};
+    printf("Content of ACC_CONF is: 0x%04x\n", toSend);
+}
 
-    readAddressSPI(Register::GYR_CONF, responseData, 3);
-    printf("Content of GYR_CONF is: 0x%04x\n", (static_cast<int16_t>(responseData[2]) << 8) | static_cast<int16_t>(responseData[1]));
+void BMI323SPI::gyroSetup(uint16_t odr)
+{
+    uint16_t toSend = readShadow(Register::GYR_CONF);
+    toSend = GYR_CONF.mode.set(toSend, SENSOR_MODE_HIGH_PERF);    // high performance mode
+    toSend = GYR_CONF.avgNum.set(toSend, 0);                      // no averaging, pass sample without filtering
+    toSend = GYR_CONF.bw.set(toSend, 0);                          // ODR/2
+    toSend = GYR_CONF.range.set(toSend, 0);                       // +/-125◦/s, 262.144 LSB/◦/s
+    toSend = GYR_CONF.odr.set(toSend, odr);
 
     writeAddressSPI(Register::GYR_CONF, toSend);
-    readAddressSPI(Register::GYR_CONF, responseData, 3);
 
-    printf("Content of GYR_CONF is: 0x%04x\n", (static_cast<int16_t>(responseData[2]) << 8) | static_cast<int16_t>(responseData[1]));
-}
\ No newline at end of file
+    printf("Content of GYR_CONF is: 0x%04x\n", toSend);
+}
+
+uint16_t BMI323SPI::readWordSPI(Register address)
+{
+    char data[3] = {0x0, 0x0, 0x0};
+
+    readAddressSPI(address, data, 3);
+
+    return (static_cast<uint16_t>(static_cast<uint8_t>(data[2])) << 8) | static_cast<uint8_t>(data[1]);
+}
+
+/**
+ * @brief Section 6.2:
+ * "A transaction consists of writing the address to FEATURE_DATA_ADDR and then continuously reading all data from
+ * or writing all data to FEATURE_DATA_TX"
+ * 
+ * There must be no other register access in between, so keep these two calls together.
+ */
+uint16_t BMI323SPI::readExtendedSPI(ExtRegister address)
+{
+    writeAddressSPI(Register::FEATURE_DATA_ADDR, static_cast<uint16_t>(address));
+    return readWordSPI(Register::FEATURE_DATA_TX);
+}
+
+void BMI323SPI::writeExtendedSPI(ExtRegister address, uint16_t data)
+{
+    writeAddressSPI(Register::FEATURE_DATA_ADDR, static_cast<uint16_t>(address));
+    writeAddressSPI(Register::FEATURE_DATA_TX, data);
+}
+
+bool BMI323SPI::featureEngineSetup()
+{
+    // Section 5.8.1, Figure 9
+    writeAddressSPI(Register::FEATURE_IO2, 0x012C);
+    writeAddressSPI(Register::FEATURE_IO_STATUS, 0x0001);
+    writeAddressSPI(Register::FEATURE_CTRL, 0x0001);
+
+    // Poll FEATURE_IO1.error_status until it reports "feature engine activated"
+    uint16_t errorStatus = 0;
+    for(int i = 0; i < 100; i++)
+    {
+        wait_us(1000);
+        errorStatus = readWordSPI(Register::FEATURE_IO1) & 0x000F;
+        if(errorStatus == 0x0001)
+        {
+            return true;
+        }
+    }
+
+    printf("Feature engine failed to start, FEATURE_IO1.error_status: 0x%x\n", errorStatus);
+    return false;
+}
+
+bool BMI323SPI::anyMotionSetup(uint16_t slopeThreshold, uint16_t duration)
+{
+    return motionSetup(ExtRegister::ANYMO_1, slopeThreshold, duration);
+}
+
+bool BMI323SPI::noMotionSetup(uint16_t slopeThreshold, uint16_t duration)
+{
+    return motionSetup(ExtRegister::NOMO_1, slopeThreshold, duration);
+}
+
+bool BMI323SPI::motionSetup(ExtRegister first, uint16_t slopeThreshold, uint16_t duration)
+{
+    // Extended register writes go nowhere until FEATURE_IO1.error_status reports the engine activated
+    if((readWordSPI(Register::FEATURE_IO1) & 0x000F) != 0x0001)
+    {
+        return false;
+    }
+
+    uint16_t accRefUp = 0x1000;                     // reference is the previous sample (default)
+    uint16_t hysteresis = 0x0002;                   // 2/512 g (default)
+    uint16_t waitTime = 0x6000;                     // 3 * 20 ms before clearing the event (default)
+
+    // ANYMO_1..3 and NOMO_1..3 share the layout: threshold, hysteresis, duration
+    uint8_t address = static_cast<uint8_t>(first);
+    writeExtendedSPI(first, accRefUp | (slopeThreshold & 0x0FFF));
+    writeExtendedSPI(static_cast<ExtRegister>(address + 1), hysteresis);
+    writeExtendedSPI(static_cast<ExtRegister>(address + 2), waitTime | (duration & 0x1FFF));
+    return true;
+}
+
+bool BMI323SPI::altConfigSetup(const alt_config &config)
+{
+    // Section 5.8.1: the feature engine has to be enabled before any sensor, so disable both first
+    writeAddressSPI(Register::ACC_CONF, 0x0000);
+    writeAddressSPI(Register::GYR_CONF, 0x0000);
+
+    if(!featureEngineSetup())
+    {
+        return false;
+    }
+
+    // Section 5.8.1: the accel has to be configured before any advanced feature is enabled
+    uint16_t userConf[2] = {config.accelConf, config.gyroConf};
+    uint16_t altConf[2] = {config.altAccelConf, config.altGyroConf};
+    writeBurstSPI(Register::ACC_CONF, userConf, 2);
+    writeBurstSPI(Register::ALT_ACC_CONF, altConf, 2);
+
+    // The engine runs now, so the detection parameters can go in before the features are enabled
+    AltSwitchSource sources[2] = {config.toAlt, config.toUser};
+    for(AltSwitchSource source : sources)
+    {
+        if(source == AltSwitchSource::ANY_MOTION && config.anyMotionThreshold != 0)
+        {
+            anyMotionSetup(config.anyMotionThreshold, config.anyMotionDuration);
+        }
+        if(source == AltSwitchSource::NO_MOTION && config.noMotionThreshold != 0)
+        {
+            noMotionSetup(config.noMotionThreshold, config.noMotionDuration);
+        }
+    }
+
+    uint16_t altSwitchSrc = static_cast<uint16_t>(config.toAlt) & 0x000F;
+    uint16_t userSwitchSrc = (static_cast<uint16_t>(config.toUser) & 0x000F) << 4;
+    writeExtendedSPI(ExtRegister::ALT_CONFIG_CHG, userSwitchSrc | altSwitchSrc);
+
+    // Enable the features that drive the switch, one FEATURE_IO0 bit per source (feature_io0 register description)
+    uint16_t featureEnable = 0x0000;
+    for(AltSwitchSource source : sources)
+    {
+        switch(source)
+        {
+            case AltSwitchSource::NO_MOTION:        featureEnable |= 0x0007; break;     // x, y, z
+            case AltSwitchSource::ANY_MOTION:       featureEnable |= 0x0038; break;     // x, y, z
+            case AltSwitchSource::FLAT:             featureEnable |= 0x0040; break;
+            case AltSwitchSource::ORIENTATION:      featureEnable |= 0x0080; break;
+            case AltSwitchSource::STEP_DETECTOR:    featureEnable |= 0x0100; break;
+            case AltSwitchSource::STEP_COUNTER:     featureEnable |= 0x0200; break;
+            case AltSwitchSource::SIG_MOTION:       featureEnable |= 0x0400; break;
+            case AltSwitchSource::TILT:             featureEnable |= 0x0800; break;
+            case AltSwitchSource::TAP:              featureEnable |= 0x1000; break;     // single tap
+            case AltSwitchSource::NONE:             break;
+        }
+    }
+    writeAddressSPI(Register::FEATURE_IO0, featureEnable);
+    writeAddressSPI(Register::FEATURE_IO_STATUS, 0x0001);
+
+    uint16_t altAccEn = 0x0001;
+    uint16_t altGyrEn = 0x0010;
+    uint16_t altRstConfWriteEn = config.resetOnConfWrite ? 0x0100 : 0x0000;
+    writeAddressSPI(Register::ALT_CONF, altRstConfWriteEn | altGyrEn | altAccEn);
+
+    printf("Content of ALT_CONF is: 0x%04x\n", readShadow(Register::ALT_CONF));
+
+    return true;
+}
+
+uint16_t BMI323SPI::readAltStatus()
+{
+    return readWordSPI(Register::ALT_STATUS);
+}
+
+void BMI323SPI::bulkReadAlt(accel_gyro_alt_data* data)
+{
+    // ALT_STATUS is read right after the data, a switch in between is attributed to the new profile
+    bulkRead(&data->data);
+
+    uint16_t altStatus = readAltStatus();
+    data->accelAlt = (altStatus & 0x0001) != 0;
+    data->gyroAlt = (altStatus & 0x0010) != 0;
+}
+
+void BMI323SPI::bulkReadRaw(accel_gyro_raw* data)
+{
+    SPICore(BMI323SPIBus(spi)).readRaw(data);
+}
+
+void BMI323SPI::writeDataPath(const dp_calibration &cal)
+{
+    uint16_t accelConfig = readShadow(Register::ACC_CONF);
+    uint16_t gyroConfig = readShadow(Register::GYR_CONF);
+
+    // ACC_CONF and GYR_CONF are adjacent, each pair goes out in one burst
+    uint16_t disabled[2] = {ACC_CONF.mode.set(accelConfig, SENSOR_MODE_DISABLED),
+        GYR_CONF.mode.set(gyroConfig, SENSOR_MODE_DISABLED)};
+    writeBurstSPI(Register::ACC_CONF, disabled, 2);
+
+    // Registers are laid out OFF_X, DGAIN_X, OFF_Y, DGAIN_Y, OFF_Z, DGAIN_Z for both sensors, all twelve in one burst
+    uint16_t dataPath[12];
+    for(int i = 0; i < 3; i++)
+    {
+        dataPath[2 * i] = static_cast<uint16_t>(cal.accelOffset[i]) & 0x3FFF;        // 14 bit
+        dataPath[2 * i + 1] = static_cast<uint16_t>(cal.accelGain[i]) & 0x00FF;      // 8 bit
+        dataPath[6 + 2 * i] = static_cast<uint16_t>(cal.gyroOffset[i]) & 0x03FF;     // 10 bit
+        dataPath[7 + 2 * i] = static_cast<uint16_t>(cal.gyroGain[i]) & 0x007F;       // 7 bit
+    }
+    writeBurstSPI(Register::ACC_DP_OFF_X, dataPath, 12);
+
+    uint16_t restored[2] = {accelConfig, gyroConfig};
+    writeBurstSPI(Register::ACC_CONF, restored, 2);
+}
+
+void BMI323SPI::readDataPath(dp_calibration* cal)
+{
+    char data[25];
+
+    // ACC_DP_OFF_X through GYR_DP_DGAIN_Z are contiguous, one burst covers all twelve
+    readAddressSPI(Register::ACC_DP_OFF_X, data, 25);
+
+    // Sign extend each field from its register width
+    for(int i = 0; i < 3; i++)
+    {
+        uint16_t accelOffset = (static_cast<uint8_t>(data[2 + 4 * i]) << 8) | static_cast<uint8_t>(data[1 + 4 * i]);
+        uint16_t accelGain = (static_cast<uint8_t>(data[4 + 4 * i]) << 8) | static_cast<uint8_t>(data[3 + 4 * i]);
+        uint16_t gyroOffset = (static_cast<uint8_t>(data[14 + 4 * i]) << 8) | static_cast<uint8_t>(data[13 + 4 * i]);
+        uint16_t gyroGain = (static_cast<uint8_t>(data[16 + 4 * i]) << 8) | static_cast<uint8_t>(data[15 + 4 * i]);
+
+        cal->accelOffset[i] = static_cast<int16_t>(accelOffset << 2) >> 2;
+        cal->accelGain[i] = static_cast<int16_t>(accelGain << 8) >> 8;
+        cal->gyroOffset[i] = static_cast<int16_t>(gyroOffset << 6) >> 6;
+        cal->gyroGain[i] = static_cast<int16_t>(gyroGain << 9) >> 9;
+    }
+}
+
+void BMI323Base::scale(const accel_gyro_raw &raw, accel_gyro_data* data)
+{
+    SPICore::scale(raw, data);
+}
+
+uint16_t BMI323Base::odrCode(float hz)
+{
+    // 0xB is 800 Hz, one step per doubling
+    int code = 0xB + static_cast<int>(lroundf(log2f(hz / 800.0f)));
+    if(code < 0x1)
+    {
+        return 0x1;
+    }
+    if(code > 0xE)
+    {
+        return 0xE;
+    }
+    return static_cast<uint16_t>(code);
+}
+
+float BMI323Base::odrHz(uint16_t odr)
+{
+    odr &= 0x000F;
+    if(odr < 0x1 || odr > 0xE)
+    {
+        return 0.0f;
+    }
+    return ldexpf(800.0f, static_cast<int>(odr) - 0xB);
+}
+
+uint16_t BMI323Base::decodeFifo(const char* data, uint16_t frames, accel_gyro_raw* out)
+{
+    static_assert(SPICore::FIFO_FRAME_WORDS == FIFO_FRAME_WORDS, "fifoSetup() and the core disagree on the frame");
+    return SPICore::decodeFifo(data, frames, out);
+}
+
+void BMI323SPI::fifoSetup()
+{
+    uint16_t fifoGyrEn = 0x0400;        // Write gyro frames into the FIFO
+    uint16_t fifoAccEn = 0x0200;        // Write accel frames into the FIFO
+    uint16_t fifoStopOnFull = 0x0000;   // Overwrite oldest frames when full
+
+    // FIFO_CONF and FIFO_CTRL are adjacent, one burst
+    uint16_t toSend[2] = {static_cast<uint16_t>(fifoGyrEn | fifoAccEn | fifoStopOnFull), 0x0001};  // then flush
+    writeBurstSPI(Register::FIFO_CONF, toSend, 2);
+}
+
+uint16_t BMI323SPI::readFifo(accel_gyro_raw* frames, uint16_t maxFrames)
+{
+    PERF_SPAN(PERF_SPAN_FIFO_DRAIN);
+
+    // Fill level is in words and only counts complete frames
+    uint16_t fillLevel = readWordSPI(Register::FIFO_FILL_LEVEL) & 0x07FF;
+    if(fillLevel > FIFO_WORDS)
+    {
+        // More than the FIFO holds, the read was garbled
+        linkError();
+        return 0;
+    }
+    uint16_t available = fillLevel / FIFO_FRAME_WORDS;
+    if(available >= FIFO_MAX_FRAMES)
+    {
+        // Set up to overwrite the oldest frames, a full FIFO has most likely lost some
+        PERF_COUNT(PERF_FIFO_OVERFLOWS, 1);
+    }
+    if(available > maxFrames)
+    {
+        available = maxFrames;
+    }
+    if(available > FIFO_MAX_FRAMES)
+    {
+        available = FIFO_MAX_FRAMES;
+    }
+    if(available == 0)
+    {
+        return 0;
+    }
+
+    // FIFO_DATA doesn't auto-increment, so one burst drains all of it
+    readAddressSPI(Register::FIFO_DATA, fifoBuffer, 1 + available * FIFO_FRAME_WORDS * 2);
+
+    return decodeFifo(fifoBuffer + 1, available, frames);
+}
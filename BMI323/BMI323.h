@@ -56,6 +56,81 @@ class BMI323Base
         accel_data accel;
         gyro_data gyro;
     };
+
+    /**
+     * @brief Raw (unscaled) accel and gyro data, in LSB as they come off the sensor
+     */
+    struct accel_gyro_raw {
+        int16_t accel[3];   // x, y, z
+        int16_t gyro[3];    // x, y, z
+    };
+
+    /**
+     * @brief Contents of the data path offset/gain registers (Section 5.12)
+     * 
+     * Values are signed and in register units:
+     * accel offset 1 LSB = 30.52 ug, accel gain 1 LSB = 1/4096 (covers +/-3.125%)
+     * gyro offset 1 LSB = 0.061 dps, gyro gain 1 LSB = 1/512 (covers +/-12.5%)
+     */
+    struct dp_calibration {
+        int16_t accelOffset[3];
+        int16_t accelGain[3];
+        int16_t gyroOffset[3];
+        int16_t gyroGain[3];
+    };
+
+    /**
+     * @brief Bulk read of the accel and gyro data, tagged with the configuration
+     * (user or alternate) that was active when the sample was read
+     */
+    struct accel_gyro_alt_data {
+        accel_gyro_data data;
+        bool accelAlt;      // true if the accel was running off ALT_ACC_CONF
+        bool gyroAlt;       // true if the gyro was running off ALT_GYR_CONF
+    };
+
+    /**
+     * @brief Advanced features that can trigger a switch between the user and alternate configuration
+     * 
+     * Section 5.10, Table 35
+     */
+    enum class AltSwitchSource : uint8_t {
+        NONE            = 0x0,
+        NO_MOTION       = 0x1,
+        ANY_MOTION      = 0x2,
+        FLAT            = 0x3,
+        ORIENTATION     = 0x4,
+        STEP_DETECTOR   = 0x5,
+        STEP_COUNTER    = 0x6,
+        SIG_MOTION      = 0x7,
+        TILT            = 0x8,
+        TAP             = 0x9
+    };
+
+    /**
+     * @brief The two sensor profiles for the auto-operation mode change (Section 5.10)
+     * 
+     * The user profile lives in ACC_CONF/GYR_CONF and is what the sensor runs most of the time (low ODR, low power).
+     * The alternate profile lives in ALT_ACC_CONF/ALT_GYR_CONF (high ODR). The feature engine switches between them
+     * in hardware, no MCU round trip needed. Note that the alternate registers have no range field, so the range
+     * from the user profile applies to both.
+     */
+    struct alt_config {
+        uint16_t accelConf;         // ACC_CONF word for the user profile
+        uint16_t gyroConf;          // GYR_CONF word for the user profile
+        uint16_t altAccelConf;      // ALT_ACC_CONF word for the alternate profile
+        uint16_t altGyroConf;       // ALT_GYR_CONF word for the alternate profile
+        AltSwitchSource toAlt;      // event that switches user -> alternate
+        AltSwitchSource toUser;     // event that switches alternate -> user, must differ from toAlt
+        bool resetOnConfWrite;      // a host write to ACC_CONF/GYR_CONF forces the user profile back
+
+        // Detection parameters of an ANY_MOTION/NO_MOTION source, see anyMotionSetup(). A threshold of 0 keeps
+        // the feature engine's defaults.
+        uint16_t anyMotionThreshold;
+        uint16_t anyMotionDuration;
+        uint16_t noMotionThreshold;
+        uint16_t noMotionDuration;
+    };
         
     
     public:
@@ -140,7 +215,178 @@ class BMI323Base
             CFG_RES                 = 0x7f
         };
 
+        /**
+         * @brief Feature engine extended registers, accessed through FEATURE_DATA_ADDR/FEATURE_DATA_TX
+         * 
+         * Section 6.2, Table 37
+         */
+        enum class ExtRegister : uint8_t
+        {
+            GEN_SET_1               = 0x02,
+            AXIS_MAP_1              = 0x03,
+            ANYMO_1                 = 0x05,
+            ANYMO_2                 = 0x06,
+            ANYMO_3                 = 0x07,
+            NOMO_1                  = 0x08,
+            NOMO_2                  = 0x09,
+            NOMO_3                  = 0x0A,
+            ALT_CONFIG_CHG          = 0x23
+        };
+
+        /**
+         * @brief A bit field within a 16 bit register
+         * 
+         * Field updates are computed against the register shadow kept by BMI323SPI, so changing one costs a single
+         * write instead of a read, a write and a read back.
+         */
+        struct RegisterField
+        {
+            Register address;
+            uint8_t shift;
+            uint8_t width;
+
+            /** Bits of the register covered by the field */
+            constexpr uint16_t mask() const
+            {
+                return static_cast<uint16_t>(((1u << width) - 1) << shift);
+            }
+
+            /** Value of the field within a register word */
+            constexpr uint16_t get(uint16_t word) const
+            {
+                return static_cast<uint16_t>((word & mask()) >> shift);
+            }
+
+            /** Register word with the field replaced by value, every other bit kept */
+            constexpr uint16_t set(uint16_t word, uint16_t value) const
+            {
+                return static_cast<uint16_t>((word & ~mask()) | ((value << shift) & mask()));
+            }
+        };
+
+        /** Fields of ACC_CONF and GYR_CONF (Section 6.1) */
+        struct sensor_conf_fields {
+            RegisterField odr;          // bits 3:0, see odrCode()
+            RegisterField range;        // bits 6:4
+            RegisterField bw;           // bit 7, -3 dB cut off at ODR/2 (0) or ODR/4 (1)
+            RegisterField avgNum;       // bits 10:8, samples averaged in low power mode
+            RegisterField mode;         // bits 14:12, see SENSOR_MODE_*
+        };
+
+        /** Fields of ALT_ACC_CONF and ALT_GYR_CONF, which have no range or bandwidth */
+        struct alt_sensor_conf_fields {
+            RegisterField odr;
+            RegisterField avgNum;
+            RegisterField mode;
+        };
+
+        /** Fields of ALT_CONF */
+        struct alt_conf_fields {
+            RegisterField accEn;        // bit 0, feature engine may switch the accel
+            RegisterField gyrEn;        // bit 4, feature engine may switch the gyro
+            RegisterField rstConfWriteEn;   // bit 8, a write to ACC_CONF/GYR_CONF goes back to the user profile
+        };
+
+        /** Fields of FIFO_CONF */
+        struct fifo_conf_fields {
+            RegisterField stopOnFull;   // bit 0
+            RegisterField timeEn;       // bit 8
+            RegisterField accEn;        // bit 9
+            RegisterField gyrEn;        // bit 10
+            RegisterField tempEn;       // bit 11
+        };
+
+        /**
+         * @brief Field descriptors, used as ACC_CONF.odr, GYR_CONF.range, FIFO_CONF.accEn and so on
+         */
+        static constexpr sensor_conf_fields ACC_CONF = {
+            {Register::ACC_CONF, 0, 4}, {Register::ACC_CONF, 4, 3}, {Register::ACC_CONF, 7, 1},
+            {Register::ACC_CONF, 8, 3}, {Register::ACC_CONF, 12, 3}
+        };
+        static constexpr sensor_conf_fields GYR_CONF = {
+            {Register::GYR_CONF, 0, 4}, {Register::GYR_CONF, 4, 3}, {Register::GYR_CONF, 7, 1},
+            {Register::GYR_CONF, 8, 3}, {Register::GYR_CONF, 12, 3}
+        };
+        static constexpr alt_sensor_conf_fields ALT_ACC_CONF = {
+            {Register::ALT_ACC_CONF, 0, 4}, {Register::ALT_ACC_CONF, 8, 3}, {Register::ALT_ACC_CONF, 12, 3}
+        };
+        static constexpr alt_sensor_conf_fields ALT_GYR_CONF = {
+            {Register::ALT_GYR_CONF, 0, 4}, {Register::ALT_GYR_CONF, 8, 3}, {Register::ALT_GYR_CONF, 12, 3}
+        };
+        static constexpr alt_conf_fields ALT_CONF = {
+            {Register::ALT_CONF, 0, 1}, {Register::ALT_CONF, 4, 1}, {Register::ALT_CONF, 8, 1}
+        };
+        static constexpr fifo_conf_fields FIFO_CONF = {
+            {Register::FIFO_CONF, 0, 1}, {Register::FIFO_CONF, 8, 1}, {Register::FIFO_CONF, 9, 1},
+            {Register::FIFO_CONF, 10, 1}, {Register::FIFO_CONF, 11, 1}
+        };
+        static constexpr RegisterField FIF_WATERMARK_LEVEL = {Register::FIF_WATERMARK, 0, 10};
+
+        /** Values of the mode field of ACC_CONF/GYR_CONF and the alternate registers */
+        static constexpr uint16_t SENSOR_MODE_DISABLED = 0x0;
+        static constexpr uint16_t SENSOR_MODE_DUTY_CYCLING = 0x3;
+        static constexpr uint16_t SENSOR_MODE_CONTINUOUS = 0x4;
+        static constexpr uint16_t SENSOR_MODE_HIGH_PERF = 0x7;
+
+        /**
+         * @brief ACC_CONF/GYR_CONF word from its fields, for building register scripts
+         */
+        static constexpr uint16_t sensorConf(uint16_t mode, uint16_t odr, uint16_t range = 0, uint16_t avgNum = 0,
+            uint16_t bw = 0)
+        {
+            return ACC_CONF.mode.set(ACC_CONF.avgNum.set(ACC_CONF.bw.set(ACC_CONF.range.set(ACC_CONF.odr.set(0, odr),
+                range), bw), avgNum), mode);
+        }
+
+        /**
+         * @brief One step of a register write script, see BMI323SPI::applyScript()
+         */
+        struct register_write {
+            Register address;
+            uint16_t value;
+        };
+
     public:
+        /** Sensitivity for the +/-2g range set up in accelSetup() */
+        static constexpr float ACCEL_LSB_PER_MG = 16.38f;
+        /** Sensitivity for the +/-125 dps range set up in gyroSetup() */
+        static constexpr float GYRO_LSB_PER_DPS = 262.144f;
+
+        /** ODR field value for 800 Hz, the default used by accelSetup()/gyroSetup() */
+        static constexpr uint16_t ODR_800_HZ = 0x000B;
+
+        /**
+         * @brief ODR field value (ACC_CONF/GYR_CONF bits 3:0) for a rate in Hz
+         * 
+         * Rates run from 0.78125 Hz (0x1) to 6.4 kHz (0xE), doubling each step. Rounds to the nearest step.
+         */
+        static uint16_t odrCode(float hz);
+
+        /**
+         * @brief Rate in Hz for an ODR field value, 0 if the value is reserved
+         */
+        static float odrHz(uint16_t odr);
+
+        /** FIFO frames as set up by fifoSetup() hold accel x, y, z then gyro x, y, z (Section 5.7.1, Table 16) */
+        static constexpr uint16_t FIFO_FRAME_WORDS = 6;
+        /** The FIFO is 2048 bytes */
+        static constexpr uint16_t FIFO_MAX_FRAMES = 1024 / FIFO_FRAME_WORDS;
+
+        /**
+         * @brief Scale a raw sample to g and dps
+         * 
+         */
+        static void scale(const accel_gyro_raw &raw, accel_gyro_data* data);
+
+        /**
+         * @brief Decode FIFO frames as read from FIFO_DATA (little endian, dummy byte already stripped)
+         * 
+         * Dummy frames the sensor inserts while the data path settles (Section 5.7.1, Table 18) are skipped.
+         * 
+         * @return number of frames written to out
+         */
+        static uint16_t decodeFifo(const char* data, uint16_t frames, accel_gyro_raw* out);
+
         /**
          * @brief Construct a new BMI323 object
          */
@@ -236,18 +482,265 @@ class BMI323SPI : public BMI323Base
          */
         void bulkRead(accel_gyro_data* data) override;
 
-        void accelSetup();
-        void gyroSetup();
+        /**
+         * @brief Enable the accel in high performance mode, +/-2g
+         * 
+         * @param odr ODR field of ACC_CONF (Section 6.1), see odrCode(). Defaults to 800 Hz
+         */
+        void accelSetup(uint16_t odr = ODR_800_HZ);
+
+        /**
+         * @brief Enable the gyro in high performance mode, +/-125 dps
+         * 
+         * @param odr ODR field of GYR_CONF (Section 6.1), see odrCode(). Defaults to 800 Hz
+         */
+        void gyroSetup(uint16_t odr = ODR_800_HZ);
+
+        /**
+         * @brief Enable the feature engine (Section 5.8.1)
+         * 
+         * Must be done with the accel and gyro disabled, directly after power on or soft reset.
+         * 
+         * @return true if the feature engine reported itself as activated, false otherwise
+         */
+        bool featureEngineSetup();
+
+        /**
+         * @brief Configure any-motion detection on all three axes (Section 5.8.2)
+         * 
+         * The parameters are extended registers, which only take writes while the feature engine runs, so call it
+         * after featureEngineSetup(). altConfigSetup() starts the engine itself and calls this with the parameters
+         * in alt_config.
+         * 
+         * @param slopeThreshold minimum slope between samples, 1 LSB = 1/512 g
+         * @param duration number of consecutive samples above the threshold, 1 LSB = 20 ms
+         * @return false if the feature engine isn't running, nothing is written then
+         */
+        bool anyMotionSetup(uint16_t slopeThreshold, uint16_t duration);
+
+        /**
+         * @brief Configure no-motion detection on all three axes (Section 5.8.3), as anyMotionSetup()
+         * 
+         * @param slopeThreshold maximum slope between samples, 1 LSB = 1/512 g
+         * @param duration number of consecutive samples below the threshold, 1 LSB = 20 ms
+         * @return false if the feature engine isn't running, nothing is written then
+         */
+        bool noMotionSetup(uint16_t slopeThreshold, uint16_t duration);
+
+        /**
+         * @brief Configure the user and alternate profiles and let the feature engine switch between them
+         * 
+         * Disables both sensors, enables the feature engine, then writes both profiles, the switch sources, the
+         * any-motion/no-motion parameters of the sources that use them and ALT_CONF. The features selected as
+         * switch sources are enabled in FEATURE_IO0.
+         * 
+         * @return true if the feature engine came up, false otherwise
+         */
+        bool altConfigSetup(const alt_config &config);
+
+        /**
+         * @brief Read ALT_STATUS
+         * 
+         * @return bit 0 set if the accel runs off ALT_ACC_CONF, bit 4 set if the gyro runs off ALT_GYR_CONF
+         */
+        uint16_t readAltStatus();
+
+        /**
+         * @brief Bulk read of the accel and gyro data, tagged with the active profile
+         * 
+         */
+        void bulkReadAlt(accel_gyro_alt_data* data);
+
+        /**
+         * @brief Bulk read of the accel and gyro data without scaling
+         * 
+         */
+        void bulkReadRaw(accel_gyro_raw* data);
+
+        /**
+         * @brief Write the data path offset/gain registers so corrections are applied in silicon
+         * 
+         * Section 5.12 recommends updating these with the sensors disabled, so ACC_CONF/GYR_CONF are
+         * cleared for the duration of the write and restored afterwards.
+         */
+        void writeDataPath(const dp_calibration &cal);
+
+        /**
+         * @brief Read back the data path offset/gain registers
+         * 
+         */
+        void readDataPath(dp_calibration* cal);
+
+        /**
+         * @brief Buffer accel and gyro frames in the FIFO
+         * 
+         * Section 5.7.2: the FIFO has to be enabled before the accel and gyro, so call this before
+         * accelSetup()/gyroSetup(). Oldest frames are overwritten when it fills up.
+         */
+        void fifoSetup();
+
+        /**
+         * @brief Drain the FIFO in one burst
+         * 
+         * @param frames output buffer
+         * @param maxFrames frames available in the output buffer
+         * @return number of frames read
+         */
+        uint16_t readFifo(accel_gyro_raw* frames, uint16_t maxFrames);
+
+        /**
+         * @brief Reload the register shadow from the sensor
+         * 
+         * Reads every writable configuration register once, in bursts. init() does this, and a soft reset through
+         * CMD forces it again on the next shadow access. Command and pointer registers (CMD, FIFO_CTRL,
+         * FEATURE_IO_STATUS, FEATURE_DATA_*) and the ones the feature engine writes are not shadowed.
+         */
+        void loadShadow();
+
+        /**
+         * @brief Current content of a register, from the shadow if it is shadowed, off the bus otherwise
+         * 
+         */
+        uint16_t readShadow(Register address);
+
+        /**
+         * @brief Update one field of a register in a single write
+         * 
+         * The rest of the word, reserved bits included, comes from the shadow, which is the read-modify-write
+         * Section 6 asks for without the read.
+         */
+        void writeField(const RegisterField &field, uint16_t value);
+
+        /**
+         * @brief Read every shadowed register back and compare it with the shadow
+         * 
+         * @return number of registers that differ, each one is printed
+         */
+        uint16_t checkShadow();
+
+        /**
+         * @brief Apply a register write script in as few SPI transactions as possible
+         * 
+         * Entries are written in order. Entries at consecutive addresses go out as one burst write, as the address
+         * auto-increments (Section 7.2.3), so keeping blocks such as ACC_CONF/GYR_CONF, INT_* or *_DP_* together in
+         * the script saves a chip select cycle per register. CMD and FEATURE_DATA_TX are always written on their own.
+         * Afterwards the shadowed registers that were written are read back, in a single burst unless a register
+         * that clears on read lies between them, and compared with the script.
+         * 
+         * @param script register/value pairs, e.g. BMI323_SCRIPT_FIFO_STREAM
+         * @param count number of entries
+         * @return true if every shadowed register read back as written
+         */
+        bool applyScript(const register_write* script, size_t count);
+
+        template <size_t N>
+        bool applyScript(const register_write (&script)[N])
+        {
+            return applyScript(script, N);
+        }
+
+        /** Fastest SPI clock (Section 7.2.2), and the limit when VDDIO is below 1.62 V */
+        static constexpr int SPI_MAX_HZ = 10'000'000;
+        static constexpr int SPI_MAX_HZ_LOW_VDDIO = 8'000'000;
+
+        /**
+         * @brief Find the fastest SPI clock the link carries reliably
+         * 
+         * The bus starts at 100 kHz. Training steps it up through 1, 2, 4, 5, 8 and 10 MHz as far as maxHz and
+         * checks each step with checks rounds of a CHIP_ID read, a write and read back of FIF_WATERMARK with
+         * alternating bit patterns, and a read of ACC_CONF/GYR_CONF compared with the register shadow. It stops at
+         * the first step that fails and settles one step below the fastest good one as a margin. If every step up
+         * to maxHz passes, maxHz is used. Call after init(). FIF_WATERMARK is restored at the end.
+         * 
+         * @param maxHz SPI_MAX_HZ, or SPI_MAX_HZ_LOW_VDDIO on boards with VDDIO below 1.62 V
+         * @return the clock settled on, in Hz
+         */
+        int trainClock(int maxHz = SPI_MAX_HZ, uint16_t checks = 16);
+
+        /**
+         * @brief Check the link with a CHIP_ID read and step the clock down if it is wrong
+         * 
+         * Cheap enough to call now and then. readFifo() does the same when it reads an impossible fill level.
+         * 
+         * @return true if the link was fine
+         */
+        bool verifyLink();
+
+        /** Current SPI clock in Hz */
+        int clockHz() const
+        {
+            return spiHz;
+        }
+
+        /** Times the link was found broken and the clock stepped down */
+        uint32_t linkErrors() const
+        {
+            return linkErrorCount;
+        }
 
     protected:
         // Read the the passed in address and return the value there
-        void readAddressSPI(Register address, char* data, uint8_t length);
+        void readAddressSPI(Register address, char* data, uint16_t length);
+
+        // Read a single 16 bit register
+        uint16_t readWordSPI(Register address);
 
         // Write the passed in value to the passed in address
         bool writeAddressSPI(Register address, uint16_t data);
+
+        // Write count consecutive registers from first in one transaction
+        void writeBurstSPI(Register first, const uint16_t* data, uint16_t count);
+
+        // Read/write a feature engine extended register
+        uint16_t readExtendedSPI(ExtRegister address);
+        void writeExtendedSPI(ExtRegister address, uint16_t data);
+
+        // Any-motion or no-motion parameters, first is ANYMO_1 or NOMO_1
+        bool motionSetup(ExtRegister first, uint16_t slopeThreshold, uint16_t duration);
     
     private:
         SPI spi;        
+
+        // Dummy byte followed by a full FIFO worth of frames
+        char fifoBuffer[1 + FIFO_MAX_FRAMES * FIFO_FRAME_WORDS * 2];
+
+        // Last value written to or loaded from each shadowed register, indexed by address
+        uint16_t shadow[128];
+        bool shadowValid;
+
+        // Record a write in the shadow
+        void updateShadow(Register address, uint16_t data);
+
+        // Index into the clock ladder and the clock it gives
+        uint8_t clockStep;
+        int spiHz;
+        uint32_t linkErrorCount;
+
+        void setClockStep(uint8_t step);
+
+        // rounds of the checks trainClock() describes, false on the first error
+        bool checkLink(uint16_t rounds);
+
+        // Step the clock down after a transfer that can't be right
+        void linkError();
+};
+
+/**
+ * @brief Accel and gyro at 800 Hz in high performance mode, +/-2g and +/-125 dps, as accelSetup()/gyroSetup()
+ */
+inline constexpr BMI323Base::register_write BMI323_SCRIPT_STREAM[] = {
+    {BMI323Base::Register::ACC_CONF, BMI323Base::sensorConf(BMI323Base::SENSOR_MODE_HIGH_PERF, BMI323Base::ODR_800_HZ)},
+    {BMI323Base::Register::GYR_CONF, BMI323Base::sensorConf(BMI323Base::SENSOR_MODE_HIGH_PERF, BMI323Base::ODR_800_HZ)}
+};
+
+/**
+ * @brief As BMI323_SCRIPT_STREAM with accel and gyro frames going to a flushed FIFO, as fifoSetup() does first
+ */
+inline constexpr BMI323Base::register_write BMI323_SCRIPT_FIFO_STREAM[] = {
+    {BMI323Base::Register::FIFO_CONF, BMI323Base::FIFO_CONF.gyrEn.set(BMI323Base::FIFO_CONF.accEn.set(0, 1), 1)},
+    {BMI323Base::Register::FIFO_CTRL, 0x0001},     // flush
+    {BMI323Base::Register::ACC_CONF, BMI323Base::sensorConf(BMI323Base::SENSOR_MODE_HIGH_PERF, BMI323Base::ODR_800_HZ)},
+    {BMI323Base::Register::GYR_CONF, BMI323Base::sensorConf(BMI323Base::SENSOR_MODE_HIGH_PERF, BMI323Base::ODR_800_HZ)}
 };
 
 
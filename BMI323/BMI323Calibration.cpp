@@ -0,0 +1,249 @@
+/**
+ * @file BMI323Calibration.cpp
+ * @author Reo Tseng
+ * @brief Offset/gain calibration for the BMI323, applied through the data path registers
+ * @date 2023-09-26
+ *
+ * Datasheets:
+ * https://www.bosch-sensortec.com/media/boschsensortec/downloads/datasheets/bst-bmi323-ds000.pdf
+ */
+
+#include "BMI323Calibration.h"
+#include <cmath>
+
+namespace
+{
+    // Round and clamp a correction into a signed register field
+    int16_t toRegister(float value, int16_t limit)
+    {
+        long rounded = lroundf(value);
+        if(rounded > limit)
+        {
+            return limit;
+        }
+        if(rounded < -limit)
+        {
+            return -limit;
+        }
+        return static_cast<int16_t>(rounded);
+    }
+}
+
+BMI323Calibration::BMI323Calibration(BMI323SPI &imu) : imu(imu)
+{
+    for(int i = 0; i < NUM_ORIENTATIONS; i++)
+    {
+        captured[i] = false;
+    }
+}
+
+void BMI323Calibration::begin()
+{
+    BMI323Base::dp_calibration zero = {};
+    imu.writeDataPath(zero);
+
+    for(int i = 0; i < NUM_ORIENTATIONS; i++)
+    {
+        captured[i] = false;
+    }
+}
+
+void BMI323Calibration::captureStatic(Orientation orientation, uint16_t samples, uint32_t sampleDelayUs)
+{
+    int32_t accelSum[3] = {0, 0, 0};
+    int32_t gyroSum[3] = {0, 0, 0};
+
+    BMI323Base::accel_gyro_raw raw;
+    for(uint16_t n = 0; n < samples; n++)
+    {
+        imu.bulkReadRaw(&raw);
+        for(int i = 0; i < 3; i++)
+        {
+            accelSum[i] += raw.accel[i];
+            gyroSum[i] += raw.gyro[i];
+        }
+        wait_us(sampleDelayUs);
+    }
+
+    for(int i = 0; i < 3; i++)
+    {
+        accelMean[orientation][i] = static_cast<float>(accelSum[i]) / samples;
+        gyroMean[orientation][i] = static_cast<float>(gyroSum[i]) / samples;
+    }
+    captured[orientation] = true;
+}
+
+/**
+ * @brief Section 5.12 models the corrected signal as s_cal = g * s_uncal + o
+ *
+ * For an axis captured both pointing up and pointing down, the gain comes from the spread between the two and the
+ * offset from their midpoint. Otherwise the gain is left at 1 and the offset is the mean error against the expected
+ * value (+/-1g for the axis pointing up or down, 0g for the others) over every capture. The gyro only gets an offset,
+ * its gain can't be observed while static.
+ */
+bool BMI323Calibration::estimate(BMI323Base::dp_calibration* cal) const
+{
+    const float lsbPerG = BMI323Base::ACCEL_LSB_PER_MG * 1000.0f;
+
+    int captureCount = 0;
+    for(int orientation = 0; orientation < NUM_ORIENTATIONS; orientation++)
+    {
+        captureCount += captured[orientation] ? 1 : 0;
+    }
+    if(captureCount == 0)
+    {
+        return false;
+    }
+
+    for(int axis = 0; axis < 3; axis++)
+    {
+        int up = 2 * axis;
+        int down = 2 * axis + 1;
+
+        float gain = 1.0f;
+        float offsetLsb = 0.0f;
+
+        if(captured[up] && captured[down])
+        {
+            float measuredLsbPerG = (accelMean[up][axis] - accelMean[down][axis]) / 2.0f;
+            gain = lsbPerG / measuredLsbPerG;
+            offsetLsb = -gain * (accelMean[up][axis] + accelMean[down][axis]) / 2.0f;
+        }
+        else
+        {
+            int n = 0;
+            for(int orientation = 0; orientation < NUM_ORIENTATIONS; orientation++)
+            {
+                if(!captured[orientation])
+                {
+                    continue;
+                }
+
+                float expected = 0.0f;
+                if(orientation == up)
+                {
+                    expected = lsbPerG;
+                }
+                else if(orientation == down)
+                {
+                    expected = -lsbPerG;
+                }
+
+                offsetLsb += expected - accelMean[orientation][axis];
+                n++;
+            }
+            if(n > 0)
+            {
+                offsetLsb /= n;
+            }
+        }
+
+        float offsetUg = offsetLsb / lsbPerG * 1.0e6f;
+        cal->accelOffset[axis] = toRegister(offsetUg / ACCEL_OFFSET_UG_PER_LSB, 4095);
+        cal->accelGain[axis] = toRegister((gain - 1.0f) / ACCEL_GAIN_PER_LSB, 127);
+
+        // Gyro bias is whatever it reads while still, averaged over every orientation
+        float gyroBiasLsb = 0.0f;
+        for(int orientation = 0; orientation < NUM_ORIENTATIONS; orientation++)
+        {
+            if(captured[orientation])
+            {
+                gyroBiasLsb += gyroMean[orientation][axis];
+            }
+        }
+        gyroBiasLsb /= captureCount;
+
+        float gyroBiasDps = gyroBiasLsb / BMI323Base::GYRO_LSB_PER_DPS;
+        cal->gyroOffset[axis] = toRegister(-gyroBiasDps / GYRO_OFFSET_DPS_PER_LSB, 511);
+        cal->gyroGain[axis] = 0;
+    }
+
+    return true;
+}
+
+void BMI323Calibration::apply(const BMI323Base::dp_calibration &cal)
+{
+    imu.writeDataPath(cal);
+}
+
+int BMI323Calibration::save(const BMI323Base::dp_calibration &cal, mbed::BlockDevice &bd, mbed::bd_addr_t address)
+{
+    calibration_record record = {};
+    record.magic = RECORD_MAGIC;
+    record.version = RECORD_VERSION;
+    record.size = sizeof(BMI323Base::dp_calibration);
+    record.cal = cal;
+
+    mbed::MbedCRC<POLY_32BIT_ANSI, 32> crc;
+    crc.compute(&record, offsetof(calibration_record, crc), &record.crc);
+
+    // Pad the record out to the program size of the device
+    uint8_t buffer[64];
+    mbed::bd_size_t programSize = bd.get_program_size();
+    mbed::bd_size_t writeSize = ((sizeof(record) + programSize - 1) / programSize) * programSize;
+    if(writeSize > sizeof(buffer))
+    {
+        return mbed::BD_ERROR_DEVICE_ERROR;
+    }
+    memset(buffer, 0xFF, sizeof(buffer));
+    memcpy(buffer, &record, sizeof(record));
+
+    mbed::bd_size_t eraseSize = bd.get_erase_size(address);
+    int err = bd.erase(address - (address % eraseSize), eraseSize);
+    if(err)
+    {
+        printf("[Calibration] Error %d erasing calibration sector\n", err);
+        return err;
+    }
+
+    // A buffered device only programs its last page on sync
+    err = bd.program(buffer, address, writeSize);
+    if(!err)
+    {
+        err = bd.sync();
+    }
+    if(err)
+    {
+        printf("[Calibration] Error %d writing calibration\n", err);
+    }
+    return err;
+}
+
+bool BMI323Calibration::load(BMI323Base::dp_calibration* cal, mbed::BlockDevice &bd, mbed::bd_addr_t address)
+{
+    calibration_record record;
+    if(bd.read(&record, address, sizeof(record)))
+    {
+        return false;
+    }
+
+    if(record.magic != RECORD_MAGIC || record.version != RECORD_VERSION ||
+        record.size != sizeof(BMI323Base::dp_calibration))
+    {
+        return false;
+    }
+
+    uint32_t expectedCrc = 0;
+    mbed::MbedCRC<POLY_32BIT_ANSI, 32> crc;
+    crc.compute(&record, offsetof(calibration_record, crc), &expectedCrc);
+    if(expectedCrc != record.crc)
+    {
+        printf("[Calibration] CRC mismatch, ignoring saved calibration\n");
+        return false;
+    }
+
+    *cal = record.cal;
+    return true;
+}
+
+bool BMI323Calibration::restore(mbed::BlockDevice &bd, mbed::bd_addr_t address)
+{
+    BMI323Base::dp_calibration cal;
+    if(!load(&cal, bd, address))
+    {
+        return false;
+    }
+
+    apply(cal);
+    return true;
+}
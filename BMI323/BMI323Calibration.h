@@ -0,0 +1,131 @@
+/**
+ * @file BMI323Calibration.h
+ * @author Reo Tseng
+ * @brief Offset/gain calibration for the BMI323, applied through the data path registers
+ * @date 2023-09-26
+ *
+ * Datasheets:
+ * https://www.bosch-sensortec.com/media/boschsensortec/downloads/datasheets/bst-bmi323-ds000.pdf
+ */
+
+#ifndef HAMSTER_BMI323_CALIBRATION_H
+#define HAMSTER_BMI323_CALIBRATION_H
+
+#include <mbed.h>
+#include "blockdevice/BlockDevice.h"
+#include "BMI323.h"
+
+/**
+ * @brief Estimates offsets/gains from static captures and writes them into ACC_DP_* / GYR_DP_*
+ *
+ * Section 5.12: "the device does not provide means to store these within non-volatile memory", so the result
+ * is persisted to flash and has to be restored after every power on or soft reset.
+ *
+ * Usage:
+ * 1. begin() to clear the data path registers so the captures see the uncorrected signal
+ * 2. captureStatic() once per orientation the board is held still in. One orientation is enough for offsets,
+ *    both sides of an axis (e.g. Z_UP and Z_DOWN) also give the accel gain of that axis
+ * 3. estimate(), then apply() and save()
+ *
+ * At init, restore() loads the saved values and writes them to the sensor.
+ */
+class BMI323Calibration
+{
+    public:
+        /**
+         * @brief Which axis points up (against gravity) during a capture
+         */
+        enum Orientation : uint8_t {
+            X_UP,
+            X_DOWN,
+            Y_UP,
+            Y_DOWN,
+            Z_UP,
+            Z_DOWN,
+            NUM_ORIENTATIONS
+        };
+
+        /**
+         * @brief Construct a new BMI323Calibration object
+         *
+         * @param imu sensor to calibrate, must already be initialized and configured
+         */
+        BMI323Calibration(BMI323SPI &imu);
+
+        /**
+         * @brief Clear the data path registers and any previous captures
+         */
+        void begin();
+
+        /**
+         * @brief Average raw samples with the board held still
+         *
+         * @param orientation which axis is pointing up
+         * @param samples number of samples to average
+         * @param sampleDelayUs time between samples, should be at least one ODR period
+         */
+        void captureStatic(Orientation orientation, uint16_t samples = 256, uint32_t sampleDelayUs = 1250);
+
+        /**
+         * @brief Turn the captures into data path register values
+         *
+         * @return true if there was at least one capture, false otherwise
+         */
+        bool estimate(BMI323Base::dp_calibration* cal) const;
+
+        /**
+         * @brief Write the calibration to the sensor
+         */
+        void apply(const BMI323Base::dp_calibration &cal);
+
+        /**
+         * @brief Persist a calibration to flash
+         *
+         * Erases the sector containing address, so keep it outside of any log region: with FlashLogFR pass
+         * getBlockDevice() and getCalibrationAddr().
+         *
+         * @return 0 on success, block device error otherwise
+         */
+        static int save(const BMI323Base::dp_calibration &cal, mbed::BlockDevice &bd, mbed::bd_addr_t address);
+
+        /**
+         * @brief Load a calibration from flash
+         *
+         * @return true if a valid record (magic, version and CRC match) was found, false otherwise
+         */
+        static bool load(BMI323Base::dp_calibration* cal, mbed::BlockDevice &bd, mbed::bd_addr_t address);
+
+        /**
+         * @brief Load a saved calibration and write it to the sensor, call after init
+         *
+         * @return true if a calibration was found and applied, false otherwise
+         */
+        bool restore(mbed::BlockDevice &bd, mbed::bd_addr_t address);
+
+    private:
+        /** On-flash layout of a saved calibration */
+        struct calibration_record {
+            uint32_t magic;
+            uint16_t version;
+            uint16_t size;
+            BMI323Base::dp_calibration cal;
+            uint32_t crc;
+        };
+
+        static constexpr uint32_t RECORD_MAGIC = 0x4C414342;   // "BCAL"
+        static constexpr uint16_t RECORD_VERSION = 1;
+
+        // Data path register resolution, Section 6.1 (acc_dp_off_x, gyr_dp_off_x, ...)
+        static constexpr float ACCEL_OFFSET_UG_PER_LSB = 30.52f;
+        static constexpr float ACCEL_GAIN_PER_LSB = 1.0f / 4096.0f;
+        static constexpr float GYRO_OFFSET_DPS_PER_LSB = 0.061f;
+
+        BMI323SPI &imu;
+
+        // Mean raw sample per orientation, valid if captured[orientation] is set
+        float accelMean[NUM_ORIENTATIONS][3];
+        float gyroMean[NUM_ORIENTATIONS][3];
+        bool captured[NUM_ORIENTATIONS];
+};
+
+#endif // HAMSTER_BMI323_CALIBRATION_H
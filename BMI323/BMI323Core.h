@@ -0,0 +1,238 @@
+/**
+ * @file BMI323Core.h
+ * @brief Header only BMI323 read path, templated on the transport and a compile time configuration
+ *
+ * BMI323Base reads through virtual functions, so a sample read can't be inlined into the loop that uses it. The
+ * core has no virtuals: the transport is a template parameter, and range, ODR and FIFO frame layout come from a
+ * configuration struct, so the scale factors and register words are constants and the read/decode/scale path
+ * inlines. BMI323SPI forwards its sample reads here with BMI323SPIBus, the host build can plug in a model directly
+ * (SimBMI323Bus).
+ *
+ * A transport provides:
+ *   void read(uint8_t address, char* data, uint16_t length)            burst read, data[0] is the dummy byte
+ *   void write(uint8_t address, const uint16_t* data, uint16_t count)  burst write of count words
+ *
+ * Datasheets:
+ * https://www.bosch-sensortec.com/media/boschsensortec/downloads/datasheets/bst-bmi323-ds000.pdf
+ */
+
+#ifndef HAMSTER_BMI323_CORE_H
+#define HAMSTER_BMI323_CORE_H
+
+#include <mbed.h>
+#include "BMI323.h"
+#include "Perf.h"
+
+/**
+ * @brief Configuration for BMI323Core, the defaults are what accelSetup()/gyroSetup()/fifoSetup() set up
+ */
+struct BMI323DefaultConfig
+{
+    static constexpr uint16_t ACCEL_RANGE = 0;      // ACC_CONF.range: +/-2g, 4g, 8g, 16g
+    static constexpr uint16_t GYRO_RANGE = 0;       // GYR_CONF.range: +/-125, 250, 500, 1000, 2000 dps
+    static constexpr uint16_t ODR = BMI323Base::ODR_800_HZ;
+
+    // FIFO frame layout (FIFO_CONF), frames hold the enabled words in this order
+    static constexpr bool FIFO_ACCEL = true;
+    static constexpr bool FIFO_GYRO = true;
+    static constexpr bool FIFO_TEMP = false;
+    static constexpr bool FIFO_TIME = false;
+};
+
+/**
+ * @brief Transport over an Mbed SPI bus with the chip select driven by the driver, as BMI323SPI wires it
+ */
+class BMI323SPIBus
+{
+    public:
+        /** Longest write(), in words */
+        static constexpr uint16_t MAX_WRITE_WORDS = 32;
+
+        explicit BMI323SPIBus(SPI &spi) : spi(spi)
+        {
+        }
+
+        void read(uint8_t address, char* data, uint16_t length)
+        {
+            PERF_SPAN_ARG(PERF_SPAN_IMU_READ, length);
+            PERF_COUNT(PERF_IMU_SPI_TRANSFERS, 1);
+            PERF_COUNT(PERF_IMU_SPI_BYTES, 1 + length);
+
+            spi.select();
+            spi.write(0x80 | address);
+            spi.write(nullptr, 0, data, length);
+            spi.deselect();
+        }
+
+        void write(uint8_t address, const uint16_t* data, uint16_t count)
+        {
+            uint8_t toSend[1 + 2 * MAX_WRITE_WORDS];
+
+            toSend[0] = address;
+            for(uint16_t i = 0; i < count; i++)
+            {
+                toSend[1 + 2 * i] = static_cast<uint8_t>(data[i] & 0xFF);
+                toSend[2 + 2 * i] = static_cast<uint8_t>((data[i] >> 8) & 0xFF);
+            }
+
+            PERF_COUNT(PERF_IMU_SPI_TRANSFERS, 1);
+            PERF_COUNT(PERF_IMU_SPI_BYTES, 1 + 2 * count);
+            spi.write(toSend, 1 + 2 * count, nullptr, 0);
+        }
+
+    private:
+        SPI &spi;
+};
+
+template <typename Transport, typename Config = BMI323DefaultConfig>
+class BMI323Core
+{
+    public:
+        using accel_data = BMI323Base::accel_data;
+        using gyro_data = BMI323Base::gyro_data;
+        using accel_gyro_data = BMI323Base::accel_gyro_data;
+        using accel_gyro_raw = BMI323Base::accel_gyro_raw;
+        using Register = BMI323Base::Register;
+
+        static_assert(Config::ACCEL_RANGE <= 3, "ACC_CONF.range is 0 to 3");
+        static_assert(Config::GYRO_RANGE <= 4, "GYR_CONF.range is 0 to 4");
+        static_assert(Config::ODR >= 0x1 && Config::ODR <= 0xE, "ODR field is 0x1 to 0xE");
+        static_assert(Config::FIFO_ACCEL, "decodeFifo() expects accel in every frame");
+
+        /** Sensitivity for the configured ranges (Section 2, Table 1) */
+        static constexpr float ACCEL_LSB_PER_MG = Config::ACCEL_RANGE == 0 ? 16.38f : Config::ACCEL_RANGE == 1 ? 8.19f :
+            Config::ACCEL_RANGE == 2 ? 4.10f : 2.05f;
+        static constexpr float GYRO_LSB_PER_DPS = 262.144f / (1 << Config::GYRO_RANGE);
+
+        /** Scale factors as multipliers, so scaling needs no division */
+        static constexpr float ACCEL_G_PER_LSB = 1.0f / (ACCEL_LSB_PER_MG * 1000.0f);
+        static constexpr float GYRO_DPS_PER_LSB = 1.0f / GYRO_LSB_PER_DPS;
+
+        /** Register words for the configuration, high performance mode */
+        static constexpr uint16_t ACC_CONF_WORD = BMI323Base::sensorConf(BMI323Base::SENSOR_MODE_HIGH_PERF,
+            Config::ODR, Config::ACCEL_RANGE);
+        static constexpr uint16_t GYR_CONF_WORD = BMI323Base::sensorConf(BMI323Base::SENSOR_MODE_HIGH_PERF,
+            Config::ODR, Config::GYRO_RANGE);
+        static constexpr uint16_t FIFO_CONF_WORD =
+            BMI323Base::FIFO_CONF.accEn.set(0, Config::FIFO_ACCEL) | BMI323Base::FIFO_CONF.gyrEn.set(0, Config::FIFO_GYRO) |
+            BMI323Base::FIFO_CONF.tempEn.set(0, Config::FIFO_TEMP) | BMI323Base::FIFO_CONF.timeEn.set(0, Config::FIFO_TIME);
+
+        /** Words per FIFO frame: accel x, y, z, gyro x, y, z, temperature, sensor time, as enabled */
+        static constexpr uint16_t FIFO_FRAME_WORDS = (Config::FIFO_ACCEL ? 3 : 0) + (Config::FIFO_GYRO ? 3 : 0) +
+            (Config::FIFO_TEMP ? 1 : 0) + (Config::FIFO_TIME ? 1 : 0);
+
+        explicit BMI323Core(const Transport &transport) : bus(transport)
+        {
+        }
+
+        Transport &transport()
+        {
+            return bus;
+        }
+
+        /** @return true if CHIP_ID reads 0x0043 */
+        bool checkChipId()
+        {
+            char data[3];
+            bus.read(static_cast<uint8_t>(Register::CHIP_ID), data, 3);
+            return word(data + 1) == 0x0043;
+        }
+
+        /**
+         * @brief Set up the FIFO, accel and gyro from Config in two bursts, FIFO first as Section 5.7.2 asks
+         */
+        void configure()
+        {
+            uint16_t fifo[2] = {FIFO_CONF_WORD, 0x0001};    // then flush
+            uint16_t sensors[2] = {ACC_CONF_WORD, GYR_CONF_WORD};
+            bus.write(static_cast<uint8_t>(Register::FIFO_CONF), fifo, 2);
+            bus.write(static_cast<uint8_t>(Register::ACC_CONF), sensors, 2);
+        }
+
+        /** Accel and gyro data registers in one burst, raw LSB */
+        void readRaw(accel_gyro_raw* raw)
+        {
+            char data[13];
+            bus.read(static_cast<uint8_t>(Register::ACC_DATA_X), data, 13);
+            for(int i = 0; i < 3; i++)
+            {
+                raw->accel[i] = word(data + 1 + 2 * i);
+                raw->gyro[i] = word(data + 7 + 2 * i);
+            }
+        }
+
+        /** Accel and gyro in g and dps */
+        void read(accel_gyro_data* data)
+        {
+            accel_gyro_raw raw;
+            readRaw(&raw);
+            scale(raw, data);
+        }
+
+        void readAccel(accel_data* accel)
+        {
+            char data[7];
+            bus.read(static_cast<uint8_t>(Register::ACC_DATA_X), data, 7);
+            accel->x = word(data + 1) * ACCEL_G_PER_LSB;
+            accel->y = word(data + 3) * ACCEL_G_PER_LSB;
+            accel->z = word(data + 5) * ACCEL_G_PER_LSB;
+        }
+
+        void readGyro(gyro_data* gyro)
+        {
+            char data[7];
+            bus.read(static_cast<uint8_t>(Register::GYR_DATA_X), data, 7);
+            gyro->x = word(data + 1) * GYRO_DPS_PER_LSB;
+            gyro->y = word(data + 3) * GYRO_DPS_PER_LSB;
+            gyro->z = word(data + 5) * GYRO_DPS_PER_LSB;
+        }
+
+        static void scale(const accel_gyro_raw &raw, accel_gyro_data* data)
+        {
+            data->accel.x = raw.accel[0] * ACCEL_G_PER_LSB;
+            data->accel.y = raw.accel[1] * ACCEL_G_PER_LSB;
+            data->accel.z = raw.accel[2] * ACCEL_G_PER_LSB;
+            data->gyro.x = raw.gyro[0] * GYRO_DPS_PER_LSB;
+            data->gyro.y = raw.gyro[1] * GYRO_DPS_PER_LSB;
+            data->gyro.z = raw.gyro[2] * GYRO_DPS_PER_LSB;
+        }
+
+        /**
+         * @brief Decode FIFO frames in the configured layout (dummy byte already stripped)
+         * 
+         * Dummy frames (accel x 0x7f01, Section 5.7.1, Table 18) are skipped. Without gyro in the frames the gyro
+         * values are 0, temperature and time are not returned.
+         * 
+         * @return number of frames written to out
+         */
+        static uint16_t decodeFifo(const char* data, uint16_t frames, accel_gyro_raw* out)
+        {
+            uint16_t decoded = 0;
+            for(uint16_t frame = 0; frame < frames; frame++)
+            {
+                const char* words = data + frame * FIFO_FRAME_WORDS * 2;
+                if(static_cast<uint8_t>(words[0]) == 0x01 && static_cast<uint8_t>(words[1]) == 0x7f)
+                {
+                    continue;
+                }
+                for(int i = 0; i < 3; i++)
+                {
+                    out[decoded].accel[i] = word(words + 2 * i);
+                    out[decoded].gyro[i] = Config::FIFO_GYRO ? word(words + 6 + 2 * i) : 0;
+                }
+                decoded++;
+            }
+            return decoded;
+        }
+
+    private:
+        // Little endian word off the bus
+        static int16_t word(const char* bytes)
+        {
+            return static_cast<int16_t>((static_cast<uint8_t>(bytes[1]) << 8) | static_cast<uint8_t>(bytes[0]));
+        }
+
+        Transport bus;
+};
+
+#endif // HAMSTER_BMI323_CORE_H
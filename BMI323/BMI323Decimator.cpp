@@ -0,0 +1,328 @@
+/**
+ * @file BMI323Decimator.cpp
+ * @brief Anti-alias filtering and decimation of raw BMI323 frames, several output rates from one input stream
+ */
+
+#include "BMI323Decimator.h"
+#include <cmath>
+#include "Perf.h"
+
+namespace
+{
+    constexpr uint16_t HISTORY = BMI323Decimator::MAX_TAPS - 1;
+
+    // Taps per factor when addFir() picks the length
+    constexpr uint16_t DEFAULT_TAPS_PER_FACTOR = 8;
+
+    // Default FIR corner, as a fraction of the output Nyquist rate
+    constexpr float DEFAULT_CUTOFF = 0.8f;
+
+    int16_t saturate(int64_t value)
+    {
+        if(value > INT16_MAX)
+        {
+            return INT16_MAX;
+        }
+        if(value < INT16_MIN)
+        {
+            return INT16_MIN;
+        }
+        return static_cast<int16_t>(value);
+    }
+
+    /**
+     * @brief Q15 dot product of taps and samples, Q30 result
+     *
+     * With the DSP extension (Cortex-M4/M7) __SMLALD multiplies and accumulates two pairs per instruction into 64
+     * bits, so no tap set can overflow it.
+     */
+    int64_t dot(const int16_t* taps, const int16_t* samples, uint16_t count)
+    {
+        int64_t sum = 0;
+        uint16_t i = 0;
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+        for(; i + 1 < count; i += 2)
+        {
+            // History rows start at arbitrary offsets, the M7 takes unaligned word loads
+            uint32_t tapPair;
+            uint32_t samplePair;
+            memcpy(&tapPair, taps + i, sizeof(tapPair));
+            memcpy(&samplePair, samples + i, sizeof(samplePair));
+            sum = static_cast<int64_t>(__SMLALD(tapPair, samplePair, static_cast<uint64_t>(sum)));
+        }
+#endif
+        for(; i < count; i++)
+        {
+            sum += static_cast<int32_t>(taps[i]) * samples[i];
+        }
+        return sum;
+    }
+
+    int16_t &channel(BMI323Base::accel_gyro_raw &frame, uint8_t c)
+    {
+        return c < 3 ? frame.accel[c] : frame.gyro[c - 3];
+    }
+
+    int16_t channel(const BMI323Base::accel_gyro_raw &frame, uint8_t c)
+    {
+        return c < 3 ? frame.accel[c] : frame.gyro[c - 3];
+    }
+}
+
+BMI323Decimator::BMI323Decimator() : numOutputs(0)
+{
+    reset();
+}
+
+int BMI323Decimator::addFir(uint8_t factor, uint16_t tapCount, const int16_t* taps)
+{
+    if(tapCount == 0)
+    {
+        tapCount = factor * DEFAULT_TAPS_PER_FACTOR < MAX_TAPS ? factor * DEFAULT_TAPS_PER_FACTOR : MAX_TAPS;
+    }
+    if(tapCount > MAX_TAPS)
+    {
+        return -1;
+    }
+
+    int16_t designed[MAX_TAPS];
+    if(!taps)
+    {
+        if(factor < 2 || designLowPass(designed, tapCount, DEFAULT_CUTOFF * 0.5f / factor) == 0)
+        {
+            return -1;
+        }
+        taps = designed;
+    }
+
+    int index = addOutput(FILTER_FIR, factor);
+    if(index < 0)
+    {
+        return -1;
+    }
+
+    output_stage &stage = outputs[index];
+    stage.tapCount = tapCount;
+    for(uint16_t i = 0; i < tapCount; i++)
+    {
+        stage.taps[i] = taps[tapCount - 1 - i];
+    }
+    return index;
+}
+
+int BMI323Decimator::addCic(uint8_t factor, uint8_t order)
+{
+    if(order == 0 || order > MAX_CIC_ORDER || factor < 2)
+    {
+        return -1;
+    }
+
+    // Integrators need 16 bits for the sample plus order * log2(factor) of growth
+    int growth = 0;
+    while((1u << growth) < factor)
+    {
+        growth++;
+    }
+    if(16 + order * growth > 32)
+    {
+        return -1;
+    }
+
+    int index = addOutput(FILTER_CIC, factor);
+    if(index < 0)
+    {
+        return -1;
+    }
+
+    output_stage &stage = outputs[index];
+    stage.order = order;
+    stage.gain = 1;
+    for(uint8_t i = 0; i < order; i++)
+    {
+        stage.gain *= factor;
+    }
+    return index;
+}
+
+int BMI323Decimator::addOutput(FilterType type, uint8_t factor)
+{
+    if(numOutputs >= MAX_OUTPUTS || factor < 2)
+    {
+        return -1;
+    }
+
+    output_stage &stage = outputs[numOutputs];
+    stage.type = type;
+    stage.factor = factor;
+    stage.order = 0;
+    stage.tapCount = 0;
+    stage.countdown = factor;
+    stage.gain = 1;
+    stage.produced = 0;
+    memset(stage.integrators, 0, sizeof(stage.integrators));
+    memset(stage.combs, 0, sizeof(stage.combs));
+    return numOutputs++;
+}
+
+void BMI323Decimator::clear()
+{
+    numOutputs = 0;
+    reset();
+}
+
+void BMI323Decimator::reset()
+{
+    memset(history, 0, sizeof(history));
+    for(uint8_t i = 0; i < numOutputs; i++)
+    {
+        output_stage &stage = outputs[i];
+        stage.countdown = stage.factor;
+        stage.produced = 0;
+        memset(stage.integrators, 0, sizeof(stage.integrators));
+        memset(stage.combs, 0, sizeof(stage.combs));
+    }
+}
+
+uint16_t BMI323Decimator::process(const BMI323Base::accel_gyro_raw* frames, uint16_t count)
+{
+    count = count < MAX_BATCH ? count : MAX_BATCH;
+    PERF_SPAN_ARG(PERF_SPAN_DECIMATE, count);
+
+    // Split into channels once, every output reads from here
+    for(uint8_t c = 0; c < CHANNELS; c++)
+    {
+        int16_t* row = history[c] + HISTORY;
+        for(uint16_t i = 0; i < count; i++)
+        {
+            row[i] = channel(frames[i], c);
+        }
+    }
+
+    for(uint8_t i = 0; i < numOutputs; i++)
+    {
+        if(outputs[i].type == FILTER_FIR)
+        {
+            runFir(outputs[i], count);
+        }
+        else
+        {
+            runCic(outputs[i], count);
+        }
+    }
+
+    // Keep the newest inputs for the next batch's FIRs
+    for(uint8_t c = 0; c < CHANNELS; c++)
+    {
+        memmove(history[c], history[c] + count, HISTORY * sizeof(history[c][0]));
+    }
+    return count;
+}
+
+void BMI323Decimator::runFir(output_stage &stage, uint16_t count)
+{
+    uint16_t produced = 0;
+    uint32_t n = stage.countdown - 1;
+    for(; n < count; n += stage.factor)
+    {
+        // The window ends on input n, its oldest taps reach back into the previous batch
+        uint32_t first = HISTORY + n + 1 - stage.tapCount;
+        BMI323Base::accel_gyro_raw &out = stage.frames[produced++];
+        for(uint8_t c = 0; c < CHANNELS; c++)
+        {
+            int64_t sum = dot(stage.taps, history[c] + first, stage.tapCount);
+            channel(out, c) = saturate((sum + (1 << 14)) >> 15);
+        }
+    }
+    stage.countdown = n - count + 1;
+    stage.produced = produced;
+}
+
+/**
+ * @brief Hogenauer's CIC, differential delay 1
+ *
+ * Integrators run at the input rate and the combs at the output rate, both wrap in 32 bits. The output is exact as
+ * long as the true result fits, which addCic() makes sure of.
+ */
+void BMI323Decimator::runCic(output_stage &stage, uint16_t count)
+{
+    uint32_t next = stage.countdown - 1;
+    uint16_t produced = 0;
+
+    for(uint8_t c = 0; c < CHANNELS; c++)
+    {
+        const int16_t* row = history[c] + HISTORY;
+        uint32_t* integrators = &stage.integrators[0][c];
+        uint32_t* combs = &stage.combs[0][c];
+        uint32_t outputAt = next;
+        produced = 0;
+
+        for(uint16_t i = 0; i < count; i++)
+        {
+            uint32_t value = static_cast<uint32_t>(static_cast<int32_t>(row[i]));
+            for(uint8_t s = 0; s < stage.order; s++)
+            {
+                integrators[s * CHANNELS] += value;
+                value = integrators[s * CHANNELS];
+            }
+
+            if(i != outputAt)
+            {
+                continue;
+            }
+            outputAt += stage.factor;
+
+            for(uint8_t s = 0; s < stage.order; s++)
+            {
+                uint32_t delayed = combs[s * CHANNELS];
+                combs[s * CHANNELS] = value;
+                value -= delayed;
+            }
+
+            int32_t sum = static_cast<int32_t>(value);
+            int32_t half = sum >= 0 ? stage.gain / 2 : -stage.gain / 2;
+            channel(stage.frames[produced++], c) = saturate((sum + half) / stage.gain);
+        }
+    }
+
+    while(next < count)
+    {
+        next += stage.factor;
+    }
+    stage.countdown = next - count + 1;
+    stage.produced = produced;
+}
+
+uint16_t BMI323Decimator::designLowPass(int16_t* taps, uint16_t tapCount, float cutoff)
+{
+    if(tapCount == 0 || !(cutoff > 0.0f && cutoff <= 0.5f))
+    {
+        return 0;
+    }
+
+    const float pi = 3.14159265f;
+    const float middle = (tapCount - 1) / 2.0f;
+
+    auto tap = [&](uint16_t k) {
+        float t = k - middle;
+        float sinc = t == 0.0f ? 2.0f * cutoff : sinf(2.0f * pi * cutoff * t) / (pi * t);
+        float window = tapCount > 1 ? 0.54f - 0.46f * cosf(2.0f * pi * k / (tapCount - 1)) : 1.0f;
+        return sinc * window;
+    };
+
+    float sum = 0.0f;
+    for(uint16_t k = 0; k < tapCount; k++)
+    {
+        sum += tap(k);
+    }
+
+    // Rounding leaves the sum a few LSB off unity, the centre tap takes the difference
+    int32_t quantizedSum = 0;
+    for(uint16_t k = 0; k < tapCount; k++)
+    {
+        taps[k] = saturate(lroundf(tap(k) / sum * 32768.0f));
+        quantizedSum += taps[k];
+    }
+    uint16_t centre = tapCount / 2;
+    taps[centre] = saturate(taps[centre] + 32768 - quantizedSum);
+    return tapCount;
+}
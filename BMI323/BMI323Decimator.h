@@ -0,0 +1,161 @@
+/**
+ * @file BMI323Decimator.h
+ * @brief Anti-alias filtering and decimation of raw BMI323 frames, several output rates from one input stream
+ *
+ * Vibration analysis wants the sensor at a high ODR, navigation and the log only need a few hundred Hz. Feed each
+ * batch readFifo() returns to process(), then take the decimated frames of every output from output(). Each output
+ * has its own rate and filter:
+ * - FIR: Q15 taps, only every factor'th output is computed (the polyphase form of a decimating FIR). Taps are
+ *   designed with designLowPass() unless given. On cores with the DSP extension the dot products use the CMSIS
+ *   __SMLALD intrinsic, two taps per instruction, everywhere else plain C.
+ * - CIC: order N integrators and combs, no multiplies at all, gain divided out exactly. Its droop and weaker
+ *   stopband suit outputs well below the sensor's own low pass, the FIR is the better anti-alias filter.
+ *
+ * Frames are split into channels once per batch and every output reads the same history, so adding an output
+ * costs its filter only. Raw LSB go in and come out, so BMI323Base::scale() and the log take the outputs as they
+ * are. All buffers are sized at compile time.
+ */
+
+#ifndef HAMSTER_BMI323_DECIMATOR_H
+#define HAMSTER_BMI323_DECIMATOR_H
+
+#include <mbed.h>
+#include "BMI323.h"
+
+class BMI323Decimator
+{
+    public:
+        enum FilterType : uint8_t {
+            FILTER_FIR,
+            FILTER_CIC
+        };
+
+        /** Output rates one decimator serves */
+        static constexpr uint8_t MAX_OUTPUTS = 3;
+
+        /** Longest FIR, also the input history kept between batches */
+        static constexpr uint16_t MAX_TAPS = 64;
+
+        static constexpr uint8_t MAX_CIC_ORDER = 4;
+
+        /** Most frames one process() call takes, a full FIFO */
+        static constexpr uint16_t MAX_BATCH = BMI323Base::FIFO_MAX_FRAMES;
+
+        /** Most frames one output produces per process(), factors are at least 2 */
+        static constexpr uint16_t MAX_OUTPUT_FRAMES = MAX_BATCH / 2 + 1;
+
+        /** accel x, y, z then gyro x, y, z */
+        static constexpr uint8_t CHANNELS = 6;
+
+        BMI323Decimator();
+
+        /**
+         * @brief Add an output through a decimating FIR
+         *
+         * @param factor input frames per output frame, 2 or more
+         * @param tapCount filter length up to MAX_TAPS, 0 picks 8 taps per factor
+         * @param taps Q15 coefficients, copied. nullptr designs a low pass at 80% of the output Nyquist rate.
+         * @return index of the output, -1 if the parameters are out of range or MAX_OUTPUTS are in use
+         */
+        int addFir(uint8_t factor, uint16_t tapCount = 0, const int16_t* taps = nullptr);
+
+        /**
+         * @brief Add an output through a CIC decimator
+         *
+         * The gain is factor^order, which has to fit next to 16 bit samples in 32 bit integrators: order 3 takes
+         * factors up to 32, order 4 up to 16.
+         *
+         * @return index of the output, -1 if the parameters are out of range or MAX_OUTPUTS are in use
+         */
+        int addCic(uint8_t factor, uint8_t order = 3);
+
+        /**
+         * @brief Remove every output
+         */
+        void clear();
+
+        /**
+         * @brief Zero the history and the filter states, keep the outputs. Call when the input stream restarts.
+         */
+        void reset();
+
+        /**
+         * @brief Filter a batch of frames into every output
+         *
+         * Outputs of the previous call are replaced.
+         *
+         * @param count frames in the batch, anything past MAX_BATCH is left for the next call
+         * @return frames consumed
+         */
+        uint16_t process(const BMI323Base::accel_gyro_raw* frames, uint16_t count);
+
+        uint8_t outputCount() const
+        {
+            return numOutputs;
+        }
+
+        /** Frames an output produced in the last process() */
+        uint16_t available(uint8_t output) const
+        {
+            return outputs[output].produced;
+        }
+
+        const BMI323Base::accel_gyro_raw* output(uint8_t output) const
+        {
+            return outputs[output].frames;
+        }
+
+        uint8_t factor(uint8_t output) const
+        {
+            return outputs[output].factor;
+        }
+
+        FilterType filterType(uint8_t output) const
+        {
+            return outputs[output].type;
+        }
+
+        /**
+         * @brief Design a windowed sinc (Hamming) low pass in Q15, quantized so the taps sum to exactly unity gain
+         *
+         * @param cutoff corner frequency in cycles per input sample, 0 to 0.5
+         * @return tapCount, or 0 if it or the cutoff is out of range
+         */
+        static uint16_t designLowPass(int16_t* taps, uint16_t tapCount, float cutoff);
+
+    private:
+        /**
+         * @brief One output rate
+         */
+        struct output_stage {
+            FilterType type;
+            uint8_t factor;
+            uint8_t order;              // CIC only
+            uint16_t tapCount;          // FIR only
+            uint16_t countdown;         // input frames still to come before the next output frame, 1 to factor
+
+            // FIR taps, stored reversed so each output is one dot product over ascending history
+            int16_t taps[MAX_TAPS];
+
+            // CIC integrators and comb delays, unsigned so they wrap as the algorithm expects
+            uint32_t integrators[MAX_CIC_ORDER][CHANNELS];
+            uint32_t combs[MAX_CIC_ORDER][CHANNELS];
+            int32_t gain;               // factor^order
+
+            uint16_t produced;
+            BMI323Base::accel_gyro_raw frames[MAX_OUTPUT_FRAMES];
+        };
+
+        int addOutput(FilterType type, uint8_t factor);
+
+        void runFir(output_stage &stage, uint16_t count);
+        void runCic(output_stage &stage, uint16_t count);
+
+        uint8_t numOutputs;
+        output_stage outputs[MAX_OUTPUTS];
+
+        // Per channel, the last MAX_TAPS - 1 inputs followed by the current batch
+        int16_t history[CHANNELS][MAX_TAPS - 1 + MAX_BATCH];
+};
+
+#endif // HAMSTER_BMI323_DECIMATOR_H
@@ -0,0 +1,124 @@
+/**
+ * @file BMI323Preintegrator.cpp
+ * @brief Delta angle and delta velocity increments at the sensor rate, with coning and sculling compensation
+ */
+
+#include "BMI323Preintegrator.h"
+
+namespace
+{
+    constexpr float RAD_PER_DEG = 3.14159265f / 180.0f;
+
+    // out += scale * (a x b)
+    void addCross(float* out, const float* a, const float* b, float scale)
+    {
+        out[0] += scale * (a[1] * b[2] - a[2] * b[1]);
+        out[1] += scale * (a[2] * b[0] - a[0] * b[2]);
+        out[2] += scale * (a[0] * b[1] - a[1] * b[0]);
+    }
+}
+
+BMI323Preintegrator::BMI323Preintegrator() : periodS(0.0f), samplesPer(0), compensate(true)
+{
+    setup(800.0f);
+}
+
+bool BMI323Preintegrator::setup(float odrHz, uint16_t samplesPerIncrement)
+{
+    if(!(odrHz > 0.0f) || samplesPerIncrement == 0)
+    {
+        return false;
+    }
+
+    periodS = 1.0f / odrHz;
+    samplesPer = samplesPerIncrement;
+    angleScale = periodS * RAD_PER_DEG / BMI323Base::GYRO_LSB_PER_DPS;
+    velocityScale = periodS * GRAVITY / (BMI323Base::ACCEL_LSB_PER_MG * 1000.0f);
+
+    reset();
+    return true;
+}
+
+void BMI323Preintegrator::reset()
+{
+    samples = 0;
+    ready = false;
+    memset(&result, 0, sizeof(result));
+    memset(alpha, 0, sizeof(alpha));
+    memset(velocity, 0, sizeof(velocity));
+    memset(coning, 0, sizeof(coning));
+    memset(sculling, 0, sizeof(sculling));
+    memset(lastAngle, 0, sizeof(lastAngle));
+    memset(lastVelocity, 0, sizeof(lastVelocity));
+}
+
+uint16_t BMI323Preintegrator::process(const BMI323Base::accel_gyro_raw* frames, uint16_t count)
+{
+    ready = false;
+
+    uint16_t used = 0;
+    while(used < count && !ready)
+    {
+        const BMI323Base::accel_gyro_raw &frame = frames[used++];
+
+        float angle[3];
+        float dv[3];
+        for(int i = 0; i < 3; i++)
+        {
+            angle[i] = frame.gyro[i] * angleScale;
+            dv[i] = frame.accel[i] * velocityScale;
+        }
+
+        if(compensate)
+        {
+            // Both terms use the sums before this sample, the previous sample may be from the last increment
+            float angleBefore[3];
+            float velocityBefore[3];
+            for(int i = 0; i < 3; i++)
+            {
+                angleBefore[i] = alpha[i] + lastAngle[i] / 6.0f;
+                velocityBefore[i] = velocity[i] + lastVelocity[i] / 6.0f;
+            }
+            addCross(coning, angleBefore, angle, 0.5f);
+            addCross(sculling, angleBefore, dv, 0.5f);
+            addCross(sculling, velocityBefore, angle, 0.5f);
+        }
+
+        for(int i = 0; i < 3; i++)
+        {
+            alpha[i] += angle[i];
+            velocity[i] += dv[i];
+            lastAngle[i] = angle[i];
+            lastVelocity[i] = dv[i];
+        }
+
+        if(++samples == samplesPer)
+        {
+            finish();
+        }
+    }
+    return used;
+}
+
+void BMI323Preintegrator::finish()
+{
+    for(int i = 0; i < 3; i++)
+    {
+        result.deltaAngle[i] = alpha[i] + coning[i];
+        result.deltaVelocity[i] = velocity[i] + sculling[i];
+    }
+    if(compensate)
+    {
+        // Rotation of the velocity sum into the frame at the start of the interval
+        addCross(result.deltaVelocity, alpha, velocity, 0.5f);
+    }
+    result.dt = samples * periodS;
+    result.samples = samples;
+
+    samples = 0;
+    ready = true;
+    memset(alpha, 0, sizeof(alpha));
+    memset(velocity, 0, sizeof(velocity));
+    memset(coning, 0, sizeof(coning));
+    memset(sculling, 0, sizeof(sculling));
+}
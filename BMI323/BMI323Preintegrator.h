@@ -0,0 +1,113 @@
+/**
+ * @file BMI323Preintegrator.h
+ * @brief Delta angle and delta velocity increments at the sensor rate, with coning and sculling compensation
+ *
+ * A navigation loop that integrates rates at its own, slower rate misses the rotation within each step: vibration
+ * that rotates the board back and forth around two axes out of phase (coning) leaves a net rotation, and the same
+ * with acceleration (sculling) a net velocity, which plain sums of samples don't see. The preintegrator runs on the
+ * FIFO batches at the ODR and hands the loop one increment per samplesPerIncrement frames. An increment is the
+ * rotation vector over its interval and the velocity change in the body frame at its start, from Savage's recursive
+ * two-sample algorithms (Strapdown Analytics, 7.1.1 and 7.2.2.2):
+ *
+ *   rotation:  phi = alpha + beta,             beta += 1/2 (alpha + 1/6 dalpha_prev) x dalpha
+ *   velocity:  dv = v + 1/2 alpha x v + s,     s += 1/2 [(alpha + 1/6 dalpha_prev) x dv_l + (v + 1/6 dv_prev) x dalpha]
+ *
+ * alpha and v are the plain sums so far, dalpha and dv_l the increments of one sample (rate times period).
+ * Velocities are specific force, gravity included. Scales are the driver's defaults, as BMI323Base::scale().
+ */
+
+#ifndef HAMSTER_BMI323_PREINTEGRATOR_H
+#define HAMSTER_BMI323_PREINTEGRATOR_H
+
+#include <mbed.h>
+#include "BMI323.h"
+
+class BMI323Preintegrator
+{
+    public:
+        /**
+         * @brief What the navigation loop gets, body frame x, y, z
+         */
+        struct delta_increment {
+            float deltaAngle[3];        // rad, rotation vector, coning included
+            float deltaVelocity[3];     // m/s, in the frame at the start of the interval, sculling included
+            float dt;                   // s
+            uint16_t samples;
+        };
+
+        /** Standard gravity, for the accel scale */
+        static constexpr float GRAVITY = 9.80665f;
+
+        BMI323Preintegrator();
+
+        /**
+         * @brief Set the input rate and how many frames go into each increment, then reset
+         *
+         * @return false if a parameter is out of range, the previous setup is kept then
+         */
+        bool setup(float odrHz, uint16_t samplesPerIncrement = 8);
+
+        /**
+         * @brief Drop the sums of the increment being built and the previous sample. Call when the stream restarts.
+         */
+        void reset();
+
+        /**
+         * @brief Integrate a batch of frames
+         *
+         * Stops right after the frame that completes an increment, so feed the rest of the batch in again:
+         *
+         *   for(uint16_t used = 0; used < count; )
+         *   {
+         *       used += integrator.process(frames + used, count - used);
+         *       if(integrator.incrementReady()) { ... integrator.increment() ... }
+         *   }
+         *
+         * @return frames consumed
+         */
+        uint16_t process(const BMI323Base::accel_gyro_raw* frames, uint16_t count);
+
+        /** Set when the last process() completed an increment */
+        bool incrementReady() const
+        {
+            return ready;
+        }
+
+        const delta_increment &increment() const
+        {
+            return result;
+        }
+
+        /** Turn coning and sculling compensation off (and on again), to compare against plain sums */
+        void setCompensation(bool enabled)
+        {
+            compensate = enabled;
+        }
+
+    private:
+        // Increment complete, sums into result
+        void finish();
+
+        float periodS;
+        uint16_t samplesPer;
+        bool compensate;
+
+        // Radians and m/s per LSB over one sample period
+        float angleScale;
+        float velocityScale;
+
+        uint16_t samples;
+        bool ready;
+        delta_increment result;
+
+        float alpha[3];                 // sum of the sample angles
+        float velocity[3];              // sum of the sample velocities
+        float coning[3];
+        float sculling[3];
+
+        // Previous sample, carried into the next increment
+        float lastAngle[3];
+        float lastVelocity[3];
+};
+
+#endif // HAMSTER_BMI323_PREINTEGRATOR_H
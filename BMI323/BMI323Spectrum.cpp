@@ -0,0 +1,296 @@
+/**
+ * @file BMI323Spectrum.cpp
+ * @brief Vibration spectrum of raw high rate accel frames, reduced to band RMS summaries small enough to log
+ */
+
+#include "BMI323Spectrum.h"
+#include <cmath>
+#include "Perf.h"
+
+namespace
+{
+    constexpr float PI = 3.14159265f;
+}
+
+BMI323Spectrum::BMI323Spectrum() : odr(0.0f), size(0), hopSize(0), averageCount(0), bandTotal(0), windowPower(0.0f)
+{
+    setup(800.0f);
+}
+
+bool BMI323Spectrum::setup(float odrHz, uint16_t fftSize, uint16_t hop, uint16_t averages)
+{
+    hop = hop ? hop : fftSize / 2;
+    bool powerOfTwo = fftSize && (fftSize & (fftSize - 1)) == 0;
+    if(!(odrHz > 0.0f) || !powerOfTwo || fftSize < MIN_FFT_SIZE || fftSize > MAX_FFT_SIZE || hop > fftSize ||
+        averages == 0)
+    {
+        return false;
+    }
+
+    odr = odrHz;
+    size = fftSize;
+    hopSize = hop;
+    averageCount = averages;
+
+    // Periodic Hann, overlapping windows at half a window sum to a constant
+    windowPower = 0.0f;
+    for(uint16_t n = 0; n < size; n++)
+    {
+        window[n] = 0.5f - 0.5f * cosf(2.0f * PI * n / size);
+        windowPower += window[n] * window[n];
+    }
+
+    for(uint16_t k = 0; k < size / 2; k++)
+    {
+        twiddles[2 * k] = cosf(2.0f * PI * k / size);
+        twiddles[2 * k + 1] = sinf(2.0f * PI * k / size);
+    }
+
+    float edges[MAX_BANDS + 1];
+    for(uint8_t i = 0; i <= MAX_BANDS; i++)
+    {
+        edges[i] = odr / 2.0f * i / MAX_BANDS;
+    }
+    setBands(edges, MAX_BANDS);
+
+    reset();
+    return true;
+}
+
+bool BMI323Spectrum::setBands(const float* edgesHz, uint8_t bands)
+{
+    if(bands == 0 || bands > MAX_BANDS || edgesHz[0] < 0.0f || edgesHz[bands] > odr / 2.0f)
+    {
+        return false;
+    }
+    for(uint8_t i = 0; i < bands; i++)
+    {
+        if(!(edgesHz[i] < edgesHz[i + 1]))
+        {
+            return false;
+        }
+    }
+
+    bandTotal = bands;
+    memcpy(bandEdges, edgesHz, (bands + 1) * sizeof(bandEdges[0]));
+    return true;
+}
+
+void BMI323Spectrum::reset()
+{
+    filled = 0;
+    windows = 0;
+    ready = false;
+    memset(power, 0, sizeof(power));
+    memset(&result, 0, sizeof(result));
+}
+
+uint16_t BMI323Spectrum::process(const BMI323Base::accel_gyro_raw* frames, uint16_t count)
+{
+    ready = false;
+
+    uint16_t used = 0;
+    while(used < count && !ready)
+    {
+        for(uint8_t axis = 0; axis < AXES; axis++)
+        {
+            samples[axis][filled] = frames[used].accel[axis];
+        }
+        filled++;
+        used++;
+
+        if(filled < size)
+        {
+            continue;
+        }
+
+        analyse();
+
+        // Keep the overlap for the next window
+        filled = size - hopSize;
+        for(uint8_t axis = 0; axis < AXES; axis++)
+        {
+            memmove(samples[axis], samples[axis] + hopSize, filled * sizeof(samples[axis][0]));
+        }
+
+        if(++windows == averageCount)
+        {
+            summarise();
+            memset(power, 0, sizeof(power));
+            windows = 0;
+            ready = true;
+        }
+    }
+    return used;
+}
+
+/**
+ * @brief The size real samples are packed as size / 2 complex ones, even samples real and odd ones imaginary. With
+ * Z the FFT of those, E and O the spectra of the even and odd samples are (Z[k] + Z*[M - k]) / 2 and
+ * (Z[k] - Z*[M - k]) / 2i, and X[k] = E[k] + W^k O[k] with W = e^(-2 pi i / size), for k from 0 to M = size / 2.
+ */
+void BMI323Spectrum::analyse()
+{
+    PERF_SPAN_ARG(PERF_SPAN_SPECTRUM, size);
+
+    const uint16_t points = size / 2;
+
+    for(uint8_t axis = 0; axis < AXES; axis++)
+    {
+        // Gravity and offsets would leak out of bin 0 into the low bins
+        int32_t sum = 0;
+        for(uint16_t n = 0; n < size; n++)
+        {
+            sum += samples[axis][n];
+        }
+        float mean = static_cast<float>(sum) / size;
+
+        for(uint16_t n = 0; n < size; n++)
+        {
+            work[n] = (samples[axis][n] - mean) * window[n];
+        }
+
+        fft(work, points);
+
+        for(uint16_t k = 0; k <= points; k++)
+        {
+            uint16_t a = k % points;
+            uint16_t b = (points - k) % points;
+            float zr = work[2 * a];
+            float zi = work[2 * a + 1];
+            float cr = work[2 * b];
+            float ci = -work[2 * b + 1];
+
+            float evenRe = (zr + cr) / 2.0f;
+            float evenIm = (zi + ci) / 2.0f;
+            float oddRe = (zi - ci) / 2.0f;
+            float oddIm = -(zr - cr) / 2.0f;
+
+            float wr = k < points ? twiddles[2 * k] : -1.0f;
+            float wi = k < points ? -twiddles[2 * k + 1] : 0.0f;
+
+            float xr = evenRe + wr * oddRe - wi * oddIm;
+            float xi = evenIm + wr * oddIm + wi * oddRe;
+            power[axis][k] += xr * xr + xi * xi;
+        }
+    }
+}
+
+/**
+ * @brief Parseval: the mean square of the windowed signal is the sum of |X[k]|^2 over every bin, divided by the size
+ * and by the window's power. Bins other than DC and Nyquist stand for their negative frequency twin too, so they
+ * count twice.
+ */
+void BMI323Spectrum::summarise()
+{
+    const uint16_t points = size / 2;
+    const float scale = 1.0f / (static_cast<float>(size) * windowPower * windows);
+    const float bin = binHz();
+
+    result.windows = windows;
+    result.bands = bandTotal;
+
+    for(uint8_t axis = 0; axis < AXES; axis++)
+    {
+        float bandSquares[MAX_BANDS] = {};
+        float totalSquares = 0.0f;
+        uint16_t peak = 1;
+        uint8_t band = 0;
+
+        for(uint16_t k = 0; k <= points; k++)
+        {
+            float squares = power[axis][k] * scale * (k == 0 || k == points ? 1.0f : 2.0f);
+            totalSquares += squares;
+
+            float hz = k * bin;
+            while(band + 1 < bandTotal && hz >= bandEdges[band + 1])
+            {
+                band++;
+            }
+            bool last = band + 1 == bandTotal;
+            if(hz >= bandEdges[band] && (hz < bandEdges[band + 1] || (last && hz <= bandEdges[band + 1])))
+            {
+                bandSquares[band] += squares;
+            }
+
+            if(k > 0 && power[axis][k] > power[axis][peak])
+            {
+                peak = k;
+            }
+        }
+
+        for(uint8_t i = 0; i < MAX_BANDS; i++)
+        {
+            result.bandRms[axis][i] = sqrtf(bandSquares[i]);
+        }
+        result.totalRms[axis] = sqrtf(totalSquares);
+
+        // Parabola through the magnitudes around the peak, a Hann windowed tone spreads over three bins
+        float offset = 0.0f;
+        float peakSquares = 0.0f;
+        if(peak < points)
+        {
+            float below = sqrtf(power[axis][peak - 1]);
+            float centre = sqrtf(power[axis][peak]);
+            float above = sqrtf(power[axis][peak + 1]);
+            float curvature = below - 2.0f * centre + above;
+            offset = curvature < 0.0f ? 0.5f * (below - above) / curvature : 0.0f;
+        }
+        for(uint16_t k = peak - 1; k <= peak + 1 && k <= points; k++)
+        {
+            peakSquares += power[axis][k] * scale * (k == 0 || k == points ? 1.0f : 2.0f);
+        }
+        result.peakHz[axis] = (peak + offset) * bin;
+        result.peakRms[axis] = sqrtf(peakSquares);
+    }
+}
+
+void BMI323Spectrum::fft(float* data, uint16_t points) const
+{
+    // Bit reversed order
+    for(uint16_t i = 1, j = 0; i < points; i++)
+    {
+        uint16_t bit = points >> 1;
+        while(j & bit)
+        {
+            j ^= bit;
+            bit >>= 1;
+        }
+        j ^= bit;
+
+        if(i < j)
+        {
+            float re = data[2 * i];
+            float im = data[2 * i + 1];
+            data[2 * i] = data[2 * j];
+            data[2 * i + 1] = data[2 * j + 1];
+            data[2 * j] = re;
+            data[2 * j + 1] = im;
+        }
+    }
+
+    // Butterflies, twiddles of the points FFT are every other one of the size table
+    for(uint16_t length = 2; length <= points; length <<= 1)
+    {
+        uint16_t half = length / 2;
+        uint16_t stride = 2 * points / length;
+        for(uint16_t start = 0; start < points; start += length)
+        {
+            for(uint16_t k = 0; k < half; k++)
+            {
+                float wr = twiddles[2 * k * stride];
+                float wi = -twiddles[2 * k * stride + 1];
+
+                float* u = data + 2 * (start + k);
+                float* v = data + 2 * (start + k + half);
+                float vr = v[0] * wr - v[1] * wi;
+                float vi = v[0] * wi + v[1] * wr;
+
+                v[0] = u[0] - vr;
+                v[1] = u[1] - vi;
+                u[0] += vr;
+                u[1] += vi;
+            }
+        }
+    }
+}
@@ -0,0 +1,163 @@
+/**
+ * @file BMI323Spectrum.h
+ * @brief Vibration spectrum of raw high rate accel frames, reduced to band RMS summaries small enough to log
+ *
+ * Motor health needs the accel spectrum, not the samples. process() takes the batches readFifo() returns and
+ * collects windows of fftSize samples per axis, overlapping by fftSize - hop. Each window has its mean removed,
+ * gets a Hann window and goes through a real FFT. The bin powers of `averages` windows are averaged (Welch), then
+ * reduced to the RMS acceleration in up to MAX_BANDS frequency bands plus the strongest peak of each axis. A summary
+ * of 8 bands takes a few dozen bytes where the raw samples behind it take tens of KB.
+ *
+ * The FFT is a radix-2 complex FFT of fftSize / 2 points with a split step for the real input, in single
+ * precision floats, which the Cortex-M7 FPU runs in hardware. All buffers are sized for MAX_FFT_SIZE at compile
+ * time, about 24 KB.
+ */
+
+#ifndef HAMSTER_BMI323_SPECTRUM_H
+#define HAMSTER_BMI323_SPECTRUM_H
+
+#include <mbed.h>
+#include "BMI323.h"
+
+class BMI323Spectrum
+{
+    public:
+        static constexpr uint16_t MIN_FFT_SIZE = 16;
+        static constexpr uint16_t MAX_FFT_SIZE = 1024;
+        static constexpr uint8_t MAX_BANDS = 8;
+
+        /** accel x, y, z */
+        static constexpr uint8_t AXES = 3;
+
+        /**
+         * @brief Averaged spectrum of `windows` windows, acceleration in accel LSB (BMI323Base::ACCEL_LSB_PER_MG)
+         */
+        struct vibration_summary {
+            uint16_t windows;
+            uint8_t bands;                      // bands in use, edges from bandEdgeHz()
+            float bandRms[AXES][MAX_BANDS];     // RMS acceleration between the band's edges
+            float totalRms[AXES];               // over all bins, mean removed
+            float peakHz[AXES];                 // strongest bin above DC, interpolated between bins
+            float peakRms[AXES];                // RMS of the peak, its bin and both neighbours
+        };
+
+        BMI323Spectrum();
+
+        /**
+         * @brief Set the input rate and the analysis, then reset
+         *
+         * Bands default to MAX_BANDS of equal width from 0 Hz to the Nyquist rate.
+         *
+         * @param odrHz rate the frames come in at
+         * @param fftSize samples per window, a power of two from MIN_FFT_SIZE to MAX_FFT_SIZE
+         * @param hop samples between the starts of two windows, 1 to fftSize, 0 for half a window
+         * @param averages windows averaged into each summary
+         * @return false if a parameter is out of range, the previous setup is kept then
+         */
+        bool setup(float odrHz, uint16_t fftSize = 512, uint16_t hop = 0, uint16_t averages = 8);
+
+        /**
+         * @brief Set the bands the summaries report
+         *
+         * @param edgesHz bands + 1 ascending edges from 0 to the Nyquist rate, a bin belongs to the band its frequency
+         * is at or above the lower edge of and below the upper one (the last band includes its upper edge)
+         * @return false if the edges are out of range, the previous bands are kept then
+         */
+        bool setBands(const float* edgesHz, uint8_t bands);
+
+        /**
+         * @brief Drop the samples collected and the windows averaged so far
+         */
+        void reset();
+
+        /**
+         * @brief Collect accel samples from a batch of frames, analysing every full window
+         *
+         * Stops right after the frame that completes a summary, so feed the rest of the batch in again:
+         *
+         *   for(uint16_t used = 0; used < count; )
+         *   {
+         *       used += spectrum.process(frames + used, count - used);
+         *       if(spectrum.summaryReady()) { ... spectrum.summary() ... }
+         *   }
+         *
+         * @return frames consumed
+         */
+        uint16_t process(const BMI323Base::accel_gyro_raw* frames, uint16_t count);
+
+        /** Set when the last process() completed a summary */
+        bool summaryReady() const
+        {
+            return ready;
+        }
+
+        const vibration_summary &summary() const
+        {
+            return result;
+        }
+
+        float binHz() const
+        {
+            return odr / size;
+        }
+
+        uint16_t fftSize() const
+        {
+            return size;
+        }
+
+        /** Frames each summary covers, the first one takes fftSize - hop more */
+        uint32_t framesPerSummary() const
+        {
+            return static_cast<uint32_t>(hopSize) * averageCount;
+        }
+
+        uint8_t bandCount() const
+        {
+            return bandTotal;
+        }
+
+        float bandEdgeHz(uint8_t edge) const
+        {
+            return bandEdges[edge];
+        }
+
+    private:
+        // Window full: FFT of every axis into the power sums
+        void analyse();
+
+        // Power sums into the summary
+        void summarise();
+
+        // In place radix-2 FFT of points complex values, interleaved real and imaginary
+        void fft(float* data, uint16_t points) const;
+
+        float odr;
+        uint16_t size;
+        uint16_t hopSize;
+        uint16_t averageCount;
+
+        uint8_t bandTotal;
+        float bandEdges[MAX_BANDS + 1];
+
+        // Sum of the squared window, scales bin powers to mean square
+        float windowPower;
+
+        uint16_t filled;
+        uint16_t windows;
+        bool ready;
+        vibration_summary result;
+
+        int16_t samples[AXES][MAX_FFT_SIZE];
+        float window[MAX_FFT_SIZE];
+
+        // cos and sin of 2 pi k / size for k below size / 2, interleaved
+        float twiddles[MAX_FFT_SIZE];
+
+        float work[MAX_FFT_SIZE];
+
+        // Bin powers summed over the windows so far, bins 0 to size / 2
+        float power[AXES][MAX_FFT_SIZE / 2 + 1];
+};
+
+#endif // HAMSTER_BMI323_SPECTRUM_H
@@ -0,0 +1,124 @@
+/**
+ * @file DumpProtocol.cpp
+ * @brief Framed binary protocol for downloading a flash log over a serial link
+ */
+
+#include "DumpProtocol.h"
+#include "IMUCodec.h"
+#include <cstring>
+
+void dumpSealRequest(dump_request *request)
+{
+    request->magic = DUMP_REQUEST_MAGIC;
+    request->crc = imuCrc32(request, offsetof(dump_request, crc));
+}
+
+bool dumpCheckRequest(const dump_request &request)
+{
+    return request.magic == DUMP_REQUEST_MAGIC && request.crc == imuCrc32(&request, offsetof(dump_request, crc));
+}
+
+namespace
+{
+    uint32_t frameCrc(const dump_frame_header &header, const void *payload)
+    {
+        dump_frame_header zeroed = header;
+        zeroed.crc = 0;
+        uint32_t crc = imuCrc32(&zeroed, sizeof(zeroed));
+        return imuCrc32(payload, header.payloadSize, crc);
+    }
+}
+
+void dumpSealFrame(dump_frame_header *header, const void *payload)
+{
+    header->magic = DUMP_FRAME_MAGIC;
+    header->crc = frameCrc(*header, payload);
+}
+
+bool dumpCheckFrame(const dump_frame_header &header, const void *payload)
+{
+    return header.magic == DUMP_FRAME_MAGIC && header.payloadSize <= DUMP_MAX_PAYLOAD &&
+        header.crc == frameCrc(header, payload);
+}
+
+/**
+ * Control byte n: 0..127 copies the next n + 1 literal bytes, 129..255 repeats the next byte 257 - n times
+ * (2 to 128), 128 is unused.
+ */
+size_t dumpRleEncode(const uint8_t *in, size_t size, uint8_t *out)
+{
+    size_t o = 0;
+    size_t i = 0;
+
+    while (i < size)
+    {
+        // Length of the run starting here
+        size_t run = 1;
+        while (i + run < size && run < 128 && in[i + run] == in[i])
+        {
+            run++;
+        }
+
+        if (run >= 2)
+        {
+            out[o++] = static_cast<uint8_t>(257 - run);
+            out[o++] = in[i];
+            i += run;
+            continue;
+        }
+
+        // Literals until the next run of 2 or more
+        size_t start = i;
+        while (i < size && i - start < 128)
+        {
+            if (i + 1 < size && in[i + 1] == in[i])
+            {
+                break;
+            }
+            i++;
+        }
+        out[o++] = static_cast<uint8_t>(i - start - 1);
+        memcpy(out + o, in + start, i - start);
+        o += i - start;
+    }
+
+    return o;
+}
+
+size_t dumpRleDecode(const uint8_t *in, size_t size, uint8_t *out, size_t outSize)
+{
+    size_t o = 0;
+    size_t i = 0;
+
+    while (i < size)
+    {
+        uint8_t control = in[i++];
+        if (control < 128)
+        {
+            size_t count = control + 1;
+            if (i + count > size || o + count > outSize)
+            {
+                return 0;
+            }
+            memcpy(out + o, in + i, count);
+            i += count;
+            o += count;
+        }
+        else if (control > 128)
+        {
+            size_t count = 257 - control;
+            if (i >= size || o + count > outSize)
+            {
+                return 0;
+            }
+            memset(out + o, in[i++], count);
+            o += count;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+
+    return o;
+}
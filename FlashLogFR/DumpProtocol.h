@@ -0,0 +1,112 @@
+/**
+ * @file DumpProtocol.h
+ * @brief Framed binary protocol for downloading a flash log over a serial link
+ *
+ * The host sends a dump_request, the device answers with a DUMP_FRAME_START frame, one DUMP_FRAME_CHUNK frame per
+ * DUMP_CHUNK_SIZE bytes of log and a DUMP_FRAME_END frame. Every frame carries a CRC-32 over its header and payload,
+ * and each chunk carries its log offset, so a receiver keeps every good chunk, then sends new requests for the ranges
+ * it is missing (resume). A request with DUMP_FLAG_DONE ends the session.
+ *
+ * Chunks can be run length encoded (PackBits), which mostly pays off on erased space and the unused tails of IMU
+ * blocks. A chunk is only sent encoded if that makes it smaller.
+ *
+ * All fields are little endian. No Mbed dependencies, this file is also built into the host side tools.
+ */
+
+#ifndef FLASHLOGFR_DUMP_PROTOCOL_H
+#define FLASHLOGFR_DUMP_PROTOCOL_H
+
+#include <cstdint>
+#include <cstddef>
+
+/** "FLDR", host -> device */
+constexpr uint32_t DUMP_REQUEST_MAGIC = 0x52444C46;
+
+/** "FLDP", device -> host */
+constexpr uint32_t DUMP_FRAME_MAGIC = 0x50444C46;
+
+/** Log bytes per chunk frame */
+constexpr size_t DUMP_CHUNK_SIZE = 1024;
+
+/** PackBits worst case grows the input by one byte per 128 */
+constexpr size_t DUMP_MAX_PAYLOAD = DUMP_CHUNK_SIZE + DUMP_CHUNK_SIZE / 128 + 1;
+
+/** dump_request.flags */
+constexpr uint32_t DUMP_FLAG_COMPRESS = 0x1;
+constexpr uint32_t DUMP_FLAG_DONE = 0x2;            // host has everything, device answers with an END frame and stops
+
+/** dump_frame_header.flags */
+constexpr uint8_t DUMP_FRAME_FLAG_RLE = 0x1;
+
+enum DumpFrameType : uint8_t {
+    DUMP_FRAME_START = 1,       // payload is a dump_info
+    DUMP_FRAME_CHUNK = 2,       // payload is log data, rawSize bytes once decoded
+    DUMP_FRAME_END = 3,         // no payload, rawSize holds the total bytes sent
+    DUMP_FRAME_ERROR = 4        // no payload, rawSize holds the (negative) error code
+};
+
+/**
+ * @brief Request from the host
+ */
+struct dump_request {
+    uint32_t magic;
+    uint32_t offset;            // first byte to send, relative to the start of the log
+    uint32_t length;            // bytes to send, 0 for everything up to the end of the log
+    uint32_t flags;
+    uint32_t crc;               // CRC-32 of the fields above
+};
+
+static_assert(sizeof(dump_request) == 20, "dump_request layout changed, bump the protocol");
+
+struct dump_frame_header {
+    uint32_t magic;
+    uint8_t type;
+    uint8_t flags;
+    uint16_t payloadSize;
+    uint32_t offset;            // log offset of the first byte of this chunk
+    uint32_t rawSize;
+    uint32_t crc;               // CRC-32 of the header (with this field zeroed) and the payload
+};
+
+static_assert(sizeof(dump_frame_header) == 20, "dump_frame_header layout changed, bump the protocol");
+
+/**
+ * @brief Payload of DUMP_FRAME_START
+ */
+struct dump_info {
+    uint32_t offset;            // as in the request
+    uint32_t length;            // bytes that will be sent, after clamping to the log
+    uint32_t logSize;           // bytes in the log
+    uint32_t chunkSize;
+};
+
+/** Fill in the CRC of a request */
+void dumpSealRequest(dump_request *request);
+
+/** @return true if the request magic and CRC are valid */
+bool dumpCheckRequest(const dump_request &request);
+
+/**
+ * @brief Fill in a frame header, including the CRC over header and payload
+ */
+void dumpSealFrame(dump_frame_header *header, const void *payload);
+
+/** @return true if the frame CRC matches */
+bool dumpCheckFrame(const dump_frame_header &header, const void *payload);
+
+/**
+ * @brief PackBits encode
+ *
+ * @param out at least size + size / 128 + 1 bytes
+ * @return encoded size
+ */
+size_t dumpRleEncode(const uint8_t *in, size_t size, uint8_t *out);
+
+/**
+ * @brief PackBits decode
+ *
+ * @return decoded size, or 0 if the input is malformed or doesn't fit in outSize
+ */
+size_t dumpRleDecode(const uint8_t *in, size_t size, uint8_t *out, size_t outSize);
+
+#endif // FLASHLOGFR_DUMP_PROTOCOL_H
@@ -1,94 +1,1329 @@
 #include "FlashLogFR.h"
+#include "Perf.h"
 
-FlashLogFR::FlashLogFR(PinName _FLOG_MOSI, PinName _FLOG_MISO, PinName _FLOG_SCLK, 
-    PinName _FLOG_CS1, PinName _FLOG_CS2, PinName _CONSOLE_RX, PinName _CONSOLE_TX)
+namespace
+{
+    // Lets the search in LogIndex.h probe blocks through readData, only the bytes it asks for
+    class FlashBlockReader : public LogBlockReader
+    {
+        public:
+            FlashBlockReader(FlashLogFR &log, bd_addr_t start) : log(log), start(start)
+            {
+            }
+
+            bool readBlock(uint32_t blockIndex, void *buffer, size_t size) override
+            {
+                return size <= IMU_BLOCK_SIZE &&
+                    log.readData(buffer, start + static_cast<bd_addr_t>(blockIndex) * IMU_BLOCK_SIZE, size) ==
+                    FlashLogFR::FL_SUCCESS;
+            }
+
+        private:
+            FlashLogFR &log;
+            bd_addr_t start;
+    };
+
+    // Streams the session through readData, which knows where the ring wraps and which sectors are remapped
+    class SessionDumper : public LogDumper
+    {
+        public:
+            SessionDumper(FlashLogFR &log, BlockDevice &bd, FileHandle &port, bd_addr_t start, bd_size_t size) :
+                LogDumper(bd, port, start, size), log(log), start(start)
+            {
+            }
+
+        protected:
+            int readLog(void *buffer, bd_addr_t offset, bd_size_t length) override
+            {
+                return log.readData(buffer, start + offset, length) == FlashLogFR::FL_SUCCESS ? 0 :
+                    BD_ERROR_DEVICE_ERROR;
+            }
+
+        private:
+            FlashLogFR &log;
+            bd_addr_t start;
+    };
+
+    /**
+     * @brief Offset after the last record of a block of record pages. A page ends at its first erased type id, or
+     * at a type the schema doesn't know, which is then kept up to the end of its page. A page that starts erased
+     * ends the block, pages fill in order.
+     */
+    size_t recordsEnd(const uint8_t *block)
+    {
+        size_t end = 0;
+        for (size_t page = 0; page < IMU_BLOCK_SIZE; page += LOG_RECORD_PAGE_SIZE)
+        {
+            size_t offset = page;
+            while (offset + sizeof(uint16_t) <= page + LOG_RECORD_PAGE_SIZE)
+            {
+                uint16_t type;
+                memcpy(&type, block + offset, sizeof(type));
+                if (type == LOG_RECORD_NONE)
+                {
+                    break;
+                }
+
+                size_t size = LogRecordSchema::sizeOf(type);
+                if (size == 0 || offset + size > page + LOG_RECORD_PAGE_SIZE)
+                {
+                    offset = page + LOG_RECORD_PAGE_SIZE;
+                    break;
+                }
+                offset += size;
+            }
+
+            if (offset == page)
+            {
+                break;
+            }
+            end = offset;
+        }
+        return end;
+    }
+
+    // Only errors where the chip didn't finish in time or refused to start count against the sector, anything
+    // else is more likely the bus
+    bool isSectorFailure(int err)
+    {
+        return err == SPIF_BD_ERROR_READY_FAILED || err == SPIF_BD_ERROR_WREN_FAILED;
+    }
+}
+
+FlashLogFR::FlashLogFR(PinName _FLOG_MOSI, PinName _FLOG_MISO, PinName _FLOG_SCLK,
+    PinName _FLOG_CS1, PinName _FLOG_CS2, PinName _CONSOLE_RX, PinName _CONSOLE_TX) :
+    flashLogSector0(_FLOG_MOSI, _FLOG_MISO, _FLOG_SCLK, _FLOG_CS1, FLOG_FREQ),
+    flashLogSector1(_FLOG_MOSI, _FLOG_MISO, _FLOG_SCLK, _FLOG_CS2, FLOG_FREQ),
+    flashLogArr{&flashLogSector0, &flashLogSector1},
+    chainedFlashLog(flashLogArr, 2),
+    // Reading off the flashlog using serial
+    serialPort(_CONSOLE_TX, _CONSOLE_RX, CONSOLE_BAUD),
+    bufferedFlashLog(&chainedFlashLog),
+    flashLog(&bufferedFlashLog)
 {
     // Init the FlashLog SPI lines
     FLOG_MOSI = _FLOG_MOSI;
     FLOG_MISO = _FLOG_MISO;
     FLOG_SCLK = _FLOG_SCLK;
     FLOG_CS1 = _FLOG_CS1;
-    FLOG_CS2 = _FLOG_CS2;   
+    FLOG_CS2 = _FLOG_CS2;
     CONSOLE_TX = _CONSOLE_TX;
     CONSOLE_RX = _CONSOLE_RX;
-    
-    flashLogSector0 = SPIFBlockDevice(FLOG_MOSI, FLOG_MISO, FLOG_SCLK, FLOG_CS1, FLOG_FREQ);
-    flashLogSector1 = SPIFBlockDevice(FLOG_MOSI, FLOG_MISO, FLOG_SCLK, FLOG_CS2, FLOG_FREQ);
-
-    BlockDevice *flashLogArr[2] = {&flashLogSector0, &flashLogSector1};
-    ChainingBlockDevice chainedFlashLog(flashLogArr);
-
-    // TODO validate this, check if it caches correctly
-    flashLog = bufferedBlockDevice(&ChainingBlockDevice(chainedFlashLog, 2));
 
+    // Sizes are only known once the devices are initialized, see init()
     logStart = 0;
-    logEnd = flashLog.size();
+    logEnd = 0;
     currAddr = logStart;
+    blockSize = 0;
+    eraseBlockSize = 0;
 
-    blockSize = flashLog.get_program_size();
-    eraseBlockSize = flashLog.get_erase_size();
+    memset(&currentSession, 0, sizeof(currentSession));
+    recording = false;
+    dataStart = 0;
+    dataSize = 0;
+    spareStart = 0;
+    erasedUntil = 0;
+    eraseInFlight = false;
+    eraseChip = nullptr;
 
-    // Reading off the flashlog using serial
-    flashLog = BufferedSerial(CONSOLE_TX, CONSOLE_RX, 115200);
+    imuBlockAddr = 0;
+    imuProgrammed = 0;
+    commitInterval = COMMIT_INTERVAL;
+    readAheadSize = READ_AHEAD;
+
+    recordPage = 0;
+    recordFlushed = 0;
+    recordUsed = 0;
+    recordReserved = 0;
+    recordOpen = false;
+
+    for (size_t i = 0; i < CHIP_COUNT; i++)
+    {
+        chipInitialized[i] = false;
+    }
 }
 
 FlashLogFR::~FlashLogFR()
 {
-    flashLog.deinit();
+    flashLog->deinit();
 }
 
-std::pair<bd_error, FLResultCode> FlashLogFR::init()
+FlashLogFR::FLResultCode FlashLogFR::init()
 {
-    bd_error blockDevErr = static_cast<bd_error>(bufferedBlockDevice.init());
+    int blockDevErr = flashLog->init();
     if (blockDevErr)
     {
-        printf("[FlashLog] Error %d initializing device!", blockDevErr);
-        return std::pair<blockDevErr, FLResultCode::FL_ERROR_BD_INIT>;
+        printf("[FlashLog] Error %d initializing device!\n", blockDevErr);
+        return FL_ERROR_BD_INIT;
+    }
+
+    // The chain took its own reference on chips initChip() brought up, keep only that one
+    for (size_t i = 0; i < CHIP_COUNT; i++)
+    {
+        if (chipInitialized[i])
+        {
+            flashLogArr[i]->deinit();
+            chipInitialized[i] = false;
+        }
+    }
+
+    blockSize = flashLog->get_program_size();
+    eraseBlockSize = flashLog->get_erase_size();
+
+    // Two directory sectors, the calibration sector, the ring, then the spares
+    dataStart = (CALIBRATION_SECTOR + 1) * eraseBlockSize;
+    spareStart = (flashLog->size() / eraseBlockSize - SPARE_SECTORS) * eraseBlockSize;
+    dataSize = spareStart - dataStart;
+    readCache.setWindow(readAheadSize, eraseBlockSize);
+
+    imuEncoder.reset();
+    imuSummary.reset();
+    imuProgrammed = 0;
+    recordOpen = false;
+    recording = false;
+
+    if (sessions.mount(*flashLog, 0, eraseBlockSize))
+    {
+        printf("[FlashLog] No session directory found, formatting it\n");
+        if (sessions.format())
+        {
+            return FL_ERROR_BD_IO;
+        }
+    }
+
+    // Sessions cut by a reset have no end recorded yet
+    for (uint32_t i = 0; i < sessions.count(); i++)
+    {
+        if (!sessions.get(i).closed)
+        {
+            uint32_t count = sessions.count();
+            FLResultCode result = recoverSession(sessions.get(i));
+            if (result != FL_SUCCESS)
+            {
+                return result;
+            }
+            if (sessions.count() < count)
+            {
+                // Empty, dropped
+                i--;
+            }
+        }
     }
 
+    // The space after the tail was erased by the previous session up to the end of its sector, or further by a wipe
+    erasedUntil = ((sessions.tail() + eraseBlockSize - 1) / eraseBlockSize) * eraseBlockSize;
+    erasedUntil = sessions.erased() > erasedUntil ? sessions.erased() : erasedUntil;
+
+    if (sessions.count() > 0)
+    {
+        return openSession(sessions.get(sessions.count() - 1).id);
+    }
+
+    logStart = sessions.tail();
+    logEnd = logStart;
+    currAddr = logStart;
+
     // if we got here, then successfully return
-    return std::pair<blockDevErr, FLResultCode::FL_OK>;
+    return FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::initChip(size_t chip)
+{
+    if (chip >= CHIP_COUNT)
+    {
+        return FL_ERROR_BD_PARAMS;
+    }
+    if (chipInitialized[chip])
+    {
+        return FL_SUCCESS;
+    }
+
+    int blockDevErr = flashLogArr[chip]->init();
+    if (blockDevErr)
+    {
+        printf("[FlashLog] Error %d initializing chip %u!\n", blockDevErr, static_cast<unsigned>(chip));
+        return FL_ERROR_BD_INIT;
+    }
+    chipInitialized[chip] = true;
+    return FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::startSession(uint32_t tag, const char *label)
+{
+    if (recording)
+    {
+        FLResultCode result = endSession();
+        if (result != FL_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    // erasedUntil may move below
+    FLResultCode erased = finishErase();
+    if (erased != FL_SUCCESS)
+    {
+        return erased;
+    }
+
+    // Sessions start on a block boundary so their blocks can be found by index
+    bd_addr_t start = ((sessions.tail() + IMU_BLOCK_SIZE - 1) / IMU_BLOCK_SIZE) * IMU_BLOCK_SIZE;
+    if (sessions.begin(start, tag, label, &currentSession))
+    {
+        return FL_ERROR_BD_IO;
+    }
+    recording = true;
+
+    // The session may use the whole ring, up to the sector it started in
+    logStart = start;
+    logEnd = (start / eraseBlockSize) * eraseBlockSize + dataSize;
+    currAddr = start;
+
+    bd_addr_t startSector = ((start + eraseBlockSize - 1) / eraseBlockSize) * eraseBlockSize;
+    erasedUntil = erasedUntil > startSector ? erasedUntil : startSector;
+
+    imuEncoder.reset();
+    imuSummary.reset();
+    imuProgrammed = 0;
+    recordOpen = false;
+
+    commitTimer.reset();
+    commitTimer.start();
+    return FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::endSession()
+{
+    if (!recording)
+    {
+        return FL_SUCCESS;
+    }
+
+    FLResultCode result = closeRecordPage();
+    if (result == FL_SUCCESS)
+    {
+        result = flushIMU();
+    }
+    if (result != FL_SUCCESS)
+    {
+        return result;
+    }
+
+    currentSession.end = currAddr;
+    if (sessions.end(currentSession))
+    {
+        return FL_ERROR_BD_IO;
+    }
+
+    // Keep reading the session that was just recorded
+    currentSession.closed = true;
+    recording = false;
+    logEnd = currAddr;
+    return FL_SUCCESS;
+}
+
+uint32_t FlashLogFR::getSessionCount()
+{
+    return sessions.count();
+}
+
+FlashLogFR::FLResultCode FlashLogFR::getSession(uint32_t index, session_info *info)
+{
+    if (index >= sessions.count())
+    {
+        return FL_ERROR_NO_SESSION;
+    }
+
+    *info = sessions.get(index);
+    if (recording && info->id == currentSession.id)
+    {
+        // The directory only has the start of the session being recorded
+        *info = currentSession;
+        info->end = currAddr;
+    }
+    return FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::openSession(uint32_t id)
+{
+    if (recording)
+    {
+        return FL_ERROR_RECORDING;
+    }
+
+    const session_info *session = sessions.find(id);
+    if (!session)
+    {
+        return FL_ERROR_NO_SESSION;
+    }
+
+    currentSession = *session;
+    logStart = session->start;
+    logEnd = session->end;
+    currAddr = session->end;
+    imuSummary.reset();
+    return FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::recoverSession(session_info session)
+{
+    bd_addr_t limit = (session.start / eraseBlockSize) * eraseBlockSize + dataSize;
+    bd_addr_t end = session.start;
+
+    if (!blockErased(session.start))
+    {
+        // The sector after the last one written to is always erased (prepareWrite), so find the first sector
+        // that starts erased, the end is in the sector before it
+        bd_addr_t sectorEnd = (session.start / eraseBlockSize + 1) * eraseBlockSize;
+        while (sectorEnd < limit && !blockErased(sectorEnd))
+        {
+            sectorEnd += eraseBlockSize;
+        }
+        if (sectorEnd > limit)
+        {
+            sectorEnd = limit;
+        }
+
+        // Within a sector the written blocks are a prefix, binary search for the first erased one
+        bd_addr_t low = sectorEnd - eraseBlockSize > session.start ? sectorEnd - eraseBlockSize : session.start;
+        uint32_t lowBlock = 1;
+        uint32_t highBlock = (sectorEnd - low) / IMU_BLOCK_SIZE;
+        while (lowBlock < highBlock)
+        {
+            uint32_t mid = lowBlock + (highBlock - lowBlock) / 2;
+            if (blockErased(low + static_cast<bd_addr_t>(mid) * IMU_BLOCK_SIZE))
+            {
+                highBlock = mid;
+            }
+            else
+            {
+                lowBlock = mid + 1;
+            }
+        }
+        end = low + static_cast<bd_addr_t>(lowBlock) * IMU_BLOCK_SIZE;
+    }
+
+    if (end > session.start)
+    {
+        FLResultCode result = sealLastBlock(session.start, &end);
+        if (result != FL_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    if (end == session.start)
+    {
+        return sessions.drop(session.id) ? FL_ERROR_BD_IO : FL_SUCCESS;
+    }
+
+    // Time range and sample count from the first and the last intact block, data and summary blocks share
+    // these header fields
+    imu_block_header header;
+    if (!readRing(&header, session.start, sizeof(header), false) &&
+        (header.magic == IMU_BLOCK_MAGIC || header.magic == LOG_SUMMARY_MAGIC))
+    {
+        session.firstTimestamp = header.firstTimestamp;
+    }
+    // A session that ends in record pages ends within a block
+    bd_addr_t lastBlock = session.start + ((end - session.start - 1) / IMU_BLOCK_SIZE) * IMU_BLOCK_SIZE;
+    for (bd_addr_t block = lastBlock; block >= session.start; block -= IMU_BLOCK_SIZE)
+    {
+        if (!readRing(&header, block, sizeof(header), false) &&
+            (header.magic == IMU_BLOCK_MAGIC || header.magic == LOG_SUMMARY_MAGIC))
+        {
+            session.lastTimestamp = header.lastTimestamp;
+            session.sampleCount = header.firstSampleIndex + header.sampleCount;
+            break;
+        }
+        if (block == session.start)
+        {
+            break;
+        }
+    }
+
+    printf("[FlashLog] Recovered session %lu, %lu bytes\n", static_cast<unsigned long>(session.id),
+        static_cast<unsigned long>(end - session.start));
+
+    session.end = end;
+    return sessions.end(session) ? FL_ERROR_BD_IO : FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::sealLastBlock(bd_addr_t start, bd_addr_t *end)
+{
+    bd_addr_t blockAddr = *end - IMU_BLOCK_SIZE;
+    if (blockAddr < start)
+    {
+        return FL_SUCCESS;
+    }
+
+    uint8_t block[IMU_BLOCK_SIZE];
+    if (readRing(block, blockAddr, sizeof(block)))
+    {
+        return FL_ERROR_BD_IO;
+    }
+
+    uint32_t magic;
+    memcpy(&magic, block, sizeof(magic));
+    if (magic == IMU_BLOCK_MAGIC && IMUBlockDecoder::check(block, sizeof(block)))
+    {
+        return FL_SUCCESS;
+    }
+
+    // Record pages are programmed record by record, whatever made it to the flash stays
+    uint16_t type;
+    memcpy(&type, block, sizeof(type));
+    if (type != 0 && type < LOG_RECORD_MAX_TYPE)
+    {
+        *end = blockAddr + recordsEnd(block);
+        return FL_SUCCESS;
+    }
+    if (magic == LOG_SUMMARY_MAGIC)
+    {
+        log_segment_summary summary;
+        memcpy(&summary, block, sizeof(summary));
+        if (logCheckSummary(summary))
+        {
+            return FL_SUCCESS;
+        }
+    }
+
+    imu_block_header header;
+    if (IMUBlockDecoder::recoverHeader(block, &header) == IMU_CODEC_OK)
+    {
+        // The final values only clear bits relative to the erased fields of the open header
+        printf("[FlashLog] Sealing block %lu from its commit stamp\n",
+            static_cast<unsigned long>((blockAddr - start) / IMU_BLOCK_SIZE));
+        return programRing(&header, blockAddr, sizeof(header)) ? FL_ERROR_BD_IO : FL_SUCCESS;
+    }
+
+    // Nothing in it was committed, clear the magic so readers stop before it
+    uint32_t cleared = 0;
+    if (programRing(&cleared, blockAddr, sizeof(cleared)))
+    {
+        return FL_ERROR_BD_IO;
+    }
+    *end = blockAddr;
+    return FL_SUCCESS;
+}
+
+bool FlashLogFR::blockErased(bd_addr_t position)
+{
+    uint32_t magic;
+    return readRing(&magic, position, sizeof(magic), false) || magic == 0xFFFFFFFF;
+}
+
+bd_addr_t FlashLogFR::physicalAddr(bd_addr_t position)
+{
+    bd_addr_t offset = position % dataSize;
+    uint32_t sector = offset / eraseBlockSize;
+
+    for (uint32_t i = 0; i < sessions.badSectorCount(); i++)
+    {
+        const bad_sector &bad = sessions.getBadSector(i);
+        if (bad.sector == sector)
+        {
+            return spareStart + static_cast<bd_addr_t>(bad.spare) * eraseBlockSize + offset % eraseBlockSize;
+        }
+    }
+    return dataStart + offset;
+}
+
+int FlashLogFR::readRing(void *buffer, bd_addr_t position, bd_size_t size, bool cached)
+{
+    // Sector by sector, any of them may be remapped and the ring may wrap
+    uint8_t *bytes = static_cast<uint8_t *>(buffer);
+    while (size > 0)
+    {
+        bd_size_t piece = eraseBlockSize - position % eraseBlockSize;
+        piece = piece < size ? piece : size;
+
+        // Reads at least a window long go straight to the flash, smaller ones through the read-ahead windows
+        bd_addr_t offset = position % dataSize;
+        if (cached && piece < readCache.window())
+        {
+            bd_size_t copied = readCache.read(bytes, offset, piece);
+            if (copied == 0)
+            {
+                PERF_COUNT(PERF_LOG_READ_MISSES, 1);
+                uint8_t *window = readCache.fill(offset);
+                bd_addr_t windowOffset = offset - offset % readCache.window();
+                int err = flashLog->read(window, physicalAddr(windowOffset), readCache.window());
+                if (err)
+                {
+                    readCache.invalidate(windowOffset, readCache.window());
+                    return err;
+                }
+                readCache.filled();
+                copied = readCache.read(bytes, offset, piece);
+            }
+            piece = copied;
+        }
+        else
+        {
+            int err = flashLog->read(bytes, physicalAddr(position), piece);
+            if (err)
+            {
+                return err;
+            }
+        }
+        bytes += piece;
+        position += piece;
+        size -= piece;
+    }
+    return 0;
+}
+
+int FlashLogFR::programRing(const void *buffer, bd_addr_t position, bd_size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(buffer);
+    while (size > 0)
+    {
+        bd_size_t piece = eraseBlockSize - position % eraseBlockSize;
+        piece = piece < size ? piece : size;
+        readCache.invalidate(position % dataSize, piece);
+
+        // BufferedBlockDevice takes care of padding to the program size of the chips
+        int err = flashLog->program(bytes, physicalAddr(position), piece);
+        if (isSectorFailure(err))
+        {
+            // Move what is already in the sector to a spare and try there
+            if (remapSector(position, piece, true, err) != FL_SUCCESS)
+            {
+                return err;
+            }
+            err = flashLog->program(bytes, physicalAddr(position), piece);
+        }
+        if (err)
+        {
+            return err;
+        }
+        bytes += piece;
+        position += piece;
+        size -= piece;
+    }
+    return 0;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::prepareWrite(bd_addr_t end)
+{
+    // One sector of margin, so after a reset the data ends where the erased space starts
+    bd_addr_t target = ((end + eraseBlockSize - 1) / eraseBlockSize + 1) * eraseBlockSize;
+    if (target > logEnd)
+    {
+        target = logEnd;
+    }
+
+    while (erasedUntil < target)
+    {
+        if (eraseInFlight)
+        {
+            // poll() is already on this sector
+            FLResultCode result = finishErase();
+            if (result != FL_SUCCESS)
+            {
+                return result;
+            }
+            continue;
+        }
+
+        FLResultCode result = eraseSector(erasedUntil);
+        if (result != FL_SUCCESS)
+        {
+            return result;
+        }
+        erasedUntil += eraseBlockSize;
+    }
+    return FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::eraseSector(bd_addr_t position)
+{
+    FLResultCode result = dropSessionsIn(position);
+    if (result != FL_SUCCESS)
+    {
+        return result;
+    }
+    return eraseMapped(position);
+}
+
+FlashLogFR::FLResultCode FlashLogFR::dropSessionsIn(bd_addr_t position)
+{
+    // The sector also holds ring position - dataSize onwards, drop every older session reaching into it
+    while (sessions.count() > 0)
+    {
+        const session_info &oldest = sessions.get(0);
+        if (oldest.id == currentSession.id || oldest.start + dataSize >= position + eraseBlockSize)
+        {
+            break;
+        }
+        printf("[FlashLog] Dropping session %lu to make room\n", static_cast<unsigned long>(oldest.id));
+        PERF_COUNT(PERF_LOG_SESSIONS_DROPPED, 1);
+        if (sessions.drop(oldest.id))
+        {
+            return FL_ERROR_BD_IO;
+        }
+    }
+    return FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::poll()
+{
+    if (eraseInFlight)
+    {
+        if (eraseChip->erase_busy())
+        {
+            return FL_SUCCESS;
+        }
+        FLResultCode result = finishErase();
+        if (result != FL_SUCCESS)
+        {
+            return result;
+        }
+    }
+    if (!recording)
+    {
+        return FL_SUCCESS;
+    }
+
+    // One sector beyond what prepareWrite() keeps erased
+    bd_addr_t target = ((currAddr + eraseBlockSize - 1) / eraseBlockSize + 2) * eraseBlockSize;
+    if (target > logEnd)
+    {
+        target = logEnd;
+    }
+    return erasedUntil < target ? startErase() : FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::startErase()
+{
+    FLResultCode result = dropSessionsIn(erasedUntil);
+    if (result != FL_SUCCESS)
+    {
+        return result;
+    }
+
+    readCache.invalidate(erasedUntil % dataSize - erasedUntil % eraseBlockSize, eraseBlockSize);
+
+    bd_addr_t chipAddr;
+    SPIFBlockDevice &chip = chipAt(physicalAddr(erasedUntil), &chipAddr);
+    if (chip.erase_start(chipAddr) == SPIF_BD_ERROR_OK)
+    {
+        PERF_COUNT(PERF_FLASH_BACKGROUND_ERASES, 1);
+        eraseInFlight = true;
+        eraseChip = &chip;
+    }
+    // Otherwise prepareWrite() erases it when it is needed, retries and spares included
+    return FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::finishErase()
+{
+    if (!eraseInFlight)
+    {
+        return FL_SUCCESS;
+    }
+    eraseInFlight = false;
+
+    int err = eraseChip->erase_wait();
+    if (err)
+    {
+        // Another go the blocking way, which moves to a spare if the sector keeps failing
+        FLResultCode result = eraseMapped(erasedUntil);
+        if (result != FL_SUCCESS)
+        {
+            return result;
+        }
+    }
+    erasedUntil += eraseBlockSize;
+    return FL_SUCCESS;
 }
 
-FLResultCode FlashLogFR::writeData(void *buffer, bd_addr_t address, bd_size_t size)
+SPIFBlockDevice &FlashLogFR::chipAt(bd_addr_t addr, bd_addr_t *chipAddr)
 {
+    // Chained in order, the first chip's size is known once it is initialized
+    bd_size_t chip0Size = flashLogSector0.size();
+    if (addr < chip0Size)
+    {
+        *chipAddr = addr;
+        return flashLogSector0;
+    }
+    *chipAddr = addr - chip0Size;
+    return flashLogSector1;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::eraseMapped(bd_addr_t position)
+{
+    readCache.invalidate(position % dataSize - position % eraseBlockSize, eraseBlockSize);
+
+    int err = flashLog->erase(physicalAddr(position), eraseBlockSize);
+    if (isSectorFailure(err))
+    {
+        // One more try before giving up on the sector
+        err = flashLog->erase(physicalAddr(position), eraseBlockSize);
+        if (isSectorFailure(err))
+        {
+            return remapSector(position, 0, false, err);
+        }
+    }
+    return err ? FL_ERROR_BD_IO : FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::remapSector(bd_addr_t position, bd_size_t size, bool keep, int error)
+{
+    bd_addr_t sectorStart = (position / eraseBlockSize) * eraseBlockSize;
+    uint32_t sector = (sectorStart % dataSize) / eraseBlockSize;
+
+    // Spares that fail to erase are skipped and stay used up
+    uint32_t spare = sessions.sparesUsed();
+    while (spare < SPARE_SECTORS && flashLog->erase(spareStart + static_cast<bd_addr_t>(spare) * eraseBlockSize,
+        eraseBlockSize))
+    {
+        spare++;
+    }
+    if (spare >= SPARE_SECTORS || sessions.badSectorCount() == SessionDirectory::MAX_BAD_SECTORS)
+    {
+        printf("[FlashLog] Sector %lu failed (error %d), no spare sectors left!\n", static_cast<unsigned long>(sector),
+            error);
+        return FL_ERROR_BD_IO;
+    }
+
+    // The whole sector, not just what is below position: commit stamps fill IMU blocks from the end and the seal
+    // goes back to the block start, so writes into a sector don't come in address order
+    bd_addr_t spareAddr = spareStart + static_cast<bd_addr_t>(spare) * eraseBlockSize;
+    bd_addr_t sectorEnd = keep ? sectorStart + eraseBlockSize : sectorStart;
+    uint8_t buffer[IMU_BLOCK_SIZE];
+    for (bd_addr_t copied = sectorStart; copied < sectorEnd; copied += sizeof(buffer))
+    {
+        if (flashLog->read(buffer, physicalAddr(copied), sizeof(buffer)))
+        {
+            return FL_ERROR_BD_IO;
+        }
+
+        // The failed bytes may be half programmed, they go over erased for the retry
+        bd_addr_t failedStart = position > copied ? position : copied;
+        bd_addr_t failedEnd = position + size < copied + sizeof(buffer) ? position + size : copied + sizeof(buffer);
+        if (failedStart < failedEnd)
+        {
+            memset(buffer + (failedStart - copied), 0xFF, failedEnd - failedStart);
+        }
+
+        if (flashLog->program(buffer, spareAddr + (copied - sectorStart), sizeof(buffer)))
+        {
+            return FL_ERROR_BD_IO;
+        }
+    }
+
+    if (sessions.addBadSector(sector, spare))
+    {
+        return FL_ERROR_BD_IO;
+    }
+    readCache.invalidate(static_cast<bd_addr_t>(sector) * eraseBlockSize, eraseBlockSize);
+    printf("[FlashLog] Sector %lu failed (error %d), replaced by spare %lu\n", static_cast<unsigned long>(sector),
+        error, static_cast<unsigned long>(spare));
+    return FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::writeData(void *buffer, bd_addr_t address, bd_size_t size)
+{
+    if (!recording)
+    {
+        FLResultCode result = startSession();
+        if (result != FL_SUCCESS)
+        {
+            return result;
+        }
+    }
+
     // Check if the address is within the bounds of the flashlog
     if (address < logStart || address + size > logEnd)
     {
-        printf("[FlashLog] Address out of bounds!");
-        return FLResultCode::FL_ERROR_BD_PARAMS;
+        printf("[FlashLog] Address out of bounds!\n");
+        return FL_ERROR_BOUNDS;
     }
 
-    // Make size a multiple of the block size. Integer division rounds down, add a block size to round up
-    // will give us mallest multiple of blockSize greater than size
-    bd_size_t readSize = (size / blockSize) + blockSize;
+    FLResultCode result = prepareWrite(address + size);
+    if (result != FL_SUCCESS)
+    {
+        return result;
+    }
+
+    if (programRing(buffer, address, size))
+    {
+        return FL_ERROR_BD_IO;
+    }
 
-    flashLog.program(packet, currAddr, readSize);
-    currAddr += size;
-    return FLResultCode::FL_OK;
+    if (address + size > currAddr)
+    {
+        currAddr = address + size;
+    }
+    return FL_SUCCESS;
 }
 
-FLResultCode FlashLogFR::readData(void *buffer, bd_addr_t address, bd_size_t size)
+FlashLogFR::FLResultCode FlashLogFR::readData(void *buffer, bd_addr_t address, bd_size_t size)
 {
     // Check if the read is within bounds
     if (address < logStart || address + size > logEnd)
     {
-        printf("[FlashLog] Address out of bounds!");
-        return FLResultCode::FL_ERROR_BD_PARAMS;
+        printf("[FlashLog] Address out of bounds!\n");
+        return FL_ERROR_BOUNDS;
     }
 
-    // Make size a multiple of the block size. Integer division rounds down, add a block size to round up
-    // will give us mallest multiple of blockSize greater than size
-    bd_size_t readSize = (size / blockSize) + blockSize;
-    
-    flashLog.read(buffer, address, readSize);
-    return FLResultCode::FL_OK;
+    if (readRing(buffer, address, size))
+    {
+        return FL_ERROR_BD_IO;
+    }
+    return FL_SUCCESS;
+}
+
+void FlashLogFR::setReadAhead(size_t size)
+{
+    readAheadSize = size;
+    if (eraseBlockSize > 0)
+    {
+        readCache.setWindow(readAheadSize, eraseBlockSize);
+    }
+}
+
+FlashLogFR::FLResultCode FlashLogFR::writeIMUSample(const int16_t sample[IMU_CHANNELS], uint32_t timestamp)
+{
+    PERF_SPAN(PERF_SPAN_LOG_SAMPLE);
+
+    if (!recording)
+    {
+        FLResultCode result = startSession();
+        if (result != FL_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    if (recordOpen)
+    {
+        FLResultCode result = closeRecordPage();
+        if (result != FL_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    if (currentSession.sampleCount == 0)
+    {
+        currentSession.firstTimestamp = timestamp;
+    }
+    currentSession.lastTimestamp = timestamp;
+    currentSession.sampleCount++;
+
+    imuSummary.addSample(sample, timestamp);
+    if (imuEncoder.push(sample, timestamp))
+    {
+        return writeIMUBlock();
+    }
+
+    if (commitInterval.count() > 0 && commitTimer.elapsed_time() >= commitInterval)
+    {
+        return commitIMU();
+    }
+    return FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::commitIMU()
+{
+    PERF_SPAN(PERF_SPAN_LOG_COMMIT);
+    commitTimer.reset();
+    commitTimer.start();
+
+    if (recordOpen)
+    {
+        FLResultCode result = flushRecords();
+        if (result != FL_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    if (imuEncoder.sampleCount() > 0)
+    {
+        FLResultCode result;
+        if (!imuEncoder.canStamp())
+        {
+            // No room left for another stamp, the block is nearly full anyway
+            result = writeIMUBlock();
+        }
+        else
+        {
+            result = programOpenBlock();
+            if (result == FL_SUCCESS)
+            {
+                imu_block_stamp stamp = imuEncoder.stamp();
+                result = writeData(&stamp, imuBlockAddr + imuEncoder.stampOffset(), sizeof(stamp));
+                imuEncoder.addStamp();
+            }
+        }
+        if (result != FL_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    return flashLog->sync() ? FL_ERROR_BD_IO : FL_SUCCESS;
+}
+
+void *FlashLogFR::reserveRecord(size_t size, size_t align)
+{
+    if (size == 0 || size > RECORD_PAGE_SIZE)
+    {
+        PERF_COUNT(PERF_LOG_RECORDS_DROPPED, 1);
+        return nullptr;
+    }
+
+    if (!recording && startSession() != FL_SUCCESS)
+    {
+        return nullptr;
+    }
+
+    if (!recordOpen)
+    {
+        // Records start after whatever is in the session, an open IMU block gets sealed first
+        if (imuEncoder.sampleCount() > 0 && writeIMUBlock() != FL_SUCCESS)
+        {
+            return nullptr;
+        }
+        recordPage = (currAddr / RECORD_PAGE_SIZE) * RECORD_PAGE_SIZE;
+        recordFlushed = currAddr - recordPage;
+        recordUsed = recordFlushed;
+        memset(recordBuffer, 0xFF, sizeof(recordBuffer));
+        recordOpen = true;
+    }
+
+    size_t offset = ((recordUsed + align - 1) / align) * align;
+    if (offset + size > RECORD_PAGE_SIZE)
+    {
+        // Doesn't fit in this page, the rest of it stays erased
+        if (closeRecordPage() != FL_SUCCESS)
+        {
+            return nullptr;
+        }
+        recordPage += RECORD_PAGE_SIZE;
+        recordFlushed = 0;
+        recordUsed = 0;
+        memset(recordBuffer, 0xFF, sizeof(recordBuffer));
+        recordOpen = true;
+        offset = 0;
+    }
+
+    if (recordPage + offset + size > logEnd)
+    {
+        PERF_COUNT(PERF_LOG_RECORDS_DROPPED, 1);
+        return nullptr;
+    }
+
+    // Alignment padding stays erased, commitRecord counts from the aligned start
+    recordUsed = offset;
+    recordReserved = size;
+    return recordBuffer + offset;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::commitRecord(size_t size)
+{
+    if (!recordOpen || size > recordReserved)
+    {
+        return FL_ERROR_BOUNDS;
+    }
+
+    recordUsed += size;
+    recordReserved = 0;
+    currAddr = recordPage + recordUsed;
+
+    return recordUsed == RECORD_PAGE_SIZE ? closeRecordPage() : FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::flushRecords()
+{
+    if (!recordOpen || recordUsed == recordFlushed)
+    {
+        return FL_SUCCESS;
+    }
+
+    // Straight out of the page buffer
+    FLResultCode result = writeData(recordBuffer + recordFlushed, recordPage + recordFlushed,
+        recordUsed - recordFlushed);
+    if (result == FL_SUCCESS)
+    {
+        recordFlushed = recordUsed;
+    }
+    return result;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::closeRecordPage()
+{
+    FLResultCode result = flushRecords();
+    recordOpen = false;
+    return result;
+}
+
+void FlashLogFR::setCommitInterval(std::chrono::microseconds interval)
+{
+    commitInterval = interval;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::programOpenBlock()
+{
+    if (imuProgrammed == 0)
+    {
+        imuBlockAddr = nextBlockAddr();
+        imu_block_header header = imuEncoder.openHeader();
+        FLResultCode result = writeData(&header, imuBlockAddr, sizeof(header));
+        if (result != FL_SUCCESS)
+        {
+            return result;
+        }
+        imuProgrammed = sizeof(header);
+    }
+
+    // Only bytes that are still erased, NOR can't be programmed twice
+    size_t used = imuEncoder.usedSize();
+    if (used > imuProgrammed)
+    {
+        FLResultCode result = writeData(const_cast<uint8_t *>(imuEncoder.data()) + imuProgrammed,
+            imuBlockAddr + imuProgrammed, used - imuProgrammed);
+        if (result != FL_SUCCESS)
+        {
+            return result;
+        }
+        imuProgrammed = used;
+    }
+    return FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::flushIMU()
+{
+    if (imuEncoder.sampleCount() > 0)
+    {
+        FLResultCode result = writeIMUBlock();
+        if (result != FL_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    // Close the segment early so everything written so far is covered by a summary
+    if (imuSummary.blockCount() > 0)
+    {
+        FLResultCode result = writeSummaryBlock();
+        if (result != FL_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    return flashLog->sync() ? FL_ERROR_BD_IO : FL_SUCCESS;
+}
+
+bd_addr_t FlashLogFR::nextBlockAddr()
+{
+    return logStart + ((currAddr - logStart + IMU_BLOCK_SIZE - 1) / IMU_BLOCK_SIZE) * IMU_BLOCK_SIZE;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::writeIMUBlock()
+{
+    PERF_SPAN(PERF_SPAN_LOG_BLOCK);
+    FLResultCode result;
+    bd_addr_t blockAddr;
+
+    if (imuProgrammed == 0)
+    {
+        // Never committed, only the used part is programmed, the rest of the block stays erased
+        blockAddr = nextBlockAddr();
+        const uint8_t *block = imuEncoder.block();
+        result = writeData(const_cast<uint8_t *>(block), blockAddr, imuEncoder.usedSize());
+    }
+    else
+    {
+        // Rest of the payload, a final stamp, then the remaining header fields over the erased ones. A power loss
+        // at any point leaves either a sealed block or one the stamps can recover.
+        result = programOpenBlock();
+        blockAddr = imuBlockAddr;
+        if (result == FL_SUCCESS)
+        {
+            imu_block_stamp stamp = imuEncoder.stamp();
+            result = writeData(&stamp, blockAddr + imuEncoder.stampOffset(), sizeof(stamp));
+        }
+        if (result == FL_SUCCESS)
+        {
+            result = writeData(const_cast<uint8_t *>(imuEncoder.block()), blockAddr, sizeof(imu_block_header));
+        }
+    }
+
+    imuEncoder.nextBlock();
+    imuProgrammed = 0;
+    if (result != FL_SUCCESS)
+    {
+        return result;
+    }
+
+    currAddr = blockAddr + IMU_BLOCK_SIZE;
+    imuSummary.addBlock((blockAddr - logStart) / IMU_BLOCK_SIZE);
+
+    if (imuSummary.blockCount() >= LOG_SEGMENT_BLOCKS)
+    {
+        return writeSummaryBlock();
+    }
+    return FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::writeSummaryBlock()
+{
+    bd_addr_t blockAddr = nextBlockAddr();
+
+    log_segment_summary summary = imuSummary.finish((blockAddr - logStart) / IMU_BLOCK_SIZE);
+    FLResultCode result = writeData(&summary, blockAddr, sizeof(summary));
+    if (result == FL_SUCCESS)
+    {
+        currAddr = blockAddr + IMU_BLOCK_SIZE;
+    }
+    return result;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::readIMUBlock(uint32_t blockIndex, uint8_t buffer[IMU_BLOCK_SIZE])
+{
+    return readData(buffer, logStart + static_cast<bd_addr_t>(blockIndex) * IMU_BLOCK_SIZE, IMU_BLOCK_SIZE);
+}
+
+FlashLogFR::FLResultCode FlashLogFR::serveDump(int baud)
+{
+    serialPort.sync();
+    serialPort.set_baud(baud);
+    FLResultCode result = serveDump(serialPort);
+    serialPort.sync();
+    serialPort.set_baud(CONSOLE_BAUD);
+    return result;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::serveDump(FileHandle &port)
+{
+    if (flashLog->sync())
+    {
+        return FL_ERROR_BD_IO;
+    }
+
+    SessionDumper dumper(*this, *flashLog, port, logStart, currAddr - logStart);
+    return dumper.serve() ? FL_ERROR_BD_IO : FL_SUCCESS;
+}
+
+uint32_t FlashLogFR::getBlockCount()
+{
+    return (nextBlockAddr() - logStart) / IMU_BLOCK_SIZE;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::findIMUBlock(uint32_t timestamp, uint32_t *blockIndex)
+{
+    if (flashLog->sync())
+    {
+        return FL_ERROR_BD_IO;
+    }
+
+    FlashBlockReader reader(*this, logStart);
+    *blockIndex = logFindBlock(reader, getBlockCount(), timestamp);
+    return FL_SUCCESS;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::readSummary(uint32_t blockIndex, log_segment_summary *summary)
+{
+    FLResultCode result = readData(summary, logStart + static_cast<bd_addr_t>(blockIndex) * IMU_BLOCK_SIZE,
+        sizeof(*summary));
+    if (result != FL_SUCCESS)
+    {
+        return result;
+    }
+
+    if (summary->magic != LOG_SUMMARY_MAGIC)
+    {
+        return FL_ERROR_TYPE;
+    }
+    return logCheckSummary(*summary) ? FL_SUCCESS : FL_ERROR_CHECKSUM;
+}
+
+uint32_t FlashLogFR::getLastSummaryBlock()
+{
+    return imuSummary.lastSummary();
 }
 
 void FlashLogFR::wipeLog()
 {
-    currAddr = logStart;
-    flashLog.erase(logStart, logEnd);
+    finishErase();
+
+    // Carry on from the furthest point erased so far instead of going back to the first sector
+    bd_addr_t tail = erasedUntil > sessions.tail() ? erasedUntil : sessions.tail();
+    tail = ((tail + eraseBlockSize - 1) / eraseBlockSize) * eraseBlockSize;
+
+    // One erase over the whole ring is much faster, the chips use their 64 KB block erase. Sector by sector is
+    // needed to get around bad sectors.
+    if (sessions.badSectorCount() > 0 || flashLog->erase(dataStart, dataSize))
+    {
+        for (bd_addr_t position = tail; position < tail + dataSize; position += eraseBlockSize)
+        {
+            eraseMapped(position);
+        }
+    }
+
+    erasedUntil = tail + dataSize;
+    sessions.format(tail, erasedUntil);
+    readCache.clear();
+
+    recording = false;
+    memset(&currentSession, 0, sizeof(currentSession));
+    logStart = tail;
+    logEnd = tail;
+    currAddr = tail;
+    imuEncoder.reset();
+    imuSummary.reset();
+    imuProgrammed = 0;
+    recordOpen = false;
+}
+
+FlashLogFR::FLResultCode FlashLogFR::getWearStats(flash_wear_stats *stats)
+{
+    uint32_t ringSectors = dataSize / eraseBlockSize;
+    if (ringSectors == 0)
+    {
+        return FL_ERROR_LOGNOINIT;
+    }
+
+    // The ring is erased in order, so the first sector is always the most worn
+    stats->maxSectorErases = getSectorEraseCount(0);
+    stats->minSectorErases = getSectorEraseCount(ringSectors - 1);
+    stats->directoryErases = sessions.eraseCount();
+    stats->badSectors = sessions.badSectorCount();
+    stats->sparesLeft = SPARE_SECTORS - sessions.sparesUsed();
+    return FL_SUCCESS;
+}
+
+uint32_t FlashLogFR::getSectorEraseCount(uint32_t sector)
+{
+    // Every time the erase point passes the sector's place in the ring
+    bd_addr_t position = static_cast<bd_addr_t>(sector) * eraseBlockSize;
+    return erasedUntil > position ? static_cast<uint32_t>((erasedUntil - position - 1) / dataSize + 1) : 0;
+}
+
+BlockDevice &FlashLogFR::getBlockDevice()
+{
+    return *flashLog;
+}
+
+bd_addr_t FlashLogFR::getCalibrationAddr()
+{
+    return static_cast<bd_addr_t>(CALIBRATION_SECTOR) * eraseBlockSize;
+}
+
+bd_addr_t FlashLogFR::getFlashAddr(bd_addr_t position)
+{
+    return physicalAddr(position);
+}
+
+SPIFBlockDevice &FlashLogFR::getChip(size_t chip)
+{
+    return chip == 0 ? flashLogSector0 : flashLogSector1;
 }
 
 bd_addr_t FlashLogFR::getLogSize()
@@ -99,4 +1334,4 @@ bd_addr_t FlashLogFR::getLogSize()
 bd_addr_t FlashLogFR::getRemainingSize()
 {
     return logEnd - currAddr;
-}
\ No newline at end of file
+}
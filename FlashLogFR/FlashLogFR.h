@@ -1,12 +1,44 @@
+#ifndef FLASHLOGFR_H
+#define FLASHLOGFR_H
+
 #include "SPIFBlockDevice.h"
 #include "ChainingBlockDevice.h"
 #include "BufferedBlockDevice.h"
+#include "StaticBufferedBlockDevice.h"
 #include "mbed.h"
+#include "IMUCodec.h"
+#include "LogIndex.h"
+#include "LogDump.h"
+#include "SessionDirectory.h"
+#include "ReadAheadCache.h"
+#include "LogRecords.h"
 
 // Currently only supports our NOR flash chip, but we can add support for SD cards later
+//
+// Layout: the first two erase sectors hold the session directory (SessionDirectory.h), the third one is kept for the
+// sensor calibration (getCalibrationAddr), the rest is a ring that sessions are appended to one after the other.
+// Sectors are erased just ahead of the write point, and once the ring wraps the oldest sessions are dropped as their
+// sectors get reused, so no full erase is needed between runs.
+// Log addresses (readData, writeData, getLogSize...) are positions in the ring, they only ever grow and are mapped
+// onto the flash modulo the ring size.
+//
+// The last SPARE_SECTORS sectors are spares. A ring sector that keeps failing to erase or program (the chip times
+// out, SPIF_BD_ERROR_READY_FAILED/WREN_FAILED) is replaced by a spare and the swap is recorded in the directory.
+
+/**
+ * @brief Flash wear, see FlashLogFR::getWearStats
+ */
+struct flash_wear_stats {
+    uint32_t minSectorErases;       // ring sectors, the ring spreads erases so these differ by at most one
+    uint32_t maxSectorErases;
+    uint32_t directoryErases;       // both directory sectors together
+    uint32_t badSectors;
+    uint32_t sparesLeft;
+};
 
 class FlashLogFR 
 {
+    public:
     enum FLResultCode
     {
         FL_SUCCESS = 0,
@@ -24,6 +56,8 @@ class FlashLogFR
         FL_ERROR_BD_INIT = -10,     // Error initializing block device
         FL_ERROR_BD_IO = -11,       // Error reading to or writing from block device
         FL_ERROR_BD_PARAMS = -12,   // Error with parameters/configuration of block device
+        FL_ERROR_NO_SESSION = -13,  // No session with this id in the directory
+        FL_ERROR_RECORDING = -14,   // Not possible while a session is being recorded, call endSession() first
     };
 
     
@@ -32,30 +66,313 @@ class FlashLogFR
         PinName _FLOG_CS1, PinName _FLOG_CS2, PinName _CONSOLE_RX, PinName _CONSOLE_TX);
         ~FlashLogFR();
 
-        bd_error init();
+        /**
+         * Mount the session directory (formatting it if there is none) and close sessions that were cut by a reset,
+         * their end is found where the erased space starts. Reads then go to the newest session.
+         */
+        FLResultCode init();
+
+        /**
+         * Bring up one flash chip (0 or 1) ahead of init(), so both chips can go through their reset and SFDP parse
+         * from separate threads at start up. init() then only has to mount the log. Chips not initialized this way
+         * are initialized by init() as before.
+         */
+        FLResultCode initChip(size_t chip);
+
+        /** Number of flash chips the log is chained across */
+        static constexpr size_t CHIP_COUNT = 2;
 
+        /**
+         * Start recording a new session after the end of the previous one. tag and label are stored in the
+         * directory for the application, e.g. a flight number and name. Ends the current session first if there
+         * is one.
+         */
+        FLResultCode startSession(uint32_t tag = 0, const char *label = nullptr);
+
+        /** Flush the IMU data and record the end of the session in the directory */
+        FLResultCode endSession();
+
+        /** Sessions in the directory, oldest first */
+        uint32_t getSessionCount();
+        FLResultCode getSession(uint32_t index, session_info *info);
+
+        /** Point reads, searches and serveDump at session id, not possible while recording */
+        FLResultCode openSession(uint32_t id);
+
+        /**
+         * Raw access to the current session, address runs from the session start (logStart) to logEnd.
+         * Writing starts a session if none is being recorded.
+         */
         FLResultCode writeData(void *buffer, bd_addr_t address, bd_size_t size);
         FLResultCode readData(void *buffer, bd_addr_t address, bd_size_t size);
 
+        /**
+         * Reads smaller than size are served from a size byte window read ahead from the flash (two of them, see
+         * ReadAheadCache), so a reader going through the log in small steps costs one flash read per window. Up to
+         * the erase sector size and ReadAheadCache::MAX_WINDOW, 0 reads straight from the flash. Default
+         * READ_AHEAD.
+         */
+        void setReadAhead(size_t size);
+
+        /**
+         * Reserve room for a record at the end of the session and return where to build it, nullptr if it doesn't
+         * fit (larger than RECORD_PAGE_SIZE, or the session is full). The memory is the page buffer that gets
+         * programmed to flash, so the record is never copied. Finish with commitRecord(), the pointer is valid until
+         * then. Records don't straddle flash pages, the rest of a page that can't take the next record stays erased.
+         *
+         * Switching between records and IMU samples closes the IMU block or record page, so mixing them in one
+         * session wastes space, and the timestamp search only understands IMU blocks.
+         */
+        void *reserveRecord(size_t size, size_t align = 4);
+
+        /**
+         * Reserve a record from LogRecords.h with its type id already filled in, finish with commitRecord<Record>().
+         * Only types in LogRecordSchema compile, so the host parser knows every record written this way.
+         */
+        template <typename Record>
+        Record *reserveRecord()
+        {
+            static_assert(LogRecordSchema::sizeOf(LogRecordTraits<Record>::TYPE_ID) == sizeof(Record),
+                "record type is not part of LogRecordSchema");
+
+            Record *record = static_cast<Record *>(reserveRecord(sizeof(Record), alignof(Record)));
+            if (record)
+            {
+                record->type = Record::TYPE_ID;
+            }
+            return record;
+        }
+
+        /** Commit the first size bytes of the last reservation, programmed once the page is full or on flushRecords */
+        FLResultCode commitRecord(size_t size);
+
+        template <typename Record>
+        FLResultCode commitRecord()
+        {
+            return commitRecord(sizeof(Record));
+        }
+
+        /** Copy a record built elsewhere into the log, the type id is set here */
+        template <typename Record>
+        FLResultCode writeRecord(const Record &record)
+        {
+            Record *slot = reserveRecord<Record>();
+            if (!slot)
+            {
+                return FL_ERROR_BOUNDS;
+            }
+            memcpy(reinterpret_cast<uint8_t *>(slot) + sizeof(record.type),
+                reinterpret_cast<const uint8_t *>(&record) + sizeof(record.type), sizeof(Record) - sizeof(record.type));
+            return commitRecord<Record>();
+        }
+
+        /** Program the committed records of the open page */
+        FLResultCode flushRecords();
+
+        /**
+         * Compress an IMU sample (accel x, y, z, gyro x, y, z in raw LSB) into the current block.
+         * Once the block is full it is written at the next IMU_BLOCK_SIZE aligned address.
+         * Starts a session if none is being recorded.
+         */
+        FLResultCode writeIMUSample(const int16_t sample[IMU_CHANNELS], uint32_t timestamp);
+
+        /** Write out the partially filled IMU block, e.g. before stopping a recording */
+        FLResultCode flushIMU();
+
+        /**
+         * Make the IMU samples so far survive a power loss without sealing the block: the new payload bytes and a
+         * commit stamp (see imu_block_stamp) are programmed into the open block, no erase needed. writeIMUSample
+         * does this by itself once the commit interval has passed.
+         */
+        FLResultCode commitIMU();
+
+        /**
+         * At most this much IMU data is lost on a power loss, 0 to only commit whole blocks. Each commit costs a
+         * small program and a sync, default COMMIT_INTERVAL.
+         */
+        void setCommitInterval(std::chrono::microseconds interval);
+
+        /**
+         * Background erase for main loops without threads, call it between writes.
+         *
+         * Without it the sector after the one being written is erased in the write that reaches it, which blocks
+         * for the whole erase. poll() starts erasing one sector further ahead with SPIFBlockDevice::erase_start and
+         * returns right away, a later poll() picks up the result. The erase runs while the caller does other work,
+         * flash accesses to the same chip wait for it.
+         *
+         * @return FL_SUCCESS, or the error of an erase that failed on the sector and its spare
+         */
+        FLResultCode poll();
+
+        /**
+         * Read block number blockIndex, block k lives at logStart + k * IMU_BLOCK_SIZE. It is either IMU data
+         * (decode with IMUBlockDecoder) or a segment summary (see LogIndex.h), check the magic.
+         */
+        FLResultCode readIMUBlock(uint32_t blockIndex, uint8_t buffer[IMU_BLOCK_SIZE]);
+
+        /**
+         * Binary search for the first block whose time range ends at or after timestamp, a few dozen bytes read
+         * per step. blockIndex is set past the last block if the log ends before timestamp.
+         */
+        FLResultCode findIMUBlock(uint32_t timestamp, uint32_t *blockIndex);
+
+        /** Read and check the segment summary at blockIndex */
+        FLResultCode readSummary(uint32_t blockIndex, log_segment_summary *summary);
+
+        /**
+         * Block index of the newest segment summary written in this session, LOG_NO_SUMMARY if none. Older ones
+         * follow from log_segment_summary::previousSummary.
+         */
+        uint32_t getLastSummaryBlock();
+
+        /**
+         * Wait for a download request from log_receive on the console UART and stream the session back.
+         * The UART runs at baud for the duration of the dump and is restored to 115200 afterwards.
+         */
+        FLResultCode serveDump(int baud = DUMP_BAUD);
+
+        /** Same as above over any other link, e.g. a USBSerial for USB CDC */
+        FLResultCode serveDump(FileHandle &port);
+
         int getSize();
         int getStartAddr();
 
+        /**
+         * Erase the whole ring, sessions included. The ring carries on from where it was rather than from its first
+         * sector, so the wear stays even.
+         */
         void wipeLog();
 
-        bd_addr_t FlashLogFR::getLogSize();
-        bd_addr_t FlashLogFR::getRemainingSize();
+        /** Erase counts and bad sectors. Counts are derived from how far the ring has advanced, give or take one. */
+        FLResultCode getWearStats(flash_wear_stats *stats);
+
+        /** Times ring sector (0 is the first sector after the directory) was erased, give or take one */
+        uint32_t getSectorEraseCount(uint32_t sector);
+
+        /**
+         * The sector kept for the sensor calibration, pass both to BMI323Calibration::save(), load() and restore().
+         * The log never erases or writes it, wipeLog() included. Valid after init().
+         */
+        BlockDevice &getBlockDevice();
+        bd_addr_t getCalibrationAddr();
+
+        /** Flash address a log position is stored at, after bad sectors were replaced. Chip 0 comes first. */
+        bd_addr_t getFlashAddr(bd_addr_t position);
+
+        /** Flash chip 0 or 1. On the host build it is the flash model, tests inject faults through it. */
+        SPIFBlockDevice &getChip(size_t chip);
+
+        bd_addr_t getLogSize();
+        bd_addr_t getRemainingSize();
+
+
+    private:
+        // Program the current IMU block and start the next one
+        FLResultCode writeIMUBlock();
+
+        // Program the summary of the current segment and start the next one
+        FLResultCode writeSummaryBlock();
 
+        // Blocks sit on IMU_BLOCK_SIZE boundaries so they can be found by index
+        bd_addr_t nextBlockAddr();
+
+        // Blocks that may hold data, for searching
+        uint32_t getBlockCount();
+
+        // Ring position to flash address
+        bd_addr_t physicalAddr(bd_addr_t position);
+
+        // Access the ring, split in two where it wraps around. Probes that jump through the log pass cached false
+        // and go straight to the flash, a read-ahead window for each would read most of what they skip.
+        int readRing(void *buffer, bd_addr_t position, bd_size_t size, bool cached = true);
+        int programRing(const void *buffer, bd_addr_t position, bd_size_t size);
+
+        // Erase up to the sector after the one holding end, see recoverSession()
+        FLResultCode prepareWrite(bd_addr_t end);
+
+        // Erase the sector at position, dropping the older sessions stored in it first
+        FLResultCode eraseSector(bd_addr_t position);
+
+        // Drop the sessions older than the current one that reach into the sector at position
+        FLResultCode dropSessionsIn(bd_addr_t position);
+
+        // Start erasing the sector at erasedUntil without waiting for it, see poll()
+        FLResultCode startErase();
+
+        // Wait for the erase started by startErase() and count the sector as erased
+        FLResultCode finishErase();
+
+        // Chip behind a flash address, and the address on the chip
+        SPIFBlockDevice &chipAt(bd_addr_t addr, bd_addr_t *chipAddr);
+
+        // Erase the sector at position, replacing it by a spare if it fails
+        FLResultCode eraseMapped(bd_addr_t position);
+
+        // Replace the sector holding position by a spare. With keep set, everything the sector holds moves along
+        // except the size bytes at position whose program failed.
+        FLResultCode remapSector(bd_addr_t position, bd_size_t size, bool keep, int error);
+
+        // Find the end of a session that was never closed and record it
+        FLResultCode recoverSession(session_info session);
+
+        // Seal the block before end from its commit stamps, or drop it if there are none. Moves end back over a
+        // block that couldn't be saved, or to the last record of a block of record pages.
+        FLResultCode sealLastBlock(bd_addr_t start, bd_addr_t *end);
+
+        // Program the open header and the payload not yet on flash
+        FLResultCode programOpenBlock();
+
+        // Program what is left in the record page and stop using it
+        FLResultCode closeRecordPage();
+
+        // true if the block at position starts with erased flash
+        bool blockErased(bd_addr_t position);
+
+        static constexpr int FLOG_FREQ = 40000000;
+
+    public:
+        /** Largest record for reserveRecord, the flash page size */
+        static constexpr size_t RECORD_PAGE_SIZE = LOG_RECORD_PAGE_SIZE;
 
     private:
+
+        // Bound on the IMU data lost on a power loss
+        static constexpr std::chrono::microseconds COMMIT_INTERVAL = std::chrono::milliseconds(50);
+
+        // One erase sector, a read of that size takes about 1 ms at FLOG_FREQ
+        static constexpr size_t READ_AHEAD = 4096;
+
+        // Sectors before the ring: two for the session directory, then the calibration
+        static constexpr uint32_t DIRECTORY_SECTORS = 2;
+        static constexpr uint32_t CALIBRATION_SECTOR = DIRECTORY_SECTORS;
+
+        // Sectors kept at the end of the flash to stand in for bad ones, 128 KB
+        static constexpr uint32_t SPARE_SECTORS = SessionDirectory::MAX_BAD_SECTORS;
+
+        static constexpr int CONSOLE_BAUD = 115200;
+        // 17x the console rate, log_receive has to be started with the same --baud
+        static constexpr int DUMP_BAUD = 2000000;
+
         SPIFBlockDevice flashLogSector0;
         SPIFBlockDevice flashLogSector1;
-        // ChainingBlockDevice chainedFlashLog;
+        // ChainingBlockDevice keeps a pointer to this array
+        BlockDevice *flashLogArr[CHIP_COUNT];
+        ChainingBlockDevice chainedFlashLog;
+
+        // Chips brought up by initChip(), init() drops the extra reference they hold
+        bool chipInitialized[CHIP_COUNT];
 
         // Reading off the flashlog
         BufferedSerial serialPort;
 
-        // Buffered Block Device for caching writes
-        BufferedBlockDevice* flashLog;
+        // Buffered Block Device for caching writes. Mbed's allocates its buffers in init(), the static allocation
+        // build uses one with fixed buffers instead
+#if defined(MBED_CONF_APP_STATIC_ALLOC) && MBED_CONF_APP_STATIC_ALLOC
+        StaticBufferedBlockDevice bufferedFlashLog;
+#else
+        BufferedBlockDevice bufferedFlashLog;
+#endif
+        BlockDevice* flashLog;
 
         PinName FLOG_MOSI;
         PinName FLOG_MISO;
@@ -66,8 +383,6 @@ class FlashLogFR
         PinName CONSOLE_TX;
         PinName CONSOLE_RX;
 
-        constexpr int FLOG_FREQ = 40000000;
-
         /** Addressing bounds of the memory chips in use */
         const bd_addr_t flashStartAddr  = 0x00000000;
         /** for two 64 Mbyte flash cards in sequence (each address holds 1 byte) */
@@ -81,4 +396,48 @@ class FlashLogFR
         bd_addr_t logEnd; // 1 greater than the largest accessible address
         bd_size_t blockSize; // Reading and writing must be done in blocks of a multiple of this size
         bd_size_t eraseBlockSize; // Erasing must be done in blocks of a multiple of this size
-};
\ No newline at end of file
+
+        // Streaming compression for IMU samples
+        IMUBlockEncoder imuEncoder;
+
+        // Summary of the IMU blocks in the current segment
+        LogSummaryBuilder imuSummary;
+
+        // Address of the open IMU block and how much of it is on flash, 0 before its first commit
+        bd_addr_t imuBlockAddr;
+        size_t imuProgrammed;
+
+        // Flash page that records are built in, recordPage is its ring position. Bytes before recordFlushed are on
+        // flash, recordUsed is the end of the committed records.
+        alignas(8) uint8_t recordBuffer[RECORD_PAGE_SIZE];
+        bd_addr_t recordPage;
+        size_t recordFlushed;
+        size_t recordUsed;
+        size_t recordReserved;
+        bool recordOpen;
+
+        Timer commitTimer;
+        std::chrono::microseconds commitInterval;
+
+        // Windows keyed by ring offset, programRing and eraseMapped keep them current
+        ReadAheadCache readCache;
+        size_t readAheadSize;
+
+        SessionDirectory sessions;
+        // Session being recorded, or the one being read if recording is false
+        session_info currentSession;
+        bool recording;
+
+        // Ring the sessions are stored in, after the directory
+        bd_addr_t dataStart;
+        bd_size_t dataSize;
+        bd_addr_t spareStart;
+        // Ring position up to which the flash is known to be erased
+        bd_addr_t erasedUntil;
+
+        // startErase() left the sector at erasedUntil erasing on this chip
+        bool eraseInFlight;
+        SPIFBlockDevice *eraseChip;
+};
+
+#endif // FLASHLOGFR_H
\ No newline at end of file
@@ -0,0 +1,316 @@
+/**
+ * @file IMUCodec.cpp
+ * @brief Lossless block codec for 6-axis IMU samples
+ */
+
+#include "IMUCodec.h"
+#include <cstring>
+
+namespace
+{
+    struct crc_table {
+        uint32_t entries[256];
+    };
+
+    constexpr crc_table makeCrcTable()
+    {
+        crc_table table = {};
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+            {
+                c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+            }
+            table.entries[i] = c;
+        }
+        return table;
+    }
+
+    // Built by the compiler, so it sits in flash and the log_export workers can share it without a lock
+    constexpr crc_table CRC_TABLE = makeCrcTable();
+
+    inline uint32_t zigzag(int32_t value)
+    {
+        return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+    }
+
+    inline int32_t unzigzag(uint32_t value)
+    {
+        return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+    }
+
+    inline uint8_t *putVarint(uint8_t *out, uint32_t value)
+    {
+        while (value >= 0x80)
+        {
+            *out++ = static_cast<uint8_t>(value) | 0x80;
+            value >>= 7;
+        }
+        *out++ = static_cast<uint8_t>(value);
+        return out;
+    }
+
+    // Returns nullptr if the varint runs past end or is longer than a 17 bit delta can be
+    inline const uint8_t *getVarint(const uint8_t *in, const uint8_t *end, uint32_t *value)
+    {
+        uint32_t result = 0;
+        for (int shift = 0; shift < 21; shift += 7)
+        {
+            if (in == end)
+            {
+                return nullptr;
+            }
+            uint8_t byte = *in++;
+            result |= static_cast<uint32_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+            {
+                *value = result;
+                return in;
+            }
+        }
+        return nullptr;
+    }
+
+    uint32_t blockCrc(const imu_block_header &header, const uint8_t *payload)
+    {
+        imu_block_header zeroed = header;
+        zeroed.crc = 0;
+        uint32_t crc = imuCrc32(&zeroed, sizeof(zeroed));
+        return imuCrc32(payload, header.payloadSize, crc);
+    }
+}
+
+uint32_t imuCrc32(const void *data, size_t size, uint32_t crc)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = CRC_TABLE.entries[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+IMUBlockEncoder::IMUBlockEncoder()
+{
+    reset();
+}
+
+void IMUBlockEncoder::reset()
+{
+    nextSampleIndex = 0;
+    nextSequence = 0;
+    nextBlock();
+}
+
+void IMUBlockEncoder::nextBlock()
+{
+    memset(&header, 0, sizeof(header));
+    header.magic = IMU_BLOCK_MAGIC;
+    header.sequence = nextSequence++;
+    header.firstSampleIndex = nextSampleIndex;
+    stampCount = 0;
+
+    memset(buffer, 0xFF, sizeof(buffer));
+}
+
+size_t IMUBlockEncoder::capacity(size_t stamps) const
+{
+    return IMU_BLOCK_SIZE - stamps * sizeof(imu_block_stamp);
+}
+
+imu_block_header IMUBlockEncoder::openHeader() const
+{
+    imu_block_header open = header;
+    open.lastTimestamp = 0xFFFFFFFF;
+    open.sampleCount = 0xFFFF;
+    open.payloadSize = 0xFFFF;
+    open.crc = 0xFFFFFFFF;
+    return open;
+}
+
+imu_block_stamp IMUBlockEncoder::stamp() const
+{
+    imu_block_stamp result;
+    result.payloadSize = header.payloadSize;
+    result.sampleCount = header.sampleCount;
+    result.lastTimestamp = header.lastTimestamp;
+    result.crc = blockCrc(header, buffer + sizeof(imu_block_header));
+    return result;
+}
+
+bool IMUBlockEncoder::canStamp() const
+{
+    // The next sample still has to fit once one more slot is taken
+    return usedSize() + IMU_MAX_SAMPLE_BYTES <= capacity(stampCount + 2);
+}
+
+void IMUBlockEncoder::addStamp()
+{
+    stampCount++;
+}
+
+bool IMUBlockEncoder::push(const int16_t sample[IMU_CHANNELS], uint32_t timestamp)
+{
+    if (header.sampleCount == 0)
+    {
+        memcpy(header.first, sample, sizeof(header.first));
+        header.firstTimestamp = timestamp;
+    }
+    else
+    {
+        uint8_t *out = buffer + sizeof(imu_block_header) + header.payloadSize;
+        for (size_t i = 0; i < IMU_CHANNELS; i++)
+        {
+            out = putVarint(out, zigzag(static_cast<int32_t>(sample[i]) - previous[i]));
+        }
+        header.payloadSize = static_cast<uint16_t>(out - (buffer + sizeof(imu_block_header)));
+    }
+
+    memcpy(previous, sample, sizeof(previous));
+    header.lastTimestamp = timestamp;
+    header.sampleCount++;
+    nextSampleIndex++;
+
+    // Full once the worst case sample no longer fits next to the free stamp slot
+    return usedSize() + IMU_MAX_SAMPLE_BYTES > capacity(stampCount + 1);
+}
+
+const uint8_t *IMUBlockEncoder::block()
+{
+    header.crc = blockCrc(header, buffer + sizeof(imu_block_header));
+    memcpy(buffer, &header, sizeof(header));
+    return buffer;
+}
+
+namespace
+{
+    bool headerValid(const imu_block_header &header, const uint8_t *block, size_t size)
+    {
+        return header.magic == IMU_BLOCK_MAGIC && header.sampleCount != 0 &&
+            sizeof(header) + header.payloadSize <= size && sizeof(header) + header.payloadSize <= IMU_BLOCK_SIZE &&
+            blockCrc(header, block + sizeof(header)) == header.crc;
+    }
+}
+
+bool IMUBlockDecoder::check(const uint8_t *block, size_t size)
+{
+    imu_block_header header;
+    if (size < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, block, sizeof(header));
+    return headerValid(header, block, size);
+}
+
+int IMUBlockDecoder::recoverHeader(const uint8_t *block, imu_block_header *header)
+{
+    memcpy(header, block, sizeof(*header));
+    if (header->magic != IMU_BLOCK_MAGIC)
+    {
+        return IMU_CODEC_ERROR_MAGIC;
+    }
+
+    // Stamps are programmed in slot order, the newest is before the first erased slot
+    size_t count = 0;
+    while (count < IMU_MAX_STAMPS)
+    {
+        const uint8_t *slot = block + IMU_BLOCK_SIZE - (count + 1) * sizeof(imu_block_stamp);
+        size_t erased = 0;
+        while (erased < sizeof(imu_block_stamp) && slot[erased] == 0xFF)
+        {
+            erased++;
+        }
+        if (erased == sizeof(imu_block_stamp))
+        {
+            break;
+        }
+        count++;
+    }
+
+    // A torn newest stamp fails its CRC, fall back to the one before
+    while (count-- > 0)
+    {
+        imu_block_stamp stamp;
+        memcpy(&stamp, block + IMU_BLOCK_SIZE - (count + 1) * sizeof(imu_block_stamp), sizeof(stamp));
+        if (stamp.sampleCount == 0 ||
+            sizeof(imu_block_header) + stamp.payloadSize > IMU_BLOCK_SIZE - (count + 1) * sizeof(imu_block_stamp))
+        {
+            continue;
+        }
+
+        imu_block_header candidate = *header;
+        candidate.payloadSize = stamp.payloadSize;
+        candidate.sampleCount = stamp.sampleCount;
+        candidate.lastTimestamp = stamp.lastTimestamp;
+        candidate.crc = stamp.crc;
+        if (blockCrc(candidate, block + sizeof(imu_block_header)) == stamp.crc)
+        {
+            *header = candidate;
+            return IMU_CODEC_OK;
+        }
+    }
+    return IMU_CODEC_ERROR_CHECKSUM;
+}
+
+int IMUBlockDecoder::decode(const uint8_t *block, size_t size, int16_t (*samples)[IMU_CHANNELS], size_t maxSamples,
+    imu_block_header *headerOut)
+{
+    imu_block_header header;
+    if (size < sizeof(header))
+    {
+        return IMU_CODEC_ERROR_FORMAT;
+    }
+    memcpy(&header, block, sizeof(header));
+
+    if (header.magic != IMU_BLOCK_MAGIC)
+    {
+        return IMU_CODEC_ERROR_MAGIC;
+    }
+    if (!headerValid(header, block, size))
+    {
+        // Not sealed (or torn while sealing), the commit stamps may still cover part of it
+        if (size < IMU_BLOCK_SIZE || recoverHeader(block, &header) != IMU_CODEC_OK)
+        {
+            bool formatError = header.sampleCount == 0 || sizeof(header) + header.payloadSize > size ||
+                sizeof(header) + header.payloadSize > IMU_BLOCK_SIZE;
+            return formatError ? IMU_CODEC_ERROR_FORMAT : IMU_CODEC_ERROR_CHECKSUM;
+        }
+    }
+
+    const uint8_t *payload = block + sizeof(header);
+    if (header.sampleCount > maxSamples)
+    {
+        return IMU_CODEC_ERROR_SPACE;
+    }
+    if (headerOut)
+    {
+        *headerOut = header;
+    }
+
+    memcpy(samples[0], header.first, sizeof(header.first));
+
+    const uint8_t *in = payload;
+    const uint8_t *end = payload + header.payloadSize;
+    for (uint16_t n = 1; n < header.sampleCount; n++)
+    {
+        for (size_t i = 0; i < IMU_CHANNELS; i++)
+        {
+            uint32_t delta;
+            in = getVarint(in, end, &delta);
+            if (!in)
+            {
+                return IMU_CODEC_ERROR_FORMAT;
+            }
+            samples[n][i] = static_cast<int16_t>(samples[n - 1][i] + unzigzag(delta));
+        }
+    }
+
+    if (in != end)
+    {
+        return IMU_CODEC_ERROR_FORMAT;
+    }
+    return header.sampleCount;
+}
@@ -0,0 +1,194 @@
+/**
+ * @file IMUCodec.h
+ * @brief Lossless block codec for 6-axis IMU samples
+ *
+ * Successive samples are highly correlated, so each axis is stored as the difference to the previous sample,
+ * zig-zag mapped to unsigned and written as a LEB128 varint. Samples are packed into fixed size blocks, each with a
+ * header that holds the first sample verbatim, so any block decodes on its own and block k of a log always starts at
+ * logStart + k * IMU_BLOCK_SIZE (random seek without scanning).
+ *
+ * A block that is still being filled can be committed to flash part way with stamps (imu_block_stamp), so a power
+ * loss costs only the samples since the last stamp.
+ *
+ * No Mbed dependencies, this file is also built into the host side tools.
+ */
+
+#ifndef FLASHLOGFR_IMU_CODEC_H
+#define FLASHLOGFR_IMU_CODEC_H
+
+#include <cstdint>
+#include <cstddef>
+
+/** Size of one encoded block, a multiple of the flash page size */
+constexpr size_t IMU_BLOCK_SIZE = 512;
+
+/** Number of channels per sample: accel x, y, z then gyro x, y, z */
+constexpr size_t IMU_CHANNELS = 6;
+
+/** "IMUB", marks the start of a block */
+constexpr uint32_t IMU_BLOCK_MAGIC = 0x42554D49;
+
+/**
+ * @brief Header at the start of every block
+ */
+struct imu_block_header {
+    uint32_t magic;
+    uint32_t sequence;              // block number since the start of the log
+    uint32_t firstSampleIndex;      // index of the first sample in this block since the start of the log
+    uint32_t firstTimestamp;        // timestamp of the first sample, units are up to the producer
+    uint32_t lastTimestamp;         // timestamp of the last sample
+    uint16_t sampleCount;
+    uint16_t payloadSize;           // bytes of varint payload following the header
+    int16_t first[IMU_CHANNELS];    // first sample, stored verbatim
+    uint32_t crc;                   // CRC-32 of the header (with this field zeroed) and the payload
+};
+
+static_assert(sizeof(imu_block_header) == 40, "imu_block_header layout changed, bump the format");
+
+/**
+ * @brief Commit stamp for a block that is still being filled
+ *
+ * While a block is open its header only holds the fields known from the first sample, the others stay erased
+ * (0xFF) so the final values can still be programmed over them. Each commit programs the payload so far and then a
+ * stamp into the tail of the block, stamps fill the block from the end backwards: slot k is at
+ * IMU_BLOCK_SIZE - (k + 1) * sizeof(imu_block_stamp). crc is the CRC the header would get if the block were sealed
+ * with these counts, so a stamp checks both itself and the payload it covers, and the newest valid stamp gives the
+ * header to seal the block with after a power loss.
+ */
+struct imu_block_stamp {
+    uint16_t payloadSize;
+    uint16_t sampleCount;
+    uint32_t lastTimestamp;
+    uint32_t crc;
+};
+
+static_assert(sizeof(imu_block_stamp) == 12, "imu_block_stamp layout changed, bump the format");
+
+/** Stamps that can fit in a block */
+constexpr size_t IMU_MAX_STAMPS = (IMU_BLOCK_SIZE - sizeof(imu_block_header)) / sizeof(imu_block_stamp);
+
+/** Worst case bytes for one encoded sample (17 bit zig-zag deltas take 3 varint bytes) */
+constexpr size_t IMU_MAX_SAMPLE_BYTES = IMU_CHANNELS * 3;
+
+/** Result codes for the decoder */
+enum IMUCodecResult {
+    IMU_CODEC_OK = 0,
+    IMU_CODEC_ERROR_MAGIC = -1,         // not a block (erased flash reads as 0xFF)
+    IMU_CODEC_ERROR_CHECKSUM = -2,
+    IMU_CODEC_ERROR_FORMAT = -3,        // header or payload is inconsistent
+    IMU_CODEC_ERROR_SPACE = -4          // output buffer is too small
+};
+
+/**
+ * @brief CRC-32 (IEEE 802.3, reflected), same result as MbedCRC<POLY_32BIT_ANSI, 32>
+ */
+uint32_t imuCrc32(const void *data, size_t size, uint32_t crc = 0);
+
+/**
+ * @brief Streams samples into fixed size blocks
+ */
+class IMUBlockEncoder
+{
+    public:
+        IMUBlockEncoder();
+
+        /**
+         * @brief Start a fresh stream, block and sample numbering restart at 0
+         */
+        void reset();
+
+        /**
+         * @brief Add a sample to the current block
+         *
+         * @return true if the block is now full and should be written out with block(), then started over
+         * with nextBlock()
+         */
+        bool push(const int16_t sample[IMU_CHANNELS], uint32_t timestamp);
+
+        /**
+         * @brief Finalize the header of the current block (CRC, counts) and return it
+         *
+         * The block is always IMU_BLOCK_SIZE bytes, the unused tail is left at 0xFF (erased flash) so it costs no
+         * program time beyond the bytes actually used.
+         */
+        const uint8_t *block();
+
+        /**
+         * @brief Begin the next block after the current one was written out
+         */
+        void nextBlock();
+
+        /** Number of samples in the current block */
+        uint16_t sampleCount() const { return header.sampleCount; }
+
+        /** Bytes of the current block that hold data (header + payload) */
+        size_t usedSize() const { return sizeof(imu_block_header) + header.payloadSize; }
+
+        /** Current block as encoded so far, only the payload is valid before block() */
+        const uint8_t *data() const { return buffer; }
+
+        /** Header to program while the block is open, the fields that still change are left erased */
+        imu_block_header openHeader() const;
+
+        /** Stamp covering the samples so far */
+        imu_block_stamp stamp() const;
+
+        /**
+         * @brief Offset of the free stamp slot
+         *
+         * One slot is always kept free, so a block can be sealed with a final stamp. Program the stamp from stamp()
+         * there, then call addStamp() for a commit, or block() to seal.
+         */
+        size_t stampOffset() const { return IMU_BLOCK_SIZE - (stampCount + 1) * sizeof(imu_block_stamp); }
+
+        /** false if the block is too full to keep another stamp slot free, seal it instead of committing */
+        bool canStamp() const;
+
+        /** The stamp slot was used by a commit, move to the next one */
+        void addStamp();
+
+    private:
+        // Payload bytes available with the free stamp slots
+        size_t capacity(size_t stamps) const;
+
+        imu_block_header header;
+        uint8_t buffer[IMU_BLOCK_SIZE];
+        int16_t previous[IMU_CHANNELS];
+        uint32_t nextSampleIndex;
+        uint32_t nextSequence;
+        size_t stampCount;
+};
+
+/**
+ * @brief Decodes one block
+ */
+class IMUBlockDecoder
+{
+    public:
+        /**
+         * @brief Decode a block
+         *
+         * @param block start of the block
+         * @param size bytes available at block (at least the used part of the block)
+         * @param samples output, one row per sample
+         * @param maxSamples rows available in samples
+         * @param header if not null, receives the block header
+         * @return number of samples decoded, or a negative IMUCodecResult
+         */
+        static int decode(const uint8_t *block, size_t size, int16_t (*samples)[IMU_CHANNELS], size_t maxSamples,
+            imu_block_header *header = nullptr);
+
+        /** @return true if the block is sealed and its header and payload pass the CRC */
+        static bool check(const uint8_t *block, size_t size);
+
+        /**
+         * @brief Rebuild the header of a block that was not sealed from its newest valid commit stamp
+         *
+         * @param block the whole block, IMU_BLOCK_SIZE bytes
+         * @param header receives the header the block would have been sealed with
+         * @return IMU_CODEC_OK, IMU_CODEC_ERROR_MAGIC if it isn't a block, IMU_CODEC_ERROR_CHECKSUM if no stamp is valid
+         */
+        static int recoverHeader(const uint8_t *block, imu_block_header *header);
+};
+
+#endif // FLASHLOGFR_IMU_CODEC_H
@@ -0,0 +1,160 @@
+/**
+ * @file LogDump.cpp
+ * @brief Streams a region of a block device to a serial link using the protocol in DumpProtocol.h
+ */
+
+#include "LogDump.h"
+
+LogDumper::LogDumper(BlockDevice &bd, FileHandle &port, bd_addr_t start, bd_size_t size) :
+    bd(bd), port(port), start(start), size(size)
+{
+}
+
+int LogDumper::readLog(void *buffer, bd_addr_t offset, bd_size_t length)
+{
+    return bd.read(buffer, start + offset, length);
+}
+
+int LogDumper::serve()
+{
+    while (true)
+    {
+        dump_request request;
+        receiveRequest(&request);
+
+        if (request.flags & DUMP_FLAG_DONE)
+        {
+            dump_frame_header header = {};
+            header.type = DUMP_FRAME_END;
+            sendFrame(header, nullptr);
+            port.sync();
+            return 0;
+        }
+
+        int err = dump(request.offset, request.length, request.flags & DUMP_FLAG_COMPRESS);
+        if (err)
+        {
+            return err;
+        }
+    }
+}
+
+void LogDumper::receiveRequest(dump_request *request)
+{
+    uint8_t *bytes = reinterpret_cast<uint8_t *>(request);
+    size_t received = 0;
+
+    while (true)
+    {
+        ssize_t count = port.read(bytes + received, sizeof(dump_request) - received);
+        if (count <= 0)
+        {
+            continue;
+        }
+        received += count;
+
+        if (received < sizeof(dump_request))
+        {
+            continue;
+        }
+        if (dumpCheckRequest(*request))
+        {
+            return;
+        }
+
+        // Slide by one byte and keep looking for the start of a request
+        memmove(bytes, bytes + 1, sizeof(dump_request) - 1);
+        received = sizeof(dump_request) - 1;
+    }
+}
+
+int LogDumper::dump(uint32_t offset, uint32_t length, bool compress)
+{
+    if (offset > size)
+    {
+        offset = size;
+    }
+    if (length == 0 || length > size - offset)
+    {
+        length = size - offset;
+    }
+
+    dump_info info = {offset, length, static_cast<uint32_t>(size), DUMP_CHUNK_SIZE};
+    dump_frame_header header = {};
+    header.type = DUMP_FRAME_START;
+    header.payloadSize = sizeof(info);
+    header.offset = offset;
+    sendFrame(header, &info);
+
+    uint32_t sent = 0;
+    while (sent < length)
+    {
+        uint32_t chunkSize = length - sent < DUMP_CHUNK_SIZE ? length - sent : DUMP_CHUNK_SIZE;
+
+        int err = readLog(chunk, offset + sent, chunkSize);
+        if (err)
+        {
+            header = {};
+            header.type = DUMP_FRAME_ERROR;
+            header.offset = offset + sent;
+            header.rawSize = static_cast<uint32_t>(err);
+            sendFrame(header, nullptr);
+            return err;
+        }
+
+        header = {};
+        header.type = DUMP_FRAME_CHUNK;
+        header.offset = offset + sent;
+        header.rawSize = chunkSize;
+
+        const uint8_t *payload = chunk;
+        header.payloadSize = chunkSize;
+        if (compress)
+        {
+            size_t encodedSize = dumpRleEncode(chunk, chunkSize, encoded);
+            if (encodedSize < chunkSize)
+            {
+                payload = encoded;
+                header.payloadSize = encodedSize;
+                header.flags = DUMP_FRAME_FLAG_RLE;
+            }
+        }
+        sendFrame(header, payload);
+
+        sent += chunkSize;
+    }
+
+    header = {};
+    header.type = DUMP_FRAME_END;
+    header.offset = offset + sent;
+    header.rawSize = sent;
+    sendFrame(header, nullptr);
+
+    port.sync();
+    return 0;
+}
+
+void LogDumper::sendFrame(dump_frame_header &header, const void *payload)
+{
+    dumpSealFrame(&header, payload);
+    writeAll(&header, sizeof(header));
+    if (header.payloadSize)
+    {
+        writeAll(payload, header.payloadSize);
+    }
+}
+
+void LogDumper::writeAll(const void *data, size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    while (size > 0)
+    {
+        ssize_t written = port.write(bytes, size);
+        if (written <= 0)
+        {
+            continue;
+        }
+        bytes += written;
+        size -= written;
+    }
+}
@@ -0,0 +1,72 @@
+/**
+ * @file LogDump.h
+ * @brief Streams a region of a block device to a serial link using the protocol in DumpProtocol.h
+ */
+
+#ifndef FLASHLOGFR_LOG_DUMP_H
+#define FLASHLOGFR_LOG_DUMP_H
+
+#include "mbed.h"
+#include "blockdevice/BlockDevice.h"
+#include "DumpProtocol.h"
+
+/**
+ * @brief Device side of the log download
+ *
+ * Works over anything that is a FileHandle: the console BufferedSerial (run it at the highest baud rate the link
+ * supports, see FlashLogFR::serveDump) or USBSerial for USB CDC.
+ */
+class LogDumper
+{
+    public:
+        /**
+         * @param bd device holding the log
+         * @param port link to the host
+         * @param start address of the first log byte on bd
+         * @param size bytes of log, requests are clamped to this
+         */
+        LogDumper(BlockDevice &bd, FileHandle &port, bd_addr_t start, bd_size_t size);
+        virtual ~LogDumper() {}
+
+        /**
+         * @brief Answer requests from the host until it sends one with DUMP_FLAG_DONE
+         *
+         * Bytes outside of valid requests (console noise, partial requests) are skipped.
+         *
+         * @return 0 once the host is done, block device error otherwise
+         */
+        int serve();
+
+        /**
+         * @brief Send part of the log without waiting for a request
+         *
+         * @param offset first byte, relative to start
+         * @param length bytes to send, 0 for everything from offset to the end
+         * @param compress run length encode chunks where that makes them smaller
+         * @return 0 on success, block device error otherwise
+         */
+        int dump(uint32_t offset, uint32_t length, bool compress);
+
+    protected:
+        /**
+         * @brief Read log bytes from offset, override for logs that aren't stored in one piece
+         */
+        virtual int readLog(void *buffer, bd_addr_t offset, bd_size_t length);
+
+    private:
+        // Block until a valid request arrives
+        void receiveRequest(dump_request *request);
+
+        void sendFrame(dump_frame_header &header, const void *payload);
+        void writeAll(const void *data, size_t size);
+
+        BlockDevice &bd;
+        FileHandle &port;
+        bd_addr_t start;
+        bd_size_t size;
+
+        uint8_t chunk[DUMP_CHUNK_SIZE];
+        uint8_t encoded[DUMP_MAX_PAYLOAD];
+};
+
+#endif // FLASHLOGFR_LOG_DUMP_H
@@ -0,0 +1,103 @@
+/**
+ * @file LogIndex.cpp
+ * @brief Sparse index over an IMU log: per segment summaries and timestamp search
+ */
+
+#include "LogIndex.h"
+#include <cstring>
+
+LogSummaryBuilder::LogSummaryBuilder()
+{
+    reset();
+}
+
+void LogSummaryBuilder::reset()
+{
+    nextSequence = 0;
+    previousSummary = LOG_NO_SUMMARY;
+    nextSampleIndex = 0;
+    startSegment();
+}
+
+void LogSummaryBuilder::startSegment()
+{
+    memset(&summary, 0, sizeof(summary));
+    summary.magic = LOG_SUMMARY_MAGIC;
+    summary.sequence = nextSequence;
+    summary.firstSampleIndex = nextSampleIndex;
+    summary.previousSummary = previousSummary;
+    for (size_t i = 0; i < IMU_CHANNELS; i++)
+    {
+        summary.min[i] = INT16_MAX;
+        summary.max[i] = INT16_MIN;
+    }
+}
+
+void LogSummaryBuilder::addSample(const int16_t sample[IMU_CHANNELS], uint32_t timestamp)
+{
+    if (summary.sampleCount == 0)
+    {
+        summary.firstTimestamp = timestamp;
+    }
+    summary.lastTimestamp = timestamp;
+    summary.sampleCount++;
+    nextSampleIndex++;
+
+    for (size_t i = 0; i < IMU_CHANNELS; i++)
+    {
+        summary.min[i] = sample[i] < summary.min[i] ? sample[i] : summary.min[i];
+        summary.max[i] = sample[i] > summary.max[i] ? sample[i] : summary.max[i];
+    }
+}
+
+void LogSummaryBuilder::addBlock(uint32_t blockIndex)
+{
+    if (summary.blockCount == 0)
+    {
+        summary.firstBlock = blockIndex;
+    }
+    summary.blockCount++;
+}
+
+const log_segment_summary &LogSummaryBuilder::finish(uint32_t blockIndex)
+{
+    sealed = summary;
+    sealed.crc = imuCrc32(&sealed, offsetof(log_segment_summary, crc));
+
+    nextSequence++;
+    previousSummary = blockIndex;
+    startSegment();
+
+    return sealed;
+}
+
+bool logCheckSummary(const log_segment_summary &summary)
+{
+    return summary.magic == LOG_SUMMARY_MAGIC && summary.crc == imuCrc32(&summary, offsetof(log_segment_summary, crc));
+}
+
+uint32_t logFindBlock(LogBlockReader &reader, uint32_t blockCount, uint32_t timestamp)
+{
+    uint32_t low = 0;
+    uint32_t high = blockCount;
+
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+
+        imu_block_header header;
+        bool valid = reader.readBlock(mid, &header, LOG_BLOCK_PROBE_SIZE) &&
+            (header.magic == IMU_BLOCK_MAGIC || header.magic == LOG_SUMMARY_MAGIC);
+
+        if (valid && header.lastTimestamp < timestamp)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
@@ -0,0 +1,120 @@
+/**
+ * @file LogIndex.h
+ * @brief Sparse index over an IMU log: per segment summaries and timestamp search
+ *
+ * The log is a sequence of IMU_BLOCK_SIZE blocks. After every LOG_SEGMENT_BLOCKS data blocks (and when the log is
+ * flushed) a summary block is written in line, holding the time range, sample count and per channel min/max of the
+ * data blocks since the previous summary, plus a back link to it. Readers can:
+ * - find the block holding a timestamp with a binary search over block headers (logFindBlock), both block types
+ *   start with the same magic/sequence/sample index/time range fields so any block can be probed
+ * - walk the summaries from the newest one backwards to skip segments without reading their data
+ *
+ * Timestamps have to be monotonic within a log for the search to work.
+ *
+ * No Mbed dependencies, this file is also built into the host side tools.
+ */
+
+#ifndef FLASHLOGFR_LOG_INDEX_H
+#define FLASHLOGFR_LOG_INDEX_H
+
+#include "IMUCodec.h"
+
+/** "IMUX", marks a summary block */
+constexpr uint32_t LOG_SUMMARY_MAGIC = 0x58554D49;
+
+/** Data blocks per segment, 16 KB */
+constexpr uint32_t LOG_SEGMENT_BLOCKS = 32;
+
+/** previousSummary of the first summary in a log */
+constexpr uint32_t LOG_NO_SUMMARY = 0xFFFFFFFF;
+
+/**
+ * @brief Content of a summary block, the rest of the block is left erased
+ */
+struct log_segment_summary {
+    uint32_t magic;
+    uint32_t sequence;              // summary number since the start of the log
+    uint32_t firstSampleIndex;
+    uint32_t firstTimestamp;
+    uint32_t lastTimestamp;
+    uint32_t sampleCount;
+    uint32_t firstBlock;            // block index of the first data block in the segment
+    uint16_t blockCount;            // data blocks in the segment, they directly precede this summary
+    uint16_t reserved;
+    uint32_t previousSummary;       // block index of the previous summary, LOG_NO_SUMMARY for the first
+    int16_t min[IMU_CHANNELS];
+    int16_t max[IMU_CHANNELS];
+    uint32_t crc;                   // CRC-32 of the fields above
+};
+
+static_assert(sizeof(log_segment_summary) == 64, "log_segment_summary layout changed, bump the format");
+static_assert(offsetof(log_segment_summary, lastTimestamp) == offsetof(imu_block_header, lastTimestamp),
+    "summary and data blocks must share the time range fields");
+
+/** Bytes of a block header needed to tell its type and time range */
+constexpr size_t LOG_BLOCK_PROBE_SIZE = offsetof(imu_block_header, lastTimestamp) + sizeof(uint32_t);
+
+/**
+ * @brief Accumulates the summary of the current segment
+ */
+class LogSummaryBuilder
+{
+    public:
+        LogSummaryBuilder();
+
+        /** Start a fresh log, summary numbering restarts at 0 */
+        void reset();
+
+        /** Account for a sample written to the log */
+        void addSample(const int16_t sample[IMU_CHANNELS], uint32_t timestamp);
+
+        /** Account for a data block written at blockIndex */
+        void addBlock(uint32_t blockIndex);
+
+        /** Data blocks in the current segment */
+        uint16_t blockCount() const { return summary.blockCount; }
+
+        /** Block index of the newest summary, LOG_NO_SUMMARY if none was finished yet */
+        uint32_t lastSummary() const { return previousSummary; }
+
+        /**
+         * @brief Seal the summary of the current segment, to be written at blockIndex, and start the next one
+         */
+        const log_segment_summary &finish(uint32_t blockIndex);
+
+    private:
+        void startSegment();
+
+        log_segment_summary summary;
+        log_segment_summary sealed;
+        uint32_t nextSequence;
+        uint32_t previousSummary;
+        uint32_t nextSampleIndex;
+};
+
+/** @return true if the summary magic and CRC are valid */
+bool logCheckSummary(const log_segment_summary &summary);
+
+/**
+ * @brief Source of log blocks for the search functions, implemented on top of flash or a dump file
+ */
+class LogBlockReader
+{
+    public:
+        virtual ~LogBlockReader() {}
+
+        /** Read the first size bytes of block blockIndex, false on error */
+        virtual bool readBlock(uint32_t blockIndex, void *buffer, size_t size) = 0;
+};
+
+/**
+ * @brief Binary search for the first block (data or summary) whose time range ends at or after timestamp
+ *
+ * Erased or unreadable blocks count as being past the end, so blockCount can be an upper bound such as the size of
+ * a dump. Costs about log2(blockCount) reads of LOG_BLOCK_PROBE_SIZE bytes.
+ *
+ * @return block index, blockCount if every block ends before timestamp
+ */
+uint32_t logFindBlock(LogBlockReader &reader, uint32_t blockCount, uint32_t timestamp);
+
+#endif // FLASHLOGFR_LOG_INDEX_H
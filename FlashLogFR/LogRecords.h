@@ -0,0 +1,228 @@
+/**
+ * @file LogRecords.h
+ * @brief Typed, fixed size log records shared between the firmware and the host tools
+ *
+ * Every record is a packed struct that starts with its type id and has a compile time TYPE_ID, so its size on
+ * flash follows from the id and needs no length field. FlashLogFR::reserveRecord<T>() builds them in place, and
+ * LogRecordSchema::parse() walks a dump and hands each record to a visitor with the matching overload.
+ *
+ * Records are packed into LOG_RECORD_PAGE_SIZE pages and never straddle one, the rest of a page reads as erased
+ * (type LOG_RECORD_NONE). IMU blocks and summary blocks (IMUCodec.h, LogIndex.h) in the same log are skipped.
+ *
+ * To add a record: define the struct below with a new TYPE_ID (never reuse one), add it to LogRecordSchema, and
+ * add an overload to the visitors that care (host/log_records.cpp).
+ *
+ * No Mbed dependencies, this file is also built into the host side tools.
+ */
+
+#ifndef FLASHLOGFR_LOG_RECORDS_H
+#define FLASHLOGFR_LOG_RECORDS_H
+
+#include "IMUCodec.h"
+#include "LogIndex.h"
+#include <cstring>
+#include <type_traits>
+
+/** Records are packed into pages of this size, the flash page size */
+constexpr size_t LOG_RECORD_PAGE_SIZE = 256;
+
+/** Type id read from erased flash, nothing more in this page */
+constexpr uint16_t LOG_RECORD_NONE = 0xFFFF;
+
+/** Type ids stay below this, so they can't be mistaken for the magic of an IMU or summary block */
+constexpr uint16_t LOG_RECORD_MAX_TYPE = 0x100;
+
+/** Bands in a log_vibration_record, BMI323Spectrum::MAX_BANDS */
+constexpr size_t LOG_VIBRATION_BANDS = 8;
+
+#pragma pack(push, 1)
+
+/**
+ * @brief One unscaled accel + gyro sample, for logs that skip the IMU block codec
+ */
+struct log_imu_raw_record {
+    static constexpr uint16_t TYPE_ID = 1;
+
+    uint16_t type;
+    uint32_t timestamp;
+    int16_t accel[3];               // x, y, z in LSB
+    int16_t gyro[3];
+};
+
+/**
+ * @brief Something the application wants on the timeline, code and value are up to it
+ */
+struct log_event_record {
+    static constexpr uint16_t TYPE_ID = 2;
+
+    uint16_t type;
+    uint32_t timestamp;
+    uint16_t code;
+    uint32_t value;
+};
+
+/**
+ * @brief Data path calibration in use from timestamp on, register units as BMI323Base::dp_calibration
+ */
+struct log_calibration_record {
+    static constexpr uint16_t TYPE_ID = 3;
+
+    uint16_t type;
+    uint32_t timestamp;
+    int16_t accelOffset[3];
+    int16_t accelGain[3];
+    int16_t gyroOffset[3];
+    int16_t gyroGain[3];
+};
+
+/**
+ * @brief Switch between the user and alternate sensor configuration (BMI323Base::readAltStatus)
+ */
+struct log_alt_status_record {
+    static constexpr uint16_t TYPE_ID = 4;
+
+    uint16_t type;
+    uint32_t timestamp;
+    uint8_t accelAlt;
+    uint8_t gyroAlt;
+};
+
+/**
+ * @brief Accel vibration spectrum up to timestamp (BMI323Spectrum::vibration_summary), logged in place of the raw
+ * samples. Accelerations are RMS in accel LSB, clipped to 0xFFFF. Bands past bands read as 0.
+ */
+struct log_vibration_record {
+    static constexpr uint16_t TYPE_ID = 5;
+
+    uint16_t type;
+    uint32_t timestamp;             // end of the last window
+    uint16_t windows;               // windows averaged
+    uint8_t bands;
+    uint16_t bandEdgeHz[LOG_VIBRATION_BANDS + 1];
+    uint16_t bandRms[3][LOG_VIBRATION_BANDS];   // x, y, z
+    uint16_t peakDeciHz[3];         // strongest peak of each axis, in 0.1 Hz
+    uint16_t peakRms[3];
+};
+
+#pragma pack(pop)
+
+/**
+ * @brief Compile time checks every record type has to pass
+ */
+template <typename Record>
+struct LogRecordTraits
+{
+    static_assert(std::is_trivially_copyable<Record>::value, "records are stored as bytes");
+    static_assert(alignof(Record) == 1, "records have to be packed, they sit at any offset in a page");
+    static_assert(offsetof(Record, type) == 0, "records start with their type id");
+    static_assert(Record::TYPE_ID != 0 && Record::TYPE_ID < LOG_RECORD_MAX_TYPE, "type id out of range");
+    static_assert(sizeof(Record) <= LOG_RECORD_PAGE_SIZE, "records have to fit in a page");
+
+    static constexpr uint16_t TYPE_ID = Record::TYPE_ID;
+    static constexpr size_t SIZE = sizeof(Record);
+};
+
+/**
+ * @brief A set of record types, gives the size of each type id and dispatches parsed records to a visitor
+ */
+template <typename... Records>
+class LogSchema
+{
+    public:
+        /** @return size of a record with this type id, 0 if it isn't part of the schema */
+        static constexpr size_t sizeOf(uint16_t type)
+        {
+            size_t size = 0;
+            ((type == LogRecordTraits<Records>::TYPE_ID ? (size = LogRecordTraits<Records>::SIZE) : 0), ...);
+            return size;
+        }
+
+        /**
+         * @brief Walk the records in a dump
+         *
+         * @param data log as it is on flash, starting at a page boundary
+         * @param visitor called as visitor(const Record &) for every record, needs an overload per record type
+         * @param errors if not null, receives the number of pages cut short by an unknown or truncated record
+         * @return number of records visited
+         */
+        template <typename Visitor>
+        static size_t parse(const uint8_t *data, size_t size, Visitor &&visitor, size_t *errors = nullptr)
+        {
+            size_t visited = 0;
+            size_t bad = 0;
+            size_t offset = 0;
+
+            while (offset + sizeof(uint16_t) <= size)
+            {
+                size_t pageEnd = (offset / LOG_RECORD_PAGE_SIZE + 1) * LOG_RECORD_PAGE_SIZE;
+
+                if (offset % IMU_BLOCK_SIZE == 0 && offset + sizeof(uint32_t) <= size)
+                {
+                    uint32_t magic;
+                    memcpy(&magic, data + offset, sizeof(magic));
+                    if (magic == IMU_BLOCK_MAGIC || magic == LOG_SUMMARY_MAGIC)
+                    {
+                        offset += IMU_BLOCK_SIZE;
+                        continue;
+                    }
+                }
+
+                uint16_t type;
+                memcpy(&type, data + offset, sizeof(type));
+                if (type == LOG_RECORD_NONE)
+                {
+                    offset = pageEnd;
+                    continue;
+                }
+
+                size_t recordSize = sizeOf(type);
+                if (recordSize == 0 || offset + recordSize > pageEnd || offset + recordSize > size)
+                {
+                    bad++;
+                    offset = pageEnd;
+                    continue;
+                }
+
+                dispatch(type, data + offset, visitor);
+                visited++;
+                offset += recordSize;
+            }
+
+            if (errors)
+            {
+                *errors = bad;
+            }
+            return visited;
+        }
+
+    private:
+        static constexpr bool uniqueTypes()
+        {
+            uint16_t types[] = {LogRecordTraits<Records>::TYPE_ID...};
+            for (size_t i = 0; i < sizeof...(Records); i++)
+            {
+                for (size_t k = i + 1; k < sizeof...(Records); k++)
+                {
+                    if (types[i] == types[k])
+                    {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        static_assert(uniqueTypes(), "two records share a type id");
+
+        template <typename Visitor>
+        static void dispatch(uint16_t type, const uint8_t *record, Visitor &visitor)
+        {
+            ((type == Records::TYPE_ID ? (visitor(*reinterpret_cast<const Records *>(record)), 0) : 0), ...);
+        }
+};
+
+/** Every record type the firmware writes */
+using LogRecordSchema = LogSchema<log_imu_raw_record, log_event_record, log_calibration_record, log_alt_status_record,
+    log_vibration_record>;
+
+#endif // FLASHLOGFR_LOG_RECORDS_H
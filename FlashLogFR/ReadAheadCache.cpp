@@ -0,0 +1,90 @@
+#include "ReadAheadCache.h"
+
+ReadAheadCache::ReadAheadCache() : windowSize(0), filling(0), useCounter(0), hitCount(0), missCount(0)
+{
+    clear();
+}
+
+void ReadAheadCache::setWindow(size_t size, size_t limit)
+{
+    size = size < limit ? size : limit;
+    size = size < MAX_WINDOW ? size : MAX_WINDOW;
+
+    size_t window = MIN_WINDOW;
+    while (window * 2 <= size)
+    {
+        window *= 2;
+    }
+    windowSize = size >= MIN_WINDOW ? window : 0;
+    clear();
+}
+
+bd_size_t ReadAheadCache::read(void *buffer, bd_addr_t offset, bd_size_t size)
+{
+    if (windowSize == 0)
+    {
+        return 0;
+    }
+
+    bd_addr_t windowOffset = offset - offset % windowSize;
+    for (size_t i = 0; i < WINDOWS; i++)
+    {
+        if (windows[i].valid && windows[i].offset == windowOffset)
+        {
+            bd_size_t available = windowOffset + windowSize - offset;
+            bd_size_t piece = size < available ? size : available;
+            memcpy(buffer, buffers[i] + (offset - windowOffset), piece);
+            windows[i].lastUse = ++useCounter;
+            hitCount++;
+            return piece;
+        }
+    }
+    return 0;
+}
+
+uint8_t *ReadAheadCache::fill(bd_addr_t offset)
+{
+    filling = 0;
+    for (size_t i = 1; i < WINDOWS; i++)
+    {
+        if (!windows[filling].valid)
+        {
+            break;
+        }
+        if (!windows[i].valid || windows[i].lastUse < windows[filling].lastUse)
+        {
+            filling = i;
+        }
+    }
+
+    windows[filling].offset = offset - offset % windowSize;
+    windows[filling].valid = false;
+    missCount++;
+    return buffers[filling];
+}
+
+void ReadAheadCache::filled()
+{
+    windows[filling].valid = true;
+    windows[filling].lastUse = ++useCounter;
+}
+
+void ReadAheadCache::invalidate(bd_addr_t offset, bd_size_t size)
+{
+    for (size_t i = 0; i < WINDOWS; i++)
+    {
+        if (windows[i].valid && windows[i].offset < offset + size && offset < windows[i].offset + windowSize)
+        {
+            windows[i].valid = false;
+        }
+    }
+}
+
+void ReadAheadCache::clear()
+{
+    for (size_t i = 0; i < WINDOWS; i++)
+    {
+        windows[i].valid = false;
+        windows[i].lastUse = 0;
+    }
+}
@@ -0,0 +1,81 @@
+/**
+ * @file ReadAheadCache.h
+ * @brief Read-ahead window for the log ring, so small sequential reads don't each cost a flash read command
+ *
+ * A miss reads the whole aligned window around it, following reads inside the window are copied from RAM. There are
+ * two windows, replaced least recently used first, so a reader that goes back and forth between two places (a block
+ * header and the data after it, the session start and its end) keeps both.
+ *
+ * Windows are keyed by ring offset (position % ring size) and never cross an erase sector, the owner maps them to
+ * the flash and has to invalidate() whatever it programs or erases.
+ */
+
+#ifndef FLASHLOGFR_READ_AHEAD_CACHE_H
+#define FLASHLOGFR_READ_AHEAD_CACHE_H
+
+#include "mbed.h"
+#include "blockdevice/BlockDevice.h"
+
+class ReadAheadCache
+{
+    public:
+        /** Largest window, also the RAM taken per window */
+        static constexpr size_t MAX_WINDOW = 4096;
+
+        /** Smallest window worth having, one flash page */
+        static constexpr size_t MIN_WINDOW = 256;
+
+        static constexpr size_t WINDOWS = 2;
+
+        ReadAheadCache();
+
+        /**
+         * @brief Set the window size, 0 turns the cache off
+         *
+         * Rounded down to a power of two and to limit (the erase sector size), and at most MAX_WINDOW.
+         * Smaller than MIN_WINDOW turns the cache off. Drops everything cached.
+         */
+        void setWindow(size_t size, size_t limit);
+
+        size_t window() const { return windowSize; }
+
+        /**
+         * @brief Copy from a cached window
+         *
+         * @return bytes copied from offset on, up to size, 0 on a miss
+         */
+        bd_size_t read(void *buffer, bd_addr_t offset, bd_size_t size);
+
+        /**
+         * @brief Take the least recently used window for the window aligned offset
+         *
+         * Read window() bytes into the returned buffer, then call filled(), or invalidate() if the read failed.
+         */
+        uint8_t *fill(bd_addr_t offset);
+        void filled();
+
+        /** Forget anything cached between offset and offset + size */
+        void invalidate(bd_addr_t offset, bd_size_t size);
+        void clear();
+
+        uint32_t hits() const { return hitCount; }
+        uint32_t misses() const { return missCount; }
+
+    private:
+        struct Window
+        {
+            bd_addr_t offset;
+            uint32_t lastUse;
+            bool valid;
+        };
+
+        Window windows[WINDOWS];
+        alignas(8) uint8_t buffers[WINDOWS][MAX_WINDOW];
+        size_t windowSize;
+        size_t filling;
+        uint32_t useCounter;
+        uint32_t hitCount;
+        uint32_t missCount;
+};
+
+#endif // FLASHLOGFR_READ_AHEAD_CACHE_H
@@ -0,0 +1,362 @@
+/**
+ * @file SessionDirectory.cpp
+ * @brief Journal of recording sessions kept in two reserved flash sectors
+ */
+
+#include "SessionDirectory.h"
+#include "IMUCodec.h"
+
+SessionDirectory::SessionDirectory() :
+    bd(nullptr), address(0), sectorSize(0), activeSector(0), generation(0), writeOffset(0), sessionCount(0),
+    nextId(1), tailPosition(0), erasedPosition(0), badCount(0), spareCount(0)
+{
+}
+
+bool SessionDirectory::readRecord(bd_addr_t recordAddress, session_record *record)
+{
+    if (bd->read(record, recordAddress, sizeof(*record)))
+    {
+        return false;
+    }
+    return record->magic == RECORD_MAGIC && record->crc == imuCrc32(record, offsetof(session_record, crc));
+}
+
+int SessionDirectory::mount(BlockDevice &device, bd_addr_t directoryAddress, bd_size_t directorySectorSize)
+{
+    bd = &device;
+    address = directoryAddress;
+    sectorSize = directorySectorSize;
+    sessionCount = 0;
+    nextId = 1;
+    tailPosition = 0;
+    erasedPosition = 0;
+    badCount = 0;
+    spareCount = 0;
+
+    // The sector with the newest valid header is in charge
+    int found = -1;
+    uint32_t bestGeneration = 0;
+    for (int sector = 0; sector < 2; sector++)
+    {
+        session_record header;
+        if (readRecord(address + sector * sectorSize, &header) && header.type == RECORD_HEADER &&
+            (found < 0 || header.id > bestGeneration))
+        {
+            found = sector;
+            bestGeneration = header.id;
+        }
+    }
+    if (found < 0)
+    {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    activeSector = found;
+    generation = bestGeneration;
+
+    session_record record;
+    readRecord(address + activeSector * sectorSize, &record);
+    tailPosition = record.end;
+    erasedPosition = record.start;
+
+    // Replay up to the first erased or torn record
+    writeOffset = sizeof(session_record);
+    while (writeOffset + sizeof(session_record) <= sectorSize &&
+        readRecord(address + activeSector * sectorSize + writeOffset, &record))
+    {
+        apply(record);
+        writeOffset += sizeof(session_record);
+    }
+
+    // A torn record still occupies its slot, skip past anything that isn't erased
+    while (writeOffset + sizeof(session_record) <= sectorSize)
+    {
+        uint32_t magic;
+        if (bd->read(&magic, address + activeSector * sectorSize + writeOffset, sizeof(magic)) || magic == 0xFFFFFFFF)
+        {
+            break;
+        }
+        writeOffset += sizeof(session_record);
+    }
+
+    return 0;
+}
+
+int SessionDirectory::format(bd_addr_t tail, bd_addr_t erased)
+{
+    int err = bd->erase(address, 2 * sectorSize);
+    if (err)
+    {
+        return err;
+    }
+
+    sessionCount = 0;
+    nextId = 1;
+    tailPosition = tail;
+    erasedPosition = erased;
+
+    // Both sectors were erased, count that in the generation
+    err = writeSector(0, generation + 2);
+    if (err)
+    {
+        return err;
+    }
+    activeSector = 0;
+    return 0;
+}
+
+void SessionDirectory::apply(const session_record &record)
+{
+    if (record.id >= nextId && record.type != RECORD_HEADER && record.type != RECORD_BAD_SECTOR)
+    {
+        nextId = record.id + 1;
+    }
+
+    session_info *session = const_cast<session_info *>(find(record.id));
+
+    switch (record.type)
+    {
+        case RECORD_START:
+        case RECORD_END:
+        {
+            if (!session)
+            {
+                if (sessionCount == MAX_SESSIONS)
+                {
+                    // Only happens if a drop record was lost, the oldest is the one that would have gone
+                    memmove(&sessions[0], &sessions[1], (MAX_SESSIONS - 1) * sizeof(session_info));
+                    sessionCount--;
+                }
+                session = &sessions[sessionCount++];
+            }
+
+            session->id = record.id;
+            session->tag = record.tag;
+            session->start = record.start;
+            session->end = record.type == RECORD_END ? record.end : record.start;
+            session->firstTimestamp = record.firstTimestamp;
+            session->lastTimestamp = record.lastTimestamp;
+            session->sampleCount = record.sampleCount;
+            memcpy(session->label, record.label, sizeof(session->label));
+            session->closed = record.type == RECORD_END;
+
+            bd_addr_t reached = record.type == RECORD_END ? record.end : record.start;
+            tailPosition = reached > tailPosition ? reached : tailPosition;
+            break;
+        }
+        case RECORD_BAD_SECTOR:
+        {
+            uint32_t index = 0;
+            while (index < badCount && badSectors[index].sector != record.id)
+            {
+                index++;
+            }
+            if (index == MAX_BAD_SECTORS)
+            {
+                break;
+            }
+            badCount = index == badCount ? badCount + 1 : badCount;
+            badSectors[index].sector = record.id;
+            badSectors[index].spare = record.tag;
+            spareCount = record.tag + 1 > spareCount ? record.tag + 1 : spareCount;
+            break;
+        }
+        case RECORD_DROP:
+        {
+            if (session)
+            {
+                uint32_t index = session - sessions;
+                memmove(&sessions[index], &sessions[index + 1], (sessionCount - index - 1) * sizeof(session_info));
+                sessionCount--;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+const session_info *SessionDirectory::find(uint32_t id) const
+{
+    for (uint32_t i = 0; i < sessionCount; i++)
+    {
+        if (sessions[i].id == id)
+        {
+            return &sessions[i];
+        }
+    }
+    return nullptr;
+}
+
+void SessionDirectory::toRecord(const session_info &session, RecordType type, session_record *record)
+{
+    memset(record, 0, sizeof(*record));
+    record->type = type;
+    record->id = session.id;
+    record->tag = session.tag;
+    record->start = session.start;
+    record->end = session.end;
+    record->firstTimestamp = session.firstTimestamp;
+    record->lastTimestamp = session.lastTimestamp;
+    record->sampleCount = session.sampleCount;
+    memcpy(record->label, session.label, sizeof(record->label));
+}
+
+int SessionDirectory::program(session_record &record, bd_addr_t recordAddress)
+{
+    record.magic = RECORD_MAGIC;
+    record.crc = imuCrc32(&record, offsetof(session_record, crc));
+
+    int err = bd->program(&record, recordAddress, sizeof(record));
+    if (err)
+    {
+        return err;
+    }
+    return bd->sync();
+}
+
+int SessionDirectory::append(session_record &record)
+{
+    if (writeOffset + sizeof(session_record) > sectorSize)
+    {
+        int err = compact();
+        if (err)
+        {
+            return err;
+        }
+    }
+
+    int err = program(record, address + activeSector * sectorSize + writeOffset);
+    writeOffset += sizeof(session_record);
+    if (err)
+    {
+        return err;
+    }
+
+    apply(record);
+    return 0;
+}
+
+int SessionDirectory::compact()
+{
+    int other = 1 - activeSector;
+
+    int err = bd->erase(address + other * sectorSize, sectorSize);
+    if (err)
+    {
+        return err;
+    }
+
+    err = writeSector(other, generation + 1);
+    if (err)
+    {
+        return err;
+    }
+    activeSector = other;
+    return 0;
+}
+
+int SessionDirectory::writeSector(int sector, uint32_t newGeneration)
+{
+    bd_addr_t sectorAddress = address + sector * sectorSize;
+    bd_addr_t offset = sizeof(session_record);
+
+    for (uint32_t i = 0; i < badCount; i++)
+    {
+        session_record record = {};
+        record.type = RECORD_BAD_SECTOR;
+        record.id = badSectors[i].sector;
+        record.tag = badSectors[i].spare;
+        int err = program(record, sectorAddress + offset);
+        if (err)
+        {
+            return err;
+        }
+        offset += sizeof(session_record);
+    }
+
+    // Closed sessions need only their END record, open ones their START
+    for (uint32_t i = 0; i < sessionCount; i++)
+    {
+        session_record record;
+        toRecord(sessions[i], sessions[i].closed ? RECORD_END : RECORD_START, &record);
+        int err = program(record, sectorAddress + offset);
+        if (err)
+        {
+            return err;
+        }
+        offset += sizeof(session_record);
+    }
+
+    // Header last, until it's there the old sector stays in charge
+    session_record header = {};
+    header.type = RECORD_HEADER;
+    header.id = newGeneration;
+    header.start = erasedPosition;
+    header.end = tailPosition;
+    int err = program(header, sectorAddress);
+    if (err)
+    {
+        return err;
+    }
+
+    generation = newGeneration;
+    writeOffset = offset;
+    return 0;
+}
+
+int SessionDirectory::begin(bd_addr_t start, uint32_t tag, const char *label, session_info *session)
+{
+    if (sessionCount == MAX_SESSIONS)
+    {
+        int err = drop(sessions[0].id);
+        if (err)
+        {
+            return err;
+        }
+    }
+
+    memset(session, 0, sizeof(*session));
+    session->id = nextId;
+    session->tag = tag;
+    session->start = start;
+    session->end = start;
+    if (label)
+    {
+        // Full 16 characters are kept without a terminator, the rest of the field stays zero
+        memcpy(session->label, label, strnlen(label, sizeof(session->label)));
+    }
+
+    session_record record;
+    toRecord(*session, RECORD_START, &record);
+    return append(record);
+}
+
+int SessionDirectory::end(const session_info &session)
+{
+    session_record record;
+    toRecord(session, RECORD_END, &record);
+    return append(record);
+}
+
+int SessionDirectory::drop(uint32_t id)
+{
+    const session_info *session = find(id);
+    if (!session)
+    {
+        return 0;
+    }
+
+    session_record record;
+    toRecord(*session, RECORD_DROP, &record);
+    return append(record);
+}
+
+int SessionDirectory::addBadSector(uint32_t sector, uint32_t spare)
+{
+    session_record record = {};
+    record.type = RECORD_BAD_SECTOR;
+    record.id = sector;
+    record.tag = spare;
+    return append(record);
+}
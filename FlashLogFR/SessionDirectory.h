@@ -0,0 +1,169 @@
+/**
+ * @file SessionDirectory.h
+ * @brief Journal of recording sessions kept in two reserved flash sectors
+ *
+ * Every change (session started, session ended, session dropped) is appended as a fixed size record, so updating
+ * the directory never needs an erase. When the active sector fills up, the live sessions are rewritten into the
+ * other sector, then its header is programmed last with a higher generation, so a power loss during compaction
+ * leaves the old sector in charge.
+ *
+ * Session addresses are positions in the log ring (see FlashLogFR), they only ever grow.
+ *
+ * The directory also keeps the bad sector table: ring sectors that failed to erase or program and the spare sector
+ * standing in for each of them.
+ */
+
+#ifndef FLASHLOGFR_SESSION_DIRECTORY_H
+#define FLASHLOGFR_SESSION_DIRECTORY_H
+
+#include "mbed.h"
+#include "blockdevice/BlockDevice.h"
+
+/**
+ * @brief One recording session
+ */
+struct session_info {
+    uint32_t id;
+    uint32_t tag;                   // free for the application, e.g. flight number
+    bd_addr_t start;                // ring position of the first byte
+    bd_addr_t end;                  // ring position after the last byte, valid once closed
+    uint32_t firstTimestamp;
+    uint32_t lastTimestamp;
+    uint32_t sampleCount;
+    char label[16];                 // free for the application, not necessarily null terminated
+    bool closed;                    // false while recording, or if the recording was cut by a reset
+};
+
+/**
+ * @brief Ring sector replaced by a spare
+ */
+struct bad_sector {
+    uint32_t sector;                // ring sector index
+    uint32_t spare;                 // spare sector index
+};
+
+class SessionDirectory
+{
+    public:
+        /** Sessions kept, starting a new one beyond this drops the oldest */
+        static constexpr uint32_t MAX_SESSIONS = 16;
+
+        /** Bad sectors that can be remembered, also the most spares that can be used */
+        static constexpr uint32_t MAX_BAD_SECTORS = 32;
+
+        SessionDirectory();
+
+        /**
+         * @brief Load the directory from the two sectors at address
+         *
+         * @return 0 on success, BD_ERROR_DEVICE_ERROR if neither sector holds a directory (call format()),
+         * block device error otherwise
+         */
+        int mount(BlockDevice &bd, bd_addr_t address, bd_size_t sectorSize);
+
+        /**
+         * @brief Erase both sectors and start a directory without sessions, the bad sector table is kept
+         *
+         * @param tail where the next session starts
+         * @param erased ring position up to which the flash is known to be erased, see erased()
+         */
+        int format(bd_addr_t tail = 0, bd_addr_t erased = 0);
+
+        /**
+         * @brief Record the start of a session at ring position start, drops the oldest session if full
+         */
+        int begin(bd_addr_t start, uint32_t tag, const char *label, session_info *session);
+
+        /** Record the end of a session, session.end and the counters have to be filled in */
+        int end(const session_info &session);
+
+        /** Record that a session's data was overwritten */
+        int drop(uint32_t id);
+
+        /** Sessions oldest first */
+        uint32_t count() const { return sessionCount; }
+        const session_info &get(uint32_t index) const { return sessions[index]; }
+
+        /** @return the session with this id, nullptr if there is none */
+        const session_info *find(uint32_t id) const;
+
+        /** Ring position after the newest data ever recorded, where the next session starts */
+        bd_addr_t tail() const { return tailPosition; }
+
+        /** Ring position up to which the flash was erased when the directory was formatted, e.g. by a full wipe */
+        bd_addr_t erased() const { return erasedPosition; }
+
+        /** Directory sectors erased so far, both together */
+        uint32_t eraseCount() const { return generation; }
+
+        /** Record that ring sector is replaced by spare, replaces an earlier entry for the same sector */
+        int addBadSector(uint32_t sector, uint32_t spare);
+
+        uint32_t badSectorCount() const { return badCount; }
+        const bad_sector &getBadSector(uint32_t index) const { return badSectors[index]; }
+
+        /** Spares handed out so far, including ones that went bad themselves */
+        uint32_t sparesUsed() const { return spareCount; }
+
+    private:
+        enum RecordType : uint16_t {
+            RECORD_HEADER = 1,          // first record of a sector, id holds the generation, end the tail
+            RECORD_START = 2,
+            RECORD_END = 3,
+            RECORD_DROP = 4,
+            RECORD_BAD_SECTOR = 5       // id holds the ring sector, tag the spare
+        };
+
+        /** On-flash layout of a directory record */
+        struct session_record {
+            uint32_t magic;
+            uint16_t type;
+            uint16_t reserved;
+            uint32_t id;
+            uint32_t tag;
+            uint64_t start;
+            uint64_t end;
+            uint32_t firstTimestamp;
+            uint32_t lastTimestamp;
+            uint32_t sampleCount;
+            char label[16];
+            uint32_t crc;               // CRC-32 of the fields above
+        };
+
+        static_assert(sizeof(session_record) == 64, "session_record layout changed, bump the format");
+
+        static constexpr uint32_t RECORD_MAGIC = 0x53534553;   // "SESS"
+
+        bool readRecord(bd_addr_t address, session_record *record);
+        void apply(const session_record &record);
+        int append(session_record &record);
+        int program(session_record &record, bd_addr_t address);
+
+        // Rewrite the live sessions into the other sector
+        int compact();
+
+        // Program the bad sectors, the live sessions and then the header into an erased sector
+        int writeSector(int sector, uint32_t newGeneration);
+
+        static void toRecord(const session_info &session, RecordType type, session_record *record);
+
+        BlockDevice *bd;
+        bd_addr_t address;
+        bd_size_t sectorSize;
+
+        int activeSector;
+        uint32_t generation;
+        bd_addr_t writeOffset;          // next free record within the active sector
+
+        session_info sessions[MAX_SESSIONS];
+        uint32_t sessionCount;
+        uint32_t nextId;
+        bd_addr_t tailPosition;
+        bd_addr_t erasedPosition;
+
+        bad_sector badSectors[MAX_BAD_SECTORS];
+        uint32_t badCount;
+        uint32_t spareCount;
+};
+
+#endif // FLASHLOGFR_SESSION_DIRECTORY_H
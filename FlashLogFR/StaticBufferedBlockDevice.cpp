@@ -0,0 +1,214 @@
+/**
+ * @file StaticBufferedBlockDevice.cpp
+ * @brief BufferedBlockDevice with its buffers sized at compile time
+ */
+
+#include "StaticBufferedBlockDevice.h"
+#include <cinttypes>
+
+StaticBufferedBlockDevice::StaticBufferedBlockDevice(BlockDevice *bd) :
+    bd(bd), programSize(0), readSize(0), cacheAddr(0), cacheValid(false)
+{
+}
+
+int StaticBufferedBlockDevice::init()
+{
+    int err = bd->init();
+    if (err)
+    {
+        return err;
+    }
+
+    programSize = bd->get_program_size();
+    readSize = bd->get_read_size();
+    if (programSize > MAX_PROGRAM_SIZE || readSize > MAX_READ_SIZE || programSize % readSize)
+    {
+        printf("[StaticBufferedBlockDevice] Device pages too large: program %" PRIu32 ", read %" PRIu32 "\n",
+            static_cast<uint32_t>(programSize), static_cast<uint32_t>(readSize));
+        bd->deinit();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    cacheValid = false;
+    return BD_ERROR_OK;
+}
+
+int StaticBufferedBlockDevice::deinit()
+{
+    int err = flush();
+    int deinitErr = bd->deinit();
+    return err ? err : deinitErr;
+}
+
+int StaticBufferedBlockDevice::sync()
+{
+    int err = flush();
+    return err ? err : bd->sync();
+}
+
+int StaticBufferedBlockDevice::read(void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    uint8_t *bytes = static_cast<uint8_t *>(buffer);
+    bd_addr_t start = addr;
+    bd_size_t remaining = size;
+
+    while (remaining > 0)
+    {
+        bd_size_t offset = addr % readSize;
+        if (offset == 0 && remaining >= readSize)
+        {
+            // Whole read units straight into the caller's buffer
+            bd_size_t piece = remaining - remaining % readSize;
+            int err = bd->read(bytes, addr, piece);
+            if (err)
+            {
+                return err;
+            }
+            bytes += piece;
+            addr += piece;
+            remaining -= piece;
+        }
+        else
+        {
+            bd_size_t piece = readSize - offset < remaining ? readSize - offset : remaining;
+            int err = bd->read(readBuffer, addr - offset, readSize);
+            if (err)
+            {
+                return err;
+            }
+            memcpy(bytes, readBuffer + offset, piece);
+            bytes += piece;
+            addr += piece;
+            remaining -= piece;
+        }
+    }
+
+    // What hasn't been programmed yet comes from the cache
+    if (cacheValid && cacheAddr < start + size && start < cacheAddr + programSize)
+    {
+        bd_addr_t from = cacheAddr > start ? cacheAddr : start;
+        bd_addr_t to = cacheAddr + programSize < start + size ? cacheAddr + programSize : start + size;
+        memcpy(static_cast<uint8_t *>(buffer) + (from - start), writeCache + (from - cacheAddr), to - from);
+    }
+
+    return BD_ERROR_OK;
+}
+
+int StaticBufferedBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(buffer);
+
+    while (size > 0)
+    {
+        bd_addr_t page = addr - addr % programSize;
+        bd_size_t offset = addr - page;
+
+        if (offset == 0 && size >= programSize && !(cacheValid && cacheAddr == page))
+        {
+            // Whole pages go out directly
+            bd_size_t piece = size - size % programSize;
+            if (cacheValid && cacheAddr >= addr && cacheAddr < addr + piece)
+            {
+                // Overwritten before it was programmed
+                cacheValid = false;
+            }
+            int err = bd->program(bytes, addr, piece);
+            if (err)
+            {
+                return err;
+            }
+            bytes += piece;
+            addr += piece;
+            size -= piece;
+            continue;
+        }
+
+        if (!cacheValid || cacheAddr != page)
+        {
+            int err = flush();
+            if (err)
+            {
+                return err;
+            }
+            // Start from what the page holds, normally erased bytes, which program as no change
+            err = bd->read(writeCache, page, programSize);
+            if (err)
+            {
+                return err;
+            }
+            cacheAddr = page;
+            cacheValid = true;
+        }
+
+        bd_size_t piece = programSize - offset < size ? programSize - offset : size;
+        memcpy(writeCache + offset, bytes, piece);
+        bytes += piece;
+        addr += piece;
+        size -= piece;
+
+        if (offset + piece == programSize)
+        {
+            int err = flush();
+            if (err)
+            {
+                return err;
+            }
+        }
+    }
+
+    return BD_ERROR_OK;
+}
+
+int StaticBufferedBlockDevice::erase(bd_addr_t addr, bd_size_t size)
+{
+    if (cacheValid && cacheAddr >= addr && cacheAddr < addr + size)
+    {
+        cacheValid = false;
+    }
+    return bd->erase(addr, size);
+}
+
+int StaticBufferedBlockDevice::flush()
+{
+    if (!cacheValid)
+    {
+        return BD_ERROR_OK;
+    }
+    cacheValid = false;
+    return bd->program(writeCache, cacheAddr, programSize);
+}
+
+bd_size_t StaticBufferedBlockDevice::get_read_size() const
+{
+    return 1;
+}
+
+bd_size_t StaticBufferedBlockDevice::get_program_size() const
+{
+    return 1;
+}
+
+bd_size_t StaticBufferedBlockDevice::get_erase_size() const
+{
+    return bd->get_erase_size();
+}
+
+bd_size_t StaticBufferedBlockDevice::get_erase_size(bd_addr_t addr) const
+{
+    return bd->get_erase_size(addr);
+}
+
+int StaticBufferedBlockDevice::get_erase_value() const
+{
+    return bd->get_erase_value();
+}
+
+bd_size_t StaticBufferedBlockDevice::size() const
+{
+    return bd->size();
+}
+
+const char *StaticBufferedBlockDevice::get_type() const
+{
+    return "STATIC_BUFFERED";
+}
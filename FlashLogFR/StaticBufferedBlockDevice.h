@@ -0,0 +1,60 @@
+/**
+ * @file StaticBufferedBlockDevice.h
+ * @brief BufferedBlockDevice with its buffers sized at compile time, for builds without a heap on the log path
+ *
+ * Mbed's BufferedBlockDevice allocates its write cache and read buffer with new[] in init(), sized by the device
+ * underneath. This one has the same interface and behaviour (read and program size of 1, partial pages collected
+ * in RAM and programmed when the page is complete, on sync() or when a write moves on to another page) with both
+ * buffers held in the object, so it can live in static memory with the rest of FlashLogFR. init() fails on a device
+ * with pages larger than MAX_PROGRAM_SIZE or reads larger than MAX_READ_SIZE.
+ *
+ * Used by FlashLogFR when "app.static_alloc" is set.
+ */
+
+#ifndef FLASHLOGFR_STATIC_BUFFERED_BLOCK_DEVICE_H
+#define FLASHLOGFR_STATIC_BUFFERED_BLOCK_DEVICE_H
+
+#include "mbed.h"
+#include "blockdevice/BlockDevice.h"
+
+class StaticBufferedBlockDevice : public BlockDevice
+{
+    public:
+        /** Largest program and read size of the device underneath, a NOR page */
+        static constexpr bd_size_t MAX_PROGRAM_SIZE = 256;
+        static constexpr bd_size_t MAX_READ_SIZE = 256;
+
+        explicit StaticBufferedBlockDevice(BlockDevice *bd);
+
+        int init() override;
+        int deinit() override;
+        int sync() override;
+        int read(void *buffer, bd_addr_t addr, bd_size_t size) override;
+        int program(const void *buffer, bd_addr_t addr, bd_size_t size) override;
+        int erase(bd_addr_t addr, bd_size_t size) override;
+
+        bd_size_t get_read_size() const override;
+        bd_size_t get_program_size() const override;
+        bd_size_t get_erase_size() const override;
+        bd_size_t get_erase_size(bd_addr_t addr) const override;
+        int get_erase_value() const override;
+        bd_size_t size() const override;
+        const char *get_type() const override;
+
+    private:
+        // Program the cached page if there is one
+        int flush();
+
+        BlockDevice *bd;
+        bd_size_t programSize;
+        bd_size_t readSize;
+
+        // Page being filled, cacheAddr is page aligned
+        bd_addr_t cacheAddr;
+        bool cacheValid;
+
+        alignas(8) uint8_t writeCache[MAX_PROGRAM_SIZE];
+        alignas(8) uint8_t readBuffer[MAX_READ_SIZE];
+};
+
+#endif // FLASHLOGFR_STATIC_BUFFERED_BLOCK_DEVICE_H
@@ -1,8 +1,502 @@
+/**
+ * @file test_FlashLogFR.cpp
+ * @brief Tests of the flash log: session recovery after a reset, commits, bad sectors, the calibration sector
+ *
+ * Runs every test in turn, or on the host build the ones named as arguments (test_FlashLogFR reset). Each test
+ * records its own sessions after whatever is already in the log, so they can run in any order, but they do write
+ * to the flash: on the board, run it on a log that can be lost. Tests that need the flash to fail inject the
+ * faults into the flash model (host/sim/SimFlashBlockDevice) and only exist on the host build.
+ *
+ * Output follows test_BMI323: RESULT,<test>,PASS|FAIL for each test and SUMMARY,pass=<n>,fail=<n> at the end,
+ * INFO lines say what a failing test was checking. The exit code is 1 if a test failed.
+ */
+
 #include "FlashLogFR.h"
+#include "BMI323Calibration.h"
+#include "PinNames.h"
 #include <cinttypes>
 
+namespace
+{
+    struct TestCase
+    {
+        const char *name;
+        bool (*run)(FlashLogFR &log);
+    };
+
+    // 800 Hz, timestamps in us
+    constexpr uint32_t SAMPLE_PERIOD_US = 1250;
+
+    uint32_t passCount = 0;
+    uint32_t failCount = 0;
+
+    bool expect(const char *test, bool condition, const char *what)
+    {
+        if (!condition)
+        {
+            printf("RESULT,%s,INFO,failed=%s\n", test, what);
+        }
+        return condition;
+    }
+
+    // The last session in the directory, after a reset
+    bool lastSession(FlashLogFR &log, session_info *info)
+    {
+        uint32_t count = log.getSessionCount();
+        return count > 0 && log.getSession(count - 1, info) == FlashLogFR::FL_SUCCESS;
+    }
+
+    // Counts the event records of a session and checks they carry value 0, 1, 2...
+    struct EventCounter
+    {
+        uint32_t events = 0;
+        bool inOrder = true;
+
+        void operator()(const log_event_record &event)
+        {
+            inOrder = inOrder && event.value == events;
+            events++;
+        }
+
+        template <typename Record>
+        void operator()(const Record &)
+        {
+        }
+    };
+
+    bool countEvents(FlashLogFR &log, const session_info &session, EventCounter *counter)
+    {
+        static uint8_t data[16 * IMU_BLOCK_SIZE];
+        bd_size_t size = session.end - session.start;
+        if (size > sizeof(data) || log.openSession(session.id) != FlashLogFR::FL_SUCCESS ||
+            log.readData(data, session.start, size) != FlashLogFR::FL_SUCCESS)
+        {
+            return false;
+        }
+        size_t errors = 0;
+        LogRecordSchema::parse(data, size, *counter, &errors);
+        return errors == 0;
+    }
+
+    bool writeEvents(FlashLogFR &log, uint32_t count)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            log_event_record event = {};
+            event.timestamp = i;
+            event.value = i;
+            if (log.writeRecord(event) != FlashLogFR::FL_SUCCESS)
+            {
+                return false;
+            }
+        }
+        return log.flushRecords() == FlashLogFR::FL_SUCCESS;
+    }
+
+    bool writeSamples(FlashLogFR &log, uint32_t first, uint32_t count, int paceUs = 0)
+    {
+        int16_t sample[IMU_CHANNELS] = {0, 0, 2048, 0, 0, 0};
+        for (uint32_t i = first; i < first + count; i++)
+        {
+            sample[3] = static_cast<int16_t>(i % 64);
+            if (log.writeIMUSample(sample, i * SAMPLE_PERIOD_US) != FlashLogFR::FL_SUCCESS)
+            {
+                return false;
+            }
+            if (paceUs)
+            {
+                wait_us(paceUs);
+            }
+        }
+        return true;
+    }
+
+    // Current end of the session being recorded
+    bd_addr_t recordingEnd(FlashLogFR &log)
+    {
+        session_info session;
+        return lastSession(log, &session) ? session.end : 0;
+    }
+
+    // Decodes every IMU block of a session and checks the samples are the ones writeSamples() wrote from 0 on
+    bool readSamples(FlashLogFR &log, const session_info &session, uint32_t *count)
+    {
+        static int16_t samples[IMU_BLOCK_SIZE][IMU_CHANNELS];
+        uint8_t block[IMU_BLOCK_SIZE];
+        *count = 0;
+        if (log.openSession(session.id) != FlashLogFR::FL_SUCCESS)
+        {
+            return false;
+        }
+
+        uint32_t blocks = (session.end - session.start) / IMU_BLOCK_SIZE;
+        for (uint32_t i = 0; i < blocks; i++)
+        {
+            if (log.readIMUBlock(i, block) != FlashLogFR::FL_SUCCESS)
+            {
+                return false;
+            }
+            uint32_t magic;
+            memcpy(&magic, block, sizeof(magic));
+            if (magic == LOG_SUMMARY_MAGIC)
+            {
+                continue;
+            }
+
+            imu_block_header header;
+            int decoded = IMUBlockDecoder::decode(block, sizeof(block), samples, IMU_BLOCK_SIZE, &header);
+            if (decoded <= 0 || header.firstTimestamp != *count * SAMPLE_PERIOD_US)
+            {
+                return false;
+            }
+            for (int n = 0; n < decoded; n++)
+            {
+                if (samples[n][3] != static_cast<int16_t>((*count + n) % 64))
+                {
+                    return false;
+                }
+            }
+            *count += decoded;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Records that were flushed survive a reset: a session of only records, and one where records follow
+     * the IMU blocks, are both recovered with every record
+     */
+    bool testReset(FlashLogFR &log)
+    {
+        const uint32_t EVENTS = 20;
+        const uint32_t SAMPLES = 1000;
+        bool pass = true;
+
+        uint32_t sessionsBefore = log.getSessionCount();
+        pass &= expect("reset", log.startSession(1, "records") == FlashLogFR::FL_SUCCESS, "start");
+        pass &= expect("reset", writeEvents(log, EVENTS), "write");
+        pass &= expect("reset", log.init() == FlashLogFR::FL_SUCCESS, "init");
+
+        session_info session;
+        EventCounter records;
+        pass &= expect("reset", log.getSessionCount() == sessionsBefore + 1 && lastSession(log, &session) &&
+            session.closed, "records session kept");
+        pass &= expect("reset", countEvents(log, session, &records) && records.events == EVENTS && records.inOrder,
+            "records read back");
+
+        pass &= expect("reset", log.startSession(2, "mixed") == FlashLogFR::FL_SUCCESS, "start");
+        pass &= expect("reset", writeSamples(log, 0, SAMPLES), "write samples");
+        pass &= expect("reset", writeEvents(log, 1), "write after samples");
+        pass &= expect("reset", log.init() == FlashLogFR::FL_SUCCESS, "init");
+
+        EventCounter mixed;
+        pass &= expect("reset", lastSession(log, &session) && session.closed && session.sampleCount == SAMPLES,
+            "mixed session samples");
+        pass &= expect("reset", countEvents(log, session, &mixed) && mixed.events == 1, "record after samples");
+
+        printf("RESULT,reset,INFO,records=%" PRIu32 ",mixed_samples=%" PRIu32 ",mixed_records=%" PRIu32 "\n",
+            records.events, session.sampleCount, mixed.events);
+        return pass;
+    }
+
+    /**
+     * @brief A reset loses only what came after the last commit: samples written past an explicit commit are
+     * dropped and the session ends on the committed stamp, and at 800 Hz with the default interval at most 50 ms
+     * of samples are lost
+     */
+    bool testCommit(FlashLogFR &log)
+    {
+        const uint32_t COMMITTED = 1000;
+        const uint32_t PAST_COMMIT = 5;
+        const uint32_t PACED = 400;
+        bool pass = true;
+
+        // Only explicit commits, the samples after the last one stay in the open block
+        log.setCommitInterval(std::chrono::microseconds(0));
+        pass &= expect("commit", log.startSession(3, "commit") == FlashLogFR::FL_SUCCESS, "start");
+        pass &= expect("commit", writeSamples(log, 0, COMMITTED), "write");
+        pass &= expect("commit", log.commitIMU() == FlashLogFR::FL_SUCCESS, "commit");
+        pass &= expect("commit", writeSamples(log, COMMITTED, PAST_COMMIT), "write past commit");
+        pass &= expect("commit", log.init() == FlashLogFR::FL_SUCCESS, "init");
+
+        session_info session;
+        pass &= expect("commit", lastSession(log, &session) && session.closed, "session recovered");
+        pass &= expect("commit", session.sampleCount == COMMITTED, "sample count at the stamp");
+        pass &= expect("commit", session.firstTimestamp == 0 &&
+            session.lastTimestamp == (COMMITTED - 1) * SAMPLE_PERIOD_US, "last timestamp at the stamp");
+        printf("RESULT,commit,INFO,written=%" PRIu32 ",recovered=%" PRIu32 ",last_us=%" PRIu32 "\n",
+            COMMITTED + PAST_COMMIT, session.sampleCount, session.lastTimestamp);
+
+        // init() went back to the default interval, samples come in at the sensor rate
+        pass &= expect("commit", log.startSession(4, "paced") == FlashLogFR::FL_SUCCESS, "start");
+        pass &= expect("commit", writeSamples(log, 0, PACED, SAMPLE_PERIOD_US), "write paced");
+        pass &= expect("commit", log.init() == FlashLogFR::FL_SUCCESS, "init");
+
+        uint32_t lastWritten = (PACED - 1) * SAMPLE_PERIOD_US;
+        pass &= expect("commit", lastSession(log, &session) && session.closed, "paced session recovered");
+        pass &= expect("commit", session.sampleCount > 0 &&
+            session.lastTimestamp == (session.sampleCount - 1) * SAMPLE_PERIOD_US, "paced count and stamp agree");
+        pass &= expect("commit", lastWritten - session.lastTimestamp <= 50000, "at most 50 ms lost");
+        printf("RESULT,commit,INFO,paced_written=%" PRIu32 ",paced_recovered=%" PRIu32 ",lost_us=%" PRIu32 "\n",
+            PACED, session.sampleCount, lastWritten - session.lastTimestamp);
+        return pass;
+    }
+
+    /**
+     * @brief A calibration saved to the calibration sector survives wiping the log, recording over it and a
+     * remount, and no log position maps onto the sector
+     */
+    bool testCalibration(FlashLogFR &log)
+    {
+        const bd_addr_t address = log.getCalibrationAddr();
+        const bd_size_t SECTOR = log.getBlockDevice().get_erase_size(address);
+        bool pass = true;
+
+        BMI323Base::dp_calibration cal = {{120, -340, 56}, {7, -9, 3}, {-45, 60, -12}, {5, -2, 1}};
+        pass &= expect("calibration", BMI323Calibration::save(cal, log.getBlockDevice(), address) == 0, "save");
+
+        log.wipeLog();
+        pass &= expect("calibration", log.startSession(6, "cal") == FlashLogFR::FL_SUCCESS, "start");
+        session_info session;
+        pass &= expect("calibration", lastSession(log, &session), "session");
+        uint32_t written = 0;
+        while (pass && recordingEnd(log) < session.start + 4 * SECTOR)
+        {
+            pass &= writeSamples(log, written, 100);
+            written += 100;
+        }
+        pass &= expect("calibration", log.endSession() == FlashLogFR::FL_SUCCESS, "end");
+        pass &= expect("calibration", log.init() == FlashLogFR::FL_SUCCESS, "init");
+
+        for (bd_addr_t position = session.start; position < session.start + 4 * SECTOR; position += SECTOR)
+        {
+            bd_addr_t flashAddr = log.getFlashAddr(position);
+            pass &= expect("calibration", flashAddr + SECTOR <= address || flashAddr >= address + SECTOR,
+                "ring clear of the calibration sector");
+        }
+
+        BMI323Base::dp_calibration loaded = {};
+        pass &= expect("calibration", BMI323Calibration::load(&loaded, log.getBlockDevice(), address) &&
+            memcmp(&loaded, &cal, sizeof(cal)) == 0, "calibration kept");
+        printf("RESULT,calibration,INFO,addr=%lu,samples=%" PRIu32 "\n", static_cast<unsigned long>(address),
+            written);
+        return pass;
+    }
+
+#ifdef BMI323_HOST_BUILD
+    // Fail erases and programs of the flash sector holding a log position, error 0 heals it
+    void failSector(FlashLogFR &log, bd_addr_t position, int error)
+    {
+        bd_addr_t flashAddr = log.getFlashAddr(position);
+        bd_size_t chip0Size = log.getChip(0).size();
+        if (flashAddr < chip0Size)
+        {
+            log.getChip(0).failSector(flashAddr, error);
+        }
+        else
+        {
+            log.getChip(1).failSector(flashAddr - chip0Size, error);
+        }
+    }
+
+    // Makes only the programs overlapping [position, position + size) fail, 0 heals it
+    void failProgram(FlashLogFR &log, bd_addr_t position, bd_size_t size, int error)
+    {
+        bd_addr_t flashAddr = log.getFlashAddr(position);
+        bd_size_t chip0Size = log.getChip(0).size();
+        if (flashAddr < chip0Size)
+        {
+            log.getChip(0).failProgram(flashAddr, size, error);
+        }
+        else
+        {
+            log.getChip(1).failProgram(flashAddr - chip0Size, size, error);
+        }
+    }
+
+    /**
+     * @brief Start a block of its own in the next sector, commit it in parts, then fail the program into faultOffset
+     * of it that the next write() makes. Whatever the block held before the fault has to be in the spare afterwards.
+     */
+    template <typename Write>
+    bool failInBlock(FlashLogFR &log, uint32_t *written, size_t faultOffset, bd_size_t faultSize, Write write)
+    {
+        const bd_size_t SECTOR = log.getChip(0).get_erase_size();
+        bool pass = true;
+        for (bd_addr_t sector = recordingEnd(log) / SECTOR; pass && recordingEnd(log) / SECTOR == sector; )
+        {
+            pass &= writeSamples(log, *written, 10);
+            *written += 10;
+        }
+        pass &= expect("badsector", log.flushIMU() == FlashLogFR::FL_SUCCESS, "flush before block");
+        bd_addr_t blockAddr = recordingEnd(log);
+        for (int commit = 0; commit < 2 && pass; commit++)
+        {
+            pass &= writeSamples(log, *written, 10) && log.commitIMU() == FlashLogFR::FL_SUCCESS;
+            *written += 10;
+        }
+
+        uint8_t before[IMU_BLOCK_SIZE];
+        uint8_t after[IMU_BLOCK_SIZE];
+        pass &= expect("badsector", log.readData(before, blockAddr, sizeof(before)) == FlashLogFR::FL_SUCCESS,
+            "read block");
+        failProgram(log, blockAddr + faultOffset, faultSize, SPIF_BD_ERROR_READY_FAILED);
+        pass &= expect("badsector", write(), "write over the fault");
+        failProgram(log, blockAddr + faultOffset, faultSize, 0);
+
+        pass &= expect("badsector", log.readData(after, blockAddr, sizeof(after)) == FlashLogFR::FL_SUCCESS,
+            "read block from the spare");
+        for (size_t i = 0; i < sizeof(before) && pass; i++)
+        {
+            pass &= expect("badsector", before[i] == 0xFF || after[i] == before[i], "block kept in the spare");
+        }
+        return pass;
+    }
+
+    /**
+     * @brief A ring sector that times out is replaced by a spare: once while a block is programmed into it, where
+     * what it already held moves to the spare, and once while it is erased ahead of the write point. Then on the
+     * writes into a block that go below ones already made: the seal of the header, and a commit stamp under the
+     * first one. Every sample reads back and the wear stats count all four.
+     */
+    bool testBadSector(FlashLogFR &log)
+    {
+        const bd_size_t SECTOR = log.getChip(0).get_erase_size();
+        const uint32_t SAMPLES_AFTER = 2000;
+        bool pass = true;
+
+        flash_wear_stats before;
+        pass &= expect("badsector", log.getWearStats(&before) == FlashLogFR::FL_SUCCESS, "wear stats");
+        pass &= expect("badsector", log.startSession(5, "bad") == FlashLogFR::FL_SUCCESS, "start");
+
+        // Into the middle of a sector, so the next block is programmed into one that already holds data
+        uint32_t written = 0;
+        bd_addr_t start = recordingEnd(log);
+        while (pass && (recordingEnd(log) - start < SECTOR / 4 || recordingEnd(log) % SECTOR < SECTOR / 4 ||
+            recordingEnd(log) % SECTOR > SECTOR / 2))
+        {
+            pass &= writeSamples(log, written, 1);
+            written++;
+        }
+        bd_addr_t programFault = recordingEnd(log);
+        failSector(log, programFault, SPIF_BD_ERROR_READY_FAILED);
+        pass &= expect("badsector", writeSamples(log, written, SAMPLES_AFTER), "write over program fault");
+        written += SAMPLES_AFTER;
+        failSector(log, programFault, 0);
+
+        flash_wear_stats afterProgram;
+        log.getWearStats(&afterProgram);
+        pass &= expect("badsector", afterProgram.badSectors == before.badSectors + 1 &&
+            afterProgram.sparesLeft == before.sparesLeft - 1, "program fault counted");
+
+        // A sector the erase point hasn't reached yet
+        bd_addr_t eraseFault = (recordingEnd(log) / SECTOR + 3) * SECTOR;
+        failSector(log, eraseFault, SPIF_BD_ERROR_READY_FAILED);
+        while (pass && recordingEnd(log) < eraseFault + SECTOR)
+        {
+            pass &= writeSamples(log, written, 100);
+            written += 100;
+        }
+        failSector(log, eraseFault, 0);
+
+        flash_wear_stats afterErase;
+        log.getWearStats(&afterErase);
+        pass &= expect("badsector", afterErase.badSectors == before.badSectors + 2 &&
+            afterErase.sparesLeft == before.sparesLeft - 2, "erase fault counted");
+
+        // Only explicit commits, so the stamps land in known slots
+        log.setCommitInterval(std::chrono::microseconds(0));
+        pass &= failInBlock(log, &written, 0, 1, [&]() {
+            // The final stamp goes in, then the seal over the header fails
+            bool ok = writeSamples(log, written, 10) && log.flushIMU() == FlashLogFR::FL_SUCCESS;
+            written += 10;
+            return ok;
+        });
+        pass &= failInBlock(log, &written, IMU_BLOCK_SIZE - 3 * sizeof(imu_block_stamp), sizeof(imu_block_stamp),
+            [&]() {
+            // The payload goes in, then the third stamp below the first two fails
+            bool ok = writeSamples(log, written, 10) && log.commitIMU() == FlashLogFR::FL_SUCCESS;
+            written += 10;
+            return ok;
+        });
+        pass &= expect("badsector", log.endSession() == FlashLogFR::FL_SUCCESS, "end");
+
+        flash_wear_stats after;
+        log.getWearStats(&after);
+        pass &= expect("badsector", after.badSectors == before.badSectors + 4 &&
+            after.sparesLeft == before.sparesLeft - 4, "seal and stamp faults counted");
+
+        session_info session;
+        uint32_t readBack = 0;
+        pass &= expect("badsector", lastSession(log, &session) && readSamples(log, session, &readBack) &&
+            readBack == written, "samples read back through the spares");
+
+        printf("RESULT,badsector,INFO,written=%" PRIu32 ",read=%" PRIu32 ",bad_sectors=%" PRIu32
+            ",spares_left=%" PRIu32 "\n", written, readBack, after.badSectors, after.sparesLeft);
+        return pass;
+    }
+#endif
+
+    const TestCase TESTS[] = {
+        {"reset",       testReset},
+        {"commit",      testCommit},
+#ifdef BMI323_HOST_BUILD
+        {"badsector",   testBadSector},
+#endif
+        {"calibration", testCalibration},
+    };
+
+    void runTest(FlashLogFR &log, const TestCase &test)
+    {
+        bool pass = test.run(log);
+        printf("RESULT,%s,%s\n", test.name, pass ? "PASS" : "FAIL");
+        pass ? passCount++ : failCount++;
+    }
+}
+
+#ifdef BMI323_HOST_BUILD
+int main(int argc, char **argv)
+#else
 int main()
+#endif
 {
-    printf("Hello World\n");
-    return 0;
-}
\ No newline at end of file
+    static FlashLogFR log(INTEGRATOR_FLASH_MOSI, INTEGRATOR_FLASH_MISO, INTEGRATOR_FLASH_SCLK,
+        INTEGRATOR_FLASH0_CS1, INTEGRATOR_FLASH1_CS2, CONSOLE_RX, CONSOLE_TX);
+    if (log.init() != FlashLogFR::FL_SUCCESS)
+    {
+        printf("RESULT,init,FAIL\n");
+        return 1;
+    }
+
+#ifdef BMI323_HOST_BUILD
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            bool found = false;
+            for (const TestCase &test : TESTS)
+            {
+                if (strcmp(argv[i], test.name) == 0)
+                {
+                    runTest(log, test);
+                    found = true;
+                }
+            }
+            if (!found)
+            {
+                printf("RESULT,%s,FAIL,unknown test\n", argv[i]);
+                failCount++;
+            }
+        }
+    }
+    else
+#endif
+    {
+        for (const TestCase &test : TESTS)
+        {
+            runTest(log, test);
+        }
+    }
+
+    printf("SUMMARY,pass=%" PRIu32 ",fail=%" PRIu32 "\n", passCount, failCount);
+    return failCount ? 1 : 0;
+}
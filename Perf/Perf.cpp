@@ -0,0 +1,203 @@
+#include "Perf.h"
+#include <mbed.h>
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#ifdef BMI323_HOST_BUILD
+#include <chrono>
+#include <mutex>
+#endif
+
+namespace
+{
+    const char *const COUNTER_NAMES[PERF_COUNTER_COUNT] = {
+        "imu_spi_transfers", "imu_spi_bytes", "fifo_overflows", "imu_link_errors", "flash_spi_transfers",
+        "flash_spi_bytes", "flash_wip_polls", "flash_mutex_waits", "flash_background_erases", "log_sessions_dropped",
+        "log_records_dropped", "log_read_misses"
+    };
+
+    const char *const SPAN_NAMES[PERF_SPAN_COUNT] = {
+        "imu_read", "fifo_drain", "decimate", "spectrum", "flash_read", "flash_program", "flash_erase",
+        "flash_mutex_wait", "log_sample", "log_commit", "log_block"
+    };
+
+    std::atomic<uint32_t> counters[PERF_COUNTER_COUNT];
+
+    // Span totals and the trace ring, only touched with the lock held
+    perf_span_stats spanStats[PERF_SPAN_COUNT];
+    perf_trace_entry trace[PERF_TRACE_ENTRIES];
+    size_t traceNext;
+    size_t traceUsed;
+    uint32_t traceThreshold;
+
+#ifdef BMI323_HOST_BUILD
+    const auto perfEpoch = std::chrono::steady_clock::now();
+    std::mutex statsMutex;
+
+    class StatsLock
+    {
+        public:
+            StatsLock() { statsMutex.lock(); }
+            ~StatsLock() { statsMutex.unlock(); }
+    };
+#else
+    // A few dozen cycles with interrupts off, so spans can end in interrupt handlers too
+    class StatsLock
+    {
+        public:
+            StatsLock() { core_util_critical_section_enter(); }
+            ~StatsLock() { core_util_critical_section_exit(); }
+    };
+#endif
+}
+
+#ifdef BMI323_HOST_BUILD
+void perfInit()
+{
+}
+
+// Nanoseconds on the host
+uint32_t perfCycles()
+{
+    auto elapsed = std::chrono::steady_clock::now() - perfEpoch;
+    return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+float perfCyclesToUs(uint32_t cycles)
+{
+    return static_cast<float>(cycles) / 1000.0f;
+}
+#else
+void perfInit()
+{
+    // Same as the benchmarks, the Cortex-M7 also needs the DWT lock access register unlocked
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->LAR = 0xC5ACCE55;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+uint32_t perfCycles()
+{
+    return DWT->CYCCNT;
+}
+
+float perfCyclesToUs(uint32_t cycles)
+{
+    return static_cast<float>(cycles) / (static_cast<float>(SystemCoreClock) / 1.0e6f);
+}
+#endif
+
+void perfCount(PerfCounter counter, uint32_t amount)
+{
+    counters[counter].fetch_add(amount, std::memory_order_relaxed);
+}
+
+void perfSpanEnd(PerfSpanId span, uint32_t start, uint32_t arg)
+{
+    uint32_t end = perfCycles();
+    uint32_t cycles = end - start;
+
+    StatsLock lock;
+    perf_span_stats &stats = spanStats[span];
+    stats.count++;
+    stats.totalCycles += cycles;
+    stats.maxCycles = cycles > stats.maxCycles ? cycles : stats.maxCycles;
+
+    if (cycles >= traceThreshold)
+    {
+        perf_trace_entry &entry = trace[traceNext];
+        entry.start = start;
+        entry.cycles = cycles;
+        entry.span = static_cast<uint16_t>(span);
+        entry.arg = static_cast<uint16_t>(arg < 0xFFFF ? arg : 0xFFFF);
+        traceNext = (traceNext + 1) % PERF_TRACE_ENTRIES;
+        traceUsed = traceUsed < PERF_TRACE_ENTRIES ? traceUsed + 1 : PERF_TRACE_ENTRIES;
+    }
+}
+
+void perfSetTraceThreshold(uint32_t us)
+{
+    // Cycles per us from the conversion the dump uses
+    uint32_t cyclesPerUs = static_cast<uint32_t>(1.0f / perfCyclesToUs(1) + 0.5f);
+    StatsLock lock;
+    traceThreshold = us * cyclesPerUs;
+}
+
+uint32_t perfCounter(PerfCounter counter)
+{
+    return counters[counter].load(std::memory_order_relaxed);
+}
+
+void perfSpanStats(PerfSpanId span, perf_span_stats *stats)
+{
+    StatsLock lock;
+    *stats = spanStats[span];
+}
+
+size_t perfReadTrace(perf_trace_entry *entries, size_t maxEntries)
+{
+    StatsLock lock;
+    size_t count = traceUsed < maxEntries ? traceUsed : maxEntries;
+    // The newest count entries, oldest of them first
+    size_t first = (traceNext + PERF_TRACE_ENTRIES - count) % PERF_TRACE_ENTRIES;
+    for (size_t i = 0; i < count; i++)
+    {
+        entries[i] = trace[(first + i) % PERF_TRACE_ENTRIES];
+    }
+    return count;
+}
+
+void perfReset()
+{
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+    {
+        counters[i].store(0, std::memory_order_relaxed);
+    }
+
+    StatsLock lock;
+    memset(spanStats, 0, sizeof(spanStats));
+    traceNext = 0;
+    traceUsed = 0;
+}
+
+void perfDump()
+{
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+    {
+        printf("PERF,counter,%s,%" PRIu32 "\n", COUNTER_NAMES[i], perfCounter(static_cast<PerfCounter>(i)));
+    }
+
+    for (size_t i = 0; i < PERF_SPAN_COUNT; i++)
+    {
+        perf_span_stats stats;
+        perfSpanStats(static_cast<PerfSpanId>(i), &stats);
+        if (stats.count == 0)
+        {
+            continue;
+        }
+        float meanUs = perfCyclesToUs(static_cast<uint32_t>(stats.totalCycles / stats.count));
+        printf("PERF,span,%s,count=%" PRIu32 ",mean_us=%.2f,max_us=%.2f\n", SPAN_NAMES[i], stats.count, meanUs,
+            perfCyclesToUs(stats.maxCycles));
+    }
+
+    // Copied out first so the dump doesn't hold the lock while printing
+    static perf_trace_entry entries[PERF_TRACE_ENTRIES];
+    size_t count = perfReadTrace(entries, PERF_TRACE_ENTRIES);
+    for (size_t i = 0; i < count; i++)
+    {
+        printf("TRACE,%.2f,%s,%.2f,%u\n", perfCyclesToUs(entries[i].start - entries[0].start),
+            SPAN_NAMES[entries[i].span], perfCyclesToUs(entries[i].cycles), entries[i].arg);
+    }
+}
+
+const char *perfCounterName(PerfCounter counter)
+{
+    return COUNTER_NAMES[counter];
+}
+
+const char *perfSpanName(PerfSpanId span)
+{
+    return SPAN_NAMES[span];
+}
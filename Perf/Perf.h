@@ -0,0 +1,159 @@
+/**
+ * @file Perf.h
+ * @brief Runtime performance counters and a trace of timed spans, cheap enough to leave in production builds
+ *
+ * Counters count events (SPI transfers, bytes, WIP polls, FIFO overflows...). Spans time a piece of code with the
+ * DWT cycle counter: every span updates the count/mean/max for its id, and spans at least as long as the trace
+ * threshold are also kept in a RAM ring of the last PERF_TRACE_ENTRIES, so latency outliers can be found in the
+ * field. perfDump() prints all of it.
+ *
+ * Instrument with the macros, they compile to nothing unless "app.perf_trace" is set in mbed_app.json:
+ *
+ *   PERF_COUNT(PERF_IMU_SPI_BYTES, length);
+ *   PERF_SPAN(PERF_SPAN_FIFO_DRAIN);          // times the rest of the enclosing scope
+ *
+ * Counters and the trace ring are updated atomically, so threads and interrupts can share them.
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(MBED_CONF_APP_PERF_TRACE) && MBED_CONF_APP_PERF_TRACE
+#define PERF_ENABLED 1
+#else
+#define PERF_ENABLED 0
+#endif
+
+/** Entries kept in the trace ring */
+constexpr size_t PERF_TRACE_ENTRIES = 256;
+
+enum PerfCounter {
+    PERF_IMU_SPI_TRANSFERS,
+    PERF_IMU_SPI_BYTES,
+    PERF_FIFO_OVERFLOWS,            // FIFO found full on a drain, the oldest frames were overwritten
+    PERF_IMU_LINK_ERRORS,           // garbled IMU transfers, each one steps the SPI clock down
+    PERF_FLASH_SPI_TRANSFERS,
+    PERF_FLASH_SPI_BYTES,
+    PERF_FLASH_WIP_POLLS,           // status register reads waiting for a program or erase to finish
+    PERF_FLASH_MUTEX_WAITS,         // flash access blocked on another thread
+    PERF_FLASH_BACKGROUND_ERASES,   // sector erases FlashLogFR::poll() started ahead of the writes
+    PERF_LOG_SESSIONS_DROPPED,      // oldest sessions overwritten by the log ring
+    PERF_LOG_RECORDS_DROPPED,       // reserveRecord calls that found no room
+    PERF_LOG_READ_MISSES,           // reads the read-ahead windows couldn't serve
+    PERF_COUNTER_COUNT
+};
+
+enum PerfSpanId {
+    PERF_SPAN_IMU_READ,             // one register burst read
+    PERF_SPAN_FIFO_DRAIN,
+    PERF_SPAN_DECIMATE,             // one BMI323Decimator::process batch, arg is the frames in it
+    PERF_SPAN_SPECTRUM,             // FFT of one BMI323Spectrum window, all three axes, arg is the size
+    PERF_SPAN_FLASH_READ,
+    PERF_SPAN_FLASH_PROGRAM,
+    PERF_SPAN_FLASH_ERASE,
+    PERF_SPAN_FLASH_MUTEX_WAIT,
+    PERF_SPAN_LOG_SAMPLE,           // FlashLogFR::writeIMUSample, including any block write or commit
+    PERF_SPAN_LOG_COMMIT,
+    PERF_SPAN_LOG_BLOCK,
+    PERF_SPAN_COUNT
+};
+
+/**
+ * @brief One span in the trace ring
+ */
+struct perf_trace_entry {
+    uint32_t start;                 // cycle counter at the start
+    uint32_t cycles;
+    uint16_t span;                  // PerfSpanId
+    uint16_t arg;                   // span specific, e.g. bytes moved, clipped to 0xFFFF
+};
+
+/**
+ * @brief Totals of one span id
+ */
+struct perf_span_stats {
+    uint32_t count;
+    uint32_t maxCycles;
+    uint64_t totalCycles;
+};
+
+/** Start the cycle counter, call once at boot */
+void perfInit();
+
+/** Cycle counter, wraps after a few seconds at full clock */
+uint32_t perfCycles();
+
+float perfCyclesToUs(uint32_t cycles);
+
+void perfCount(PerfCounter counter, uint32_t amount = 1);
+
+/** Record a span that started at start (from perfCycles) */
+void perfSpanEnd(PerfSpanId span, uint32_t start, uint32_t arg = 0);
+
+/** Only spans at least this long go into the trace ring, 0 keeps all of them (the default) */
+void perfSetTraceThreshold(uint32_t us);
+
+uint32_t perfCounter(PerfCounter counter);
+void perfSpanStats(PerfSpanId span, perf_span_stats *stats);
+
+/**
+ * @brief Copy the trace ring out, oldest first
+ *
+ * @return entries copied
+ */
+size_t perfReadTrace(perf_trace_entry *entries, size_t maxEntries);
+
+/** Zero the counters, span totals and trace */
+void perfReset();
+
+/**
+ * @brief Print everything, one tagged line each:
+ *   PERF,counter,<name>,<value>
+ *   PERF,span,<name>,count=<n>,mean_us=<us>,max_us=<us>
+ *   TRACE,<start_us>,<name>,<us>,<arg>          oldest first, start relative to the oldest entry
+ */
+void perfDump();
+
+const char *perfCounterName(PerfCounter counter);
+const char *perfSpanName(PerfSpanId span);
+
+/**
+ * @brief Times its own lifetime as a span
+ */
+class PerfSpan
+{
+    public:
+        explicit PerfSpan(PerfSpanId span, uint32_t arg = 0) : span(span), arg(arg), start(perfCycles())
+        {
+        }
+
+        ~PerfSpan()
+        {
+            perfSpanEnd(span, start, arg);
+        }
+
+        void setArg(uint32_t value) { arg = value; }
+
+    private:
+        PerfSpanId span;
+        uint32_t arg;
+        uint32_t start;
+};
+
+#define PERF_CONCAT_(a, b) a##b
+#define PERF_CONCAT(a, b) PERF_CONCAT_(a, b)
+
+#if PERF_ENABLED
+#define PERF_COUNT(counter, amount) perfCount(counter, amount)
+#define PERF_SPAN(span) PerfSpan PERF_CONCAT(perfSpan, __LINE__)(span)
+#define PERF_SPAN_ARG(span, arg) PerfSpan PERF_CONCAT(perfSpan, __LINE__)(span, arg)
+#else
+#define PERF_COUNT(counter, amount) do {} while (0)
+#define PERF_SPAN(span) do {} while (0)
+#define PERF_SPAN_ARG(span, arg) do {} while (0)
+#endif
+
+#endif // PERF_H
@@ -19,6 +19,7 @@
 #include "SPIFBlockDevice.h"
 #include "rtos/ThisThread.h"
 #include "mbed_critical.h"
+#include "Perf.h"
 
 #include <string.h>
 #include <inttypes.h>
@@ -108,17 +109,13 @@ enum spif_four_byte_instructions {
 };
 #endif
 
-// Mutex is used for some SPI Driver commands that must be done sequentially with no other commands in between
-// e.g. (1)Set Write Enable, (2)Program, (3)Wait Memory Ready
-SingletonPtr<PlatformMutex> SPIFBlockDevice::_mutex;
-
 //***********************
 // SPIF Block Device APIs
 //***********************
 SPIFBlockDevice::SPIFBlockDevice(PinName mosi, PinName miso, PinName sclk, PinName csel, int freq)
     :
     _spi(mosi, miso, sclk, csel, use_gpio_ssel), _prog_instruction(0), _erase_instruction(0),
-    _page_size_bytes(0), _init_ref_count(0), _is_initialized(false)
+    _page_size_bytes(0), _init_ref_count(0), _is_initialized(false), _erase_pending(false)
 {
     // Initial SFDP read tables are read with 8 dummy cycles
     // Default Bus Setup 1_1_1 with 0 dummy and mode cycles
@@ -144,7 +141,7 @@ int SPIFBlockDevice::init()
 {
     int status = SPIF_BD_ERROR_OK;
 
-    _mutex->lock();
+    _mutex.lock();
 
     if (!_is_initialized) {
         _init_ref_count = 0;
@@ -223,7 +220,7 @@ int SPIFBlockDevice::init()
     }
 
 exit_point:
-    _mutex->unlock();
+    _mutex.unlock();
 
     return status;
 }
@@ -233,7 +230,7 @@ int SPIFBlockDevice::deinit()
 {
     spif_bd_error status = SPIF_BD_ERROR_OK;
 
-    _mutex->lock();
+    _mutex.lock();
 
     if (!_is_initialized) {
         _init_ref_count = 0;
@@ -246,6 +243,8 @@ int SPIFBlockDevice::deinit()
         goto exit_point;
     }
 
+    _finish_erase();
+
     // Disable Device for Writing
     status = _spi_send_general_command(SPIF_WRDI, SPI_NO_ADDRESS_COMMAND, NULL, 0, NULL, 0);
     if (status != SPIF_BD_ERROR_OK)  {
@@ -254,7 +253,7 @@ int SPIFBlockDevice::deinit()
     _is_initialized = false;
 
 exit_point:
-    _mutex->unlock();
+    _mutex.unlock();
 
     return status;
 }
@@ -267,7 +266,14 @@ int SPIFBlockDevice::read(void *buffer, bd_addr_t addr, bd_size_t size)
 
     int status = SPIF_BD_ERROR_OK;
     tr_debug("Read - Inst: 0x%xh", _read_instruction);
-    _mutex->lock();
+    PERF_SPAN_ARG(PERF_SPAN_FLASH_READ, size);
+    _lock();
+
+    status = _finish_erase();
+    if (status != SPIF_BD_ERROR_OK) {
+        _mutex.unlock();
+        return status;
+    }
 
     // Set Dummy Cycles for Specific Read Command Mode
     _dummy_and_mode_cycles = _read_dummy_and_mode_cycles;
@@ -277,7 +283,7 @@ int SPIFBlockDevice::read(void *buffer, bd_addr_t addr, bd_size_t size)
     // Set Dummy Cycles for all other command modes
     _dummy_and_mode_cycles = _write_dummy_and_mode_cycles;
 
-    _mutex->unlock();
+    _mutex.unlock();
     return status;
 }
 
@@ -293,6 +299,7 @@ int SPIFBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size)
     uint32_t chunk = 0;
 
     tr_debug("program - Buff: 0x%" PRIx32 "h, addr: %llu, size: %llu", (uint32_t)buffer, addr, size);
+    PERF_SPAN_ARG(PERF_SPAN_FLASH_PROGRAM, size);
 
     while (size > 0) {
 
@@ -300,7 +307,13 @@ int SPIFBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size)
         offset = addr % _page_size_bytes;
         chunk = (offset + size < _page_size_bytes) ? size : (_page_size_bytes - offset);
 
-        _mutex->lock();
+        _lock();
+
+        if (_finish_erase() != SPIF_BD_ERROR_OK) {
+            program_failed = true;
+            status = SPIF_BD_ERROR_READY_FAILED;
+            goto exit_point;
+        }
 
         //Send WREN
         if (_set_write_enable() != 0) {
@@ -322,12 +335,12 @@ int SPIFBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size)
             status = SPIF_BD_ERROR_READY_FAILED;
             goto exit_point;
         }
-        _mutex->unlock();
+        _mutex.unlock();
     }
 
 exit_point:
     if (program_failed) {
-        _mutex->unlock();
+        _mutex.unlock();
     }
 
     return status;
@@ -354,6 +367,7 @@ int SPIFBlockDevice::erase(bd_addr_t addr, bd_size_t size)
     uint8_t bitfield = _sfdp_info.smptbl.region_erase_types_bitfld[region];
 
     tr_debug("erase - addr: %llu, size: %llu", addr, size);
+    PERF_SPAN_ARG(PERF_SPAN_FLASH_ERASE, size / 1024);
 
     if ((addr + size) > _sfdp_info.bptbl.device_size_bytes) {
         tr_error("erase exceeds flash device size");
@@ -368,29 +382,7 @@ int SPIFBlockDevice::erase(bd_addr_t addr, bd_size_t size)
     // For each iteration erase the largest section supported by current region
     while (size > 0) {
 
-#if !SPIF_USE_4BYTE_ADDRESSES
-        // iterate to find next Largest erase type ( a. supported by region, b. smaller than size)
-        // find the matching instruction and erase size chunk for that type.
-        type = sfdp_iterate_next_largest_erase_type(bitfield, size, addr, region, _sfdp_info.smptbl);
-        cur_erase_inst = _sfdp_info.smptbl.erase_type_inst_arr[type];
-        curr_erase_size = _sfdp_info.smptbl.erase_type_size_arr[type];
-#else
-        /* Select the proper erase instruction and size based on the size of the current region */
-        if (_sfdp_info.smptbl.region_size[region] > 0x1000)
-        {
-            /* Use 256 KB sector erase */
-            type = 2;
-            cur_erase_inst = SPIF_4SE;
-            curr_erase_size = 0x40000; /* 4SE always erases 256 KB */
-        }
-        else
-        {
-            /* Use 4 KB parameter sector erase */
-            type = 1;
-            cur_erase_inst = SPIF_4P4E;
-            curr_erase_size = 0x1000; /* 4P4E erases a 4 KB parameter sector */
-        }
-#endif
+        type = _select_erase(addr, size, region, bitfield, cur_erase_inst, curr_erase_size);
         if (addr % curr_erase_size != 0 || addr + size < curr_erase_size) {
             // Should not happen if the erase table parsing
             // and alignment checks were performed correctly
@@ -403,9 +395,9 @@ int SPIFBlockDevice::erase(bd_addr_t addr, bd_size_t size)
         tr_debug("erase - Region: %d, Type:%d",
                  region, type);
 
-        _mutex->lock();
+        _lock();
 
-        if (_set_write_enable() != 0) {
+        if (_finish_erase() != SPIF_BD_ERROR_OK || _set_write_enable() != 0) {
             tr_error("SPI Erase Device not ready - failed");
             erase_failed = true;
             status = SPIF_BD_ERROR_READY_FAILED;
@@ -430,17 +422,125 @@ int SPIFBlockDevice::erase(bd_addr_t addr, bd_size_t size)
             goto exit_point;
         }
 
-        _mutex->unlock();
+        _mutex.unlock();
     }
 
 exit_point:
     if (erase_failed) {
-        _mutex->unlock();
+        _mutex.unlock();
+    }
+
+    return status;
+}
+
+int SPIFBlockDevice::_select_erase(bd_addr_t addr, bd_size_t size, int region, uint8_t bitfield, int &inst,
+                                   unsigned int &erase_size)
+{
+    int type;
+#if !SPIF_USE_4BYTE_ADDRESSES
+    // iterate to find next Largest erase type ( a. supported by region, b. smaller than size)
+    // find the matching instruction and erase size chunk for that type.
+    type = sfdp_iterate_next_largest_erase_type(bitfield, size, addr, region, _sfdp_info.smptbl);
+    inst = _sfdp_info.smptbl.erase_type_inst_arr[type];
+    erase_size = _sfdp_info.smptbl.erase_type_size_arr[type];
+#else
+    /* Select the proper erase instruction and size based on the size of the current region */
+    if (_sfdp_info.smptbl.region_size[region] > 0x1000)
+    {
+        /* Use 256 KB sector erase */
+        type = 2;
+        inst = SPIF_4SE;
+        erase_size = 0x40000; /* 4SE always erases 256 KB */
+    }
+    else
+    {
+        /* Use 4 KB parameter sector erase */
+        type = 1;
+        inst = SPIF_4P4E;
+        erase_size = 0x1000; /* 4P4E erases a 4 KB parameter sector */
+    }
+#endif
+    return type;
+}
+
+int SPIFBlockDevice::erase_start(bd_addr_t addr)
+{
+    if (!_is_initialized) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    int region = sfdp_find_addr_region(addr, _sfdp_info);
+    if (region < 0) {
+        tr_error("no region found for address %llu", addr);
+        return SPIF_BD_ERROR_INVALID_ERASE_PARAMS;
+    }
+
+    bd_size_t size = get_erase_size(addr);
+    if (addr % size != 0 || addr + size > _sfdp_info.bptbl.device_size_bytes) {
+        tr_error("invalid erase_start - unaligned address or beyond the device");
+        return SPIF_BD_ERROR_INVALID_ERASE_PARAMS;
+    }
+
+    int inst = _erase_instruction;
+    unsigned int erase_size = 0;
+    _select_erase(addr, size, region, _sfdp_info.smptbl.region_erase_types_bitfld[region], inst, erase_size);
+    tr_debug("erase_start - addr: %llu, Inst: 0x%xh, erase size: %u", addr, inst, erase_size);
+
+    _lock();
+
+    int status = _finish_erase();
+    if (status == SPIF_BD_ERROR_OK && _set_write_enable() != 0) {
+        tr_error("SPI Erase Device not ready - failed");
+        status = SPIF_BD_ERROR_WREN_FAILED;
+    }
+    if (status == SPIF_BD_ERROR_OK) {
+        status = _spi_send_erase_command(inst, addr, erase_size);
+        _erase_pending = status == SPIF_BD_ERROR_OK;
     }
 
+    _mutex.unlock();
     return status;
 }
 
+bool SPIFBlockDevice::erase_busy()
+{
+    if (!_erase_pending) {
+        return false;
+    }
+
+    char status_value[2] = {0, 0};
+    _lock();
+    spif_bd_error status = _spi_send_general_command(SPIF_RDSR, SPI_NO_ADDRESS_COMMAND, NULL, 0, status_value, 1);
+    // A failed status read counts as busy, erase_wait() times out if the chip is gone
+    bool busy = status != SPIF_BD_ERROR_OK || (status_value[0] & SPIF_STATUS_BIT_WIP) != 0;
+    _erase_pending = busy;
+    _mutex.unlock();
+
+    return busy;
+}
+
+int SPIFBlockDevice::erase_wait()
+{
+    _lock();
+    int status = _finish_erase();
+    _mutex.unlock();
+    return status;
+}
+
+int SPIFBlockDevice::_finish_erase()
+{
+    if (!_erase_pending) {
+        return SPIF_BD_ERROR_OK;
+    }
+
+    _erase_pending = false;
+    if (false == _is_mem_ready()) {
+        tr_error("Erase from erase_start() not finished - failed");
+        return SPIF_BD_ERROR_READY_FAILED;
+    }
+    return SPIF_BD_ERROR_OK;
+}
+
 int SPIFBlockDevice::bulk_erase()
 {
     if (!_is_initialized) {
@@ -471,7 +571,7 @@ int SPIFBlockDevice::bulk_erase()
     int status = SPIF_BD_ERROR_OK;
     int wip_retries = 0;
 
-    _mutex->lock();
+    _mutex.lock();
 
     /* Set WREN */
     if (_set_write_enable() != 0) {
@@ -509,7 +609,7 @@ int SPIFBlockDevice::bulk_erase()
     }
 
 exit_point:
-    _mutex->unlock();
+    _mutex.unlock();
 
     return status;
 }
@@ -596,6 +696,9 @@ spif_bd_error SPIFBlockDevice::_spi_send_read_command(int read_inst, uint8_t *bu
     uint32_t dummy_bytes = _dummy_and_mode_cycles / 8;
     int dummy_byte = 0;
 
+    PERF_COUNT(PERF_FLASH_SPI_TRANSFERS, 1);
+    PERF_COUNT(PERF_FLASH_SPI_BYTES, 1 + _address_size + dummy_bytes + size);
+
     _spi.select();
 
     // Write 1 byte Instruction
@@ -662,6 +765,9 @@ spif_bd_error SPIFBlockDevice::_spi_send_program_command(int prog_inst, const vo
     int dummy_byte = 0;
     uint8_t *data = (uint8_t *)buffer;
 
+    PERF_COUNT(PERF_FLASH_SPI_TRANSFERS, 1);
+    PERF_COUNT(PERF_FLASH_SPI_BYTES, 1 + _address_size + dummy_bytes + size);
+
     _spi.select();
 
     // Write 1 byte Instruction
@@ -702,6 +808,10 @@ spif_bd_error SPIFBlockDevice::_spi_send_general_command(int instruction, bd_add
     uint32_t dummy_bytes = _dummy_and_mode_cycles / 8;
     uint8_t dummy_byte = 0x00;
 
+    PERF_COUNT(PERF_FLASH_SPI_TRANSFERS, 1);
+    PERF_COUNT(PERF_FLASH_SPI_BYTES, 1 + (addr != SPI_NO_ADDRESS_COMMAND ? _address_size + dummy_bytes : 0) +
+               (tx_length > rx_length ? tx_length : rx_length));
+
     _spi.select();
 
     // Write 1 byte Instruction
@@ -849,6 +959,21 @@ int SPIFBlockDevice::_reset_flash_mem()
     return status;
 }
 
+void SPIFBlockDevice::_lock()
+{
+#if PERF_ENABLED && MBED_CONF_RTOS_API_PRESENT
+    // Only time the lock when someone else holds it
+    if (_mutex.trylock()) {
+        return;
+    }
+    PERF_COUNT(PERF_FLASH_MUTEX_WAITS, 1);
+    PERF_SPAN(PERF_SPAN_FLASH_MUTEX_WAIT);
+    _mutex.lock();
+#else
+    _mutex.lock();
+#endif
+}
+
 bool SPIFBlockDevice::_is_mem_ready()
 {
     // Check Status Register Busy Bit to Verify the Device isn't Busy
@@ -859,6 +984,7 @@ bool SPIFBlockDevice::_is_mem_ready()
     do {
         rtos::ThisThread::sleep_for(1ms);
         retries++;
+        PERF_COUNT(PERF_FLASH_WIP_POLLS, 1);
         // Read the Status Register from device
         if (SPIF_BD_ERROR_OK != _spi_send_general_command(SPIF_RDSR, SPI_NO_ADDRESS_COMMAND, NULL, 0, status_value,
                                                           1)) {   // store received values in status_value
@@ -17,7 +17,7 @@
 #ifndef MBED_SPIF_BLOCK_DEVICE_H
 #define MBED_SPIF_BLOCK_DEVICE_H
 
-#include "platform/SingletonPtr.h"
+#include "platform/PlatformMutex.h"
 #include "drivers/SPI.h"
 #include "drivers/DigitalOut.h"
 #include "blockdevice/internal/SFDP.h"
@@ -224,6 +224,34 @@ public:
      */
     int bulk_erase();
 
+    /** Start erasing one erase block and return while the chip works on it
+     *
+     *  Lets a caller without threads get on with other work, the other chip on the bus included, during the
+     *  erase. The chip ignores everything but status reads until it is done, so read(), program(), erase() and
+     *  deinit() wait for it first.
+     *
+     *  @param addr     Start of the erase block, aligned to get_erase_size(addr)
+     *  @return         SPIF_BD_ERROR_OK(0) - erase started
+     *                  SPIF_BD_ERROR_DEVICE_ERROR - device driver transaction failed
+     *                  SPIF_BD_ERROR_READY_FAILED - the previous erase didn't finish in time
+     *                  SPIF_BD_ERROR_WREN_FAILED - Write Enable failed
+     *                  SPIF_BD_ERROR_INVALID_ERASE_PARAMS - unaligned address or beyond the device
+     */
+    int erase_start(mbed::bd_addr_t addr);
+
+    /** Check on an erase started with erase_start(), one status register read without waiting
+     *
+     *  @return         true while the erase is running
+     */
+    bool erase_busy();
+
+    /** Wait for an erase started with erase_start()
+     *
+     *  @return         SPIF_BD_ERROR_OK(0) - done, or no erase was running
+     *                  SPIF_BD_ERROR_READY_FAILED - the erase didn't finish in time
+     */
+    int erase_wait();
+
 private:
     /****************************************/
     /* SFDP Detection and Parsing Functions */
@@ -267,9 +295,19 @@ private:
     // Configure Write Enable in Status Register
     int _set_write_enable();
 
+    // Take _mutex, counting the times it was held by another thread
+    void _lock();
+
     // Wait on status register until write not-in-progress
     bool _is_mem_ready();
 
+    // Instruction and size of the largest erase at addr that fits in size, returns the erase type
+    int _select_erase(mbed::bd_addr_t addr, mbed::bd_size_t size, int region, uint8_t bitfield, int &inst,
+                      unsigned int &erase_size);
+
+    // Wait for an erase from erase_start(), with _mutex held
+    int _finish_erase();
+
     // Query vendor ID and handle special behavior that isn't covered by SFDP data
     int _handle_vendor_quirks();
 
@@ -279,7 +317,9 @@ private:
 
     // Mutex is used to protect Flash device for some SPI Driver commands that must be done sequentially with no other commands in between
     // e.g. (1)Set Write Enable, (2)Program, (3)Wait Memory Ready
-    static SingletonPtr<PlatformMutex> _mutex;
+    // One per device, so chips on the same bus can init and erase in parallel. The SPI object locks the bus itself for
+    // each select() to deselect() transfer.
+    PlatformMutex _mutex;
 
     // Command Instructions
     int _read_instruction;
@@ -299,6 +339,9 @@ private:
     unsigned int _dummy_and_mode_cycles; // Number of Dummy and Mode Bits required by Current Bus Mode
     uint32_t _init_ref_count;
     bool _is_initialized;
+
+    // erase_start() left the chip erasing
+    bool _erase_pending;
 };
 
 #endif  /* MBED_SPIF_BLOCK_DEVICE_H */
@@ -0,0 +1,432 @@
+/**
+ * @file StartupSequence.cpp
+ * @brief Cold start with the IMU and both flash chips brought up at the same time
+ */
+
+#include "StartupSequence.h"
+#include <cinttypes>
+
+namespace
+{
+#if !MBED_CONF_RTOS_PRESENT
+    // Bare metal: start() and poll() do the flash work on the caller's stack
+    constexpr uint32_t STATIC_STACKS = 0;
+    const char *const STACKS_NOTE = " (no threads)";
+#elif defined(MBED_CONF_APP_STATIC_ALLOC) && MBED_CONF_APP_STATIC_ALLOC
+    // Only one sequence runs at a time
+    STARTUP_STATIC_RAM MBED_ALIGN(8) unsigned char flashStack[StartupSequence::FLASH_STACK_SIZE];
+    STARTUP_STATIC_RAM MBED_ALIGN(8) unsigned char chip1Stack[StartupSequence::FLASH_STACK_SIZE];
+    constexpr uint32_t STATIC_STACKS = sizeof(flashStack) + sizeof(chip1Stack);
+    const char *const STACKS_NOTE = "";
+#else
+    // Thread allocates the stacks from the heap
+    unsigned char *const flashStack = nullptr;
+    unsigned char *const chip1Stack = nullptr;
+    constexpr uint32_t STATIC_STACKS = 0;
+    const char *const STACKS_NOTE = " (heap)";
+#endif
+}
+
+StartupSequence::StartupSequence(BMI323SPI &imu, FlashLogFR &log, float odrHz) :
+    imu(imu), log(log), periodUs(static_cast<uint32_t>(1.0e6f / odrHz)), spectrum(nullptr), logRaw(true),
+    sessionTag(0), sessionLabel(nullptr),
+    flashDone(false), flashOk(false), imuOk(false), nextStage(STAGE_COUNT), result(false), firstSample(0),
+    logReady(0), sampleCount(0), resumeSample(0), resumeBase(0), backlogCount(0), backlogDropped(0)
+{
+    memset(timings, 0, sizeof(timings));
+}
+
+bool StartupSequence::run(uint32_t tag, const char *label)
+{
+#if MBED_CONF_RTOS_PRESENT
+    reset(tag, label);
+
+    Thread flashThread(osPriorityNormal, FLASH_STACK_SIZE, flashStack, "startup-flash");
+    flashThread.start(callback(this, &StartupSequence::flashTask));
+
+    startImu();
+
+    // Keep the FIFO from overflowing until the log can take the samples
+    while (!flashDone)
+    {
+        if (imuOk)
+        {
+            bufferSamples();
+        }
+        ThisThread::sleep_for(1ms);
+    }
+    flashThread.join();
+
+    if (!imuOk || !flashOk)
+    {
+        return false;
+    }
+    return restoreCalibration() && writeBacklog();
+#else
+    start(tag, label);
+    while (!poll())
+    {
+    }
+    return succeeded();
+#endif
+}
+
+void StartupSequence::start(uint32_t tag, const char *label)
+{
+    reset(tag, label);
+    startImu();
+    nextStage = STAGE_FLASH_CHIP0;
+}
+
+bool StartupSequence::poll()
+{
+    if (nextStage == STAGE_COUNT)
+    {
+        return true;
+    }
+    if (imuOk)
+    {
+        bufferSamples();
+    }
+
+    // One stage per call, the FIFO is drained in between
+    Stage stage = nextStage;
+    switch (stage)
+    {
+        case STAGE_FLASH_CHIP0:
+        case STAGE_FLASH_CHIP1:
+            begin(stage);
+            end(stage, log.initChip(stage == STAGE_FLASH_CHIP0 ? 0 : 1));
+            if (timings[stage].result != FlashLogFR::FL_SUCCESS)
+            {
+                return finish(false);
+            }
+            nextStage = stage == STAGE_FLASH_CHIP0 ? STAGE_FLASH_CHIP1 : STAGE_LOG_MOUNT;
+            return false;
+
+        case STAGE_LOG_MOUNT:
+            flashOk = openLog();
+            if (!flashOk)
+            {
+                return finish(false);
+            }
+            nextStage = STAGE_CALIBRATION;
+            return false;
+
+        case STAGE_CALIBRATION:
+            if (!imuOk || !restoreCalibration())
+            {
+                return finish(false);
+            }
+            nextStage = STAGE_BACKLOG;
+            return false;
+
+        case STAGE_BACKLOG:
+            return finish(imuOk && writeBacklog());
+
+        default:
+            return finish(false);
+    }
+}
+
+uint16_t StartupSequence::pump()
+{
+    uint16_t count = imu.readFifo(frames, BMI323Base::FIFO_MAX_FRAMES);
+    uint32_t firstTimestamp = sampleTime(sampleCount);
+
+    for (uint16_t i = 0; i < count; i++)
+    {
+        uint32_t timestamp = nextTimestamp();
+        if (!logRaw)
+        {
+            continue;
+        }
+
+        int16_t sample[IMU_CHANNELS];
+        memcpy(sample, frames[i].accel, sizeof(frames[i].accel));
+        memcpy(sample + 3, frames[i].gyro, sizeof(frames[i].gyro));
+        if (log.writeIMUSample(sample, timestamp) != FlashLogFR::FL_SUCCESS)
+        {
+            return i;
+        }
+    }
+
+    if (spectrum && !logSpectrum(count, firstTimestamp))
+    {
+        return 0;
+    }
+
+    // Next sector erases while the caller waits for more samples
+    log.poll();
+    return count;
+}
+
+void StartupSequence::setSpectrum(BMI323Spectrum *spectrum, bool logRaw)
+{
+    this->spectrum = spectrum;
+    this->logRaw = logRaw || !spectrum;
+}
+
+bool StartupSequence::logSpectrum(uint16_t count, uint32_t firstTimestamp)
+{
+    for (uint16_t used = 0; used < count;)
+    {
+        used += spectrum->process(frames + used, count - used);
+        if (!spectrum->summaryReady())
+        {
+            continue;
+        }
+
+        const BMI323Spectrum::vibration_summary &summary = spectrum->summary();
+        log_vibration_record *record = log.reserveRecord<log_vibration_record>();
+        if (!record)
+        {
+            return false;
+        }
+
+        // Built in the page buffer, so every field is written, unused bands included
+        auto clip = [](float value) {
+            return static_cast<uint16_t>(value < 65535.0f ? value + 0.5f : 65535.0f);
+        };
+        record->timestamp = firstTimestamp + (used - 1) * periodUs;
+        record->windows = summary.windows;
+        record->bands = summary.bands;
+        for (uint8_t i = 0; i <= LOG_VIBRATION_BANDS; i++)
+        {
+            record->bandEdgeHz[i] = i <= summary.bands ? clip(spectrum->bandEdgeHz(i)) : 0;
+        }
+        for (int axis = 0; axis < 3; axis++)
+        {
+            for (uint8_t i = 0; i < LOG_VIBRATION_BANDS; i++)
+            {
+                record->bandRms[axis][i] = i < summary.bands ? clip(summary.bandRms[axis][i]) : 0;
+            }
+            record->peakDeciHz[axis] = clip(summary.peakHz[axis] * 10.0f);
+            record->peakRms[axis] = clip(summary.peakRms[axis]);
+        }
+        if (log.commitRecord<log_vibration_record>() != FlashLogFR::FL_SUCCESS)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void StartupSequence::reset(uint32_t tag, const char *label)
+{
+    sessionTag = tag;
+    sessionLabel = label;
+    flashDone = false;
+    flashOk = false;
+    imuOk = false;
+    result = false;
+    sampleCount = 0;
+    resumeSample = 0;
+    backlogCount = 0;
+    backlogDropped = 0;
+}
+
+void StartupSequence::startImu()
+{
+    begin(STAGE_IMU_INIT);
+    imuOk = imu.init();
+    end(STAGE_IMU_INIT, imuOk ? 0 : -1);
+
+    if (imuOk)
+    {
+        begin(STAGE_IMU_CONFIG);
+        imuOk = imu.applyScript(BMI323_SCRIPT_FIFO_STREAM);
+        end(STAGE_IMU_CONFIG, imuOk ? 0 : -1);
+        firstSample = us_ticker_read();
+        resumeBase = firstSample;
+    }
+}
+
+bool StartupSequence::openLog()
+{
+    begin(STAGE_LOG_MOUNT);
+    FlashLogFR::FLResultCode mounted = log.init();
+    end(STAGE_LOG_MOUNT, mounted);
+    bool ok = mounted == FlashLogFR::FL_SUCCESS;
+
+    if (ok)
+    {
+        begin(STAGE_SESSION);
+        FlashLogFR::FLResultCode started = log.startSession(sessionTag, sessionLabel);
+        end(STAGE_SESSION, started);
+        ok = started == FlashLogFR::FL_SUCCESS;
+    }
+
+    logReady = us_ticker_read();
+    return ok;
+}
+
+bool StartupSequence::restoreCalibration()
+{
+    begin(STAGE_CALIBRATION);
+
+    // The FIFO up to here was sampled without the calibration
+    bufferSamples();
+    BMI323Calibration calibration(imu);
+    if (!calibration.restore(log.getBlockDevice(), log.getCalibrationAddr()))
+    {
+        // Not calibrated yet, not a reason to stop
+        end(STAGE_CALIBRATION, 1);
+        return true;
+    }
+
+    // The data path write turns both sensors off and on again. What is in the FIFO now was sampled before that,
+    // the samples after it start over from here rather than from firstSample
+    bufferSamples();
+    resumeSample = sampleCount;
+    resumeBase = us_ticker_read() - sampleCount * periodUs;
+
+    BMI323Base::dp_calibration cal;
+    imu.readDataPath(&cal);
+    log_calibration_record record = {};
+    record.timestamp = sampleTime(sampleCount);
+    memcpy(record.accelOffset, cal.accelOffset, sizeof(record.accelOffset));
+    memcpy(record.accelGain, cal.accelGain, sizeof(record.accelGain));
+    memcpy(record.gyroOffset, cal.gyroOffset, sizeof(record.gyroOffset));
+    memcpy(record.gyroGain, cal.gyroGain, sizeof(record.gyroGain));
+    FlashLogFR::FLResultCode written = log.writeRecord(record);
+    end(STAGE_CALIBRATION, written);
+
+    return written == FlashLogFR::FL_SUCCESS;
+}
+
+bool StartupSequence::writeBacklog()
+{
+    begin(STAGE_BACKLOG);
+    bufferSamples();
+
+    FlashLogFR::FLResultCode written = FlashLogFR::FL_SUCCESS;
+    for (uint32_t i = 0; i < backlogCount && written == FlashLogFR::FL_SUCCESS; i++)
+    {
+        int16_t sample[IMU_CHANNELS];
+        memcpy(sample, backlog[i].accel, sizeof(backlog[i].accel));
+        memcpy(sample + 3, backlog[i].gyro, sizeof(backlog[i].gyro));
+        written = log.writeIMUSample(sample, sampleTime(i));
+    }
+    end(STAGE_BACKLOG, written);
+
+    return written == FlashLogFR::FL_SUCCESS;
+}
+
+bool StartupSequence::finish(bool ok)
+{
+    nextStage = STAGE_COUNT;
+    result = ok;
+    return true;
+}
+
+#if MBED_CONF_RTOS_PRESENT
+void StartupSequence::flashTask()
+{
+    // The second chip gets its own thread, this one does the first, then the mount that needs both
+    Thread chip1Thread(osPriorityNormal, FLASH_STACK_SIZE, chip1Stack, "startup-chip1");
+    chip1Thread.start(callback(this, &StartupSequence::chip1Task));
+
+    begin(STAGE_FLASH_CHIP0);
+    end(STAGE_FLASH_CHIP0, log.initChip(0));
+    chip1Thread.join();
+
+    bool ok = timings[STAGE_FLASH_CHIP0].result == FlashLogFR::FL_SUCCESS &&
+        timings[STAGE_FLASH_CHIP1].result == FlashLogFR::FL_SUCCESS;
+
+    flashOk = ok && openLog();
+    flashDone = true;
+}
+
+void StartupSequence::chip1Task()
+{
+    begin(STAGE_FLASH_CHIP1);
+    end(STAGE_FLASH_CHIP1, log.initChip(1));
+}
+#endif
+
+void StartupSequence::bufferSamples()
+{
+    uint16_t count = imu.readFifo(frames, BMI323Base::FIFO_MAX_FRAMES);
+    for (uint16_t i = 0; i < count; i++)
+    {
+        // Samples that don't fit still advance the timestamps, so the log stays on the sensor's time base
+        if (backlogCount < BACKLOG_SAMPLES)
+        {
+            backlog[backlogCount++] = frames[i];
+        }
+        else
+        {
+            backlogDropped++;
+        }
+        sampleCount++;
+    }
+}
+
+void StartupSequence::begin(Stage stage)
+{
+    timings[stage].startUs = us_ticker_read();
+}
+
+void StartupSequence::end(Stage stage, int result)
+{
+    timings[stage].endUs = us_ticker_read();
+    timings[stage].result = result;
+}
+
+uint32_t StartupSequence::nextTimestamp()
+{
+    return sampleTime(sampleCount++);
+}
+
+uint32_t StartupSequence::sampleTime(uint32_t sample) const
+{
+    return (sample < resumeSample ? firstSample : resumeBase) + sample * periodUs;
+}
+
+void StartupSequence::printTimings() const
+{
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        const stage_timing &stage = timings[i];
+        printf("[Startup] %-12s %8.2f ms to %8.2f ms (%.2f ms), result %d\n", stageName(static_cast<Stage>(i)),
+            stage.startUs / 1000.0f, stage.endUs / 1000.0f, (stage.endUs - stage.startUs) / 1000.0f, stage.result);
+    }
+    printf("[Startup] First sample at %.2f ms, log ready at %.2f ms, %" PRIu32 " samples buffered, %" PRIu32
+        " dropped\n", firstSample / 1000.0f, logReady / 1000.0f, backlogCount, backlogDropped);
+}
+
+void StartupSequence::printRamBudget()
+{
+    uint32_t total = sizeof(BMI323SPI) + sizeof(FlashLogFR) + sizeof(StartupSequence) + STATIC_STACKS;
+
+    printf("[Startup] RAM imu       %6" PRIu32 " bytes\n", static_cast<uint32_t>(sizeof(BMI323SPI)));
+    printf("[Startup] RAM flash log %6" PRIu32 " bytes\n", static_cast<uint32_t>(sizeof(FlashLogFR)));
+    printf("[Startup] RAM sequence  %6" PRIu32 " bytes (backlog %" PRIu32 ")\n",
+        static_cast<uint32_t>(sizeof(StartupSequence)), static_cast<uint32_t>(sizeof(backlog)));
+    printf("[Startup] RAM stacks    %6" PRIu32 " bytes%s\n", STATIC_STACKS, STACKS_NOTE);
+    printf("[Startup] RAM total     %6" PRIu32 " bytes\n", total);
+
+#ifdef MBED_HEAP_STATS_ENABLED
+    mbed_stats_heap_t heap;
+    mbed_stats_heap_get(&heap);
+    printf("[Startup] Heap max %" PRIu32 " bytes in %" PRIu32 " allocations\n", heap.max_size, heap.total_alloc_cnt);
+#endif
+}
+
+const char *StartupSequence::stageName(Stage stage)
+{
+    switch (stage)
+    {
+        case STAGE_IMU_INIT:        return "imu_init";
+        case STAGE_IMU_CONFIG:      return "imu_config";
+        case STAGE_FLASH_CHIP0:     return "flash_chip0";
+        case STAGE_FLASH_CHIP1:     return "flash_chip1";
+        case STAGE_LOG_MOUNT:       return "log_mount";
+        case STAGE_SESSION:         return "session";
+        case STAGE_CALIBRATION:     return "calibration";
+        case STAGE_BACKLOG:         return "backlog";
+        case STAGE_COUNT:           break;
+    }
+    return "unknown";
+}
@@ -0,0 +1,246 @@
+/**
+ * @file StartupSequence.h
+ * @brief Cold start with the IMU and both flash chips brought up at the same time
+ *
+ * Going through BMI323SPI::init(), then each SPIFBlockDevice (soft reset, vendor quirks, SFDP parse, WIP polls that
+ * sleep 1 ms) and then the log mount one after the other keeps the IMU idle for the whole flash bring up. run()
+ * instead starts the flash work on two threads, one per chip (the chips share a bus, but each driver has its own
+ * lock and most of their init is spent sleeping on WIP polls), and meanwhile brings the IMU up from
+ * BMI323_SCRIPT_FIFO_STREAM. From then on the FIFO is drained into a RAM backlog until the log has mounted and a
+ * session is open, the backlog is then written to the log and pump() carries on from there. Sampling starts about a
+ * millisecond after run() is called, independent of how long the flash takes.
+ *
+ * The BMI323 forgets its data path calibration at power on. Once the log is mounted the one saved in the log's
+ * calibration sector (FlashLogFR::getCalibrationAddr) is restored, and a log_calibration_record marks the sample
+ * it applies from. The backlog before that is uncorrected. Restoring turns the sensors off and on again, so the
+ * timestamps after the record are taken up again from the time it was written.
+ *
+ * Builds without an RTOS (linked to mbed-baremetal) have no threads. There start() and poll() do the same work
+ * cooperatively: poll() drains the FIFO, then runs the next flash stage, so the chips come up one after the other
+ * with the FIFO drained in between. run() loops on poll() there. Both are available in RTOS builds too, for callers
+ * that would rather not spawn threads.
+ *
+ * With "app.static_alloc" the flash threads run on static stacks, so together with FlashLogFR's
+ * StaticBufferedBlockDevice nothing on the way from the IMU to the log comes from the heap. STARTUP_STATIC_RAM puts
+ * the objects it is used on into "app.static_ram_section".
+ */
+
+#ifndef STARTUP_SEQUENCE_H
+#define STARTUP_SEQUENCE_H
+
+#include <mbed.h>
+#include <atomic>
+#include "BMI323.h"
+#include "BMI323Calibration.h"
+#include "BMI323Spectrum.h"
+#include "FlashLogFR.h"
+
+#if defined(MBED_CONF_APP_STATIC_ALLOC) && MBED_CONF_APP_STATIC_ALLOC && defined(MBED_CONF_APP_STATIC_RAM_SECTION)
+#define STARTUP_STATIC_RAM MBED_SECTION(MBED_CONF_APP_STATIC_RAM_SECTION)
+#else
+#define STARTUP_STATIC_RAM
+#endif
+
+class StartupSequence
+{
+    public:
+        /**
+         * @brief Steps of the start up, each one timed
+         */
+        enum Stage : uint8_t
+        {
+            STAGE_IMU_INIT,         // chip id and register shadow
+            STAGE_IMU_CONFIG,       // FIFO, accel and gyro from the register script
+            STAGE_FLASH_CHIP0,      // SPIFBlockDevice::init() of each chip, on its own thread
+            STAGE_FLASH_CHIP1,
+            STAGE_LOG_MOUNT,        // session directory and recovery, FlashLogFR::init()
+            STAGE_SESSION,          // FlashLogFR::startSession()
+            STAGE_CALIBRATION,      // saved calibration into the IMU and the log, result 1 if none was saved
+            STAGE_BACKLOG,          // RAM backlog written to the log
+            STAGE_COUNT
+        };
+
+        /**
+         * @brief When a stage ran, in us since reset (us_ticker_read()), and how it went
+         */
+        struct stage_timing {
+            uint32_t startUs;
+            uint32_t endUs;
+            int result;             // 0 on success, else the FLResultCode or -1 for the IMU
+        };
+
+        /** Samples kept in RAM while the log comes up, 1.25 s at 1600 Hz, 24 KB */
+        static constexpr uint32_t BACKLOG_SAMPLES = 2048;
+
+        /** Stack of each flash thread, printf and the SFDP parse are the deepest users */
+        static constexpr uint32_t FLASH_STACK_SIZE = 4096;
+
+        /**
+         * @param odrHz rate the IMU runs at, BMI323_SCRIPT_FIFO_STREAM sets it to 800 Hz. Only used for timestamps,
+         * FIFO frames carry none.
+         */
+        StartupSequence(BMI323SPI &imu, FlashLogFR &log, float odrHz = 800.0f);
+
+        /**
+         * @brief Bring everything up and start recording a session
+         *
+         * Returns once the backlog is in the log, or as soon as a stage fails. A failed flash still leaves the IMU
+         * running, so the caller can decide to fly without a log.
+         *
+         * @return true if the IMU is sampling and the session is recording
+         */
+        bool run(uint32_t tag = 0, const char *label = nullptr);
+
+        /**
+         * @brief Bring the IMU up and start the flash side without threads, then call poll() until it returns true
+         */
+        void start(uint32_t tag = 0, const char *label = nullptr);
+
+        /**
+         * @brief Drain the FIFO into the backlog, then run the next flash stage
+         *
+         * Each call takes as long as one stage, a chip's init, the mount with the session start, or the backlog.
+         *
+         * @return true once the sequence is done, succeeded() tells how it went
+         */
+        bool poll();
+
+        /** Same as what run() returns, once poll() returned true */
+        bool succeeded() const
+        {
+            return result;
+        }
+
+        /**
+         * @brief Move what the FIFO holds into the log, call this regularly once run() succeeded
+         *
+         * Timestamps carry on from the backlog, in us since reset. Also lets FlashLogFR::poll() start erasing ahead.
+         *
+         * @return number of samples written
+         */
+        uint16_t pump();
+
+        /**
+         * @brief Have pump() log vibration summaries (log_vibration_record) from spectrum
+         *
+         * The spectrum has to be set up for the ODR the IMU runs at. The backlog is always logged raw. With logRaw
+         * every summary closes the IMU block being filled, see FlashLogFR::reserveRecord().
+         *
+         * @param spectrum nullptr goes back to raw samples only
+         * @param logRaw keep logging the raw samples next to the summaries
+         */
+        void setSpectrum(BMI323Spectrum *spectrum, bool logRaw = false);
+
+        const stage_timing &timing(Stage stage) const
+        {
+            return timings[stage];
+        }
+
+        /** When the first sample was taken and when the log was ready to record, us since reset */
+        uint32_t firstSampleUs() const
+        {
+            return firstSample;
+        }
+        uint32_t logReadyUs() const
+        {
+            return logReady;
+        }
+
+        /** Samples that went through the RAM backlog, and those that didn't fit */
+        uint32_t backlogSamples() const
+        {
+            return backlogCount;
+        }
+        uint32_t droppedSamples() const
+        {
+            return backlogDropped;
+        }
+
+        /** Print one "[Startup]" line per stage */
+        void printTimings() const;
+
+        /**
+         * @brief Print the RAM taken by the driver, the log and the sequence, one "[Startup]" line each
+         *
+         * All of it is sized at compile time. Thread stacks are counted too when they are static, and with
+         * MBED_HEAP_STATS_ENABLED the heap's high water mark is printed as well.
+         */
+        static void printRamBudget();
+
+        static const char *stageName(Stage stage);
+
+    private:
+#if MBED_CONF_RTOS_PRESENT
+        // Flash threads
+        void flashTask();
+        void chip1Task();
+#endif
+
+        void reset(uint32_t tag, const char *label);
+
+        // IMU init and configuration, both quick
+        void startImu();
+
+        // Log mount and session start
+        bool openLog();
+
+        // Saved data path calibration into the IMU, and what it holds then into the log
+        bool restoreCalibration();
+
+        // Backlog into the log
+        bool writeBacklog();
+
+        // poll() is done
+        bool finish(bool ok);
+
+        // Move the FIFO into the backlog
+        void bufferSamples();
+
+        // Feed a pumped batch to the spectrum and log its summaries, timestamps from firstTimestamp on
+        bool logSpectrum(uint16_t count, uint32_t firstTimestamp);
+
+        void begin(Stage stage);
+        void end(Stage stage, int result);
+
+        uint32_t nextTimestamp();
+
+        // Timestamp of the sample-th sample since the FIFO started
+        uint32_t sampleTime(uint32_t sample) const;
+
+        BMI323SPI &imu;
+        FlashLogFR &log;
+        uint32_t periodUs;
+
+        BMI323Spectrum *spectrum;
+        bool logRaw;
+
+        stage_timing timings[STAGE_COUNT];
+
+        uint32_t sessionTag;
+        const char *sessionLabel;
+
+        // Set by the flash thread, read by the IMU side
+        std::atomic<bool> flashDone;
+        std::atomic<bool> flashOk;
+        bool imuOk;
+
+        // Next stage poll() runs, STAGE_COUNT when there is none
+        Stage nextStage;
+        bool result;
+
+        uint32_t firstSample;
+        uint32_t logReady;
+        uint32_t sampleCount;
+
+        // Samples from resumeSample on are timed from resumeBase, as the calibration restore leaves a gap before them
+        uint32_t resumeSample;
+        uint32_t resumeBase;
+
+        BMI323Base::accel_gyro_raw backlog[BACKLOG_SAMPLES];
+        uint32_t backlogCount;
+        uint32_t backlogDropped;
+
+        BMI323Base::accel_gyro_raw frames[BMI323Base::FIFO_MAX_FRAMES];
+};
+
+#endif // STARTUP_SEQUENCE_H
@@ -0,0 +1,409 @@
+/**
+ * @file bench_BMI323.cpp
+ * @brief Throughput/latency benchmarks for the BMI323 driver and flash log hot paths
+ *
+ * Every result is printed as one JSON object per line, prefixed with "BENCH " so it can be grepped out of the
+ * console log:
+ * BENCH {"name":"bulkRead","iterations":1000,"mean_us":...,"min_us":...,"max_us":...,"items_per_s":...,"mb_per_s":...}
+ *
+ * On target, time is taken from the DWT cycle counter. On the host build (host/CMakeLists.txt) the sensor and flash
+ * are software models and time comes from std::chrono, so host numbers measure the driver's CPU cost only.
+ *
+ * WARNING: the flash benchmarks erase and rewrite the last sector of the flash device.
+ */
+
+#include <mbed.h>
+#include <cinttypes>
+#include "BMI323/BMI323.h"
+#include "BMI323/BMI323Core.h"
+#include "BMI323/BMI323Decimator.h"
+#include "BMI323/BMI323Spectrum.h"
+#include "BMI323/BMI323Preintegrator.h"
+#include "IMUCodec.h"
+
+#ifdef BMI323_HOST_BUILD
+#include "SimBMI323.h"
+#include "SimFlashBlockDevice.h"
+#include <chrono>
+#else
+#include "SPIFBlockDevice.h"
+#endif
+
+#ifdef TARGET_INTEGRATOR_BOARD
+#define BENCH_IMU_MOSI      PB_5
+#define BENCH_IMU_MISO      PB_4
+#define BENCH_IMU_SCLK      PB_3
+#define BENCH_IMU_SSEL      PA_15
+#else
+// Nucleo board
+#define BENCH_IMU_MOSI      PB_5
+#define BENCH_IMU_MISO      PA_6
+#define BENCH_IMU_SCLK      PA_5
+#define BENCH_IMU_SSEL      PD_14
+#endif
+
+// Same wiring as FlashLogFR/PinNames.h, first chip only
+#define BENCH_FLASH_MOSI    PC_12
+#define BENCH_FLASH_MISO    PC_11
+#define BENCH_FLASH_SCLK    PC_10
+#define BENCH_FLASH_CS      PD_0
+#define BENCH_FLASH_FREQ    40000000
+
+// Flash page size used for the program benchmark
+#define BENCH_FLASH_PAGE    256
+
+namespace
+{
+#ifdef BMI323_HOST_BUILD
+    const char* BENCH_PLATFORM = "host";
+
+    const auto benchEpoch = std::chrono::steady_clock::now();
+
+    void benchClockInit()
+    {
+    }
+
+    // Nanoseconds, wraps after ~4 s which is far longer than any single call
+    inline uint32_t benchTicks()
+    {
+        auto elapsed = std::chrono::steady_clock::now() - benchEpoch;
+        return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    inline float benchTicksToUs(uint32_t ticks)
+    {
+        return static_cast<float>(ticks) / 1000.0f;
+    }
+#else
+    const char* BENCH_PLATFORM = "target";
+
+    void benchClockInit()
+    {
+        // Enable the DWT cycle counter, the Cortex-M7 also needs its lock access register unlocked
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->LAR = 0xC5ACCE55;
+        DWT->CYCCNT = 0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    }
+
+    // Core clock cycles, wraps after a few seconds at 550 MHz which is far longer than any single call
+    inline uint32_t benchTicks()
+    {
+        return DWT->CYCCNT;
+    }
+
+    inline float benchTicksToUs(uint32_t ticks)
+    {
+        return static_cast<float>(ticks) / (static_cast<float>(SystemCoreClock) / 1.0e6f);
+    }
+#endif
+
+    /**
+     * @brief Time body() iterations times and print one result line
+     *
+     * @param itemsPerCall samples (or frames) handled per call, for items_per_s
+     * @param bytesPerCall bytes moved per call, for mb_per_s, 0 to leave it out
+     * @param prepare called before every iteration, not timed
+     */
+    template <typename Body, typename Prepare>
+    void runBench(const char* name, uint32_t iterations, uint32_t itemsPerCall, uint32_t bytesPerCall, Body body,
+        Prepare prepare)
+    {
+        float totalUs = 0.0f;
+        float minUs = 1.0e9f;
+        float maxUs = 0.0f;
+        uint32_t items = 0;
+
+        for(uint32_t i = 0; i < iterations; i++)
+        {
+            prepare();
+
+            uint32_t start = benchTicks();
+            uint32_t handled = body();
+            float us = benchTicksToUs(benchTicks() - start);
+
+            totalUs += us;
+            minUs = us < minUs ? us : minUs;
+            maxUs = us > maxUs ? us : maxUs;
+            items += handled ? handled : itemsPerCall;
+        }
+
+        float meanUs = totalUs / iterations;
+        float itemsPerSecond = totalUs > 0.0f ? items / (totalUs / 1.0e6f) : 0.0f;
+        float mbPerSecond = totalUs > 0.0f ? (static_cast<float>(bytesPerCall) * iterations) / totalUs : 0.0f;
+
+        printf("BENCH {\"platform\":\"%s\",\"name\":\"%s\",\"iterations\":%" PRIu32 ",\"mean_us\":%.3f,"
+            "\"min_us\":%.3f,\"max_us\":%.3f,\"items_per_s\":%.1f,\"mb_per_s\":%.3f}\n",
+            BENCH_PLATFORM, name, iterations, meanUs, minUs, maxUs, itemsPerSecond, mbPerSecond);
+    }
+
+    template <typename Body>
+    void runBench(const char* name, uint32_t iterations, uint32_t itemsPerCall, uint32_t bytesPerCall, Body body)
+    {
+        runBench(name, iterations, itemsPerCall, bytesPerCall, body, []() {});
+    }
+
+    // Canned FIFO content, as it comes off the bus after the dummy byte
+    char fifoFrames[BMI323Base::FIFO_MAX_FRAMES * BMI323Base::FIFO_FRAME_WORDS * 2];
+
+    void buildFifoFrames()
+    {
+        for(uint16_t frame = 0; frame < BMI323Base::FIFO_MAX_FRAMES; frame++)
+        {
+            for(uint16_t word = 0; word < BMI323Base::FIFO_FRAME_WORDS; word++)
+            {
+                int16_t value = static_cast<int16_t>(frame * 7 + word * 131 - 300);
+                fifoFrames[2 * (frame * BMI323Base::FIFO_FRAME_WORDS + word)] = static_cast<char>(value & 0xFF);
+                fifoFrames[2 * (frame * BMI323Base::FIFO_FRAME_WORDS + word) + 1] = static_cast<char>((value >> 8) & 0xFF);
+            }
+        }
+    }
+
+    void benchSensor(BMI323SPI &bmi, void (*fillFifo)())
+    {
+        BMI323Base::accel_data accel;
+        BMI323Base::gyro_data gyro;
+        BMI323Base::accel_gyro_data data;
+        BMI323Base::accel_gyro_raw raw;
+        static BMI323Base::accel_gyro_raw frames[BMI323Base::FIFO_MAX_FRAMES];
+
+        runBench("readAccel", 1000, 1, 6, [&]() { bmi.readAccel(&accel); return 0u; });
+        runBench("readGyro", 1000, 1, 6, [&]() { bmi.readGyro(&gyro); return 0u; });
+        runBench("bulkRead", 1000, 1, 12, [&]() { bmi.bulkRead(&data); return 0u; });
+        runBench("bulkReadRaw", 1000, 1, 12, [&]() { bmi.bulkReadRaw(&raw); return 0u; });
+
+        // Frames drained per call depend on what's in the FIFO, so items_per_s counts the frames actually read
+        runBench("fifoDrain", 20, 0, BMI323Base::FIFO_MAX_FRAMES * BMI323Base::FIFO_FRAME_WORDS * 2,
+            [&]() { return static_cast<uint32_t>(bmi.readFifo(frames, BMI323Base::FIFO_MAX_FRAMES)); },
+            fillFifo);
+    }
+
+    /**
+     * @brief Same reads through BMI323Core, no virtual calls and constant scale factors
+     */
+    template <typename Core>
+    void benchCore(Core &core)
+    {
+        BMI323Base::accel_data accel;
+        BMI323Base::accel_gyro_data data;
+        BMI323Base::accel_gyro_raw raw;
+
+        runBench("coreReadAccel", 1000, 1, 6, [&]() { core.readAccel(&accel); return 0u; });
+        runBench("coreRead", 1000, 1, 12, [&]() { core.read(&data); return 0u; });
+        runBench("coreReadRaw", 1000, 1, 12, [&]() { core.readRaw(&raw); return 0u; });
+    }
+
+    void benchDecode()
+    {
+        static BMI323Base::accel_gyro_raw frames[BMI323Base::FIFO_MAX_FRAMES];
+        BMI323Base::accel_gyro_data data;
+
+        buildFifoFrames();
+
+        runBench("fifoDecode", 200, BMI323Base::FIFO_MAX_FRAMES, sizeof(fifoFrames),
+            [&]() { return static_cast<uint32_t>(BMI323Base::decodeFifo(fifoFrames, BMI323Base::FIFO_MAX_FRAMES, frames)); });
+
+        runBench("scale", 200, BMI323Base::FIFO_MAX_FRAMES, 0, [&]() {
+            for(uint16_t i = 0; i < BMI323Base::FIFO_MAX_FRAMES; i++)
+            {
+                BMI323Base::scale(frames[i], &data);
+            }
+            return 0u;
+        });
+
+        static IMUBlockEncoder encoder;
+        runBench("imuEncode", 200, BMI323Base::FIFO_MAX_FRAMES, 0, [&]() {
+            for(uint16_t i = 0; i < BMI323Base::FIFO_MAX_FRAMES; i++)
+            {
+                if(encoder.push(frames[i].accel, i))
+                {
+                    encoder.block();
+                    encoder.nextBlock();
+                }
+            }
+            return 0u;
+        });
+    }
+
+    /**
+     * @brief A full FIFO through one FIR output, one CIC output, then the three outputs a mixed rate setup runs
+     */
+    void benchDecimate()
+    {
+        static BMI323Base::accel_gyro_raw frames[BMI323Base::FIFO_MAX_FRAMES];
+        static BMI323Decimator decimator;
+
+        buildFifoFrames();
+        BMI323Base::decodeFifo(fifoFrames, BMI323Base::FIFO_MAX_FRAMES, frames);
+
+        auto body = [&]() { return static_cast<uint32_t>(decimator.process(frames, BMI323Base::FIFO_MAX_FRAMES)); };
+
+        decimator.clear();
+        decimator.addFir(4);
+        runBench("decimateFir4", 200, BMI323Base::FIFO_MAX_FRAMES, 0, body);
+
+        decimator.clear();
+        decimator.addCic(8);
+        runBench("decimateCic8", 200, BMI323Base::FIFO_MAX_FRAMES, 0, body);
+
+        decimator.clear();
+        decimator.addFir(2);
+        decimator.addFir(4);
+        decimator.addCic(8);
+        runBench("decimateMixed", 200, BMI323Base::FIFO_MAX_FRAMES, 0, body);
+    }
+
+    /**
+     * @brief One window per call through BMI323Spectrum, FFT of all three axes and the summary
+     */
+    void benchSpectrum()
+    {
+        static BMI323Base::accel_gyro_raw frames[BMI323Spectrum::MAX_FFT_SIZE];
+        static BMI323Spectrum spectrum;
+
+        buildFifoFrames();
+        for(uint16_t i = 0; i < BMI323Spectrum::MAX_FFT_SIZE; i += BMI323Base::FIFO_MAX_FRAMES)
+        {
+            uint16_t count = BMI323Spectrum::MAX_FFT_SIZE - i;
+            count = count < BMI323Base::FIFO_MAX_FRAMES ? count : BMI323Base::FIFO_MAX_FRAMES;
+            BMI323Base::decodeFifo(fifoFrames, count, frames + i);
+        }
+
+        spectrum.setup(3200.0f, 256, 256, 1);
+        runBench("spectrum256", 200, 256, 0, [&]() { return static_cast<uint32_t>(spectrum.process(frames, 256)); });
+
+        spectrum.setup(3200.0f, 1024, 1024, 1);
+        runBench("spectrum1024", 50, 1024, 0, [&]() { return static_cast<uint32_t>(spectrum.process(frames, 1024)); });
+    }
+
+    /**
+     * @brief A full FIFO into increments of 8 frames, with and without coning and sculling compensation
+     */
+    void benchPreintegrate()
+    {
+        static BMI323Base::accel_gyro_raw frames[BMI323Base::FIFO_MAX_FRAMES];
+        static BMI323Preintegrator integrator;
+
+        buildFifoFrames();
+        BMI323Base::decodeFifo(fifoFrames, BMI323Base::FIFO_MAX_FRAMES, frames);
+        integrator.setup(1600.0f, 8);
+
+        auto body = [&]() {
+            float sum = 0.0f;
+            for(uint16_t used = 0; used < BMI323Base::FIFO_MAX_FRAMES; )
+            {
+                used += integrator.process(frames + used, BMI323Base::FIFO_MAX_FRAMES - used);
+                sum += integrator.incrementReady() ? integrator.increment().deltaAngle[0] : 0.0f;
+            }
+            // Keeps the loop from being optimised out
+            return sum == 12345.0f ? 1u : 0u;
+        };
+
+        integrator.setCompensation(true);
+        runBench("preintegrate", 200, BMI323Base::FIFO_MAX_FRAMES, 0, body);
+
+        integrator.setCompensation(false);
+        runBench("preintegratePlain", 200, BMI323Base::FIFO_MAX_FRAMES, 0, body);
+    }
+
+    void benchFlash(BlockDevice &flash)
+    {
+        static uint8_t buffer[4096];
+
+        int err = flash.init();
+        if(err)
+        {
+            printf("Flash init failed: %d\n", err);
+            return;
+        }
+
+        // Scratch region is the last erase sector of the device
+        bd_size_t sectorSize = flash.get_erase_size(flash.size() - 1);
+        bd_addr_t scratch = flash.size() - sectorSize;
+        if(sectorSize > sizeof(buffer))
+        {
+            printf("Flash sector too large for the benchmark buffer: %" PRIu32 "\n", static_cast<uint32_t>(sectorSize));
+            flash.deinit();
+            return;
+        }
+
+        for(size_t i = 0; i < sizeof(buffer); i++)
+        {
+            buffer[i] = static_cast<uint8_t>(i * 31);
+        }
+
+        runBench("flashErase", 10, 1, sectorSize, [&]() { flash.erase(scratch, sectorSize); return 0u; });
+
+        uint32_t pages = sectorSize / BENCH_FLASH_PAGE;
+        runBench("flashProgram", 10, pages, sectorSize, [&]() {
+            for(uint32_t page = 0; page < pages; page++)
+            {
+                flash.program(buffer + page * BENCH_FLASH_PAGE, scratch + page * BENCH_FLASH_PAGE, BENCH_FLASH_PAGE);
+            }
+            return 0u;
+        }, [&]() { flash.erase(scratch, sectorSize); });
+
+        runBench("flashRead", 50, 1, sectorSize, [&]() { flash.read(buffer, scratch, sectorSize); return 0u; });
+
+        flash.deinit();
+    }
+
+#ifdef BMI323_HOST_BUILD
+    SimBMI323 simImu;
+    SimFlashBlockDevice simFlash(16 * 1024 * 1024);
+
+    void fillFifo()
+    {
+        simImu.fillFifo(BMI323Base::FIFO_MAX_FRAMES);
+    }
+#else
+    void fillFifo()
+    {
+        // Wait for a full FIFO at 800 Hz
+        ThisThread::sleep_for(1ms * (BMI323Base::FIFO_MAX_FRAMES * 1000 / 800 + 10));
+    }
+#endif
+}
+
+int main()
+{
+    benchClockInit();
+
+#ifdef BMI323_HOST_BUILD
+    SPI::attach(BENCH_IMU_SSEL, &simImu);
+    BlockDevice &flash = simFlash;
+#else
+    SPIFBlockDevice spif(BENCH_FLASH_MOSI, BENCH_FLASH_MISO, BENCH_FLASH_SCLK, BENCH_FLASH_CS, BENCH_FLASH_FREQ);
+    BlockDevice &flash = spif;
+#endif
+
+    BMI323SPI bmi(BENCH_IMU_MOSI, BENCH_IMU_MISO, BENCH_IMU_SCLK, BENCH_IMU_SSEL);
+    ThisThread::sleep_for(10ms);
+
+    if(!bmi.init())
+    {
+        printf("BMI323 not found, skipping sensor benchmarks\n");
+    }
+    else
+    {
+        bmi.fifoSetup();
+        bmi.accelSetup();
+        bmi.gyroSetup();
+        benchSensor(bmi, fillFifo);
+
+#ifdef BMI323_HOST_BUILD
+        // The target has no second handle on the driver's bus, the core's SPI path is what bulkRead() times there
+        BMI323Core<SimBMI323Bus> core{SimBMI323Bus(simImu)};
+        benchCore(core);
+#endif
+    }
+
+    benchDecode();
+    benchDecimate();
+    benchSpectrum();
+    benchPreintegrate();
+    benchFlash(flash);
+
+    printf("BENCH done\n");
+    return 0;
+}
@@ -0,0 +1,101 @@
+/**
+ * @file imu_decode.cpp
+ * @brief Decode the compressed IMU blocks of a raw flash log dump to CSV
+ *
+ * Usage: imu_decode <dump.bin> [out.csv]
+ *
+ * The dump is expected to start at logStart, so block k is at offset k * IMU_BLOCK_SIZE. Segment summary blocks are
+ * skipped. Decoding stops at the first erased block, blocks failing their CRC are reported and skipped.
+ */
+
+#include "IMUCodec.h"
+#include "LogIndex.h"
+#include <cstdio>
+#include <cinttypes>
+#include <cstring>
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <dump.bin> [out.csv]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (!in)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (argc > 2)
+    {
+        out = fopen(argv[2], "w");
+        if (!out)
+        {
+            perror(argv[2]);
+            fclose(in);
+            return 1;
+        }
+    }
+
+    // Every sample takes at least one byte per channel, so this bounds the samples per block
+    static int16_t samples[IMU_BLOCK_SIZE / IMU_CHANNELS + 1][IMU_CHANNELS];
+    uint8_t block[IMU_BLOCK_SIZE];
+
+    uint64_t blockCount = 0;
+    uint64_t sampleCount = 0;
+    uint64_t badBlocks = 0;
+
+    fprintf(out, "sample,timestamp,accel_x,accel_y,accel_z,gyro_x,gyro_y,gyro_z\n");
+
+    while (fread(block, 1, sizeof(block), in) == sizeof(block))
+    {
+        // Segment summaries (LogIndex.h) sit in line with the data
+        uint32_t magic;
+        memcpy(&magic, block, sizeof(magic));
+        if (magic == LOG_SUMMARY_MAGIC)
+        {
+            continue;
+        }
+
+        imu_block_header header;
+        int count = IMUBlockDecoder::decode(block, sizeof(block), samples, sizeof(samples) / sizeof(samples[0]), &header);
+
+        if (count == IMU_CODEC_ERROR_MAGIC)
+        {
+            break;
+        }
+        if (count < 0)
+        {
+            fprintf(stderr, "Block %" PRIu64 ": decode error %d, skipping\n", blockCount, count);
+            badBlocks++;
+            blockCount++;
+            continue;
+        }
+
+        // Timestamps in between the first and last sample are interpolated
+        for (int n = 0; n < count; n++)
+        {
+            uint32_t span = header.lastTimestamp - header.firstTimestamp;
+            uint32_t timestamp = header.firstTimestamp + (count > 1 ? static_cast<uint32_t>(static_cast<uint64_t>(span) * n / (count - 1)) : 0);
+
+            fprintf(out, "%" PRIu32 ",%" PRIu32 ",%d,%d,%d,%d,%d,%d\n", header.firstSampleIndex + n, timestamp,
+                samples[n][0], samples[n][1], samples[n][2], samples[n][3], samples[n][4], samples[n][5]);
+        }
+
+        sampleCount += count;
+        blockCount++;
+    }
+
+    fprintf(stderr, "%" PRIu64 " blocks, %" PRIu64 " samples, %" PRIu64 " bad blocks\n", blockCount, sampleCount, badBlocks);
+
+    fclose(in);
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    return badBlocks ? 2 : 0;
+}
@@ -0,0 +1,388 @@
+/**
+ * @file log_export.cpp
+ * @brief Decode the IMU blocks of a flash log dump to CSV or a columnar binary file, on all cores
+ *
+ * Usage: log_export <dump.bin> <out> [--columns] [--scaled] [--threads N]
+ *
+ * The dump is memory mapped and cut into chunks of CHUNK_BLOCKS blocks. Worker threads decode the chunks (CRC
+ * checked, unsealed blocks recovered from their commit stamps) and the main thread writes them out in order, so the
+ * output is the same as a single threaded run. Blocks that aren't IMU blocks (summaries, record pages, erased flash)
+ * are skipped, log_records handles the typed records.
+ *
+ * --scaled converts to g and dps with BMI323Base::scale, the same as readAccel()/readGyro(), instead of raw LSB.
+ *
+ * --columns writes this layout, little endian, for numpy and friends:
+ *   header      export_file_header (32 bytes)
+ *   row groups  uint32 rows, uint32 0, then the columns one after the other: sample uint32[rows],
+ *               timestamp uint32[rows], accel x, y, z, gyro x, y, z as int16[rows] (raw) or float32[rows] (scaled)
+ */
+
+#include "BMI323/BMI323.h"
+#include "IMUCodec.h"
+#include "LogIndex.h"
+#include <atomic>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    // 1 MB of log per chunk, enough to keep the thread handoff out of the profile
+    constexpr size_t CHUNK_BLOCKS = 2048;
+
+    // Chunks decoded ahead of the writer, per thread
+    constexpr size_t CHUNKS_PER_THREAD = 4;
+
+    /** "IMCL" */
+    constexpr uint32_t EXPORT_MAGIC = 0x4C434D49;
+    constexpr uint16_t EXPORT_VERSION = 1;
+    constexpr uint16_t EXPORT_FLAG_SCALED = 0x0001;
+
+    struct export_file_header {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t flags;
+        uint16_t columns;               // always 8
+        uint16_t reserved;
+        float accelLsbPerMg;            // sensitivities the raw columns were taken with
+        float gyroLsbPerDps;
+        uint32_t reserved2;
+        uint64_t rows;                  // total over all row groups
+    };
+
+    static_assert(sizeof(export_file_header) == 32, "export_file_header layout changed, bump the version");
+
+    struct Options
+    {
+        bool columns = false;
+        bool scaled = false;
+        unsigned threads = 0;
+    };
+
+    struct Chunk
+    {
+        std::string text;
+        std::vector<uint32_t> sample;
+        std::vector<uint32_t> timestamp;
+        std::vector<int16_t> raw[IMU_CHANNELS];
+        std::vector<float> scaled[IMU_CHANNELS];
+        uint64_t blocks;
+        uint64_t samples;
+        uint64_t badBlocks;
+    };
+
+    void appendCsv(std::string &text, uint32_t sample, uint32_t timestamp, const int16_t values[IMU_CHANNELS],
+        bool scaled)
+    {
+        char line[160];
+        int length;
+        if (scaled)
+        {
+            BMI323Base::accel_gyro_raw raw;
+            memcpy(raw.accel, values, sizeof(raw.accel));
+            memcpy(raw.gyro, values + 3, sizeof(raw.gyro));
+            BMI323Base::accel_gyro_data data;
+            BMI323Base::scale(raw, &data);
+            length = snprintf(line, sizeof(line), "%" PRIu32 ",%" PRIu32 ",%.6f,%.6f,%.6f,%.5f,%.5f,%.5f\n", sample,
+                timestamp, data.accel.x, data.accel.y, data.accel.z, data.gyro.x, data.gyro.y, data.gyro.z);
+        }
+        else
+        {
+            length = snprintf(line, sizeof(line), "%" PRIu32 ",%" PRIu32 ",%d,%d,%d,%d,%d,%d\n", sample, timestamp,
+                values[0], values[1], values[2], values[3], values[4], values[5]);
+        }
+        text.append(line, length);
+    }
+
+    void appendColumns(Chunk &chunk, uint32_t sample, uint32_t timestamp, const int16_t values[IMU_CHANNELS],
+        bool scaled)
+    {
+        chunk.sample.push_back(sample);
+        chunk.timestamp.push_back(timestamp);
+        if (scaled)
+        {
+            BMI323Base::accel_gyro_raw raw;
+            memcpy(raw.accel, values, sizeof(raw.accel));
+            memcpy(raw.gyro, values + 3, sizeof(raw.gyro));
+            BMI323Base::accel_gyro_data data;
+            BMI323Base::scale(raw, &data);
+            float converted[IMU_CHANNELS] = {data.accel.x, data.accel.y, data.accel.z, data.gyro.x, data.gyro.y,
+                data.gyro.z};
+            for (size_t i = 0; i < IMU_CHANNELS; i++)
+            {
+                chunk.scaled[i].push_back(converted[i]);
+            }
+        }
+        else
+        {
+            for (size_t i = 0; i < IMU_CHANNELS; i++)
+            {
+                chunk.raw[i].push_back(values[i]);
+            }
+        }
+    }
+
+    void decodeChunk(const uint8_t *log, uint64_t firstBlock, uint64_t blockCount, const Options &options, Chunk &chunk)
+    {
+        static thread_local int16_t samples[IMU_BLOCK_SIZE / IMU_CHANNELS + 1][IMU_CHANNELS];
+
+        chunk.text.clear();
+        chunk.sample.clear();
+        chunk.timestamp.clear();
+        for (size_t i = 0; i < IMU_CHANNELS; i++)
+        {
+            chunk.raw[i].clear();
+            chunk.scaled[i].clear();
+        }
+        chunk.blocks = 0;
+        chunk.samples = 0;
+        chunk.badBlocks = 0;
+
+        for (uint64_t blockIndex = firstBlock; blockIndex < firstBlock + blockCount; blockIndex++)
+        {
+            const uint8_t *block = log + blockIndex * IMU_BLOCK_SIZE;
+            uint32_t magic;
+            memcpy(&magic, block, sizeof(magic));
+            if (magic != IMU_BLOCK_MAGIC)
+            {
+                continue;
+            }
+
+            imu_block_header header;
+            int count = IMUBlockDecoder::decode(block, IMU_BLOCK_SIZE, samples, sizeof(samples) / sizeof(samples[0]),
+                &header);
+            if (count < 0)
+            {
+                fprintf(stderr, "Block %" PRIu64 ": decode error %d, skipping\n", blockIndex, count);
+                chunk.badBlocks++;
+                continue;
+            }
+
+            // Timestamps in between the first and last sample are interpolated, as imu_decode
+            uint32_t span = header.lastTimestamp - header.firstTimestamp;
+            for (int n = 0; n < count; n++)
+            {
+                uint32_t timestamp = header.firstTimestamp + (count > 1 ? static_cast<uint32_t>(static_cast<uint64_t>(span) * n / (count - 1)) : 0);
+                if (options.columns)
+                {
+                    appendColumns(chunk, header.firstSampleIndex + n, timestamp, samples[n], options.scaled);
+                }
+                else
+                {
+                    appendCsv(chunk.text, header.firstSampleIndex + n, timestamp, samples[n], options.scaled);
+                }
+            }
+            chunk.blocks++;
+            chunk.samples += count;
+        }
+    }
+
+    template <typename T>
+    bool writeColumn(FILE *out, const std::vector<T> &column)
+    {
+        return fwrite(column.data(), sizeof(T), column.size(), out) == column.size();
+    }
+
+    bool writeChunk(FILE *out, const Chunk &chunk, const Options &options)
+    {
+        if (!options.columns)
+        {
+            return fwrite(chunk.text.data(), 1, chunk.text.size(), out) == chunk.text.size();
+        }
+
+        uint32_t group[2] = {static_cast<uint32_t>(chunk.sample.size()), 0};
+        if (group[0] == 0)
+        {
+            return true;
+        }
+        bool ok = fwrite(group, sizeof(group), 1, out) == 1 && writeColumn(out, chunk.sample) &&
+            writeColumn(out, chunk.timestamp);
+        for (size_t i = 0; i < IMU_CHANNELS && ok; i++)
+        {
+            ok = options.scaled ? writeColumn(out, chunk.scaled[i]) : writeColumn(out, chunk.raw[i]);
+        }
+        return ok;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <dump.bin> <out> [--columns] [--scaled] [--threads N]\n", argv[0]);
+        return 1;
+    }
+
+    Options options;
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--columns") == 0)
+        {
+            options.columns = true;
+        }
+        else if (strcmp(argv[i], "--scaled") == 0)
+        {
+            options.scaled = true;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            options.threads = static_cast<unsigned>(atoi(argv[++i]));
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (options.threads == 0)
+    {
+        options.threads = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    uint64_t blockCount = static_cast<uint64_t>(st.st_size) / IMU_BLOCK_SIZE;
+    if (blockCount == 0)
+    {
+        fprintf(stderr, "%s holds no complete block\n", argv[1]);
+        close(fd);
+        return 1;
+    }
+
+    const uint8_t *log = static_cast<const uint8_t *>(mmap(nullptr, blockCount * IMU_BLOCK_SIZE, PROT_READ,
+        MAP_PRIVATE, fd, 0));
+    if (log == MAP_FAILED)
+    {
+        perror("mmap");
+        close(fd);
+        return 1;
+    }
+    madvise(const_cast<uint8_t *>(log), blockCount * IMU_BLOCK_SIZE, MADV_SEQUENTIAL);
+
+    FILE *out = fopen(argv[2], "wb");
+    if (!out)
+    {
+        perror(argv[2]);
+        return 1;
+    }
+
+    export_file_header fileHeader = {};
+    if (options.columns)
+    {
+        fileHeader.magic = EXPORT_MAGIC;
+        fileHeader.version = EXPORT_VERSION;
+        fileHeader.flags = options.scaled ? EXPORT_FLAG_SCALED : 0;
+        fileHeader.columns = 2 + IMU_CHANNELS;
+        fileHeader.accelLsbPerMg = BMI323Base::ACCEL_LSB_PER_MG;
+        fileHeader.gyroLsbPerDps = BMI323Base::GYRO_LSB_PER_DPS;
+        fwrite(&fileHeader, sizeof(fileHeader), 1, out);
+    }
+    else
+    {
+        fprintf(out, options.scaled ? "sample,timestamp,accel_x_g,accel_y_g,accel_z_g,gyro_x_dps,gyro_y_dps,gyro_z_dps\n" :
+            "sample,timestamp,accel_x,accel_y,accel_z,gyro_x,gyro_y,gyro_z\n");
+    }
+
+    // Workers fill the slots chunk by chunk, at most slots.size() ahead of the writer
+    uint64_t chunkCount = (blockCount + CHUNK_BLOCKS - 1) / CHUNK_BLOCKS;
+    std::vector<Chunk> slots(options.threads * CHUNKS_PER_THREAD);
+    std::vector<uint64_t> ready(slots.size(), UINT64_MAX);
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::atomic<uint64_t> nextChunk(0);
+    uint64_t writtenChunks = 0;
+
+    auto worker = [&]() {
+        while (true)
+        {
+            uint64_t chunkIndex = nextChunk++;
+            if (chunkIndex >= chunkCount)
+            {
+                return;
+            }
+
+            size_t slot = chunkIndex % slots.size();
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]() { return chunkIndex < writtenChunks + slots.size(); });
+            }
+
+            uint64_t firstBlock = chunkIndex * CHUNK_BLOCKS;
+            uint64_t count = blockCount - firstBlock < CHUNK_BLOCKS ? blockCount - firstBlock : CHUNK_BLOCKS;
+            decodeChunk(log, firstBlock, count, options, slots[slot]);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            ready[slot] = chunkIndex;
+            changed.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < options.threads; i++)
+    {
+        workers.emplace_back(worker);
+    }
+
+    uint64_t rows = 0;
+    uint64_t blocks = 0;
+    uint64_t badBlocks = 0;
+    bool writeOk = true;
+
+    for (uint64_t chunkIndex = 0; chunkIndex < chunkCount; chunkIndex++)
+    {
+        size_t slot = chunkIndex % slots.size();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]() { return ready[slot] == chunkIndex; });
+        }
+
+        const Chunk &chunk = slots[slot];
+        writeOk = writeOk && writeChunk(out, chunk, options);
+        rows += chunk.samples;
+        blocks += chunk.blocks;
+        badBlocks += chunk.badBlocks;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        writtenChunks++;
+        changed.notify_all();
+    }
+
+    for (std::thread &thread : workers)
+    {
+        thread.join();
+    }
+
+    if (options.columns)
+    {
+        fileHeader.rows = rows;
+        writeOk = writeOk && fseek(out, 0, SEEK_SET) == 0 && fwrite(&fileHeader, sizeof(fileHeader), 1, out) == 1;
+    }
+    if (fclose(out) || !writeOk)
+    {
+        perror(argv[2]);
+        return 1;
+    }
+
+    munmap(const_cast<uint8_t *>(log), blockCount * IMU_BLOCK_SIZE);
+    close(fd);
+
+    fprintf(stderr, "%" PRIu64 " blocks, %" PRIu64 " samples, %" PRIu64 " bad blocks, %u threads\n", blocks, rows,
+        badBlocks, options.threads);
+    return badBlocks ? 2 : 0;
+}
@@ -0,0 +1,278 @@
+/**
+ * @file log_query.cpp
+ * @brief Pull a time window or the segment summaries out of a flash log dump without decoding all of it
+ *
+ * Usage: log_query <dump.bin> --from T --to T [out.csv]     samples with from <= timestamp <= to, as imu_decode
+ *        log_query <dump.bin> --summaries [--spread N]     one line per segment, newest first, optionally only the
+ *                                                          segments where some channel spans more than N LSB
+ *
+ * Uses the in line segment summaries and the block search from LogIndex.h, the number of reads is reported on
+ * stderr.
+ */
+
+#include "IMUCodec.h"
+#include "LogIndex.h"
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    class DumpReader : public LogBlockReader
+    {
+        public:
+            DumpReader(int fd) : fd(fd), reads(0), bytes(0)
+            {
+            }
+
+            bool readBlock(uint32_t blockIndex, void *buffer, size_t size) override
+            {
+                reads++;
+                bytes += size;
+                return pread(fd, buffer, size, static_cast<off_t>(blockIndex) * IMU_BLOCK_SIZE) ==
+                    static_cast<ssize_t>(size);
+            }
+
+            int fd;
+            uint64_t reads;
+            uint64_t bytes;
+    };
+
+    bool isBlock(DumpReader &reader, uint32_t blockIndex)
+    {
+        uint32_t magic;
+        return reader.readBlock(blockIndex, &magic, sizeof(magic)) &&
+            (magic == IMU_BLOCK_MAGIC || magic == LOG_SUMMARY_MAGIC);
+    }
+
+    // Blocks are written back to back from 0, so the end is the first erased block
+    uint32_t findEnd(DumpReader &reader, uint32_t blockCount)
+    {
+        uint32_t low = 0;
+        uint32_t high = blockCount;
+        while (low < high)
+        {
+            uint32_t mid = low + (high - low) / 2;
+            if (isBlock(reader, mid))
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+        return low;
+    }
+
+    int listSummaries(DumpReader &reader, uint32_t blockCount, int spread)
+    {
+        uint32_t end = findEnd(reader, blockCount);
+
+        // The newest summary is at most one segment back from the end
+        uint32_t blockIndex = LOG_NO_SUMMARY;
+        for (uint32_t back = 1; back <= LOG_SEGMENT_BLOCKS + 1 && back <= end; back++)
+        {
+            log_segment_summary summary;
+            if (reader.readBlock(end - back, &summary, sizeof(summary)) && logCheckSummary(summary))
+            {
+                blockIndex = end - back;
+                break;
+            }
+        }
+
+        printf("sequence,first_block,blocks,samples,first_timestamp,last_timestamp,"
+            "min_ax,min_ay,min_az,min_gx,min_gy,min_gz,max_ax,max_ay,max_az,max_gx,max_gy,max_gz\n");
+
+        uint32_t listed = 0;
+        while (blockIndex != LOG_NO_SUMMARY && blockIndex < end)
+        {
+            log_segment_summary summary;
+            if (!reader.readBlock(blockIndex, &summary, sizeof(summary)) || !logCheckSummary(summary))
+            {
+                fprintf(stderr, "Bad summary at block %" PRIu32 ", stopping\n", blockIndex);
+                return 2;
+            }
+
+            int widest = 0;
+            for (size_t i = 0; i < IMU_CHANNELS; i++)
+            {
+                int range = summary.max[i] - summary.min[i];
+                widest = range > widest ? range : widest;
+            }
+
+            if (widest > spread)
+            {
+                printf("%" PRIu32 ",%" PRIu32 ",%u,%" PRIu32 ",%" PRIu32 ",%" PRIu32, summary.sequence,
+                    summary.firstBlock, summary.blockCount, summary.sampleCount, summary.firstTimestamp,
+                    summary.lastTimestamp);
+                for (size_t i = 0; i < IMU_CHANNELS; i++)
+                {
+                    printf(",%d", summary.min[i]);
+                }
+                for (size_t i = 0; i < IMU_CHANNELS; i++)
+                {
+                    printf(",%d", summary.max[i]);
+                }
+                printf("\n");
+                listed++;
+            }
+
+            blockIndex = summary.previousSummary;
+        }
+
+        fprintf(stderr, "%" PRIu32 " segments listed\n", listed);
+        return 0;
+    }
+
+    int extractWindow(DumpReader &reader, uint32_t blockCount, uint32_t from, uint32_t to, FILE *out)
+    {
+        static int16_t samples[IMU_BLOCK_SIZE / IMU_CHANNELS + 1][IMU_CHANNELS];
+        uint8_t block[IMU_BLOCK_SIZE];
+        uint64_t written = 0;
+
+        fprintf(out, "sample,timestamp,accel_x,accel_y,accel_z,gyro_x,gyro_y,gyro_z\n");
+
+        for (uint32_t blockIndex = logFindBlock(reader, blockCount, from); blockIndex < blockCount; blockIndex++)
+        {
+            if (!reader.readBlock(blockIndex, block, sizeof(block)))
+            {
+                break;
+            }
+
+            uint32_t magic;
+            memcpy(&magic, block, sizeof(magic));
+            if (magic == LOG_SUMMARY_MAGIC)
+            {
+                continue;
+            }
+
+            imu_block_header header;
+            int count = IMUBlockDecoder::decode(block, sizeof(block), samples, sizeof(samples) / sizeof(samples[0]),
+                &header);
+            if (count == IMU_CODEC_ERROR_MAGIC)
+            {
+                break;
+            }
+            if (count < 0)
+            {
+                fprintf(stderr, "Block %" PRIu32 ": decode error %d, skipping\n", blockIndex, count);
+                continue;
+            }
+            if (header.firstTimestamp > to)
+            {
+                break;
+            }
+
+            for (int n = 0; n < count; n++)
+            {
+                uint32_t span = header.lastTimestamp - header.firstTimestamp;
+                uint32_t timestamp = header.firstTimestamp + (count > 1 ? static_cast<uint32_t>(static_cast<uint64_t>(span) * n / (count - 1)) : 0);
+                if (timestamp < from || timestamp > to)
+                {
+                    continue;
+                }
+
+                fprintf(out, "%" PRIu32 ",%" PRIu32 ",%d,%d,%d,%d,%d,%d\n", header.firstSampleIndex + n, timestamp,
+                    samples[n][0], samples[n][1], samples[n][2], samples[n][3], samples[n][4], samples[n][5]);
+                written++;
+            }
+        }
+
+        fprintf(stderr, "%" PRIu64 " samples\n", written);
+        return 0;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <dump.bin> --from T --to T [out.csv]\n"
+            "       %s <dump.bin> --summaries [--spread N]\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    bool summaries = false;
+    bool window = false;
+    uint32_t from = 0;
+    uint32_t to = UINT32_MAX;
+    int spread = -1;
+    const char *outPath = nullptr;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--from") == 0 && i + 1 < argc)
+        {
+            from = strtoul(argv[++i], nullptr, 0);
+            window = true;
+        }
+        else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc)
+        {
+            to = strtoul(argv[++i], nullptr, 0);
+            window = true;
+        }
+        else if (strcmp(argv[i], "--summaries") == 0)
+        {
+            summaries = true;
+        }
+        else if (strcmp(argv[i], "--spread") == 0 && i + 1 < argc)
+        {
+            spread = atoi(argv[++i]);
+        }
+        else if (argv[i][0] != '-' && !outPath)
+        {
+            outPath = argv[i];
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    uint32_t blockCount = static_cast<uint32_t>(st.st_size / IMU_BLOCK_SIZE);
+
+    DumpReader reader(fd);
+    int result = 1;
+
+    if (summaries)
+    {
+        result = listSummaries(reader, blockCount, spread);
+    }
+    else if (window)
+    {
+        FILE *out = outPath ? fopen(outPath, "w") : stdout;
+        if (!out)
+        {
+            perror(outPath);
+            return 1;
+        }
+        result = extractWindow(reader, blockCount, from, to, out);
+        if (out != stdout)
+        {
+            fclose(out);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Nothing to do, give --from/--to or --summaries\n");
+    }
+
+    fprintf(stderr, "%" PRIu64 " reads, %" PRIu64 " bytes read of %" PRIu64 "\n", reader.reads, reader.bytes,
+        static_cast<uint64_t>(st.st_size));
+    close(fd);
+    return result;
+}
@@ -0,0 +1,382 @@
+/**
+ * @file log_receive.cpp
+ * @brief Download a flash log from FlashLogFR::serveDump using the protocol in DumpProtocol.h
+ *
+ * Usage: log_receive <port> <out.bin> [--baud N] [--offset N] [--length N] [--compress] [--resume]
+ *
+ * The output file mirrors the log: byte k of the file is byte k of the log, so it can go straight into imu_decode.
+ * Chunks that fail their CRC or go missing are requested again once the stream ends. If the transfer is given up,
+ * the file is cut at the first missing byte and --resume picks up from there.
+ */
+
+#include "DumpProtocol.h"
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace
+{
+    constexpr int READ_TIMEOUT_MS = 3000;
+    constexpr int MAX_ATTEMPTS = 10;
+
+    bool configurePort(int fd, long baud)
+    {
+        if (!isatty(fd))
+        {
+            // A pipe or a file holding a captured stream
+            return true;
+        }
+
+        struct BaudRate
+        {
+            long baud;
+            speed_t speed;
+        };
+        static const BaudRate rates[] = {
+            {115200, B115200}, {230400, B230400}, {460800, B460800}, {921600, B921600},
+#ifdef B1000000
+            {1000000, B1000000}, {1500000, B1500000}, {2000000, B2000000}, {3000000, B3000000}, {4000000, B4000000},
+#endif
+        };
+
+        speed_t speed = 0;
+        for (const BaudRate &rate : rates)
+        {
+            if (rate.baud == baud)
+            {
+                speed = rate.speed;
+            }
+        }
+        if (!speed)
+        {
+            fprintf(stderr, "Unsupported baud rate %ld\n", baud);
+            return false;
+        }
+
+        struct termios tty;
+        if (tcgetattr(fd, &tty))
+        {
+            perror("tcgetattr");
+            return false;
+        }
+        cfmakeraw(&tty);
+        cfsetispeed(&tty, speed);
+        cfsetospeed(&tty, speed);
+        tty.c_cflag |= CLOCAL | CREAD;
+        tty.c_cc[VMIN] = 0;
+        tty.c_cc[VTIME] = 0;
+        if (tcsetattr(fd, TCSANOW, &tty))
+        {
+            perror("tcsetattr");
+            return false;
+        }
+        tcflush(fd, TCIOFLUSH);
+        return true;
+    }
+
+    // Read exactly size bytes, false on timeout or error
+    bool readFully(int fd, void *buffer, size_t size)
+    {
+        uint8_t *bytes = static_cast<uint8_t *>(buffer);
+        while (size > 0)
+        {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            if (poll(&pfd, 1, READ_TIMEOUT_MS) <= 0)
+            {
+                return false;
+            }
+            ssize_t count = read(fd, bytes, size);
+            if (count <= 0)
+            {
+                if (count < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            bytes += count;
+            size -= count;
+        }
+        return true;
+    }
+
+    bool sendRequest(int fd, uint32_t offset, uint32_t length, uint32_t flags)
+    {
+        dump_request request = {};
+        request.offset = offset;
+        request.length = length;
+        request.flags = flags;
+        dumpSealRequest(&request);
+        return write(fd, &request, sizeof(request)) == static_cast<ssize_t>(sizeof(request));
+    }
+
+    enum FrameResult
+    {
+        FRAME_OK,
+        FRAME_BAD,          // CRC or format error, stream is still alive
+        FRAME_TIMEOUT
+    };
+
+    // Skip to the next frame magic, then read and check the frame
+    FrameResult readFrame(int fd, dump_frame_header *header, uint8_t *payload)
+    {
+        uint32_t window = 0;
+        size_t skipped = 0;
+        while (window != DUMP_FRAME_MAGIC)
+        {
+            uint8_t byte;
+            if (!readFully(fd, &byte, 1))
+            {
+                return FRAME_TIMEOUT;
+            }
+            window = (window >> 8) | (static_cast<uint32_t>(byte) << 24);
+            skipped++;
+        }
+        if (skipped > 4)
+        {
+            fprintf(stderr, "Skipped %zu bytes looking for a frame\n", skipped - 4);
+        }
+
+        header->magic = DUMP_FRAME_MAGIC;
+        if (!readFully(fd, reinterpret_cast<uint8_t *>(header) + 4, sizeof(*header) - 4))
+        {
+            return FRAME_TIMEOUT;
+        }
+        if (header->payloadSize > DUMP_MAX_PAYLOAD)
+        {
+            return FRAME_BAD;
+        }
+        if (!readFully(fd, payload, header->payloadSize))
+        {
+            return FRAME_TIMEOUT;
+        }
+        return dumpCheckFrame(*header, payload) ? FRAME_OK : FRAME_BAD;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <port> <out.bin> [--baud N] [--offset N] [--length N] [--compress] [--resume]\n",
+            argv[0]);
+        return 1;
+    }
+
+    long baud = 2000000;
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    uint32_t flags = 0;
+    bool resume = false;
+
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--baud") == 0 && i + 1 < argc)
+        {
+            baud = strtol(argv[++i], nullptr, 0);
+        }
+        else if (strcmp(argv[i], "--offset") == 0 && i + 1 < argc)
+        {
+            offset = strtoul(argv[++i], nullptr, 0);
+        }
+        else if (strcmp(argv[i], "--length") == 0 && i + 1 < argc)
+        {
+            length = strtoul(argv[++i], nullptr, 0);
+        }
+        else if (strcmp(argv[i], "--compress") == 0)
+        {
+            flags |= DUMP_FLAG_COMPRESS;
+        }
+        else if (strcmp(argv[i], "--resume") == 0)
+        {
+            resume = true;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    int port = open(argv[1], O_RDWR | O_NOCTTY);
+    if (port < 0)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    if (!configurePort(port, baud))
+    {
+        return 1;
+    }
+
+    int out = open(argv[2], O_WRONLY | O_CREAT, 0644);
+    if (out < 0)
+    {
+        perror(argv[2]);
+        return 1;
+    }
+
+    if (resume)
+    {
+        struct stat st;
+        fstat(out, &st);
+        offset = static_cast<uint32_t>(st.st_size);
+        fprintf(stderr, "Resuming at offset %" PRIu32 "\n", offset);
+    }
+
+    // One flag per chunk from offset, sized once the device tells us the length
+    std::vector<bool> received;
+    uint32_t end = 0;
+    bool haveInfo = false;
+
+    static uint8_t payload[DUMP_MAX_PAYLOAD];
+    static uint8_t chunk[DUMP_CHUNK_SIZE];
+
+    uint64_t bytesReceived = 0;
+    uint64_t badFrames = 0;
+    auto startTime = std::chrono::steady_clock::now();
+
+    uint32_t requestOffset = offset;
+    uint32_t requestLength = length;
+    int attempt = 0;
+
+    while (attempt++ < MAX_ATTEMPTS)
+    {
+        sendRequest(port, requestOffset, requestLength, flags);
+
+        // Receive until the END frame of this request or a timeout
+        while (true)
+        {
+            dump_frame_header header;
+            FrameResult result = readFrame(port, &header, payload);
+            if (result == FRAME_TIMEOUT)
+            {
+                fprintf(stderr, "Timed out waiting for data\n");
+                break;
+            }
+            if (result == FRAME_BAD)
+            {
+                badFrames++;
+                continue;
+            }
+
+            if (header.type == DUMP_FRAME_START && !haveInfo)
+            {
+                dump_info info;
+                memcpy(&info, payload, sizeof(info));
+                end = info.offset + info.length;
+                received.assign((info.length + DUMP_CHUNK_SIZE - 1) / DUMP_CHUNK_SIZE, false);
+                haveInfo = true;
+                fprintf(stderr, "Log is %" PRIu32 " bytes, receiving %" PRIu32 " from offset %" PRIu32 "\n",
+                    info.logSize, info.length, info.offset);
+            }
+            else if (header.type == DUMP_FRAME_CHUNK && haveInfo)
+            {
+                const uint8_t *data = payload;
+                if (header.flags & DUMP_FRAME_FLAG_RLE)
+                {
+                    if (dumpRleDecode(payload, header.payloadSize, chunk, sizeof(chunk)) != header.rawSize)
+                    {
+                        badFrames++;
+                        continue;
+                    }
+                    data = chunk;
+                }
+                else if (header.payloadSize != header.rawSize)
+                {
+                    badFrames++;
+                    continue;
+                }
+
+                if (header.offset < offset || header.offset >= end || (header.offset - offset) % DUMP_CHUNK_SIZE)
+                {
+                    badFrames++;
+                    continue;
+                }
+                if (pwrite(out, data, header.rawSize, header.offset) != static_cast<ssize_t>(header.rawSize))
+                {
+                    perror("write");
+                    return 1;
+                }
+                received[(header.offset - offset) / DUMP_CHUNK_SIZE] = true;
+                bytesReceived += header.rawSize;
+            }
+            else if (header.type == DUMP_FRAME_END)
+            {
+                break;
+            }
+            else if (header.type == DUMP_FRAME_ERROR)
+            {
+                fprintf(stderr, "Device error %" PRId32 " at offset %" PRIu32 "\n",
+                    static_cast<int32_t>(header.rawSize), header.offset);
+                break;
+            }
+        }
+
+        if (!haveInfo)
+        {
+            continue;
+        }
+
+        // Ask again for the first run of missing chunks
+        size_t first = 0;
+        while (first < received.size() && received[first])
+        {
+            first++;
+        }
+        if (first == received.size())
+        {
+            break;
+        }
+        size_t last = first;
+        while (last < received.size() && !received[last])
+        {
+            last++;
+        }
+        requestOffset = offset + first * DUMP_CHUNK_SIZE;
+        uint32_t runEnd = offset + last * DUMP_CHUNK_SIZE;
+        requestLength = (runEnd < end ? runEnd : end) - requestOffset;
+        fprintf(stderr, "Requesting %" PRIu32 " bytes again from offset %" PRIu32 "\n", requestLength, requestOffset);
+    }
+
+    sendRequest(port, 0, 0, DUMP_FLAG_DONE);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    fprintf(stderr, "Received %" PRIu64 " bytes in %.1f s (%.1f kB/s), %" PRIu64 " bad frames\n", bytesReceived,
+        seconds, seconds > 0 ? bytesReceived / seconds / 1000.0 : 0.0, badFrames);
+
+    // Keep only the contiguous prefix so --resume continues from the first gap
+    size_t complete = 0;
+    while (complete < received.size() && received[complete])
+    {
+        complete++;
+    }
+    if (!haveInfo || complete < received.size())
+    {
+        uint32_t keep = haveInfo ? offset + complete * DUMP_CHUNK_SIZE : offset;
+        if (ftruncate(out, keep))
+        {
+            perror("ftruncate");
+        }
+        fprintf(stderr, "Incomplete, run again with --resume to continue from offset %" PRIu32 "\n", keep);
+        close(out);
+        return 2;
+    }
+
+    if (ftruncate(out, end))
+    {
+        perror("ftruncate");
+    }
+    close(out);
+    close(port);
+    return 0;
+}
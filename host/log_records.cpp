@@ -0,0 +1,125 @@
+/**
+ * @file log_records.cpp
+ * @brief Print the typed records (LogRecords.h) in a flash log dump as CSV
+ *
+ * Usage: log_records <dump.bin> [out.csv]
+ *
+ * One line per record, the record name first and its fields after it. IMU blocks and summaries in the dump are
+ * skipped, imu_decode reads those.
+ */
+
+#include "LogRecords.h"
+#include <cinttypes>
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+    class CsvWriter
+    {
+        public:
+            CsvWriter(FILE *out) : out(out)
+            {
+            }
+
+            void operator()(const log_imu_raw_record &record)
+            {
+                fprintf(out, "imu_raw,%" PRIu32 ",%d,%d,%d,%d,%d,%d\n", record.timestamp, record.accel[0],
+                    record.accel[1], record.accel[2], record.gyro[0], record.gyro[1], record.gyro[2]);
+            }
+
+            void operator()(const log_event_record &record)
+            {
+                fprintf(out, "event,%" PRIu32 ",%u,%" PRIu32 "\n", record.timestamp, record.code, record.value);
+            }
+
+            void operator()(const log_calibration_record &record)
+            {
+                fprintf(out, "calibration,%" PRIu32, record.timestamp);
+                printValues(record.accelOffset);
+                printValues(record.accelGain);
+                printValues(record.gyroOffset);
+                printValues(record.gyroGain);
+                fprintf(out, "\n");
+            }
+
+            void operator()(const log_alt_status_record &record)
+            {
+                fprintf(out, "alt_status,%" PRIu32 ",%u,%u\n", record.timestamp, record.accelAlt, record.gyroAlt);
+            }
+
+            // Edges, then the band RMS of x, y and z, then the peak Hz and RMS of each axis
+            void operator()(const log_vibration_record &record)
+            {
+                uint8_t bands = record.bands < LOG_VIBRATION_BANDS ? record.bands : LOG_VIBRATION_BANDS;
+                fprintf(out, "vibration,%" PRIu32 ",%u,%u", record.timestamp, record.windows, bands);
+                for (uint8_t i = 0; i <= bands; i++)
+                {
+                    fprintf(out, ",%u", record.bandEdgeHz[i]);
+                }
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    for (uint8_t i = 0; i < bands; i++)
+                    {
+                        fprintf(out, ",%u", record.bandRms[axis][i]);
+                    }
+                }
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    fprintf(out, ",%.1f,%u", record.peakDeciHz[axis] / 10.0f, record.peakRms[axis]);
+                }
+                fprintf(out, "\n");
+            }
+
+        private:
+            void printValues(const int16_t (&values)[3])
+            {
+                fprintf(out, ",%d,%d,%d", values[0], values[1], values[2]);
+            }
+
+            FILE *out;
+    };
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <dump.bin> [out.csv]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (!in)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    std::vector<uint8_t> log;
+    uint8_t buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    {
+        log.insert(log.end(), buffer, buffer + count);
+    }
+    fclose(in);
+
+    FILE *out = argc > 2 ? fopen(argv[2], "w") : stdout;
+    if (!out)
+    {
+        perror(argv[2]);
+        return 1;
+    }
+
+    size_t errors = 0;
+    size_t records = LogRecordSchema::parse(log.data(), log.size(), CsvWriter(out), &errors);
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    fprintf(stderr, "%zu records, %zu pages with unknown or truncated records\n", records, errors);
+    return errors ? 2 : 0;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file BufferedBlockDevice.h
+ * @brief Host stand-in for Mbed OS BufferedBlockDevice
+ *
+ * Presents a read/program size of 1. Unlike the real one it doesn't cache, it passes straight through, so the
+ * underlying device has to accept single byte programs (the host flash model does).
+ */
+
+#ifndef HOST_MBED_SHIM_BUFFERED_BLOCK_DEVICE_H
+#define HOST_MBED_SHIM_BUFFERED_BLOCK_DEVICE_H
+
+#include "blockdevice/BlockDevice.h"
+
+namespace mbed {
+
+class BufferedBlockDevice : public BlockDevice {
+public:
+    BufferedBlockDevice(BlockDevice *bd) : _bd(bd)
+    {
+    }
+
+    int init() override
+    {
+        return _bd->init();
+    }
+    int deinit() override
+    {
+        return _bd->deinit();
+    }
+    int sync() override
+    {
+        return _bd->sync();
+    }
+    int read(void *buffer, bd_addr_t addr, bd_size_t size) override
+    {
+        return _bd->read(buffer, addr, size);
+    }
+    int program(const void *buffer, bd_addr_t addr, bd_size_t size) override
+    {
+        return _bd->program(buffer, addr, size);
+    }
+    int erase(bd_addr_t addr, bd_size_t size) override
+    {
+        return _bd->erase(addr, size);
+    }
+    bd_size_t get_read_size() const override
+    {
+        return 1;
+    }
+    bd_size_t get_program_size() const override
+    {
+        return 1;
+    }
+    bd_size_t get_erase_size() const override
+    {
+        return _bd->get_erase_size();
+    }
+    bd_size_t get_erase_size(bd_addr_t addr) const override
+    {
+        return _bd->get_erase_size(addr);
+    }
+    int get_erase_value() const override
+    {
+        return _bd->get_erase_value();
+    }
+    bd_size_t size() const override
+    {
+        return _bd->size();
+    }
+    const char *get_type() const override
+    {
+        return "BUFFERED";
+    }
+
+private:
+    BlockDevice *_bd;
+};
+
+} // namespace mbed
+
+using mbed::BufferedBlockDevice;
+
+#endif // HOST_MBED_SHIM_BUFFERED_BLOCK_DEVICE_H
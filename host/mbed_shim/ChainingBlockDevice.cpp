@@ -0,0 +1,132 @@
+/**
+ * @file ChainingBlockDevice.cpp
+ * @brief Host stand-in for Mbed OS ChainingBlockDevice, concatenates block devices
+ */
+
+#include "ChainingBlockDevice.h"
+#include <cstdint>
+
+namespace mbed {
+
+ChainingBlockDevice::ChainingBlockDevice(BlockDevice **bds, size_t bd_count) :
+    _bds(bds), _bd_count(bd_count), _size(0)
+{
+}
+
+int ChainingBlockDevice::init()
+{
+    _size = 0;
+    for (size_t i = 0; i < _bd_count; i++) {
+        int err = _bds[i]->init();
+        if (err) {
+            return err;
+        }
+        _size += _bds[i]->size();
+    }
+    return BD_ERROR_OK;
+}
+
+int ChainingBlockDevice::deinit()
+{
+    for (size_t i = 0; i < _bd_count; i++) {
+        _bds[i]->deinit();
+    }
+    return BD_ERROR_OK;
+}
+
+int ChainingBlockDevice::sync()
+{
+    for (size_t i = 0; i < _bd_count; i++) {
+        int err = _bds[i]->sync();
+        if (err) {
+            return err;
+        }
+    }
+    return BD_ERROR_OK;
+}
+
+template <typename Op>
+int ChainingBlockDevice::forEach(bd_addr_t addr, bd_size_t size, Op op)
+{
+    if (addr + size > _size) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    bd_addr_t base = 0;
+    bd_size_t done = 0;
+    for (size_t i = 0; i < _bd_count && size > 0; i++) {
+        bd_size_t bdSize = _bds[i]->size();
+        if (addr < base + bdSize) {
+            bd_size_t count = base + bdSize - addr < size ? base + bdSize - addr : size;
+            int err = op(_bds[i], addr - base, count, done);
+            if (err) {
+                return err;
+            }
+            addr += count;
+            size -= count;
+            done += count;
+        }
+        base += bdSize;
+    }
+    return BD_ERROR_OK;
+}
+
+int ChainingBlockDevice::read(void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    uint8_t *bytes = static_cast<uint8_t *>(buffer);
+    return forEach(addr, size, [bytes](BlockDevice *bd, bd_addr_t a, bd_size_t n, bd_size_t done) {
+        return bd->read(bytes + done, a, n);
+    });
+}
+
+int ChainingBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(buffer);
+    return forEach(addr, size, [bytes](BlockDevice *bd, bd_addr_t a, bd_size_t n, bd_size_t done) {
+        return bd->program(bytes + done, a, n);
+    });
+}
+
+int ChainingBlockDevice::erase(bd_addr_t addr, bd_size_t size)
+{
+    return forEach(addr, size, [](BlockDevice *bd, bd_addr_t a, bd_size_t n, bd_size_t) {
+        return bd->erase(a, n);
+    });
+}
+
+bd_size_t ChainingBlockDevice::get_read_size() const
+{
+    return _bds[0]->get_read_size();
+}
+
+bd_size_t ChainingBlockDevice::get_program_size() const
+{
+    return _bds[0]->get_program_size();
+}
+
+bd_size_t ChainingBlockDevice::get_erase_size() const
+{
+    return _bds[0]->get_erase_size();
+}
+
+bd_size_t ChainingBlockDevice::get_erase_size(bd_addr_t) const
+{
+    return _bds[0]->get_erase_size();
+}
+
+int ChainingBlockDevice::get_erase_value() const
+{
+    return _bds[0]->get_erase_value();
+}
+
+bd_size_t ChainingBlockDevice::size() const
+{
+    return _size;
+}
+
+const char *ChainingBlockDevice::get_type() const
+{
+    return "CHAINING";
+}
+
+} // namespace mbed
@@ -0,0 +1,46 @@
+/**
+ * @file ChainingBlockDevice.h
+ * @brief Host stand-in for Mbed OS ChainingBlockDevice, concatenates block devices
+ */
+
+#ifndef HOST_MBED_SHIM_CHAINING_BLOCK_DEVICE_H
+#define HOST_MBED_SHIM_CHAINING_BLOCK_DEVICE_H
+
+#include "blockdevice/BlockDevice.h"
+#include <cstddef>
+
+namespace mbed {
+
+class ChainingBlockDevice : public BlockDevice {
+public:
+    ChainingBlockDevice(BlockDevice **bds, size_t bd_count);
+
+    int init() override;
+    int deinit() override;
+    int sync() override;
+    int read(void *buffer, bd_addr_t addr, bd_size_t size) override;
+    int program(const void *buffer, bd_addr_t addr, bd_size_t size) override;
+    int erase(bd_addr_t addr, bd_size_t size) override;
+    bd_size_t get_read_size() const override;
+    bd_size_t get_program_size() const override;
+    bd_size_t get_erase_size() const override;
+    bd_size_t get_erase_size(bd_addr_t addr) const override;
+    int get_erase_value() const override;
+    bd_size_t size() const override;
+    const char *get_type() const override;
+
+private:
+    // Apply op to each device the range [addr, addr + size) touches
+    template <typename Op>
+    int forEach(bd_addr_t addr, bd_size_t size, Op op);
+
+    BlockDevice **_bds;
+    size_t _bd_count;
+    bd_size_t _size;
+};
+
+} // namespace mbed
+
+using mbed::ChainingBlockDevice;
+
+#endif // HOST_MBED_SHIM_CHAINING_BLOCK_DEVICE_H
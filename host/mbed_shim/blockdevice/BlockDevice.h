@@ -0,0 +1,74 @@
+/**
+ * @file BlockDevice.h
+ * @brief Host stand-in for Mbed OS blockdevice/BlockDevice.h
+ */
+
+#ifndef HOST_MBED_SHIM_BLOCKDEVICE_H
+#define HOST_MBED_SHIM_BLOCKDEVICE_H
+
+#include <cstdint>
+
+namespace mbed {
+
+typedef uint64_t bd_addr_t;
+typedef uint64_t bd_size_t;
+
+enum bd_error {
+    BD_ERROR_OK                 = 0,     /*!< no error */
+    BD_ERROR_DEVICE_ERROR       = -4001, /*!< device specific error */
+};
+
+/** Same interface as the Mbed OS BlockDevice, minus the parts the drivers don't use */
+class BlockDevice {
+public:
+    virtual ~BlockDevice() {}
+
+    virtual int init() = 0;
+    virtual int deinit() = 0;
+    virtual int sync()
+    {
+        return 0;
+    }
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size) = 0;
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size) = 0;
+    virtual int erase(bd_addr_t, bd_size_t)
+    {
+        return 0;
+    }
+    virtual bd_size_t get_read_size() const = 0;
+    virtual bd_size_t get_program_size() const = 0;
+    virtual bd_size_t get_erase_size() const
+    {
+        return get_program_size();
+    }
+    virtual bd_size_t get_erase_size(bd_addr_t) const
+    {
+        return get_erase_size();
+    }
+    virtual int get_erase_value() const
+    {
+        return -1;
+    }
+    virtual bd_size_t size() const = 0;
+    virtual const char *get_type() const = 0;
+
+    bool is_valid_read(bd_addr_t addr, bd_size_t size) const
+    {
+        return addr % get_read_size() == 0 && size % get_read_size() == 0 && addr + size <= this->size();
+    }
+
+    bool is_valid_program(bd_addr_t addr, bd_size_t size) const
+    {
+        return addr % get_program_size() == 0 && size % get_program_size() == 0 && addr + size <= this->size();
+    }
+
+    bool is_valid_erase(bd_addr_t addr, bd_size_t size) const
+    {
+        return addr % get_erase_size(addr) == 0 && (addr + size) % get_erase_size(addr + size - 1) == 0 &&
+            addr + size <= this->size();
+    }
+};
+
+} // namespace mbed
+
+#endif // HOST_MBED_SHIM_BLOCKDEVICE_H
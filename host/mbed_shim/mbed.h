@@ -0,0 +1,236 @@
+/**
+ * @file mbed.h
+ * @brief Host stand-in for the parts of the Mbed OS API the drivers use
+ *
+ * Lets the driver sources build and run on Linux. SPI transfers are routed to software models of the devices
+ * (see host/sim), attached to the chip select pin they would sit on, stdio stands in for the console UART.
+ */
+
+#ifndef HOST_MBED_SHIM_H
+#define HOST_MBED_SHIM_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <sys/types.h>
+
+#include "blockdevice/BlockDevice.h"
+#include "platform/SingletonPtr.h"
+
+#define BMI323_HOST_BUILD 1
+
+// mbed_toolchain.h
+#define MBED_ALIGN(N) alignas(N)
+#define MBED_SECTION(name) __attribute__((section(name)))
+
+/** Pins used by the test programs, values are only used as keys */
+enum PinName : int {
+    PA_5, PA_6, PA_15,
+    PB_3, PB_4, PB_5, PB_6, PB_7,
+    PC_10, PC_11, PC_12,
+    PD_0, PD_1, PD_14,
+    CONSOLE_TX, CONSOLE_RX,
+    USBTX = CONSOLE_TX,
+    USBRX = CONSOLE_RX,
+    NC = -1
+};
+
+namespace mbed {
+
+struct use_gpio_ssel_t {
+};
+const use_gpio_ssel_t use_gpio_ssel = {};
+
+/**
+ * @brief A device model sitting on a SPI bus
+ */
+class SPIDevice {
+public:
+    virtual ~SPIDevice() {}
+
+    /** Chip select asserted */
+    virtual void select() = 0;
+
+    /** Chip select released */
+    virtual void deselect() = 0;
+
+    /** Full duplex transfer of one byte */
+    virtual uint8_t transfer(uint8_t out) = 0;
+
+    /** Bus clock changed, models can use this to inject errors above their rated clock */
+    virtual void clock(int)
+    {
+    }
+};
+
+class SPI {
+public:
+    SPI(PinName mosi, PinName miso, PinName sclk, PinName ssel, use_gpio_ssel_t);
+
+    /** Route transfers on chip select pin ssel to device, call before constructing the driver */
+    static void attach(PinName ssel, SPIDevice *device);
+
+    void format(int bits, int mode = 0);
+    void frequency(int hz = 1000000);
+    void set_default_write_value(char data);
+
+    void select();
+    void deselect();
+
+    int write(int value);
+    int write(const void *tx_buffer, int tx_length, void *rx_buffer, int rx_length);
+
+private:
+    SPIDevice *_device;
+    char _write_fill;
+    int _select_count;
+    int _hz;
+};
+
+/**
+ * @brief Nothing is attached to the host I2C bus, the driver's I2C path is unimplemented
+ */
+class I2C {
+public:
+    I2C(PinName, PinName)
+    {
+    }
+};
+
+/**
+ * @brief Byte stream, stands in for serial ports
+ */
+class FileHandle {
+public:
+    virtual ~FileHandle() {}
+    virtual ssize_t read(void *buffer, size_t size) = 0;
+    virtual ssize_t write(const void *buffer, size_t size) = 0;
+    virtual int sync()
+    {
+        return 0;
+    }
+};
+
+/**
+ * @brief Console UART, backed by stdin/stdout
+ */
+class BufferedSerial : public FileHandle {
+public:
+    BufferedSerial(PinName tx, PinName rx, int baud = 9600);
+
+    void set_baud(int baud);
+    ssize_t read(void *buffer, size_t size) override;
+    ssize_t write(const void *buffer, size_t size) override;
+    int sync() override;
+
+private:
+    int _baud;
+};
+
+class Timer {
+public:
+    void start();
+    void stop();
+    void reset();
+    std::chrono::microseconds elapsed_time() const;
+
+private:
+    std::chrono::steady_clock::time_point _start;
+    std::chrono::steady_clock::duration _elapsed = {};
+    bool _running = false;
+};
+
+/** CRC-32 only, the one polynomial the drivers use */
+enum crc_polynomial {
+    POLY_32BIT_ANSI = 0x04C11DB7
+};
+
+template <uint32_t polynomial = POLY_32BIT_ANSI, int width = 32>
+class MbedCRC {
+public:
+    int compute(const void *buffer, unsigned long long size, uint32_t *crc)
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(buffer);
+        uint32_t value = 0xFFFFFFFF;
+        for (unsigned long long i = 0; i < size; i++) {
+            value ^= bytes[i];
+            for (int k = 0; k < 8; k++) {
+                value = (value & 1) ? (0xEDB88320 ^ (value >> 1)) : (value >> 1);
+            }
+        }
+        *crc = ~value;
+        return 0;
+    }
+};
+
+/** Bound member function, what the drivers pass to Thread::start */
+template <typename T>
+std::function<void()> callback(T *object, void (T::*method)())
+{
+    return [object, method]() { (object->*method)(); };
+}
+
+} // namespace mbed
+
+/** CMSIS-RTOS priorities, only kept for the constructor signature */
+enum osPriority {
+    osPriorityNormal = 24,
+    osPriorityAboveNormal = 32,
+    osPriorityHigh = 40
+};
+
+typedef int32_t osStatus;
+const osStatus osOK = 0;
+
+namespace rtos {
+namespace ThisThread {
+void sleep_for(std::chrono::milliseconds duration);
+} // namespace ThisThread
+
+/**
+ * @brief Backed by std::thread, priority and stack are ignored
+ */
+class Thread {
+public:
+    Thread(osPriority = osPriorityNormal, uint32_t = 0, unsigned char * = nullptr, const char * = nullptr)
+    {
+    }
+
+    ~Thread()
+    {
+        join();
+    }
+
+    osStatus start(std::function<void()> task)
+    {
+        _thread = std::thread(task);
+        return osOK;
+    }
+
+    osStatus join()
+    {
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+        return osOK;
+    }
+
+private:
+    std::thread _thread;
+};
+} // namespace rtos
+
+void wait_us(int us);
+
+/** Microseconds since start up, wraps like the Mbed ticker */
+uint32_t us_ticker_read();
+
+using namespace mbed;
+using namespace rtos;
+using namespace std::chrono_literals;
+
+#endif // HOST_MBED_SHIM_H
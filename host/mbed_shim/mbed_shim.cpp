@@ -0,0 +1,189 @@
+/**
+ * @file mbed_shim.cpp
+ * @brief Host stand-in for the parts of the Mbed OS API the drivers use
+ */
+
+#include "mbed.h"
+#include <map>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+std::map<int, mbed::SPIDevice *> &spiDevices()
+{
+    static std::map<int, mbed::SPIDevice *> devices;
+    return devices;
+}
+
+// Reads as an idle bus with nothing attached
+class FloatingBus : public mbed::SPIDevice {
+public:
+    void select() override
+    {
+    }
+    void deselect() override
+    {
+    }
+    uint8_t transfer(uint8_t) override
+    {
+        return 0xFF;
+    }
+};
+
+FloatingBus floatingBus;
+
+const auto startTime = std::chrono::steady_clock::now();
+
+} // namespace
+
+namespace mbed {
+
+SPI::SPI(PinName, PinName, PinName, PinName ssel, use_gpio_ssel_t) :
+    _device(&floatingBus), _write_fill(0), _select_count(0), _hz(1000000)
+{
+    auto device = spiDevices().find(ssel);
+    if (device != spiDevices().end()) {
+        _device = device->second;
+    }
+}
+
+void SPI::attach(PinName ssel, SPIDevice *device)
+{
+    spiDevices()[ssel] = device;
+}
+
+void SPI::format(int, int)
+{
+}
+
+void SPI::frequency(int hz)
+{
+    _hz = hz;
+    _device->clock(hz);
+}
+
+void SPI::set_default_write_value(char data)
+{
+    _write_fill = data;
+}
+
+void SPI::select()
+{
+    if (_select_count++ == 0) {
+        _device->select();
+    }
+}
+
+void SPI::deselect()
+{
+    if (_select_count > 0 && --_select_count == 0) {
+        _device->deselect();
+    }
+}
+
+int SPI::write(int value)
+{
+    select();
+    int result = _device->transfer(static_cast<uint8_t>(value));
+    deselect();
+    return result;
+}
+
+int SPI::write(const void *tx_buffer, int tx_length, void *rx_buffer, int rx_length)
+{
+    const uint8_t *tx = static_cast<const uint8_t *>(tx_buffer);
+    uint8_t *rx = static_cast<uint8_t *>(rx_buffer);
+    int total = tx_length > rx_length ? tx_length : rx_length;
+
+    select();
+    for (int i = 0; i < total; i++) {
+        uint8_t in = _device->transfer(i < tx_length ? tx[i] : static_cast<uint8_t>(_write_fill));
+        if (i < rx_length) {
+            rx[i] = in;
+        }
+    }
+    deselect();
+
+    return total;
+}
+
+BufferedSerial::BufferedSerial(PinName, PinName, int baud) : _baud(baud)
+{
+}
+
+void BufferedSerial::set_baud(int baud)
+{
+    _baud = baud;
+}
+
+ssize_t BufferedSerial::read(void *buffer, size_t size)
+{
+    return ::read(STDIN_FILENO, buffer, size);
+}
+
+ssize_t BufferedSerial::write(const void *buffer, size_t size)
+{
+    fflush(stdout);
+    return ::write(STDOUT_FILENO, buffer, size);
+}
+
+int BufferedSerial::sync()
+{
+    return 0;
+}
+
+void Timer::start()
+{
+    if (!_running) {
+        _start = std::chrono::steady_clock::now();
+        _running = true;
+    }
+}
+
+void Timer::stop()
+{
+    if (_running) {
+        _elapsed += std::chrono::steady_clock::now() - _start;
+        _running = false;
+    }
+}
+
+void Timer::reset()
+{
+    _elapsed = {};
+    _start = std::chrono::steady_clock::now();
+}
+
+std::chrono::microseconds Timer::elapsed_time() const
+{
+    auto elapsed = _elapsed;
+    if (_running) {
+        elapsed += std::chrono::steady_clock::now() - _start;
+    }
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed);
+}
+
+} // namespace mbed
+
+namespace rtos {
+namespace ThisThread {
+
+void sleep_for(std::chrono::milliseconds duration)
+{
+    std::this_thread::sleep_for(duration);
+}
+
+} // namespace ThisThread
+} // namespace rtos
+
+void wait_us(int us)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+uint32_t us_ticker_read()
+{
+    auto elapsed = std::chrono::steady_clock::now() - startTime;
+    return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+}
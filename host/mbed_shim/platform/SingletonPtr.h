@@ -0,0 +1,41 @@
+/**
+ * @file SingletonPtr.h
+ * @brief Host stand-in for Mbed OS platform/SingletonPtr.h and PlatformMutex
+ */
+
+#ifndef HOST_MBED_SHIM_SINGLETONPTR_H
+#define HOST_MBED_SHIM_SINGLETONPTR_H
+
+#include <mutex>
+
+template <typename T>
+struct SingletonPtr {
+    T *get()
+    {
+        static T instance;
+        return &instance;
+    }
+
+    T *operator->()
+    {
+        return get();
+    }
+};
+
+class PlatformMutex {
+public:
+    void lock()
+    {
+        _mutex.lock();
+    }
+
+    void unlock()
+    {
+        _mutex.unlock();
+    }
+
+private:
+    std::recursive_mutex _mutex;
+};
+
+#endif // HOST_MBED_SHIM_SINGLETONPTR_H
@@ -0,0 +1,395 @@
+/**
+ * @file SimBMI323.cpp
+ * @brief Software model of a BMI323 on the SPI bus, for running the driver on the host
+ */
+
+#include "SimBMI323.h"
+#include "BMI323.h"
+#include <cmath>
+
+namespace
+{
+    using Register = BMI323Base::Register;
+
+    inline uint8_t reg(Register address)
+    {
+        return static_cast<uint8_t>(address);
+    }
+
+    // Sign extend a data path register field
+    inline int32_t field(uint16_t value, int bits)
+    {
+        return static_cast<int32_t>(static_cast<uint32_t>(value) << (32 - bits)) >> (32 - bits);
+    }
+
+    inline int16_t saturate(int32_t value)
+    {
+        if(value > 32767)
+        {
+            return 32767;
+        }
+        if(value < -32767)
+        {
+            return -32767;
+        }
+        return static_cast<int16_t>(value);
+    }
+
+    // FIFO is 2048 bytes
+    constexpr size_t FIFO_WORDS = 1024;
+}
+
+SimBMI323::SimBMI323() : bias{0, 0, 0, 0, 0, 0}, vibrationHz(0.0f), vibrationG(0.0f), coningHz(0.0f),
+    coningAmplitude(0.0f), transactionCount(0), busClock(0), maxClock(0), linkNoise(0x9E3779B9)
+{
+    reset();
+}
+
+void SimBMI323::reset()
+{
+    for(uint16_t &r : registers)
+    {
+        r = 0;
+    }
+    for(uint16_t &r : extended)
+    {
+        r = 0;
+    }
+
+    // Reset values, Section 6.1
+    registers[reg(Register::CHIP_ID)] = 0x0043;
+    registers[reg(Register::STATUS)] = 0x0001;          // por_detected
+    registers[reg(Register::ACC_CONF)] = 0x0028;
+    registers[reg(Register::GYR_CONF)] = 0x0048;
+    registers[reg(Register::ALT_ACC_CONF)] = 0x0206;
+    registers[reg(Register::ALT_GYR_CONF)] = 0x1206;
+    registers[reg(Register::FIFO_CONF)] = 0x0000;
+
+    fifo.clear();
+    sampleIndex = 0;
+    noiseState = 0x12345678;
+    vibrationPhase = 0.0f;
+    coningPhase = 0.0f;
+    lastAccrue = std::chrono::steady_clock::now();
+
+    selected = false;
+    reading = false;
+    byteIndex = 0;
+}
+
+void SimBMI323::setBias(const int16_t accel[3], const int16_t gyro[3])
+{
+    for(int i = 0; i < 3; i++)
+    {
+        bias[i] = accel[i];
+        bias[3 + i] = gyro[i];
+    }
+}
+
+void SimBMI323::fillFifo(uint16_t frames)
+{
+    for(uint16_t i = 0; i < frames; i++)
+    {
+        pushFifoFrame();
+    }
+}
+
+void SimBMI323::setAltActive(bool active)
+{
+    registers[reg(Register::ALT_STATUS)] = active ? 0x0011 : 0x0000;
+}
+
+void SimBMI323::select()
+{
+    selected = true;
+    byteIndex = 0;
+    transactionCount++;
+}
+
+void SimBMI323::deselect()
+{
+    selected = false;
+}
+
+uint8_t SimBMI323::transfer(uint8_t out)
+{
+    if(!selected)
+    {
+        return 0xFF;
+    }
+
+    uint32_t index = byteIndex++;
+    if(index == 0)
+    {
+        reading = (out & 0x80) != 0;
+        address = out & 0x7F;
+        return 0xFF;
+    }
+
+    if(reading)
+    {
+        // One dummy byte, then words low byte first
+        if(index == 1)
+        {
+            return 0x00;
+        }
+        if((index - 2) % 2 == 0)
+        {
+            word = readRegister(address);
+            if(address != reg(Register::FIFO_DATA))
+            {
+                address = (address + 1) & 0x7F;
+            }
+            return overLink(static_cast<uint8_t>(word & 0xFF));
+        }
+        return overLink(static_cast<uint8_t>(word >> 8));
+    }
+
+    if((index - 1) % 2 == 0)
+    {
+        word = out;
+        return 0xFF;
+    }
+    word |= static_cast<uint16_t>(out) << 8;
+    writeRegister(address, word);
+    address = (address + 1) & 0x7F;
+    return 0xFF;
+}
+
+void SimBMI323::clock(int hz)
+{
+    busClock = hz;
+}
+
+uint8_t SimBMI323::overLink(uint8_t byte)
+{
+    if(maxClock == 0 || busClock <= maxClock)
+    {
+        return byte;
+    }
+    linkNoise = linkNoise * 1664525 + 1013904223;
+    if((linkNoise >> 29) == 0)
+    {
+        byte ^= static_cast<uint8_t>(1 << ((linkNoise >> 24) & 7));
+    }
+    return byte;
+}
+
+uint16_t SimBMI323::readRegister(uint8_t address)
+{
+    switch(static_cast<Register>(address))
+    {
+        case Register::ACC_DATA_X:
+        {
+            // Reading the first data register latches a new sample into all six
+            int16_t sample[6];
+            nextSample(sample);
+            for(int i = 0; i < 6; i++)
+            {
+                registers[reg(Register::ACC_DATA_X) + i] = static_cast<uint16_t>(sample[i]);
+            }
+            break;
+        }
+        case Register::FIFO_FILL_LEVEL:
+        {
+            accrueFifo();
+            registers[address] = static_cast<uint16_t>(fifo.size());
+            break;
+        }
+        case Register::FIFO_DATA:
+        {
+            if(fifo.empty())
+            {
+                return 0x8000;
+            }
+            uint16_t value = fifo.front();
+            fifo.pop_front();
+            return value;
+        }
+        case Register::FEATURE_DATA_TX:
+        {
+            uint16_t extAddress = registers[reg(Register::FEATURE_DATA_ADDR)] & 0x3F;
+            registers[reg(Register::FEATURE_DATA_ADDR)] = extAddress + 1;
+            return extended[extAddress];
+        }
+        default:
+            break;
+    }
+
+    return registers[address];
+}
+
+void SimBMI323::writeRegister(uint8_t address, uint16_t value)
+{
+    switch(static_cast<Register>(address))
+    {
+        // Read only
+        case Register::CHIP_ID:
+        case Register::ERR_REG:
+        case Register::STATUS:
+        case Register::ACC_DATA_X:
+        case Register::ACC_DATA_Y:
+        case Register::ACC_DATA_Z:
+        case Register::GYR_DATA_X:
+        case Register::GYR_DATA_Y:
+        case Register::GYR_DATA_Z:
+        case Register::FIFO_FILL_LEVEL:
+        case Register::FIFO_DATA:
+        case Register::ALT_STATUS:
+            return;
+
+        case Register::FEATURE_CTRL:
+        {
+            // Section 5.8.1: the engine only comes up with the documented start up word in FEATURE_IO2
+            if((value & 0x0001) && registers[reg(Register::FEATURE_IO2)] == 0x012C)
+            {
+                registers[reg(Register::FEATURE_IO1)] = (registers[reg(Register::FEATURE_IO1)] & ~0x000F) | 0x0001;
+            }
+            break;
+        }
+        case Register::FEATURE_DATA_TX:
+        {
+            uint16_t extAddress = registers[reg(Register::FEATURE_DATA_ADDR)] & 0x3F;
+            registers[reg(Register::FEATURE_DATA_ADDR)] = extAddress + 1;
+
+            // Extended registers belong to the feature engine, writes before it runs are lost
+            if((registers[reg(Register::FEATURE_IO1)] & 0x000F) == 0x0001)
+            {
+                extended[extAddress] = value;
+            }
+            return;
+        }
+        case Register::FIFO_CTRL:
+        {
+            if(value & 0x0001)
+            {
+                fifo.clear();
+                lastAccrue = std::chrono::steady_clock::now();
+            }
+            return;
+        }
+        case Register::CMD:
+        {
+            if(value == 0xDEAF)
+            {
+                reset();
+            }
+            return;
+        }
+        default:
+            break;
+    }
+
+    registers[address] = value;
+}
+
+void SimBMI323::nextSample(int16_t sample[6])
+{
+    const float lsbPerG = BMI323Base::ACCEL_LSB_PER_MG * 1000.0f;
+
+    float t = static_cast<float>(sampleIndex++) / 800.0f;
+    float base[6] = {
+        0.02f * lsbPerG * std::sin(2.0f * 3.14159265f * 5.0f * t),
+        0.02f * lsbPerG * std::cos(2.0f * 3.14159265f * 5.0f * t),
+        lsbPerG,
+        2.0f * BMI323Base::GYRO_LSB_PER_DPS * std::sin(2.0f * 3.14159265f * 2.0f * t),
+        0.0f,
+        0.0f
+    };
+
+    if(vibrationG != 0.0f)
+    {
+        base[0] += vibrationG * lsbPerG * std::sin(vibrationPhase);
+        vibrationPhase = std::fmod(vibrationPhase + 2.0f * 3.14159265f * vibrationHz /
+            BMI323Base::odrHz(registers[reg(Register::ACC_CONF)]), 2.0f * 3.14159265f);
+    }
+
+    if(coningAmplitude != 0.0f)
+    {
+        // Mean rates over the sample, so the sum of the samples is the exact integral of the rates
+        const float odr = BMI323Base::odrHz(registers[reg(Register::GYR_CONF)]);
+        const float step = 2.0f * 3.14159265f * coningHz / odr;
+        const float lsbPerRad = BMI323Base::GYRO_LSB_PER_DPS * 180.0f / 3.14159265f;
+        const float sinA = std::sin(coningAmplitude);
+        base[3] = lsbPerRad * odr * sinA * (std::cos(coningPhase + step) - std::cos(coningPhase));
+        base[4] = lsbPerRad * odr * sinA * (std::sin(coningPhase + step) - std::sin(coningPhase));
+        base[5] = -lsbPerRad * step * odr * (1.0f - std::cos(coningAmplitude));
+        coningPhase = std::fmod(coningPhase + step, 2.0f * 3.14159265f);
+    }
+
+    for(int i = 0; i < 6; i++)
+    {
+        // Small deterministic noise, a few LSB
+        noiseState = noiseState * 1664525u + 1013904223u;
+        int32_t noise = static_cast<int32_t>((noiseState >> 24) & 0x7) - 4;
+
+        int32_t value = static_cast<int32_t>(base[i]) + noise + bias[i];
+
+        // Data path: s_cal = g * s + o (Section 5.12)
+        if(i < 3)
+        {
+            int32_t offset = field(registers[reg(Register::ACC_DP_OFF_X) + 2 * i], 14);
+            int32_t gain = field(registers[reg(Register::ACC_DP_DGAIN_X) + 2 * i], 8);
+            value = value + value * gain / 4096 + offset / 2;               // 30.52 ug vs 61 ug per LSB at 2g
+        }
+        else
+        {
+            int32_t offset = field(registers[reg(Register::GYR_DP_OFF_X) + 2 * (i - 3)], 10);
+            int32_t gain = field(registers[reg(Register::GYR_DP_DGAIN_X) + 2 * (i - 3)], 7);
+            value = value + value * gain / 512 + offset * 16;               // 0.061 dps = 16 LSB at 125 dps
+        }
+
+        sample[i] = saturate(value);
+    }
+}
+
+void SimBMI323::accrueFifo()
+{
+    auto now = std::chrono::steady_clock::now();
+
+    uint16_t fifoConf = registers[reg(Register::FIFO_CONF)];
+    uint16_t accelConf = registers[reg(Register::ACC_CONF)];
+    bool enabled = (fifoConf & 0x0600) && (accelConf & 0x7000);
+    float hz = BMI323Base::odrHz(accelConf);
+    if(!enabled || hz <= 0.0f)
+    {
+        lastAccrue = now;
+        return;
+    }
+
+    float elapsed = std::chrono::duration<float>(now - lastAccrue).count();
+    uint32_t frames = static_cast<uint32_t>(elapsed * hz);
+    if(frames == 0)
+    {
+        return;
+    }
+    if(frames > FIFO_WORDS)
+    {
+        frames = FIFO_WORDS;
+    }
+
+    lastAccrue += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<float>(frames / hz));
+    fillFifo(static_cast<uint16_t>(frames));
+}
+
+void SimBMI323::pushFifoFrame()
+{
+    int16_t sample[6];
+    nextSample(sample);
+
+    // Overwrite the oldest frame when full, unless fifo_stop_on_full is set
+    if(fifo.size() + 6 > FIFO_WORDS)
+    {
+        if(registers[reg(Register::FIFO_CONF)] & 0x0001)
+        {
+            return;
+        }
+        fifo.erase(fifo.begin(), fifo.begin() + 6);
+    }
+
+    for(int i = 0; i < 6; i++)
+    {
+        fifo.push_back(static_cast<uint16_t>(sample[i]));
+    }
+}
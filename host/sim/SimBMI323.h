@@ -0,0 +1,162 @@
+/**
+ * @file SimBMI323.h
+ * @brief Software model of a BMI323 on the SPI bus, for running the driver on the host
+ *
+ * Models the SPI protocol (dummy byte on reads, little endian words, address auto-increment except for FIFO_DATA,
+ * burst writes), the register file, the feature engine start up handshake, extended registers, the data path
+ * offset/gain registers and the FIFO. Samples are a deterministic sinusoid plus noise around 1g on Z.
+ */
+
+#ifndef HOST_SIM_BMI323_H
+#define HOST_SIM_BMI323_H
+
+#include <mbed.h>
+#include <chrono>
+#include <deque>
+
+class SimBMI323 : public mbed::SPIDevice
+{
+    public:
+        SimBMI323();
+
+        /** Power on reset, all registers back to their defaults and the FIFO emptied */
+        void reset();
+
+        /** Static bias added to every sample, in LSB, for exercising calibration */
+        void setBias(const int16_t accel[3], const int16_t gyro[3]);
+
+        /** Add a tone of amplitude g on the accel X axis, at hz in sensor time (the configured ODR). 0 g removes it. */
+        void setVibration(float hz, float g)
+        {
+            vibrationHz = hz;
+            vibrationG = g;
+        }
+
+        /**
+         * Put the board on a coning rig: the gyro reads the body rates of a rotation vector of amplitude rad turning
+         * around Z at hz in sensor time, (-W sin A sin Wt, W sin A cos Wt, -W (1 - cos A)) averaged over each sample,
+         * in place of its usual motion. Over whole cycles the board ends where it started, but the plain sum of the
+         * rates drifts about Z at W (1 - cos A). 0 rad removes it.
+         */
+        void setConing(float hz, float amplitude)
+        {
+            coningHz = hz;
+            coningAmplitude = amplitude;
+        }
+
+        /** Push frames into the FIFO right away instead of waiting for them to accrue at the configured ODR */
+        void fillFifo(uint16_t frames);
+
+        /** Force the accel/gyro onto the alternate configuration, as the feature engine would */
+        void setAltActive(bool active);
+
+        /** Current content of a register, bypassing the bus */
+        uint16_t peek(uint8_t address) const { return registers[address & 0x7F]; }
+
+        /** Current content of a feature engine extended register */
+        uint16_t peekExtended(uint8_t address) const { return extended[address & 0x3F]; }
+
+        /**
+         * Fastest SPI clock the link carries, above it about one read byte in eight comes back with a bit flipped.
+         * 0 for no limit, the default.
+         */
+        void setMaxClock(int hz)
+        {
+            maxClock = hz;
+        }
+
+        /** Number of SPI transactions (chip select cycles) seen */
+        uint32_t transactions() const { return transactionCount; }
+
+        void select() override;
+        void deselect() override;
+        uint8_t transfer(uint8_t out) override;
+        void clock(int hz) override;
+
+    private:
+        uint16_t readRegister(uint8_t address);
+        void writeRegister(uint8_t address, uint16_t value);
+
+        // Next sample at the configured ODR, data path corrections applied
+        void nextSample(int16_t sample[6]);
+
+        // Move frames that accrued since the last call into the FIFO
+        void accrueFifo();
+        void pushFifoFrame();
+
+        uint16_t registers[128];
+        uint16_t extended[64];
+        std::deque<uint16_t> fifo;
+
+        int16_t bias[6];                // accel x, y, z then gyro x, y, z
+        uint32_t sampleIndex;
+        uint32_t noiseState;
+
+        float vibrationHz;
+        float vibrationG;
+        float vibrationPhase;           // radians
+
+        float coningHz;
+        float coningAmplitude;          // radians
+        float coningPhase;              // radians
+
+        std::chrono::steady_clock::time_point lastAccrue;
+
+        // Bus state within the current transaction
+        bool selected;
+        bool reading;
+        uint32_t byteIndex;
+        uint8_t address;
+        uint16_t word;
+        uint32_t transactionCount;
+
+        // Link quality
+        int busClock;
+        int maxClock;
+        uint32_t linkNoise;
+
+        // A read byte as it arrives over the link at busClock
+        uint8_t overLink(uint8_t byte);
+};
+
+/**
+ * @brief BMI323Core transport straight onto the model, without the SPI shim or the perf counters in between
+ *
+ * With BMI323Core<SimBMI323Bus> the whole read, down to the model's transfer(), is visible to the compiler, for
+ * timing the driver's own cost on the host.
+ */
+class SimBMI323Bus
+{
+    public:
+        explicit SimBMI323Bus(SimBMI323 &sim) : sim(sim)
+        {
+        }
+
+        void read(uint8_t address, char* data, uint16_t length)
+        {
+            sim.select();
+            sim.transfer(0x80 | address);
+            for(uint16_t i = 0; i < length; i++)
+            {
+                data[i] = static_cast<char>(sim.transfer(0));
+            }
+            sim.deselect();
+        }
+
+        void write(uint8_t address, const uint16_t* data, uint16_t count)
+        {
+            sim.select();
+            sim.transfer(address);
+            for(uint16_t i = 0; i < count; i++)
+            {
+                sim.transfer(static_cast<uint8_t>(data[i] & 0xFF));
+                sim.transfer(static_cast<uint8_t>((data[i] >> 8) & 0xFF));
+            }
+            sim.deselect();
+        }
+
+    private:
+        SimBMI323 &sim;
+};
+
+#endif // HOST_SIM_BMI323_H
@@ -0,0 +1,143 @@
+/**
+ * @file SimFlashBlockDevice.cpp
+ * @brief RAM backed stand-in for a SPI NOR flash block device
+ */
+
+#include "SimFlashBlockDevice.h"
+
+SimFlashBlockDevice::SimFlashBlockDevice(mbed::bd_size_t size, mbed::bd_size_t eraseSize, mbed::bd_size_t programSize) :
+    memory(size, 0xFF), erases(size / eraseSize, 0), faults(size / eraseSize, 0), programFaultAddr(0),
+    programFaultSize(0), programFaultError(0), sectorSize(eraseSize), pageSize(programSize)
+{
+}
+
+int SimFlashBlockDevice::init()
+{
+    return mbed::BD_ERROR_OK;
+}
+
+int SimFlashBlockDevice::deinit()
+{
+    return mbed::BD_ERROR_OK;
+}
+
+int SimFlashBlockDevice::read(void *buffer, mbed::bd_addr_t addr, mbed::bd_size_t size)
+{
+    if(!is_valid_read(addr, size))
+    {
+        return mbed::BD_ERROR_DEVICE_ERROR;
+    }
+    memcpy(buffer, memory.data() + addr, size);
+    return mbed::BD_ERROR_OK;
+}
+
+int SimFlashBlockDevice::program(const void *buffer, mbed::bd_addr_t addr, mbed::bd_size_t size)
+{
+    if(!is_valid_program(addr, size))
+    {
+        return mbed::BD_ERROR_DEVICE_ERROR;
+    }
+    if(int error = fault(addr, size))
+    {
+        return error;
+    }
+    if(programFaultError && addr < programFaultAddr + programFaultSize && programFaultAddr < addr + size)
+    {
+        return programFaultError;
+    }
+
+    // NOR programming can only clear bits
+    const uint8_t *in = static_cast<const uint8_t *>(buffer);
+    for(mbed::bd_size_t i = 0; i < size; i++)
+    {
+        memory[addr + i] &= in[i];
+    }
+    return mbed::BD_ERROR_OK;
+}
+
+int SimFlashBlockDevice::erase(mbed::bd_addr_t addr, mbed::bd_size_t size)
+{
+    if(!is_valid_erase(addr, size))
+    {
+        return mbed::BD_ERROR_DEVICE_ERROR;
+    }
+    if(int error = fault(addr, size))
+    {
+        return error;
+    }
+
+    memset(memory.data() + addr, 0xFF, size);
+    for(mbed::bd_addr_t sector = addr / sectorSize; sector < (addr + size) / sectorSize; sector++)
+    {
+        erases[sector]++;
+    }
+    return mbed::BD_ERROR_OK;
+}
+
+mbed::bd_size_t SimFlashBlockDevice::get_read_size() const
+{
+    return 1;
+}
+
+mbed::bd_size_t SimFlashBlockDevice::get_program_size() const
+{
+    return pageSize;
+}
+
+mbed::bd_size_t SimFlashBlockDevice::get_erase_size() const
+{
+    return sectorSize;
+}
+
+mbed::bd_size_t SimFlashBlockDevice::get_erase_size(mbed::bd_addr_t) const
+{
+    return sectorSize;
+}
+
+int SimFlashBlockDevice::get_erase_value() const
+{
+    return 0xFF;
+}
+
+mbed::bd_size_t SimFlashBlockDevice::size() const
+{
+    return memory.size();
+}
+
+const char *SimFlashBlockDevice::get_type() const
+{
+    return "SIMFLASH";
+}
+
+uint32_t SimFlashBlockDevice::eraseCount(mbed::bd_addr_t addr) const
+{
+    return erases[addr / sectorSize];
+}
+
+void SimFlashBlockDevice::failSector(mbed::bd_addr_t addr, int error)
+{
+    faults[addr / sectorSize] = error;
+}
+
+void SimFlashBlockDevice::failProgram(mbed::bd_addr_t addr, mbed::bd_size_t size, int error)
+{
+    programFaultAddr = addr;
+    programFaultSize = size;
+    programFaultError = error;
+}
+
+int SimFlashBlockDevice::fault(mbed::bd_addr_t addr, mbed::bd_size_t size) const
+{
+    if(size == 0)
+    {
+        return 0;
+    }
+    for(mbed::bd_addr_t sector = addr / sectorSize; sector <= (addr + size - 1) / sectorSize; sector++)
+    {
+        if(faults[sector])
+        {
+            return faults[sector];
+        }
+    }
+    return 0;
+}
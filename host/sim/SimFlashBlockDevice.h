@@ -0,0 +1,69 @@
+/**
+ * @file SimFlashBlockDevice.h
+ * @brief RAM backed stand-in for a SPI NOR flash block device
+ *
+ * Behaves like NOR: erase sets a whole sector to 0xFF, programming can only clear bits. Erases are counted per
+ * sector so wear can be inspected, and sectors can be made to fail to test bad sector handling.
+ */
+
+#ifndef HOST_SIM_FLASH_BLOCK_DEVICE_H
+#define HOST_SIM_FLASH_BLOCK_DEVICE_H
+
+#include <mbed.h>
+#include <vector>
+
+class SimFlashBlockDevice : public mbed::BlockDevice
+{
+    public:
+        /**
+         * @param size total size in bytes, a multiple of eraseSize
+         * @param eraseSize sector size
+         * @param programSize page granularity for program()
+         */
+        SimFlashBlockDevice(mbed::bd_size_t size, mbed::bd_size_t eraseSize = 4096, mbed::bd_size_t programSize = 1);
+
+        int init() override;
+        int deinit() override;
+        int read(void *buffer, mbed::bd_addr_t addr, mbed::bd_size_t size) override;
+        int program(const void *buffer, mbed::bd_addr_t addr, mbed::bd_size_t size) override;
+        int erase(mbed::bd_addr_t addr, mbed::bd_size_t size) override;
+        mbed::bd_size_t get_read_size() const override;
+        mbed::bd_size_t get_program_size() const override;
+        mbed::bd_size_t get_erase_size() const override;
+        mbed::bd_size_t get_erase_size(mbed::bd_addr_t addr) const override;
+        int get_erase_value() const override;
+        mbed::bd_size_t size() const override;
+        const char *get_type() const override;
+
+        /** Number of times the sector containing addr was erased */
+        uint32_t eraseCount(mbed::bd_addr_t addr) const;
+
+        /**
+         * @brief Make every erase and program touching the sector containing addr fail with error, 0 to heal it
+         */
+        void failSector(mbed::bd_addr_t addr, int error);
+
+        /**
+         * @brief Make only the programs overlapping [addr, addr + size) fail with error, 0 to heal it. Fails one
+         * particular write into a sector that already holds data, the rest of the sector stays usable.
+         */
+        void failProgram(mbed::bd_addr_t addr, mbed::bd_size_t size, int error);
+
+        /** Raw contents, for dumping to a file */
+        const uint8_t *data() const { return memory.data(); }
+
+    private:
+        // Error injected into the sectors in [addr, addr + size), 0 if none
+        int fault(mbed::bd_addr_t addr, mbed::bd_size_t size) const;
+
+        std::vector<uint8_t> memory;
+        std::vector<uint32_t> erases;
+        std::vector<int> faults;
+        mbed::bd_addr_t programFaultAddr;
+        mbed::bd_size_t programFaultSize;
+        int programFaultError;
+        mbed::bd_size_t sectorSize;
+        mbed::bd_size_t pageSize;
+};
+
+#endif // HOST_SIM_FLASH_BLOCK_DEVICE_H
@@ -0,0 +1,59 @@
+/**
+ * @file SPIFBlockDevice.h
+ * @brief Host replacement for SPIFBlockDevice, a RAM flash model with the same constructor
+ *
+ * Shadows SPIFBlockDevice/SPIFBlockDevice.h in the host build so FlashLogFR builds unmodified. Each chip is
+ * SIM_SPIF_SIZE bytes, kept small so the host tools don't need the full 64 MB per chip.
+ */
+
+#ifndef HOST_SIM_SPIF_BLOCK_DEVICE_H
+#define HOST_SIM_SPIF_BLOCK_DEVICE_H
+
+#include "SimFlashBlockDevice.h"
+
+#ifndef SIM_SPIF_SIZE
+#define SIM_SPIF_SIZE (8 * 1024 * 1024)
+#endif
+
+// Same codes as the real driver, SimFlashBlockDevice::failSector can inject them
+enum spif_bd_error {
+    SPIF_BD_ERROR_OK                    = 0,
+    SPIF_BD_ERROR_DEVICE_ERROR          = mbed::BD_ERROR_DEVICE_ERROR,
+    SPIF_BD_ERROR_PARSING_FAILED        = -4002,
+    SPIF_BD_ERROR_READY_FAILED          = -4003,
+    SPIF_BD_ERROR_WREN_FAILED           = -4004,
+    SPIF_BD_ERROR_INVALID_ERASE_PARAMS  = -4005,
+};
+
+class SPIFBlockDevice : public SimFlashBlockDevice
+{
+    public:
+        SPIFBlockDevice(PinName, PinName, PinName, PinName, int = 40000000) :
+            SimFlashBlockDevice(SIM_SPIF_SIZE), eraseResult(SPIF_BD_ERROR_OK)
+        {
+        }
+
+        // The model erases at once, erase_wait() hands back the result like the chip reports it after the erase
+        int erase_start(mbed::bd_addr_t addr)
+        {
+            eraseResult = erase(addr, get_erase_size(addr));
+            return SPIF_BD_ERROR_OK;
+        }
+
+        bool erase_busy()
+        {
+            return false;
+        }
+
+        int erase_wait()
+        {
+            int result = eraseResult;
+            eraseResult = SPIF_BD_ERROR_OK;
+            return result;
+        }
+
+    private:
+        int eraseResult;
+};
+
+#endif // HOST_SIM_SPIF_BLOCK_DEVICE_H
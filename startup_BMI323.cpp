@@ -0,0 +1,79 @@
+/**
+ * @file startup_BMI323.cpp
+ * @brief Cold start timing: IMU and flash log brought up by StartupSequence, then a short recording
+ *
+ * Prints one "[Startup]" line per stage (us since reset, so the first stage shows how long the boot itself took),
+ * then records for a few seconds and checks every sample made it into the session.
+ */
+
+#include <mbed.h>
+#include <cinttypes>
+#include "BMI323/BMI323.h"
+#include "FlashLogFR.h"
+#include "PinNames.h"
+#include "StartupSequence.h"
+
+#ifdef BMI323_HOST_BUILD
+#include "SimBMI323.h"
+#endif
+
+#ifdef TARGET_INTEGRATOR_BOARD
+#define STARTUP_IMU_MOSI    PB_5
+#define STARTUP_IMU_MISO    PB_4
+#define STARTUP_IMU_SCLK    PB_3
+#define STARTUP_IMU_SSEL    PA_15
+#else
+// Nucleo board
+#define STARTUP_IMU_MOSI    PB_5
+#define STARTUP_IMU_MISO    PA_6
+#define STARTUP_IMU_SCLK    PA_5
+#define STARTUP_IMU_SSEL    PD_14
+#endif
+
+// How long to record after start up
+#define STARTUP_RECORD_MS   2000
+
+namespace
+{
+#ifdef BMI323_HOST_BUILD
+    SimBMI323 simImu;
+#endif
+}
+
+int main()
+{
+#ifdef BMI323_HOST_BUILD
+    SPI::attach(STARTUP_IMU_SSEL, &simImu);
+#endif
+
+    // Static, the sequence holds the RAM backlog. With "app.static_ram_section" all three go there
+    STARTUP_STATIC_RAM static BMI323SPI bmi(STARTUP_IMU_MOSI, STARTUP_IMU_MISO, STARTUP_IMU_SCLK, STARTUP_IMU_SSEL);
+    STARTUP_STATIC_RAM static FlashLogFR flashLog(INTEGRATOR_FLASH_MOSI, INTEGRATOR_FLASH_MISO, INTEGRATOR_FLASH_SCLK,
+        INTEGRATOR_FLASH0_CS1, INTEGRATOR_FLASH1_CS2, CONSOLE_RX, CONSOLE_TX);
+    STARTUP_STATIC_RAM static StartupSequence startup(bmi, flashLog);
+
+    bool ok = startup.run(0, "startup");
+    startup.printTimings();
+    StartupSequence::printRamBudget();
+    if(!ok)
+    {
+        printf("[Startup] Failed\n");
+        return 1;
+    }
+
+    Timer timer;
+    timer.start();
+    while(timer.elapsed_time() < std::chrono::milliseconds(STARTUP_RECORD_MS))
+    {
+        startup.pump();
+        ThisThread::sleep_for(20ms);
+    }
+    startup.pump();
+    flashLog.endSession();
+
+    session_info info;
+    flashLog.getSession(flashLog.getSessionCount() - 1, &info);
+    printf("[Startup] Session %" PRIu32 ": %" PRIu32 " samples, %" PRIu32 " to %" PRIu32 " us\n", info.id,
+        info.sampleCount, info.firstTimestamp, info.lastTimestamp);
+    return 0;
+}
@@ -1,127 +1,1030 @@
+/**
+ * @file test_BMI323.cpp
+ * @brief Scriptable test runner for the BMI323 driver
+ *
+ * Tests are run by name with key=value parameters, one command per line on the console (or separated by ';'):
+ *
+ *   list                                       list the tests and their parameters
+ *   init                                       run a test...
+ *   stream odr=1600 samples=2000 mode=fifo     ...with parameters
+ *   summary                                    print the pass/fail summary
+ *   perf [reset] [threshold=<us>]              print the performance counters and trace (Perf.h), then
+ *                                              optionally clear them or only trace spans of at least <us>
+ *   quit                                       print the summary and stop
+ *
+ * Every line the runner prints starts with a tag so the log can be parsed unattended:
+ *   D,<t_us>,<ax>,<ay>,<az>,<gx>,<gy>,<gz>      one sample (raw LSB), format=csv
+ *   B,<count>                                  followed by count binary records, format=bin (see stream_record)
+ *   RESULT,<test>,PASS|FAIL[,key=value...]      outcome of one test
+ *   SUMMARY,pass=<n>,fail=<n>                  after quit
+ *   PERF,... and TRACE,...                     perf output, see perfDump()
+ * Anything else (driver diagnostics) can be ignored.
+ *
+ * Set "app.test_script" in mbed_app.json to run a fixed script at boot instead of reading the console. On the host
+ * build the script can be passed as arguments, and the sensor is the software model in host/sim.
+ */
+
 #include <mbed.h>
 #include <cinttypes>
+#include <cmath>
+#include <cstdlib>
 #include "BMI323/BMI323.h"
+#include "BMI323/BMI323Calibration.h"
+#include "BMI323/BMI323Decimator.h"
+#include "BMI323/BMI323Spectrum.h"
+#include "BMI323/BMI323Preintegrator.h"
+#include "Perf.h"
 
-int main()
+#ifdef BMI323_HOST_BUILD
+#include "SimBMI323.h"
+#include "SimFlashBlockDevice.h"
+#endif
+
+namespace
 {
-#ifdef TARGET_INTEGRATOR_BOARD
-    PinName mosi = PB_5;    // SPI 1
-    PinName miso = PB_4;    // SPI 1
-    PinName sclk = PB_3;    // SPI 1
-    PinName ssel = PA_15;   // SPI 1
-#else
-    // Nucleo board
-    PinName mosi = PB_5;    // SPI 1
-    PinName miso = PA_6;    // SPI 1
-    PinName sclk = PA_5;    // SPI 1
-    PinName ssel = PD_14;   // SPI 1
+#ifdef BMI323_HOST_BUILD
+    // The sensor model, tests that need a stimulus drive it
+    SimBMI323* hostSim = nullptr;
 #endif
-    
-    BMI323SPI bmi(mosi, miso, sclk, ssel);
-    ThisThread::sleep_for(10ms);
-    
-    // for(int i =0; i< 256; i++)
-    // {
-    //     //print all ascii
-    //     printf("%d: %c\n", i, i);
-    // }
-    
-    while (true)
-    {
-        printf("\nBMI323 Test Suite:\n");
-        printf("Select a test: \n");
-        printf("1.  Test BMI init\n");
-        printf("2.  Test BMI Accel init\n");
-        printf("3.  Test BMI readAccel\n");
-        printf("4.  Test BMI gyro init\n");
-        printf("5.  Test BMI readGyro\n");
-        printf("6.  Test bulk read\n");
-        printf("9.  Exit Test Suite\n");
-
-        // scanf("%d", &test);
-        int testNumber = 0;
-        int read = 0;
-        
-        while (read <= 0) {
-            read = scanf("%d", &testNumber);
-            if (read <= 0) {
-                // Clear the input buffer
-                while (getchar() != '\n');
-                printf("\nInvalid input. Please enter a valid test number: ");
-            }
-        }
-        printf("Running test %d:\n\n", testNumber);
-
-        // Run Tests
-        switch (testNumber)
-        {
-            case 1: // Test BMI init
-            {
-                bool init_success = bmi.init();
-                printf(init_success ? "Init Success!\n" : "Init Failed! \n");
-                break;
-            }
-            case 2: // Test BMI Accel init
-            {
-                bmi.accelSetup();
-                break;
-            }
-            case 3: // Test BMI readAccel
-            {
-                BMI323Base::accel_data accel;
-                for(int i=0; i<100; i++)
+
+    /**
+     * @brief Binary sample record for format=bin, little endian
+     */
+    struct stream_record {
+        uint32_t timestamp;     // us since the start of the stream
+        int16_t accel[3];
+        int16_t gyro[3];
+    };
+
+    static_assert(sizeof(stream_record) == 16, "stream_record layout changed");
+
+    /**
+     * @brief key=value parameters of one command
+     */
+    class TestArgs
+    {
+        public:
+            TestArgs() : count(0)
+            {
+            }
+
+            bool add(char* token)
+            {
+                char* separator = strchr(token, '=');
+                if(!separator || count >= MAX_ARGS)
+                {
+                    return false;
+                }
+                *separator = '\0';
+                keys[count] = token;
+                values[count] = separator + 1;
+                count++;
+                return true;
+            }
+
+            const char* get(const char* key, const char* fallback) const
+            {
+                for(int i = 0; i < count; i++)
+                {
+                    if(strcmp(keys[i], key) == 0)
+                    {
+                        return values[i];
+                    }
+                }
+                return fallback;
+            }
+
+            float getFloat(const char* key, float fallback) const
+            {
+                const char* value = get(key, nullptr);
+                return value ? strtof(value, nullptr) : fallback;
+            }
+
+            uint32_t getUint(const char* key, uint32_t fallback) const
+            {
+                const char* value = get(key, nullptr);
+                return value ? strtoul(value, nullptr, 0) : fallback;
+            }
+
+        private:
+            static constexpr int MAX_ARGS = 8;
+
+            const char* keys[MAX_ARGS];
+            const char* values[MAX_ARGS];
+            int count;
+    };
+
+    struct TestCase {
+        const char* name;
+        const char* usage;
+        bool (*run)(BMI323SPI &bmi, const TestArgs &args);
+    };
+
+    uint32_t passCount = 0;
+    uint32_t failCount = 0;
+
+    void emitSample(const char* format, uint32_t timestamp, const BMI323Base::accel_gyro_raw &raw)
+    {
+        if(strcmp(format, "csv") == 0)
+        {
+            printf("D,%" PRIu32 ",%d,%d,%d,%d,%d,%d\n", timestamp, raw.accel[0], raw.accel[1], raw.accel[2],
+                raw.gyro[0], raw.gyro[1], raw.gyro[2]);
+        }
+        else if(strcmp(format, "bin") == 0)
+        {
+            stream_record record;
+            record.timestamp = timestamp;
+            memcpy(record.accel, raw.accel, sizeof(record.accel));
+            memcpy(record.gyro, raw.gyro, sizeof(record.gyro));
+            fwrite(&record, sizeof(record), 1, stdout);
+        }
+    }
+
+    /**
+     * @brief What drainFifo() did
+     */
+    struct fifo_drain {
+        uint32_t received;
+        uint32_t reads;             // readFifo() calls, the empty ones included
+        uint64_t totalReadUs;
+        uint32_t maxReadUs;
+    };
+
+    /**
+     * @brief Read samples frames off a FIFO running at odrHz, handing each batch to handle(frames, count)
+     *
+     * Waits four periods whenever the FIFO is empty and gives up after twice the time the samples take plus a second.
+     * The batches come from one static buffer of FIFO_MAX_FRAMES.
+     */
+    template <typename Handler>
+    fifo_drain drainFifo(BMI323SPI &bmi, uint32_t samples, float odrHz, Handler handle)
+    {
+        static BMI323Base::accel_gyro_raw frames[BMI323Base::FIFO_MAX_FRAMES];
+
+        uint32_t periodUs = static_cast<uint32_t>(1.0e6f / odrHz);
+        uint32_t timeoutUs = 2 * samples * periodUs + 1000000;
+        fifo_drain drain = {};
+
+        Timer timer;
+        timer.start();
+
+        while(drain.received < samples && timer.elapsed_time().count() < timeoutUs)
+        {
+            uint32_t wanted = samples - drain.received;
+            uint32_t start = timer.elapsed_time().count();
+            uint16_t count = bmi.readFifo(frames, wanted < BMI323Base::FIFO_MAX_FRAMES ? wanted : BMI323Base::FIFO_MAX_FRAMES);
+            uint32_t readUs = timer.elapsed_time().count() - start;
+
+            drain.reads++;
+            drain.totalReadUs += readUs;
+            drain.maxReadUs = readUs > drain.maxReadUs ? readUs : drain.maxReadUs;
+
+            if(count == 0)
+            {
+                // Nothing buffered yet, give it a few frames
+                wait_us(4 * periodUs);
+                continue;
+            }
+
+            handle(frames, count);
+            drain.received += count;
+        }
+        return drain;
+    }
+
+    bool testInit(BMI323SPI &bmi, const TestArgs &)
+    {
+        return bmi.init();
+    }
+
+    bool testFeature(BMI323SPI &bmi, const TestArgs &)
+    {
+        return bmi.featureEngineSetup();
+    }
+
+    bool testConfig(BMI323SPI &bmi, const TestArgs &args)
+    {
+        uint16_t odr = BMI323Base::odrCode(args.getFloat("odr", 800.0f));
+        bmi.accelSetup(odr);
+        bmi.gyroSetup(odr);
+        printf("RESULT,config,INFO,odr_hz=%.2f\n", BMI323Base::odrHz(odr));
+        return true;
+    }
+
+#ifdef BMI323_HOST_BUILD
+    /**
+     * @brief Set up a low rate user and a high rate alternate profile, then flip the model between them
+     *
+     * The switch events can't be produced on the host, so the model forces ALT_STATUS the way the feature engine
+     * would. Passes if the feature engine came up, both profiles, the any/no-motion parameters and ALT_CONF reached
+     * the sensor, and every bulkReadAlt() sample is tagged with the profile that was active. Leaves ALT_CONF off.
+     */
+    bool testAlt(BMI323SPI &bmi, const TestArgs &args)
+    {
+        uint32_t samples = args.getUint("samples", 40);
+
+        BMI323Base::alt_config config;
+        config.accelConf = BMI323Base::sensorConf(BMI323Base::SENSOR_MODE_DUTY_CYCLING, BMI323Base::odrCode(50.0f));
+        config.gyroConf = BMI323Base::sensorConf(BMI323Base::SENSOR_MODE_DUTY_CYCLING, BMI323Base::odrCode(50.0f));
+        config.altAccelConf = BMI323Base::sensorConf(BMI323Base::SENSOR_MODE_HIGH_PERF, BMI323Base::ODR_800_HZ);
+        config.altGyroConf = BMI323Base::sensorConf(BMI323Base::SENSOR_MODE_HIGH_PERF, BMI323Base::ODR_800_HZ);
+        config.toAlt = BMI323Base::AltSwitchSource::ANY_MOTION;
+        config.toUser = BMI323Base::AltSwitchSource::NO_MOTION;
+        config.resetOnConfWrite = false;
+        config.anyMotionThreshold = 40;
+        config.anyMotionDuration = 5;
+        config.noMotionThreshold = 20;
+        config.noMotionDuration = 50;
+
+        bool setupOk = bmi.altConfigSetup(config);
+
+        // Threshold and duration words, with the reference update and wait time bits set
+        bool motionOk = hostSim->peekExtended(0x05) == (0x1000 | config.anyMotionThreshold) &&
+            hostSim->peekExtended(0x07) == (0x6000 | config.anyMotionDuration) &&
+            hostSim->peekExtended(0x08) == (0x1000 | config.noMotionThreshold) &&
+            hostSim->peekExtended(0x0A) == (0x6000 | config.noMotionDuration);
+
+        bool registersOk = bmi.checkShadow() == 0 &&
+            bmi.readShadow(BMI323Base::Register::ACC_CONF) == config.accelConf &&
+            bmi.readShadow(BMI323Base::Register::GYR_CONF) == config.gyroConf &&
+            bmi.readShadow(BMI323Base::Register::ALT_ACC_CONF) == config.altAccelConf &&
+            bmi.readShadow(BMI323Base::Register::ALT_GYR_CONF) == config.altGyroConf &&
+            bmi.readShadow(BMI323Base::Register::ALT_CONF) == 0x0011;
+
+        // Runs of five samples on each profile
+        uint32_t altSamples = 0;
+        uint32_t mistagged = 0;
+        for(uint32_t i = 0; i < samples; i++)
+        {
+            bool alt = (i / 5) % 2 == 1;
+            hostSim->setAltActive(alt);
+
+            BMI323Base::accel_gyro_alt_data data;
+            bmi.bulkReadAlt(&data);
+            if(data.accelAlt != alt || data.gyroAlt != alt)
+            {
+                mistagged++;
+            }
+            altSamples += alt;
+        }
+
+        hostSim->setAltActive(false);
+        bmi.writeField(BMI323Base::ALT_CONF.accEn, 0);
+        bmi.writeField(BMI323Base::ALT_CONF.gyrEn, 0);
+
+        printf("RESULT,alt,INFO,setup=%d,registers=%d,motion=%d,samples=%" PRIu32 ",alt_samples=%" PRIu32
+            ",mistagged=%" PRIu32 "\n", setupOk, registersOk, motionOk, samples, altSamples, mistagged);
+        return setupOk && registersOk && motionOk && mistagged == 0;
+    }
+#endif
+
+    /**
+     * @brief Train the SPI clock, then check the link at the clock it settled on
+     *
+     * Passes if training got above the 100 kHz start up rate and the link check afterwards found no error.
+     */
+    bool testTrain(BMI323SPI &bmi, const TestArgs &args)
+    {
+        int maxHz = static_cast<int>(args.getUint("max", BMI323SPI::SPI_MAX_HZ));
+        uint16_t checks = args.getUint("checks", 16);
+
+        Timer timer;
+        timer.start();
+        int hz = bmi.trainClock(maxHz, checks);
+        uint32_t elapsedUs = timer.elapsed_time().count();
+
+        bool linkOk = true;
+        for(int i = 0; i < 100 && linkOk; i++)
+        {
+            linkOk = bmi.verifyLink();
+        }
+
+        printf("RESULT,train,INFO,hz=%d,us=%" PRIu32 ",link_errors=%" PRIu32 "\n", bmi.clockHz(), elapsedUs,
+            bmi.linkErrors());
+        return hz > 100000 && linkOk;
+    }
+
+    /**
+     * @brief Bring the sensors up from one of the constexpr register scripts in BMI323.h
+     *
+     * Passes if every written register read back as written.
+     */
+    bool testScript(BMI323SPI &bmi, const TestArgs &args)
+    {
+        const char* name = args.get("name", "fifo");
+
+        uint32_t before = perfCounter(PERF_IMU_SPI_TRANSFERS);
+        Timer timer;
+        timer.start();
+        bool pass = strcmp(name, "stream") == 0 ? bmi.applyScript(BMI323_SCRIPT_STREAM) :
+            bmi.applyScript(BMI323_SCRIPT_FIFO_STREAM);
+        uint32_t elapsedUs = timer.elapsed_time().count();
+        uint32_t transfers = perfCounter(PERF_IMU_SPI_TRANSFERS) - before;
+
+        printf("RESULT,script,INFO,name=%s,transfers=%" PRIu32 ",us=%" PRIu32 "\n", name, transfers, elapsedUs);
+        return pass;
+    }
+
+    /**
+     * @brief Change the ODR of running sensors through the register shadow
+     *
+     * Passes if the sensors were configured, the registers on the sensor match the shadow afterwards and, with perf
+     * counters built in, each sensor took a single SPI transaction.
+     */
+    bool testRetune(BMI323SPI &bmi, const TestArgs &args)
+    {
+        uint16_t odr = BMI323Base::odrCode(args.getFloat("odr", 1600.0f));
+
+        uint32_t before = perfCounter(PERF_IMU_SPI_TRANSFERS);
+        bmi.writeField(BMI323Base::ACC_CONF.odr, odr);
+        bmi.writeField(BMI323Base::GYR_CONF.odr, odr);
+        uint32_t transfers = perfCounter(PERF_IMU_SPI_TRANSFERS) - before;
+
+        uint16_t accelConf = bmi.readShadow(BMI323Base::Register::ACC_CONF);
+        uint16_t mismatches = bmi.checkShadow();
+        printf("RESULT,retune,INFO,odr_hz=%.2f,acc_conf=0x%04x,transfers=%" PRIu32 ",mismatches=%u\n",
+            BMI323Base::odrHz(odr), accelConf, transfers, mismatches);
+
+        bool pass = mismatches == 0 && BMI323Base::ACC_CONF.odr.get(accelConf) == odr &&
+            BMI323Base::ACC_CONF.mode.get(accelConf) != BMI323Base::SENSOR_MODE_DISABLED;
+        if(PERF_ENABLED && transfers != 2)
+        {
+            pass = false;
+        }
+        return pass;
+    }
+
+    /**
+     * @brief Stream samples at a given ODR, by polling the data registers or draining the FIFO
+     *
+     * Passes if every sample arrived, polling kept up with the ODR (within 5%) and, unless gcheck=0, the mean
+     * accel magnitude is 1g +/- 20% (board at rest).
+     */
+    bool testStream(BMI323SPI &bmi, const TestArgs &args)
+    {
+        uint16_t odr = BMI323Base::odrCode(args.getFloat("odr", 800.0f));
+        float odrHz = BMI323Base::odrHz(odr);
+        uint32_t samples = args.getUint("samples", 1000);
+        const char* mode = args.get("mode", "poll");
+        const char* format = args.get("format", "csv");
+        bool gravityCheck = args.getUint("gcheck", 1) != 0;
+        bool fifo = strcmp(mode, "fifo") == 0;
+
+        if(fifo)
+        {
+            bmi.fifoSetup();
+        }
+        bmi.accelSetup(odr);
+        bmi.gyroSetup(odr);
+
+        if(strcmp(format, "bin") == 0)
+        {
+            printf("B,%" PRIu32 "\n", samples);
+            fflush(stdout);
+        }
+
+        uint32_t periodUs = static_cast<uint32_t>(1.0e6f / odrHz);
+        uint32_t received = 0;
+        uint32_t reads = 0;
+        uint32_t maxReadUs = 0;
+        uint64_t totalReadUs = 0;
+        double magnitudeSum = 0.0;
+
+        auto take = [&](const BMI323Base::accel_gyro_raw &raw, uint32_t timestamp) {
+            emitSample(format, timestamp, raw);
+
+            BMI323Base::accel_gyro_data data;
+            BMI323Base::scale(raw, &data);
+            magnitudeSum += sqrtf(data.accel.x * data.accel.x + data.accel.y * data.accel.y +
+                data.accel.z * data.accel.z);
+            received++;
+        };
+
+        Timer timer;
+        timer.start();
+
+        if(fifo)
+        {
+            fifo_drain drain = drainFifo(bmi, samples, odrHz, [&](const BMI323Base::accel_gyro_raw* frames, uint16_t count) {
+                for(uint16_t i = 0; i < count; i++)
+                {
+                    // FIFO frames carry no time, reconstruct it from the ODR
+                    take(frames[i], received * periodUs);
+                }
+            });
+            reads = drain.reads;
+            totalReadUs = drain.totalReadUs;
+            maxReadUs = drain.maxReadUs;
+        }
+        else
+        {
+            uint32_t timeoutUs = 2 * samples * periodUs + 1000000;
+            while(received < samples && timer.elapsed_time().count() < timeoutUs)
+            {
+                // Pace reads to the ODR instead of sleeping a fixed time
+                while(timer.elapsed_time().count() < received * periodUs)
+                {
+                }
+                uint32_t start = timer.elapsed_time().count();
+                BMI323Base::accel_gyro_raw raw;
+                bmi.bulkReadRaw(&raw);
+
+                uint32_t readUs = timer.elapsed_time().count() - start;
+                reads++;
+                totalReadUs += readUs;
+                maxReadUs = readUs > maxReadUs ? readUs : maxReadUs;
+
+                take(raw, start);
+            }
+        }
+
+        float elapsedS = timer.elapsed_time().count() / 1.0e6f;
+        float rateHz = elapsedS > 0.0f ? received / elapsedS : 0.0f;
+        float meanMagnitude = received ? static_cast<float>(magnitudeSum / received) : 0.0f;
+
+        fflush(stdout);
+        printf("RESULT,stream,INFO,mode=%s,odr_hz=%.2f,samples=%" PRIu32 ",rate_hz=%.1f,reads=%" PRIu32
+            ",read_mean_us=%.1f,read_max_us=%" PRIu32 ",accel_g=%.3f\n", mode, odrHz, received, rateHz, reads,
+            reads ? static_cast<float>(totalReadUs) / reads : 0.0f, maxReadUs, meanMagnitude);
+
+        bool pass = received == samples;
+        if(!fifo && rateHz < 0.95f * odrHz)
+        {
+            pass = false;
+        }
+        if(gravityCheck && (meanMagnitude < 0.8f || meanMagnitude > 1.2f))
+        {
+            pass = false;
+        }
+        return pass;
+    }
+
+    bool testCalibrate(BMI323SPI &bmi, const TestArgs &args)
+    {
+        uint16_t samples = args.getUint("samples", 256);
+
+        BMI323Calibration calibration(bmi);
+        calibration.begin();
+        calibration.captureStatic(BMI323Calibration::Z_UP, samples);
+
+        BMI323Base::dp_calibration cal;
+        if(!calibration.estimate(&cal))
+        {
+            return false;
+        }
+        calibration.apply(cal);
+
+        BMI323Base::dp_calibration readBack;
+        bmi.readDataPath(&readBack);
+        printf("RESULT,calibrate,INFO,acc_off=%d/%d/%d,gyr_off=%d/%d/%d\n", readBack.accelOffset[0],
+            readBack.accelOffset[1], readBack.accelOffset[2], readBack.gyroOffset[0], readBack.gyroOffset[1],
+            readBack.gyroOffset[2]);
+
+        return memcmp(&cal, &readBack, sizeof(cal)) == 0;
+    }
+
+#ifdef BMI323_HOST_BUILD
+    /**
+     * @brief Save a calibration to the flash model, load it back and restore it into the sensor
+     *
+     * Passes if the loaded and the restored values match what was saved, the neighbouring sectors are untouched,
+     * and a corrupted or erased record is refused. Leaves the data path cleared.
+     */
+    bool testCalStore(BMI323SPI &bmi, const TestArgs &args)
+    {
+        const mbed::bd_size_t SECTOR = 4096;
+        const mbed::bd_addr_t address = SECTOR;
+        SimFlashBlockDevice flash(4 * SECTOR, SECTOR);
+
+        // Data on both sides of the calibration sector
+        const uint8_t marker = 0x5A;
+        flash.program(&marker, address - 1, 1);
+        flash.program(&marker, address + SECTOR, 1);
+
+        BMI323Base::dp_calibration cal = {{120, -340, 56}, {7, -9, 3}, {-45, 60, -12}, {5, -2, 1}};
+        bool saved = BMI323Calibration::save(cal, flash, address) == 0;
+
+        BMI323Base::dp_calibration loaded = {};
+        bool loadOk = BMI323Calibration::load(&loaded, flash, address) && memcmp(&loaded, &cal, sizeof(cal)) == 0;
+
+        BMI323Calibration calibration(bmi);
+        calibration.begin();
+        BMI323Base::dp_calibration restored = {};
+        bool restoreOk = calibration.restore(flash, address);
+        bmi.readDataPath(&restored);
+        restoreOk = restoreOk && memcmp(&restored, &cal, sizeof(cal)) == 0;
+
+        uint8_t before = 0;
+        uint8_t after = 0;
+        flash.read(&before, address - 1, 1);
+        flash.read(&after, address + SECTOR, 1);
+        bool neighboursOk = before == marker && after == marker;
+
+        // Clear the low byte of the saved X accel offset, the CRC no longer matches
+        uint8_t corrupt = 0x00;
+        flash.program(&corrupt, address + 8, 1);
+        bool corruptRefused = !BMI323Calibration::load(&loaded, flash, address) &&
+            !calibration.restore(flash, address);
+        bool erasedRefused = !BMI323Calibration::load(&loaded, flash, address + 2 * SECTOR);
+
+        calibration.begin();
+        printf("RESULT,calstore,INFO,saved=%d,loaded=%d,restored=%d,neighbours=%d,corrupt_refused=%d,"
+            "erased_refused=%d\n", saved, loadOk, restoreOk, neighboursOk, corruptRefused, erasedRefused);
+        return saved && loadOk && restoreOk && neighboursOk && corruptRefused && erasedRefused;
+    }
+#endif
+
+    /**
+     * @brief Drain the FIFO at a high ODR through BMI323Decimator, a FIR output at a quarter and a CIC output at an
+     * eighth of the rate
+     *
+     * Passes if each output produced one frame per factor input frames and, unless gcheck=0, its mean accel
+     * magnitude is 1g +/- 20% (board at rest).
+     */
+    bool testDecimate(BMI323SPI &bmi, const TestArgs &args)
+    {
+        uint16_t odr = BMI323Base::odrCode(args.getFloat("odr", 1600.0f));
+        float odrHz = BMI323Base::odrHz(odr);
+        uint32_t samples = args.getUint("samples", 3200);
+        bool gravityCheck = args.getUint("gcheck", 1) != 0;
+
+        static BMI323Decimator decimator;
+        decimator.clear();
+        decimator.addFir(4);
+        decimator.addCic(8);
+
+        bmi.fifoSetup();
+        bmi.accelSetup(odr);
+        bmi.gyroSetup(odr);
+
+        uint32_t produced[BMI323Decimator::MAX_OUTPUTS] = {};
+        double magnitudeSum[BMI323Decimator::MAX_OUTPUTS] = {};
+
+        uint32_t received = drainFifo(bmi, samples, odrHz, [&](const BMI323Base::accel_gyro_raw* frames, uint16_t count) {
+            decimator.process(frames, count);
+
+            for(uint8_t output = 0; output < decimator.outputCount(); output++)
+            {
+                for(uint16_t i = 0; i < decimator.available(output); i++)
                 {
-                    bmi.readAccel(&accel);
-                    printf("Accel: x: %f, y: %f, z: %f\n", accel.x, accel.y, accel.z);
-                    // printf("Accel: x: %d, y: %d, z: %d\n", accel.x, accel.y, accel.z);
-                    wait_us(500000);
+                    BMI323Base::accel_gyro_data data;
+                    BMI323Base::scale(decimator.output(output)[i], &data);
+                    magnitudeSum[output] += sqrtf(data.accel.x * data.accel.x + data.accel.y * data.accel.y +
+                        data.accel.z * data.accel.z);
                 }
+                produced[output] += decimator.available(output);
+            }
+        }).received;
 
-                break;
+        bool pass = received == samples;
+        for(uint8_t output = 0; output < decimator.outputCount(); output++)
+        {
+            float meanMagnitude = produced[output] ? static_cast<float>(magnitudeSum[output] / produced[output]) : 0.0f;
+            printf("RESULT,decimate,INFO,filter=%s,factor=%u,rate_hz=%.1f,frames=%" PRIu32 ",accel_g=%.3f\n",
+                decimator.filterType(output) == BMI323Decimator::FILTER_FIR ? "fir" : "cic", decimator.factor(output),
+                odrHz / decimator.factor(output), produced[output], meanMagnitude);
+
+            if(produced[output] != received / decimator.factor(output))
+            {
+                pass = false;
             }
-            case 4: // test BMI gyro init
+            if(gravityCheck && (meanMagnitude < 0.8f || meanMagnitude > 1.2f))
             {
-                bmi.gyroSetup();
-                break;
+                pass = false;
             }
-            case 5: // test BMI readGyro
+        }
+        return pass;
+    }
+
+    /**
+     * @brief Drain the FIFO at a high ODR through BMI323Spectrum and print each vibration summary
+     *
+     * With hz=<f> the board is expected to vibrate at f along X (the host model does, at g=<amplitude>). Passes if
+     * the expected number of summaries came out and, with hz set, every X peak was within one bin of it.
+     */
+    bool testSpectrum(BMI323SPI &bmi, const TestArgs &args)
+    {
+        uint16_t odr = BMI323Base::odrCode(args.getFloat("odr", 3200.0f));
+        float odrHz = BMI323Base::odrHz(odr);
+        uint16_t size = args.getUint("size", 512);
+        uint16_t averages = args.getUint("averages", 4);
+        uint32_t summaries = args.getUint("summaries", 4);
+        float expectedHz = args.getFloat("hz", 0.0f);
+
+        static BMI323Spectrum spectrum;
+        if(!spectrum.setup(odrHz, size, 0, averages))
+        {
+            return false;
+        }
+
+#ifdef BMI323_HOST_BUILD
+        hostSim->setVibration(expectedHz, expectedHz > 0.0f ? args.getFloat("g", 0.5f) : 0.0f);
+#endif
+
+        bmi.fifoSetup();
+        bmi.accelSetup(odr);
+        bmi.gyroSetup(odr);
+
+        uint32_t samples = size - spectrum.framesPerSummary() / averages + summaries * spectrum.framesPerSummary();
+        uint32_t produced = 0;
+        bool peaksOk = true;
+
+        uint32_t received = drainFifo(bmi, samples, odrHz, [&](const BMI323Base::accel_gyro_raw* frames, uint16_t count) {
+            for(uint16_t used = 0; used < count; )
             {
-                BMI323Base::gyro_data gyro;
-                for(int i=0; i<100; i++)
+                used += spectrum.process(frames + used, count - used);
+                if(!spectrum.summaryReady())
+                {
+                    continue;
+                }
+
+                const BMI323Spectrum::vibration_summary &summary = spectrum.summary();
+                produced++;
+
+                float lsbPerMg = BMI323Base::ACCEL_LSB_PER_MG;
+                printf("RESULT,spectrum,INFO,summary=%" PRIu32 ",x_mg=%.1f,y_mg=%.1f,z_mg=%.1f,x_peak_hz=%.1f,"
+                    "x_peak_mg=%.1f,x_bands_mg=", produced, summary.totalRms[0] / lsbPerMg,
+                    summary.totalRms[1] / lsbPerMg, summary.totalRms[2] / lsbPerMg, summary.peakHz[0],
+                    summary.peakRms[0] / lsbPerMg);
+                for(uint8_t band = 0; band < summary.bands; band++)
+                {
+                    printf("%s%.1f", band ? "/" : "", summary.bandRms[0][band] / lsbPerMg);
+                }
+                printf("\n");
+
+                if(expectedHz > 0.0f && fabsf(summary.peakHz[0] - expectedHz) > spectrum.binHz())
                 {
-                    bmi.readGyro(&gyro);
-                    printf("Gyro: x: %f, y: %f, z: %f\n", gyro.x, gyro.y, gyro.z);
-                    wait_us(500000);
+                    peaksOk = false;
                 }
-                break;
             }
-            case 6: // test bulk read
+        }).received;
+
+#ifdef BMI323_HOST_BUILD
+        hostSim->setVibration(0.0f, 0.0f);
+#endif
+
+        printf("RESULT,spectrum,INFO,odr_hz=%.2f,bin_hz=%.2f,samples=%" PRIu32 ",summaries=%" PRIu32
+            ",raw_bytes=%" PRIu32 "\n", odrHz, spectrum.binHz(), received, produced,
+            received * static_cast<uint32_t>(sizeof(BMI323Base::accel_gyro_raw)));
+        return received == samples && produced == summaries && peaksOk;
+    }
+
+    /**
+     * @brief Drain the FIFO through BMI323Preintegrator, one increment per `per` frames
+     *
+     * Passes if every increment came out with the expected interval and, unless gcheck=0, the mean specific force
+     * over them is 1g +/- 20% (board at rest).
+     */
+    bool testPreintegrate(BMI323SPI &bmi, const TestArgs &args)
+    {
+        uint16_t odr = BMI323Base::odrCode(args.getFloat("odr", 1600.0f));
+        float odrHz = BMI323Base::odrHz(odr);
+        uint16_t per = args.getUint("per", 16);
+        uint32_t increments = args.getUint("increments", 200);
+        bool gravityCheck = args.getUint("gcheck", 1) != 0;
+
+        static BMI323Preintegrator integrator;
+        if(!integrator.setup(odrHz, per))
+        {
+            return false;
+        }
+
+        bmi.fifoSetup();
+        bmi.accelSetup(odr);
+        bmi.gyroSetup(odr);
+
+        uint32_t samples = increments * per;
+        uint32_t produced = 0;
+        bool intervalsOk = true;
+        float angle[3] = {0.0f, 0.0f, 0.0f};
+        double forceSum = 0.0;
+
+        uint32_t received = drainFifo(bmi, samples, odrHz, [&](const BMI323Base::accel_gyro_raw* frames, uint16_t count) {
+            for(uint16_t used = 0; used < count; )
             {
-                BMI323Base::accel_gyro_data data;
-                for(int i=0; i<100; i++)
+                used += integrator.process(frames + used, count - used);
+                if(!integrator.incrementReady())
+                {
+                    continue;
+                }
+
+                const BMI323Preintegrator::delta_increment &increment = integrator.increment();
+                const float* dv = increment.deltaVelocity;
+                forceSum += sqrtf(dv[0] * dv[0] + dv[1] * dv[1] + dv[2] * dv[2]) / increment.dt;
+                for(int i = 0; i < 3; i++)
                 {
-                    bmi.bulkRead(&data);
-                    printf("Accel: x: %f, y: %f, z: %f\n", data.accel.x, data.accel.y, data.accel.z);
-                    printf("Gyro: x: %f, y: %f, z: %f\n", data.gyro.x, data.gyro.y, data.gyro.z);
-                    wait_us(500000);
+                    angle[i] += increment.deltaAngle[i];
                 }
-                break;
+                if(increment.samples != per || fabsf(increment.dt - per / odrHz) > 1.0e-6f)
+                {
+                    intervalsOk = false;
+                }
+                produced++;
             }
-            
-            case 9: // Exit test suite
+        }).received;
+
+        float meanForce = produced ? static_cast<float>(forceSum / produced) / BMI323Preintegrator::GRAVITY : 0.0f;
+        printf("RESULT,preintegrate,INFO,odr_hz=%.2f,rate_hz=%.2f,increments=%" PRIu32 ",angle_rad=%.4f/%.4f/%.4f,"
+            "force_g=%.3f\n", odrHz, odrHz / per, produced, angle[0], angle[1], angle[2], meanForce);
+
+        bool pass = received == samples && produced == increments && intervalsOk;
+        if(gravityCheck && (meanForce < 0.8f || meanForce > 1.2f))
+        {
+            pass = false;
+        }
+        return pass;
+    }
+
+#ifdef BMI323_HOST_BUILD
+    /**
+     * @brief q = q * exp(angle), q as w, x, y, z
+     */
+    void rotate(double* q, const float* angle)
+    {
+        double norm = sqrt(angle[0] * angle[0] + angle[1] * angle[1] + angle[2] * angle[2]);
+        double scale = norm > 0.0 ? sin(norm / 2.0) / norm : 0.5;
+        double r[4] = {cos(norm / 2.0), angle[0] * scale, angle[1] * scale, angle[2] * scale};
+        double p[4] = {
+            q[0] * r[0] - q[1] * r[1] - q[2] * r[2] - q[3] * r[3],
+            q[0] * r[1] + q[1] * r[0] + q[2] * r[3] - q[3] * r[2],
+            q[0] * r[2] - q[1] * r[3] + q[2] * r[0] + q[3] * r[1],
+            q[0] * r[3] + q[1] * r[2] - q[2] * r[1] + q[3] * r[0]
+        };
+        memcpy(q, p, sizeof(p));
+    }
+
+    /**
+     * @brief Put the sensor model on a coning rig and chain the increments of two preintegrators, one with and one
+     * without compensation, over the same frames
+     *
+     * Over whole cone cycles the board ends where it started, so whatever rotation the chained increments add up to
+     * is error. Plain sums miss the coning within each increment of h seconds, which over T seconds leaves
+     * W (1 - cos A) (1 - sin(W h) / (W h)) T rad about Z (W = 2 pi hz, A = amplitude). Passes if the uncompensated
+     * error is that within 10% and the compensated one is below a tenth of it. samples = increments * per has to
+     * cover whole cycles, and W sin A has to stay inside the 125 dps gyro range. Leaves the data path cleared.
+     */
+    bool testConing(BMI323SPI &bmi, const TestArgs &args)
+    {
+        uint16_t odr = BMI323Base::odrCode(args.getFloat("odr", 1600.0f));
+        float odrHz = BMI323Base::odrHz(odr);
+        float hz = args.getFloat("hz", 10.0f);
+        float amplitude = args.getFloat("amplitude", 0.03f);
+        uint16_t per = args.getUint("per", 32);
+        uint32_t increments = args.getUint("increments", 200);
+
+        static BMI323Preintegrator integrators[2];
+        if(!integrators[0].setup(odrHz, per) || !integrators[1].setup(odrHz, per))
+        {
+            return false;
+        }
+        integrators[0].setCompensation(false);
+        integrators[1].setCompensation(true);
+
+        // Offsets left by an earlier calibrate would add a drift of their own
+        BMI323Calibration(bmi).begin();
+        hostSim->setConing(hz, amplitude);
+
+        bmi.fifoSetup();
+        bmi.accelSetup(odr);
+        bmi.gyroSetup(odr);
+
+        uint32_t samples = increments * per;
+        uint32_t produced[2] = {0, 0};
+        double attitude[2][4] = {{1.0, 0.0, 0.0, 0.0}, {1.0, 0.0, 0.0, 0.0}};
+
+        uint32_t received = drainFifo(bmi, samples, odrHz, [&](const BMI323Base::accel_gyro_raw* frames, uint16_t count) {
+            for(int k = 0; k < 2; k++)
             {
-                printf("\nExiting Test Suite\n");
-                return 0;
+                for(uint16_t used = 0; used < count; )
+                {
+                    used += integrators[k].process(frames + used, count - used);
+                    if(integrators[k].incrementReady())
+                    {
+                        rotate(attitude[k], integrators[k].increment().deltaAngle);
+                        produced[k]++;
+                    }
+                }
             }
-            default:
+        }).received;
+
+        hostSim->setConing(0.0f, 0.0f);
+
+        double errorRad[2];
+        for(int k = 0; k < 2; k++)
+        {
+            const double* q = attitude[k];
+            errorRad[k] = 2.0 * atan2(sqrt(q[1] * q[1] + q[2] * q[2] + q[3] * q[3]), fabs(q[0]));
+        }
+
+        double coneRate = 2.0 * 3.14159265358979 * hz;
+        double intervalAngle = coneRate * per / odrHz;
+        double expectedRad = coneRate * (1.0 - cos(amplitude)) * (1.0 - sin(intervalAngle) / intervalAngle) *
+            samples / odrHz;
+
+        printf("RESULT,coning,INFO,odr_hz=%.2f,hz=%.2f,amplitude_rad=%.4f,increments=%" PRIu32 ",expected_rad=%.6f,"
+            "plain_rad=%.6f,compensated_rad=%.6f\n", odrHz, hz, amplitude, produced[1], expectedRad, errorRad[0],
+            errorRad[1]);
+
+        return received == samples && produced[0] == increments && produced[1] == increments &&
+            fabs(errorRad[0] - expectedRad) < 0.1 * expectedRad && errorRad[1] < 0.1 * expectedRad;
+    }
+#endif
+
+    const TestCase TESTS[] = {
+        {"init",        "",                                                     testInit},
+        {"feature",     "",                                                     testFeature},
+        {"config",      "odr=<hz>",                                             testConfig},
+#ifdef BMI323_HOST_BUILD
+        {"alt",         "samples=<n>",                                          testAlt},
+#endif
+        {"retune",      "odr=<hz>",                                             testRetune},
+        {"script",      "name=stream|fifo",                                     testScript},
+        {"train",       "max=<hz> checks=<n>",                                  testTrain},
+        {"stream",      "odr=<hz> samples=<n> mode=poll|fifo format=csv|bin|none gcheck=0|1", testStream},
+        {"calibrate",   "samples=<n>",                                          testCalibrate},
+#ifdef BMI323_HOST_BUILD
+        {"calstore",    "",                                                     testCalStore},
+#endif
+        {"decimate",    "odr=<hz> samples=<n> gcheck=0|1",                      testDecimate},
+        {"spectrum",    "odr=<hz> size=<n> averages=<n> summaries=<n> hz=<hz> g=<g>", testSpectrum},
+        {"preintegrate", "odr=<hz> per=<n> increments=<n> gcheck=0|1",         testPreintegrate},
+#ifdef BMI323_HOST_BUILD
+        {"coning",      "odr=<hz> hz=<hz> amplitude=<rad> per=<n> increments=<n>", testConing},
+#endif
+    };
+
+    void printSummary()
+    {
+        printf("SUMMARY,pass=%" PRIu32 ",fail=%" PRIu32 "\n", passCount, failCount);
+    }
+
+    /**
+     * @brief Run one command line
+     *
+     * @return false once the runner should stop
+     */
+    bool runCommand(BMI323SPI &bmi, char* line)
+    {
+        char* save = nullptr;
+        char* name = strtok_r(line, " \t\r\n", &save);
+        if(!name)
+        {
+            return true;
+        }
+
+        if(strcmp(name, "quit") == 0 || strcmp(name, "exit") == 0)
+        {
+            printSummary();
+            return false;
+        }
+        if(strcmp(name, "summary") == 0)
+        {
+            printSummary();
+            return true;
+        }
+        if(strcmp(name, "perf") == 0)
+        {
+            perfDump();
+            for(char* token = strtok_r(nullptr, " \t\r\n", &save); token; token = strtok_r(nullptr, " \t\r\n", &save))
+            {
+                if(strcmp(token, "reset") == 0)
+                {
+                    perfReset();
+                }
+                else if(strncmp(token, "threshold=", 10) == 0)
+                {
+                    perfSetTraceThreshold(strtoul(token + 10, nullptr, 0));
+                }
+            }
+            return true;
+        }
+        if(strcmp(name, "list") == 0)
+        {
+            for(const TestCase &test : TESTS)
+            {
+                printf("TEST,%s,%s\n", test.name, test.usage);
+            }
+            return true;
+        }
+
+        TestArgs args;
+        for(char* token = strtok_r(nullptr, " \t\r\n", &save); token; token = strtok_r(nullptr, " \t\r\n", &save))
+        {
+            if(!args.add(token))
+            {
+                printf("RESULT,%s,FAIL,error=bad_argument\n", name);
+                failCount++;
+                return true;
+            }
+        }
+
+        for(const TestCase &test : TESTS)
+        {
+            if(strcmp(test.name, name) == 0)
+            {
+                bool pass = test.run(bmi, args);
+                fflush(stdout);
+                printf("RESULT,%s,%s\n", name, pass ? "PASS" : "FAIL");
+                (pass ? passCount : failCount)++;
+                return true;
+            }
+        }
+
+        printf("RESULT,%s,FAIL,error=unknown_test\n", name);
+        failCount++;
+        return true;
+    }
+
+    /**
+     * @brief Run a script of ';' or newline separated commands
+     *
+     * @return false if the script ended with quit
+     */
+    bool runScript(BMI323SPI &bmi, const char* script)
+    {
+        char line[128];
+        while(*script)
+        {
+            size_t length = strcspn(script, ";\n");
+            size_t copy = length < sizeof(line) - 1 ? length : sizeof(line) - 1;
+            memcpy(line, script, copy);
+            line[copy] = '\0';
+            script += length + (script[length] ? 1 : 0);
+
+            if(!runCommand(bmi, line))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void runConsole(BMI323SPI &bmi)
+    {
+        char line[128];
+        printf("READY\n");
+        while(fgets(line, sizeof(line), stdin))
+        {
+            if(!runCommand(bmi, line))
             {
-                printf("%d Is an Invalid Test Number Selection.\n", testNumber);
-                fflush(stdin);
-                break;
+                return;
             }
         }
+        printSummary();
+    }
+}
+
+#ifdef BMI323_HOST_BUILD
+int main(int argc, char** argv)
+#else
+int main()
+#endif
+{
+#ifdef TARGET_INTEGRATOR_BOARD
+    PinName mosi = PB_5;    // SPI 1
+    PinName miso = PB_4;    // SPI 1
+    PinName sclk = PB_3;    // SPI 1
+    PinName ssel = PA_15;   // SPI 1
+#else
+    // Nucleo board
+    PinName mosi = PB_5;    // SPI 1
+    PinName miso = PA_6;    // SPI 1
+    PinName sclk = PA_5;    // SPI 1
+    PinName ssel = PD_14;   // SPI 1
+#endif
+
+#ifdef BMI323_HOST_BUILD
+    static SimBMI323 sim;
+    SPI::attach(ssel, &sim);
+    hostSim = &sim;
+#endif
+
+    perfInit();
+
+    BMI323SPI bmi(mosi, miso, sclk, ssel);
+    ThisThread::sleep_for(10ms);
 
-        printf("Done.\r\n");
+#ifdef BMI323_HOST_BUILD
+    // Arguments are commands, e.g. test_BMI323 init "stream odr=800 samples=100" quit
+    if(argc > 1)
+    {
+        for(int i = 1; i < argc; i++)
+        {
+            if(!runScript(bmi, argv[i]))
+            {
+                return failCount ? 1 : 0;
+            }
+        }
+        printSummary();
+        return failCount ? 1 : 0;
     }
+#elif defined(MBED_CONF_APP_TEST_SCRIPT)
+    if(!runScript(bmi, MBED_CONF_APP_TEST_SCRIPT))
+    {
+        return failCount ? 1 : 0;
+    }
+#endif
 
-}
\ No newline at end of file
+    runConsole(bmi);
+    return failCount ? 1 : 0;
+}